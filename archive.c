@@ -0,0 +1,575 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "archive.h"
+#include "m2ts.h"
+
+static int archive_set_error(struct archive *ar, const char *msg)
+{
+    strncpy(ar->error_msg, msg, sizeof(ar->error_msg));
+    ar->error_msg[sizeof(ar->error_msg) - 1] = 0;
+    return -1;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+    return get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int write_all(int fd, const unsigned char *data, unsigned long len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// writes the compressed frames, in order, as long as the next one is done
+static void write_frames(struct archive *ar)
+{
+    struct archive_slot *slot;
+    struct archive_index *entry;
+    unsigned char header[ARCHIVE_FRAME_HEADER];
+
+    pthread_mutex_lock(&ar->write_mutex);
+    while (ar->written < __atomic_load_n(&ar->head, __ATOMIC_ACQUIRE))
+    {
+        slot = &ar->slots[ar->written % ar->slot_count];
+        if (!__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE))
+            break;
+
+        if (slot->out_len > 0)
+        {
+            memcpy(header, "TSZF", 4);
+            put32(header + 4, slot->out_len);
+            put32(header + 8, slot->packets);
+            put32(header + 12, crc32(0, slot->raw, (uInt) slot->packets * TS_PACKET_SIZE));
+            put64(header + 16, slot->first_packet);
+            put64(header + 24, slot->start_ns);
+            put64(header + 32, slot->end_ns);
+
+            if (ar->index_count == ar->index_size)
+            {
+                entry = realloc(ar->index, (ar->index_size + 256) * sizeof(struct archive_index));
+                if (entry)
+                {
+                    ar->index = entry;
+                    ar->index_size += 256;
+                }
+            }
+
+            if (ar->index_count == ar->index_size ||
+                write_all(ar->fd, header, sizeof(header)) < 0 ||
+                write_all(ar->fd, slot->out, slot->out_len) < 0)
+            {
+                // a frame cut short would hide the ones after it
+                if (ftruncate(ar->fd, ar->offset) < 0 || lseek(ar->fd, ar->offset, SEEK_SET) < 0)
+                    ;
+                __atomic_add_fetch(&ar->errors, 1, __ATOMIC_RELAXED);
+            }
+            else
+            {
+                entry = &ar->index[ar->index_count++];
+                entry->offset = ar->offset;
+                entry->first_packet = slot->first_packet;
+                entry->start_ns = slot->start_ns;
+                entry->end_ns = slot->end_ns;
+                entry->packets = slot->packets;
+                entry->size = slot->out_len;
+                ar->offset += sizeof(header) + slot->out_len;
+                ar->bytes_out += sizeof(header) + slot->out_len;
+            }
+        }
+        slot->done = 0;
+
+        pthread_mutex_lock(&ar->mutex);
+        ar->written++;
+        pthread_cond_broadcast(&ar->slot_cond);
+        pthread_mutex_unlock(&ar->mutex);
+    }
+    pthread_mutex_unlock(&ar->write_mutex);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct archive *ar = arg;
+    struct archive_slot *slot;
+    uLongf len;
+    uint64_t seq;
+
+    while (1)
+    {
+        pthread_mutex_lock(&ar->mutex);
+        while (!ar->feeder_done && ar->taken == ar->head)
+            pthread_cond_wait(&ar->work_cond, &ar->mutex);
+        if (ar->taken == ar->head)
+        {
+            pthread_mutex_unlock(&ar->mutex);
+            break;
+        }
+        seq = ar->taken++;
+        pthread_mutex_unlock(&ar->mutex);
+
+        slot = &ar->slots[seq % ar->slot_count];
+        len = compressBound(ARCHIVE_FRAME_PACKETS * TS_PACKET_SIZE);
+        if (compress2(slot->out, &len, slot->raw, (uLong) slot->packets * TS_PACKET_SIZE, ar->level) != Z_OK)
+        {
+            __atomic_add_fetch(&ar->errors, 1, __ATOMIC_RELAXED);
+            len = 0;
+        }
+        slot->out_len = len;
+        __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+        write_frames(ar);
+    }
+    return NULL;
+}
+
+// a free slot for the next frame, waiting for the writer if need be
+static struct archive_slot *next_slot(struct archive *ar)
+{
+    struct archive_slot *slot;
+
+    pthread_mutex_lock(&ar->mutex);
+    while (ar->head - ar->written == (uint64_t) ar->slot_count)
+        pthread_cond_wait(&ar->slot_cond, &ar->mutex);
+    slot = &ar->slots[ar->head % ar->slot_count];
+    pthread_mutex_unlock(&ar->mutex);
+
+    slot->packets = 0;
+    return slot;
+}
+
+static void queue_slot(struct archive *ar)
+{
+    pthread_mutex_lock(&ar->mutex);
+    __atomic_store_n(&ar->head, ar->head + 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&ar->work_cond);
+    pthread_mutex_unlock(&ar->mutex);
+}
+
+static void *feeder_thread(void *arg)
+{
+    struct archive *ar = arg;
+    struct archive_slot *slot = NULL;
+    const unsigned char *data;
+    uint64_t now;
+    long len;
+    int stopping;
+
+    while (1)
+    {
+        // once stopped, what is left in the ring still goes in
+        stopping = !__atomic_load_n(&ar->keep_running, __ATOMIC_ACQUIRE);
+        if (slot == NULL)
+            slot = next_slot(ar);
+
+        len = capture_cursor_peek(&ar->cursor, &data, (unsigned long) (ARCHIVE_FRAME_PACKETS - slot->packets) * TS_PACKET_SIZE);
+        if (len < 0)
+        {
+            // lapped: the frame ends at the gap
+            if (slot->packets > 0)
+            {
+                queue_slot(ar);
+                slot = NULL;
+            }
+            continue;
+        }
+        if (len == 0)
+        {
+            if (stopping)
+                break;
+            usleep(ARCHIVE_POLL_MS * 1000);
+            continue;
+        }
+
+        now = realtime_ns();
+        memcpy(slot->raw + (unsigned long) slot->packets * TS_PACKET_SIZE, data, len);
+        capture_cursor_advance(&ar->cursor, len);
+
+        // overwritten while copied: dropped, the next peek skips the gap
+        if (!capture_cursor_valid(&ar->cursor))
+            continue;
+
+        if (slot->packets == 0)
+        {
+            slot->first_packet = (ar->cursor.position - len) / TS_PACKET_SIZE;
+            slot->start_ns = now;
+        }
+        slot->packets += len / TS_PACKET_SIZE;
+        slot->end_ns = now;
+        ar->bytes_in += len;
+
+        if (slot->packets == ARCHIVE_FRAME_PACKETS)
+        {
+            queue_slot(ar);
+            slot = NULL;
+        }
+    }
+
+    if (slot && slot->packets > 0)
+        queue_slot(ar);
+    return NULL;
+}
+
+static void free_slots(struct archive *ar)
+{
+    int i;
+
+    for (i = 0; ar->slots && i < ar->slot_count; i++)
+    {
+        free(ar->slots[i].raw);
+        free(ar->slots[i].out);
+    }
+    free(ar->slots);
+    ar->slots = NULL;
+}
+
+int archive_start(struct archive *ar, struct capture *cap, const char *path, int workers, int level)
+{
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    int i;
+
+    memset(ar, 0, sizeof(struct archive));
+    ar->fd = -1;
+    if (workers < 1 || workers > ARCHIVE_MAX_WORKERS)
+        return archive_set_error(ar, "Invalid number of compression threads.");
+    if (level < -1 || level > 9)
+        return archive_set_error(ar, "Invalid compression level.");
+    ar->cap = cap;
+    ar->level = level;
+    ar->worker_count = workers;
+
+    // one frame filling, and two for each worker: compressing and waiting
+    // to be written
+    ar->slot_count = 2 * workers + 1;
+    ar->slots = calloc(ar->slot_count, sizeof(struct archive_slot));
+    for (i = 0; ar->slots && i < ar->slot_count; i++)
+    {
+        ar->slots[i].raw = malloc(ARCHIVE_FRAME_PACKETS * TS_PACKET_SIZE);
+        ar->slots[i].out = malloc(compressBound(ARCHIVE_FRAME_PACKETS * TS_PACKET_SIZE));
+        if (ar->slots[i].raw == NULL || ar->slots[i].out == NULL)
+            break;
+    }
+    if (ar->slots == NULL || i < ar->slot_count)
+    {
+        free_slots(ar);
+        return archive_set_error(ar, "Out of memory.");
+    }
+
+    if (capture_cursor_open(cap, &ar->cursor) < 0)
+    {
+        free_slots(ar);
+        return archive_set_error(ar, capture_error(cap));
+    }
+
+    ar->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    memcpy(header, "TSZ1", 4);
+    put32(header + 4, ARCHIVE_FRAME_PACKETS);
+    if (ar->fd < 0 || write_all(ar->fd, header, sizeof(header)) < 0)
+    {
+        if (ar->fd >= 0)
+            close(ar->fd);
+        free_slots(ar);
+        return archive_set_error(ar, "Error creating the archive.");
+    }
+    ar->offset = sizeof(header);
+
+    pthread_mutex_init(&ar->mutex, NULL);
+    pthread_mutex_init(&ar->write_mutex, NULL);
+    pthread_cond_init(&ar->work_cond, NULL);
+    pthread_cond_init(&ar->slot_cond, NULL);
+
+    ar->keep_running = 1;
+    for (i = 0; i < workers; i++)
+        if (pthread_create(&ar->workers[i], NULL, worker_thread, ar) != 0)
+            break;
+    ar->worker_count = i;
+    if (i < workers || pthread_create(&ar->feeder, NULL, feeder_thread, ar) != 0)
+    {
+        pthread_mutex_lock(&ar->mutex);
+        ar->feeder_done = 1;
+        pthread_cond_broadcast(&ar->work_cond);
+        pthread_mutex_unlock(&ar->mutex);
+        for (i = 0; i < ar->worker_count; i++)
+            pthread_join(ar->workers[i], NULL);
+        close(ar->fd);
+        free_slots(ar);
+        return archive_set_error(ar, "Error starting the archive threads.");
+    }
+
+    ar->running = 1;
+    return 0;
+}
+
+void archive_stop(struct archive *ar)
+{
+    unsigned char entry[ARCHIVE_INDEX_ENTRY];
+    unsigned char footer[ARCHIVE_FOOTER_SIZE];
+    uint64_t i;
+    int c;
+
+    if (!ar->running)
+        return;
+
+    __atomic_store_n(&ar->keep_running, 0, __ATOMIC_RELEASE);
+    pthread_join(ar->feeder, NULL);
+
+    pthread_mutex_lock(&ar->mutex);
+    ar->feeder_done = 1;
+    pthread_cond_broadcast(&ar->work_cond);
+    pthread_mutex_unlock(&ar->mutex);
+    for (c = 0; c < ar->worker_count; c++)
+        pthread_join(ar->workers[c], NULL);
+    ar->overruns = ar->cursor.overruns;
+
+    for (i = 0; i < ar->index_count; i++)
+    {
+        put64(entry, ar->index[i].offset);
+        put64(entry + 8, ar->index[i].first_packet);
+        put64(entry + 16, ar->index[i].start_ns);
+        put64(entry + 24, ar->index[i].end_ns);
+        put32(entry + 32, ar->index[i].packets);
+        put32(entry + 36, ar->index[i].size);
+        if (write_all(ar->fd, entry, sizeof(entry)) < 0)
+            break;
+    }
+    memcpy(footer, "TSZI", 4);
+    put32(footer + 4, ar->index_count);
+    put64(footer + 8, ar->offset);
+    if (i < ar->index_count || write_all(ar->fd, footer, sizeof(footer)) < 0)
+        ar->errors++;
+    close(ar->fd);
+    ar->fd = -1;
+
+    free_slots(ar);
+    free(ar->index);
+    ar->index = NULL;
+    pthread_mutex_destroy(&ar->mutex);
+    pthread_mutex_destroy(&ar->write_mutex);
+    pthread_cond_destroy(&ar->work_cond);
+    pthread_cond_destroy(&ar->slot_cond);
+    ar->running = 0;
+}
+
+// the index of a complete archive, from its footer (returns -1 if there is
+// none or it does not add up)
+static long read_footer_index(FILE *fp, long file_size, struct archive_index **index)
+{
+    unsigned char footer[ARCHIVE_FOOTER_SIZE];
+    unsigned char entry[ARCHIVE_INDEX_ENTRY];
+    struct archive_index *list;
+    uint64_t offset;
+    uint32_t count, i;
+
+    if (file_size < ARCHIVE_HEADER_SIZE + ARCHIVE_FOOTER_SIZE ||
+        fseek(fp, file_size - ARCHIVE_FOOTER_SIZE, SEEK_SET) < 0 ||
+        fread(footer, 1, sizeof(footer), fp) != sizeof(footer) || memcmp(footer, "TSZI", 4))
+        return -1;
+    count = get32(footer + 4);
+    offset = get64(footer + 8);
+    if (offset + (uint64_t) count * ARCHIVE_INDEX_ENTRY + ARCHIVE_FOOTER_SIZE != (uint64_t) file_size ||
+        fseek(fp, offset, SEEK_SET) < 0)
+        return -1;
+
+    list = malloc((count > 0 ? count : 1) * sizeof(struct archive_index));
+    if (list == NULL)
+        return -1;
+    for (i = 0; i < count; i++)
+    {
+        if (fread(entry, 1, sizeof(entry), fp) != sizeof(entry))
+        {
+            free(list);
+            return -1;
+        }
+        list[i].offset = get64(entry);
+        list[i].first_packet = get64(entry + 8);
+        list[i].start_ns = get64(entry + 16);
+        list[i].end_ns = get64(entry + 24);
+        list[i].packets = get32(entry + 32);
+        list[i].size = get32(entry + 36);
+    }
+    *index = list;
+    return count;
+}
+
+long archive_read_index(FILE *fp, struct archive_index **index)
+{
+    unsigned char header[ARCHIVE_FRAME_HEADER];
+    struct archive_index *list = NULL, *grown;
+    long file_size, count = 0, size = 0;
+    uint64_t offset = ARCHIVE_HEADER_SIZE;
+
+    if (fseek(fp, 0, SEEK_SET) < 0 || fread(header, 1, ARCHIVE_HEADER_SIZE, fp) != ARCHIVE_HEADER_SIZE ||
+        memcmp(header, "TSZ1", 4) || fseek(fp, 0, SEEK_END) < 0)
+        return -1;
+    file_size = ftell(fp);
+
+    count = read_footer_index(fp, file_size, index);
+    if (count >= 0)
+        return count;
+
+    // no index: the frame headers, up to the first one cut short
+    count = 0;
+    while (fseek(fp, offset, SEEK_SET) == 0 && fread(header, 1, sizeof(header), fp) == sizeof(header) &&
+           !memcmp(header, "TSZF", 4) && offset + sizeof(header) + get32(header + 4) <= (uint64_t) file_size)
+    {
+        if (count == size)
+        {
+            grown = realloc(list, (size + 256) * sizeof(struct archive_index));
+            if (grown == NULL)
+                break;
+            list = grown;
+            size += 256;
+        }
+        list[count].offset = offset;
+        list[count].size = get32(header + 4);
+        list[count].packets = get32(header + 8);
+        list[count].first_packet = get64(header + 16);
+        list[count].start_ns = get64(header + 24);
+        list[count].end_ns = get64(header + 32);
+        offset += sizeof(header) + list[count].size;
+        count++;
+    }
+    *index = list;
+    return count;
+}
+
+long archive_extract(FILE *fp, uint64_t from_ns, uint64_t to_ns, FILE *out, char *msg, int msg_len)
+{
+    unsigned char header[ARCHIVE_FRAME_HEADER];
+    struct archive_index *index = NULL;
+    unsigned char *in = NULL, *raw = NULL;
+    uint64_t t;
+    uLongf raw_len;
+    long count, written = 0, i;
+    uint32_t p;
+
+    count = archive_read_index(fp, &index);
+    if (count < 0)
+    {
+        snprintf(msg, msg_len, "Not an archive.");
+        return -1;
+    }
+
+    raw = malloc(ARCHIVE_FRAME_PACKETS * TS_PACKET_SIZE);
+    in = malloc(compressBound(ARCHIVE_FRAME_PACKETS * TS_PACKET_SIZE));
+    for (i = 0; raw && in && i < count; i++)
+    {
+        if (index[i].end_ns < from_ns || index[i].start_ns > to_ns)
+            continue;
+
+        if (index[i].size > compressBound(ARCHIVE_FRAME_PACKETS * TS_PACKET_SIZE) ||
+            index[i].packets > ARCHIVE_FRAME_PACKETS ||
+            fseek(fp, index[i].offset, SEEK_SET) < 0 ||
+            fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, "TSZF", 4) ||
+            fread(in, 1, index[i].size, fp) != index[i].size)
+        {
+            snprintf(msg, msg_len, "Frame %ld unreadable.", i);
+            written = -1;
+            break;
+        }
+        raw_len = ARCHIVE_FRAME_PACKETS * TS_PACKET_SIZE;
+        if (uncompress(raw, &raw_len, in, index[i].size) != Z_OK ||
+            raw_len != (uLongf) index[i].packets * TS_PACKET_SIZE ||
+            crc32(0, raw, raw_len) != get32(header + 12))
+        {
+            snprintf(msg, msg_len, "Frame %ld corrupt.", i);
+            written = -1;
+            break;
+        }
+
+        // packets spread evenly between the frame start and end times
+        for (p = 0; p < index[i].packets; p++)
+        {
+            t = index[i].start_ns;
+            if (index[i].packets > 1)
+                t += (index[i].end_ns - index[i].start_ns) * p / (index[i].packets - 1);
+            if (t < from_ns || t > to_ns)
+                continue;
+            if (fwrite(raw + (unsigned long) p * TS_PACKET_SIZE, TS_PACKET_SIZE, 1, out) != 1)
+            {
+                snprintf(msg, msg_len, "Error writing the output.");
+                written = -1;
+                break;
+            }
+            written++;
+        }
+        if (written < 0)
+            break;
+    }
+    if ((raw == NULL || in == NULL) && written >= 0)
+    {
+        snprintf(msg, msg_len, "Out of memory.");
+        written = -1;
+    }
+
+    free(raw);
+    free(in);
+    free(index);
+    return written;
+}
@@ -0,0 +1,132 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+// Compressed archive of a capture (.tsz): the TS cut into frames of
+// ARCHIVE_FRAME_PACKETS whole packets (~4MB), each one an independent zlib
+// stream, so any frame can be decoded on its own. A thread takes the packets
+// from the capture ring through a cursor (see capture_cursor_open()) and a
+// pool of workers compresses the frames, written in order: the capture never
+// waits for the archive, an archive that falls a ring behind loses data
+// (counted in overruns) and starts a new frame after the gap.
+//
+// File layout, integers little endian:
+//
+//   header  "TSZ1", uint32 packets per frame
+//   frames  "TSZF", uint32 compressed size, uint32 packets, uint32 crc32 of
+//           the packets, uint64 first packet number, uint64 start and end
+//           times (CLOCK_REALTIME ns, when the packets were taken from the
+//           ring), then the zlib stream
+//   index   per frame: uint64 offset, first packet, start and end times,
+//           uint32 packets and compressed size
+//   footer  "TSZI", uint32 frame count, uint64 offset of the index
+//
+// The index is written on archive_stop(); without it (a killed capture),
+// readers walk the frame headers, which needs no decoding either.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "capture.h"
+
+#define ARCHIVE_FRAME_PACKETS 21845
+#define ARCHIVE_MAX_WORKERS   16
+#define ARCHIVE_POLL_MS       20
+
+#define ARCHIVE_HEADER_SIZE   8
+#define ARCHIVE_FRAME_HEADER  40
+#define ARCHIVE_INDEX_ENTRY   40
+#define ARCHIVE_FOOTER_SIZE   16
+
+struct archive_index {
+    uint64_t offset;
+    uint64_t first_packet;
+    uint64_t start_ns, end_ns;
+    uint32_t packets;
+    uint32_t size; // compressed
+};
+
+struct archive_slot {
+    unsigned char *raw;
+    unsigned char *out;
+    unsigned long out_len;
+    int packets;
+    uint64_t first_packet;
+    uint64_t start_ns, end_ns;
+    int done; // compressed, waiting for its turn to be written
+};
+
+struct archive {
+    struct capture *cap;
+    struct capture_cursor cursor;
+    int fd;
+    int level;
+
+    pthread_t feeder;
+    pthread_t workers[ARCHIVE_MAX_WORKERS];
+    int worker_count;
+    int running;
+    volatile int keep_running;
+    int feeder_done; // the workers leave once it is set and nothing is queued
+
+    // frames being filled (head), handed to a worker (taken) and written
+    struct archive_slot *slots;
+    int slot_count;
+    uint64_t head, taken, written;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;  // a frame was queued, or stopping
+    pthread_cond_t slot_cond;  // a frame was written
+    pthread_mutex_t write_mutex;
+
+    struct archive_index *index;
+    uint64_t index_count, index_size;
+    uint64_t offset;
+
+    uint64_t bytes_in, bytes_out;
+    uint64_t overruns;
+    uint64_t errors;
+
+    char error_msg[256];
+};
+
+
+// creates path and starts archiving a running capture with workers
+// compression threads at zlib level (-1 for the default), returns -1 on error
+int archive_start(struct archive *ar, struct capture *cap, const char *path, int workers, int level);
+
+// archives what is left in the ring, waits for the workers, writes the
+// index and closes the file
+void archive_stop(struct archive *ar);
+
+
+// reads the frame index of an archive, from its index or by walking the
+// frame headers; the array is malloc()ed (returns the count, -1 on error)
+long archive_read_index(FILE *fp, struct archive_index **index);
+
+// decodes the packets taken from the ring between from_ns and to_ns
+// (CLOCK_REALTIME ns) to out, reading only the frames in that range. Packet
+// times within a frame are interpolated from its start and end times.
+// Returns the number of packets written, -1 on error (msg tells why)
+long archive_extract(FILE *fp, uint64_t from_ns, uint64_t to_ns, FILE *out, char *msg, int msg_len);
+
+#endif /* _ARCHIVE_H_ */
@@ -0,0 +1,1495 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include "capture.h"
+#include "ring_buffer.h"
+#include "m2ts.h"
+#include "shm_ring.h"
+#include "histogram.h"
+
+// replay reads are done in whole TS packets
+#define CAPTURE_READ_SIZE (TS_PACKET_SIZE * 21)
+
+// a DVR read takes whatever the kernel buffer holds, up to this much
+#define CAPTURE_DVR_READ_SIZE (TS_PACKET_SIZE * 512)
+
+// read batching, see capture_set_read_batch(): the longest sleep, well
+// within the kernel DVR buffer (~0.85s at 18Mbit/s), and how often the
+// byte rate a fill level is turned into a sleep with is measured
+#define CAPTURE_BATCH_MAX_MS  50
+#define CAPTURE_RATE_MS       500
+
+// ring size orders: 128KB, the smallest above a DVR block, up to 16GB
+#define CAPTURE_RING_ORDER_MIN 17
+#define CAPTURE_RING_ORDER_MAX 34
+
+// the sink thread waits for at least this much data, and hands at most
+// CAPTURE_MAX_BATCH to the callbacks and sinks at once
+#define CAPTURE_MIN_BATCH CAPTURE_READ_SIZE
+#define CAPTURE_MAX_BATCH (TS_PACKET_SIZE * 1024)
+
+// how often the reader looks at the stop flag while the DVR is silent
+#define CAPTURE_POLL_MS 100
+
+// commit times kept for the latency of the ring handoff; when the sink
+// thread falls further behind, the oldest are dropped
+#define CAPTURE_COMMITS 256
+
+#define SOURCE_NONE   0
+#define SOURCE_TUNER  1
+#define SOURCE_REPLAY 2
+
+struct capture_callback {
+    capture_packet_cb cb;
+    void *opaque;
+    int id;
+};
+
+// a block written to the ring: bytes_in after it, and when
+struct capture_commit {
+    uint64_t end;
+    uint64_t ns;
+};
+
+struct capture {
+    char error_msg[256];
+
+    // input
+    int source;
+    struct dvb_resource res;
+    struct m2ts_reader replay;
+
+    // ring between the reader and the sink thread
+    int ring_order;
+    struct ring_buffer ring;
+    int ring_created;
+
+    // shared-memory publication of the ring, when shm_name is set
+    char shm_name[64];
+    struct shm_ring shm;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // held by the reader to swap res and the standby, and by other threads
+    // to query the tuner: taken before mutex, never while holding it
+    pthread_mutex_t res_mutex;
+
+    pthread_t reader_id;
+    pthread_t sink_id;
+    int running;
+    volatile int keep_running;
+    int input_done;
+    int delivered;
+
+    // callbacks and sinks, changed at runtime under list_mutex
+    pthread_mutex_t list_mutex;
+    struct capture_callback callbacks[CAPTURE_MAX_CALLBACKS];
+    int callback_count;
+    int next_callback_id;
+    struct sink *sinks[CAPTURE_MAX_SINKS];
+    int sink_count;
+    // removed pipe sinks whose reader has not consumed their pages yet
+    struct sink *draining[CAPTURE_MAX_SINKS];
+    int draining_count;
+
+    // arrival timestamped output
+    int timestamps;
+    struct arrival_log arrival;
+    struct m2ts_writer m2ts;
+
+    // thread placement
+    struct thread_policy reader_policy, sink_policy;
+    int reader_policy_set, sink_policy_set;
+    int numa_bind;
+    int numa_node, numa_actual;
+
+    // pipeline latency in ns, each written by one thread only
+    struct histogram lat_wakeup;    // DVR poll wakeup to read completion
+    struct histogram lat_commit;    // read completion to ring commit
+    struct histogram lat_pickup;    // ring commit to sink thread pickup
+    struct histogram lat_callbacks; // pickup to callbacks done
+    struct histogram lat_sinks[CAPTURE_MAX_SINKS]; // pickup to write done
+    struct capture_commit commits[CAPTURE_COMMITS];
+    unsigned int commit_head, commit_tail;
+
+    // cursor readers: bumped when the capture restarts, and an eventfd
+    // written on the next commit while notify_armed is set
+    uint32_t generation;
+    int notify_fd;
+    int notify_armed;
+
+    // run by the reader on each block, see capture_set_reader_tap()
+    capture_packet_cb tap;
+    void *tap_opaque;
+    uint64_t tap_packets;
+
+    // retune asked by capture_retune(), done by the reader
+    int retune_pending;
+    uint64_t retune_freq;
+    int retune_layer;
+    uint64_t retune_ns;
+
+    // warm standby, see capture_open_standby(): the reader owns the preroll,
+    // the tuner is swapped or retuned under mutex
+    int standby_open;
+    struct dvb_resource standby;
+    int standby_flush; // retuned: what its DVR and the preroll hold is stale
+    unsigned char *preroll;
+    uint64_t preroll_bytes; // since the last flush or swap
+    uint64_t zap_ns; // retune request waiting for its first data
+    unsigned int zaps, warm_zaps;
+    uint64_t last_zap_us;
+
+    // read batching: sleep between reads once the DVR is drained, as given
+    // or as long as the byte rate takes to bring batch_fill bytes
+    unsigned int batch_us;
+    unsigned long batch_fill;
+    uint64_t rate_start_ns, rate_bytes;
+    double rate; // bytes per ns
+    uint64_t dvr_reads, dvr_wakeups;
+
+    // lock-loss recovery
+    uint64_t last_data_ns;
+    unsigned int outages;
+    uint64_t outage_ms, last_outage_ms;
+
+    // statistics
+    uint64_t bytes_in;
+    uint64_t packets_out;
+    uint64_t ring_full;
+};
+
+static int capture_set_error(struct capture *cap, const char *msg)
+{
+    strncpy(cap->error_msg, msg, sizeof(cap->error_msg));
+    cap->error_msg[sizeof(cap->error_msg) - 1] = 0;
+    return -1;
+}
+
+struct capture *capture_new(void)
+{
+    struct capture *cap = calloc(1, sizeof(struct capture));
+    if (cap == NULL)
+        return NULL;
+
+    cap->ring_order = CAPTURE_RING_ORDER;
+    cap->numa_node = -1;
+    cap->numa_actual = -1;
+    cap->notify_fd = -1;
+    pthread_mutex_init(&cap->mutex, NULL);
+    pthread_cond_init(&cap->cond, NULL);
+    pthread_mutex_init(&cap->list_mutex, NULL);
+    pthread_mutex_init(&cap->res_mutex, NULL);
+    dvbres_init(&cap->res);
+
+    return cap;
+}
+
+const char *capture_error(struct capture *cap)
+{
+    return cap->error_msg;
+}
+
+int capture_set_ring_order(struct capture *cap, int order)
+{
+    char msg[96];
+
+    if (cap->running || order < CAPTURE_RING_ORDER_MIN || order > CAPTURE_RING_ORDER_MAX)
+    {
+        snprintf(msg, sizeof(msg), "Invalid ring size, the order goes from %d to %d.",
+                 CAPTURE_RING_ORDER_MIN, CAPTURE_RING_ORDER_MAX);
+        return capture_set_error(cap, msg);
+    }
+    cap->ring_order = order;
+    return 0;
+}
+
+void capture_set_reader_policy(struct capture *cap, struct thread_policy *tp)
+{
+    cap->reader_policy = *tp;
+    cap->reader_policy_set = 1;
+}
+
+void capture_set_sink_policy(struct capture *cap, struct thread_policy *tp)
+{
+    cap->sink_policy = *tp;
+    cap->sink_policy_set = 1;
+}
+
+void capture_set_numa_bind(struct capture *cap, int enable)
+{
+    cap->numa_bind = enable;
+}
+
+int capture_set_read_batch(struct capture *cap, unsigned int budget_us, unsigned long fill)
+{
+    char msg[96];
+
+    if (cap->running || budget_us > CAPTURE_BATCH_MAX_MS * 1000)
+    {
+        snprintf(msg, sizeof(msg), "Read batching is set before starting, with a budget up to %d ms.", CAPTURE_BATCH_MAX_MS);
+        return capture_set_error(cap, msg);
+    }
+    cap->batch_us = budget_us;
+    cap->batch_fill = fill;
+    return 0;
+}
+
+int capture_publish(struct capture *cap, const char *name)
+{
+    if (cap->ring_created)
+        return capture_set_error(cap, "The ring must be published before starting.");
+    if (strlen(name) >= sizeof(cap->shm_name) - 1)
+        return capture_set_error(cap, "Shared-memory name too long.");
+    strcpy(cap->shm_name, name);
+    return 0;
+}
+
+int capture_open_tuner(struct capture *cap, int adapter, uint64_t freq, int layer_info)
+{
+    char adapter_name[64];
+
+    if (cap->source != SOURCE_NONE)
+        return capture_set_error(cap, "Capture input already open.");
+
+    if (adapter >= 0)
+        sprintf(adapter_name, "/dev/dvb/adapter%d", adapter);
+
+    dvbres_init(&cap->res);
+    if (dvbres_open(&cap->res, freq, adapter >= 0 ? adapter_name : NULL, layer_info) < 0)
+        return capture_set_error(cap, cap->res.error_msg);
+
+    if (dvbres_wait_lock(&cap->res, CAPTURE_LOCK_TIMEOUT_MS) <= 0)
+    {
+        dvbres_close(&cap->res);
+        return capture_set_error(cap, "Signal not locked.");
+    }
+
+    // prefer DVR memory-mapped streaming, read() otherwise
+    dvbres_stream_start(&cap->res, 8, DVBRES_STREAM_BUFFER_SIZE);
+
+    cap->source = SOURCE_TUNER;
+    return 0;
+}
+
+int capture_open_replay(struct capture *cap, const char *file)
+{
+    if (cap->source != SOURCE_NONE)
+        return capture_set_error(cap, "Capture input already open.");
+
+    if (m2ts_reader_open(&cap->replay, file) < 0)
+        return capture_set_error(cap, "Error opening replay file.");
+
+    cap->source = SOURCE_REPLAY;
+    return 0;
+}
+
+int capture_retune(struct capture *cap, uint64_t freq, int layer_info)
+{
+    if (cap->source != SOURCE_TUNER)
+        return capture_set_error(cap, "Not a tuner capture.");
+
+    if (!cap->running)
+    {
+        cap->res.freq = freq;
+        cap->res.layer_info = layer_info;
+        if (dvbres_retune(&cap->res) < 0)
+            return capture_set_error(cap, cap->res.error_msg);
+        if (dvbres_wait_lock(&cap->res, CAPTURE_LOCK_TIMEOUT_MS) <= 0)
+            return capture_set_error(cap, "Signal not locked.");
+        return 0;
+    }
+
+    pthread_mutex_lock(&cap->mutex);
+    cap->retune_freq = freq;
+    cap->retune_layer = layer_info;
+    cap->retune_ns = m2ts_now_ns();
+    cap->retune_pending = 1;
+    pthread_mutex_unlock(&cap->mutex);
+    return 0;
+}
+
+int capture_open_standby(struct capture *cap, int adapter)
+{
+    char adapter_name[64];
+
+    if (cap->source != SOURCE_TUNER)
+        return capture_set_error(cap, "Not a tuner capture.");
+    if (cap->standby_open)
+        return capture_set_error(cap, "Standby tuner already open.");
+
+    cap->preroll = malloc(CAPTURE_PREROLL_SIZE);
+    if (cap->preroll == NULL)
+        return capture_set_error(cap, "Out of memory.");
+
+    if (adapter >= 0)
+        sprintf(adapter_name, "/dev/dvb/adapter%d", adapter);
+
+    // on the same channel until told otherwise, not waiting for the lock
+    dvbres_init(&cap->standby);
+    if (dvbres_open(&cap->standby, cap->res.freq, adapter >= 0 ? adapter_name : NULL, cap->res.layer_info) < 0)
+    {
+        free(cap->preroll);
+        cap->preroll = NULL;
+        return capture_set_error(cap, cap->standby.error_msg);
+    }
+
+    pthread_mutex_lock(&cap->mutex);
+    cap->preroll_bytes = 0;
+    cap->standby_flush = 1;
+    cap->standby_open = 1;
+    pthread_mutex_unlock(&cap->mutex);
+    return 0;
+}
+
+int capture_standby_tune(struct capture *cap, uint64_t freq, int layer_info)
+{
+    int rc;
+
+    if (!cap->standby_open)
+        return capture_set_error(cap, "No standby tuner.");
+
+    // the tune call returns at once, the reader sees the data when locked
+    pthread_mutex_lock(&cap->mutex);
+    cap->standby.freq = freq;
+    cap->standby.layer_info = layer_info;
+    rc = dvbres_retune(&cap->standby);
+    cap->standby_flush = 1;
+    pthread_mutex_unlock(&cap->mutex);
+
+    return rc < 0 ? capture_set_error(cap, cap->standby.error_msg) : 0;
+}
+
+struct dvb_resource *capture_resource(struct capture *cap)
+{
+    return cap->source == SOURCE_TUNER ? &cap->res : NULL;
+}
+
+int capture_add_callback(struct capture *cap, capture_packet_cb cb, void *opaque)
+{
+    int id = -1;
+
+    pthread_mutex_lock(&cap->list_mutex);
+    if (cap->callback_count < CAPTURE_MAX_CALLBACKS)
+    {
+        id = cap->next_callback_id++;
+        cap->callbacks[cap->callback_count].cb = cb;
+        cap->callbacks[cap->callback_count].opaque = opaque;
+        cap->callbacks[cap->callback_count].id = id;
+        cap->callback_count++;
+    }
+    pthread_mutex_unlock(&cap->list_mutex);
+
+    if (id < 0)
+        return capture_set_error(cap, "Too many callbacks.");
+    return id;
+}
+
+int capture_remove_callback(struct capture *cap, int id)
+{
+    int i, found = 0;
+
+    pthread_mutex_lock(&cap->list_mutex);
+    for (i = 0; i < cap->callback_count; i++)
+    {
+        if (cap->callbacks[i].id == id)
+        {
+            memmove(&cap->callbacks[i], &cap->callbacks[i + 1],
+                    (cap->callback_count - i - 1) * sizeof(struct capture_callback));
+            cap->callback_count--;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cap->list_mutex);
+
+    return found ? 0 : capture_set_error(cap, "No such callback.");
+}
+
+int capture_add_sink(struct capture *cap, struct sink *sink)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&cap->list_mutex);
+    if (cap->sink_count < CAPTURE_MAX_SINKS)
+    {
+        histogram_reset(&cap->lat_sinks[cap->sink_count]);
+        cap->sinks[cap->sink_count++] = sink;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&cap->list_mutex);
+
+    return ok ? 0 : capture_set_error(cap, "Too many sinks.");
+}
+
+int capture_remove_sink(struct capture *cap, struct sink *sink)
+{
+    int i, found = 0;
+
+    // no more data goes to the sink, but it keeps holding back the ring
+    // from the draining list until the pages it vmspliced are consumed
+    pthread_mutex_lock(&cap->list_mutex);
+    for (i = 0; i < cap->sink_count; i++)
+    {
+        if (cap->sinks[i] == sink)
+        {
+            memmove(&cap->sinks[i], &cap->sinks[i + 1],
+                    (cap->sink_count - i - 1) * sizeof(struct sink *));
+            memmove(&cap->lat_sinks[i], &cap->lat_sinks[i + 1],
+                    (cap->sink_count - i - 1) * sizeof(struct histogram));
+            cap->sink_count--;
+            cap->draining[cap->draining_count++] = sink;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cap->list_mutex);
+
+    if (!found)
+        return capture_set_error(cap, "No such sink.");
+
+    // released only once the reader read everything or closed the pipe, as
+    // the ring must not overwrite pages a reader may still see
+    while (sink_pending(sink) > 0 && !sink_broken(sink))
+        usleep(10000);
+
+    pthread_mutex_lock(&cap->list_mutex);
+    for (i = 0; i < cap->draining_count; i++)
+    {
+        if (cap->draining[i] == sink)
+        {
+            memmove(&cap->draining[i], &cap->draining[i + 1],
+                    (cap->draining_count - i - 1) * sizeof(struct sink *));
+            cap->draining_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cap->list_mutex);
+
+    return 0;
+}
+
+static void capture_m2ts_cb(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    struct capture *cap = opaque;
+
+    cap->m2ts.packets = first_packet;
+    m2ts_write(&cap->m2ts, &cap->arrival, packets, (size_t) count * TS_PACKET_SIZE);
+}
+
+int capture_add_m2ts(struct capture *cap, FILE *fp)
+{
+    if (cap->running || cap->timestamps)
+        return capture_set_error(cap, "Timestamped output must be added once, before starting.");
+
+    cap->timestamps = 1;
+    m2ts_writer_init(&cap->m2ts, fp);
+    return capture_add_callback(cap, capture_m2ts_cb, cap) < 0 ? -1 : 0;
+}
+
+int capture_set_reader_tap(struct capture *cap, capture_packet_cb cb, void *opaque)
+{
+    if (cap->running)
+        return capture_set_error(cap, "The reader tap must be set before starting.");
+
+    cap->tap = cb;
+    cap->tap_opaque = opaque;
+    return 0;
+}
+
+static void capture_input_done(struct capture *cap)
+{
+    pthread_mutex_lock(&cap->mutex);
+    cap->input_done = 1;
+    pthread_cond_broadcast(&cap->cond);
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+// the largest block the reader writes into the ring at once
+static unsigned long capture_block_size(struct capture *cap)
+{
+    unsigned long block_size = CAPTURE_READ_SIZE;
+
+    if (cap->source == SOURCE_TUNER)
+        block_size = CAPTURE_DVR_READ_SIZE;
+    if (cap->source == SOURCE_TUNER && cap->res.stream_count && cap->res.stream_size > block_size)
+        block_size = cap->res.stream_size;
+    return block_size;
+}
+
+// makes len bytes at the ring write address visible to the sink thread and
+// shared-memory readers; called with the ring mutex held
+static uint64_t capture_commit(struct capture *cap, unsigned long len, uint64_t read_ns)
+{
+    uint64_t now;
+
+    if (cap->timestamps)
+        arrival_log_stamp(&cap->arrival, read_ns, len);
+    ring_buffer_write_advance(&cap->ring, len);
+    if (cap->shm.header)
+        shm_ring_commit(&cap->shm, len);
+    __atomic_store_n(&cap->bytes_in, cap->bytes_in + len, __ATOMIC_RELEASE);
+
+    if (cap->notify_fd >= 0 && __atomic_exchange_n(&cap->notify_armed, 0, __ATOMIC_ACQ_REL))
+    {
+        uint64_t one = 1;
+        if (write(cap->notify_fd, &one, sizeof(one)) < 0)
+            ;
+    }
+
+    now = m2ts_now_ns();
+    if (cap->commit_head - cap->commit_tail == CAPTURE_COMMITS)
+        cap->commit_tail++;
+    cap->commits[cap->commit_head % CAPTURE_COMMITS].end = cap->bytes_in;
+    cap->commits[cap->commit_head % CAPTURE_COMMITS].ns = now;
+    cap->commit_head++;
+
+    pthread_cond_broadcast(&cap->cond);
+    return now;
+}
+
+// how far back the ring is scanned for the PIDs to mark after a gap
+#define CAPTURE_GAP_SCAN (TS_PACKET_SIZE * 8192)
+
+// writes an adaptation-field-only packet with discontinuity_indicator set
+// for every PID of the last data before a gap, so that players resync
+// instead of trusting continuity counters and clocks across it
+static void capture_mark_gap(struct capture *cap)
+{
+    unsigned char seen[8192 / 8];
+    unsigned char cc[8192];
+    unsigned char *p, *out;
+    unsigned long scan, align, free_bytes, chunk, total = 0, n = 0;
+    int pid;
+
+    memset(seen, 0, sizeof(seen));
+
+    // the data behind the write position is intact: only this thread
+    // writes the ring
+    align = cap->bytes_in % TS_PACKET_SIZE;
+    scan = cap->bytes_in < CAPTURE_GAP_SCAN ? cap->bytes_in : CAPTURE_GAP_SCAN;
+    if (scan > cap->ring.count_bytes / 2)
+        scan = cap->ring.count_bytes / 2;
+    scan = scan < align ? 0 : scan - (scan - align) % TS_PACKET_SIZE;
+
+    // the write offset runs up to twice the ring before it wraps: reduced
+    // first, the scan stays within the mirrored mapping
+    p = (unsigned char *) cap->ring.address + cap->ring.count_bytes +
+        cap->ring.write_offset_bytes % cap->ring.count_bytes - scan;
+    for (; scan >= TS_PACKET_SIZE; scan -= TS_PACKET_SIZE, p += TS_PACKET_SIZE)
+    {
+        pid = (p[1] & 0x1F) << 8 | p[2];
+        if (p[0] != TS_SYNC_BYTE || pid == NULL_PID)
+            continue;
+        seen[pid / 8] |= 1 << (pid % 8);
+        cc[pid] = p[3] & 0x0F;
+    }
+
+    // committed a block at a time: readers only trust the data up to a
+    // block ahead of the write position
+    chunk = capture_block_size(cap) / TS_PACKET_SIZE;
+    pthread_mutex_lock(&cap->mutex);
+    free_bytes = ring_buffer_count_free_bytes(&cap->ring);
+    out = ring_buffer_write_address(&cap->ring);
+    for (pid = 0; pid < NULL_PID; pid++)
+    {
+        if (!(seen[pid / 8] & (1 << (pid % 8))))
+            continue;
+        if ((total + 1) * TS_PACKET_SIZE > free_bytes)
+            break;
+
+        p = out + n * TS_PACKET_SIZE;
+        memset(p, 0xFF, TS_PACKET_SIZE);
+        p[0] = TS_SYNC_BYTE;
+        p[1] = pid >> 8;
+        p[2] = pid & 0xFF;
+        p[3] = 0x20 | cc[pid]; // no payload: the counter does not advance
+        p[4] = TS_PACKET_SIZE - 5;
+        p[5] = 0x80; // discontinuity_indicator
+        total++;
+
+        if (++n == chunk)
+        {
+            capture_commit(cap, n * TS_PACKET_SIZE, m2ts_now_ns());
+            out = ring_buffer_write_address(&cap->ring);
+            n = 0;
+        }
+    }
+    if (n > 0)
+        capture_commit(cap, n * TS_PACKET_SIZE, m2ts_now_ns());
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+// the tuner lost its lock or the DVR went silent: retune, waiting for the
+// lock a little longer after each failure, then mark the gap
+static void capture_recover(struct capture *cap)
+{
+    struct dvb_resource *res = &cap->res;
+    int wait_ms = CAPTURE_RETUNE_MIN_MS;
+    int attempts = 0, pending;
+    uint64_t gap_ms;
+
+    fprintf(stderr, "\nSignal lost, retuning...\n");
+
+    while (cap->keep_running)
+    {
+        // a retune asked for meanwhile replaces the lost channel: the
+        // reader hands it to capture_switch(), which marks the gap
+        pthread_mutex_lock(&cap->mutex);
+        pending = cap->retune_pending;
+        pthread_mutex_unlock(&cap->mutex);
+        if (pending)
+            return;
+
+        // the same parameters again: the demux and DVR stay as they are
+        attempts++;
+        if (dvbres_retune(res) == 0 && dvbres_wait_lock(res, wait_ms) > 0)
+            break;
+
+        if (wait_ms < CAPTURE_RETUNE_MAX_MS)
+            wait_ms *= 2;
+    }
+    if (!cap->keep_running)
+        return;
+
+    capture_mark_gap(cap);
+
+    gap_ms = (m2ts_now_ns() - cap->last_data_ns) / 1000000;
+    pthread_mutex_lock(&cap->mutex);
+    cap->outages++;
+    cap->outage_ms += gap_ms;
+    cap->last_outage_ms = gap_ms;
+    pthread_mutex_unlock(&cap->mutex);
+
+    fprintf(stderr, "Signal back after %llu ms without data (%d retune%s).\n",
+            (unsigned long long) gap_ms, attempts, attempts > 1 ? "s" : "");
+
+    cap->last_data_ns = m2ts_now_ns();
+}
+
+// keeps the standby DVR flowing, its newest data in the preroll; after a
+// retune of the standby, what it still held is thrown away
+static void capture_standby_drain(struct capture *cap)
+{
+    struct dvb_resource *sb = &cap->standby;
+    unsigned long pos, take;
+    void *stream_data;
+    int n, flush;
+
+    pthread_mutex_lock(&cap->mutex);
+    flush = cap->standby_flush;
+    cap->standby_flush = 0;
+    pthread_mutex_unlock(&cap->mutex);
+    if (flush)
+        cap->preroll_bytes = 0;
+
+    do
+    {
+        pos = cap->preroll_bytes % CAPTURE_PREROLL_SIZE;
+        if (sb->stream_count)
+        {
+            n = dvbres_stream_dequeue(sb, &stream_data, NULL);
+            if (n > 0 && !flush)
+            {
+                take = (unsigned long) n < CAPTURE_PREROLL_SIZE - pos ? n : CAPTURE_PREROLL_SIZE - pos;
+                memcpy(cap->preroll + pos, stream_data, take);
+                memcpy(cap->preroll, (unsigned char *) stream_data + take, n - take);
+                cap->preroll_bytes += n;
+            }
+            if (sb->stream_index >= 0)
+                dvbres_stream_release(sb);
+        }
+        else
+        {
+            n = read(sb->dvr, cap->preroll + pos, CAPTURE_PREROLL_SIZE - pos);
+            if (n > 0 && !flush)
+                cap->preroll_bytes += n;
+        }
+    } while (n > 0);
+}
+
+// swaps in the standby when it is locked on the channel asked for (returns
+// 0 if it was not): the old tuner becomes the standby, and the preroll is
+// written to the ring behind the discontinuity packets of the old multiplex
+static int capture_warm_switch(struct capture *cap)
+{
+    struct dvb_resource old;
+    unsigned long len, pos, take, chunk, n;
+    unsigned char *out;
+    uint64_t now;
+    int warm;
+
+    if (!cap->standby_open)
+        return 0;
+    capture_standby_drain(cap);
+
+    pthread_mutex_lock(&cap->res_mutex);
+    pthread_mutex_lock(&cap->mutex);
+    warm = cap->preroll_bytes > 0 && !cap->standby_flush && cap->standby.freq == cap->retune_freq &&
+        cap->standby.layer_info == cap->retune_layer;
+    if (warm)
+    {
+        old = cap->res;
+        cap->res = cap->standby;
+        cap->standby = old;
+        cap->retune_pending = 0;
+    }
+    pthread_mutex_unlock(&cap->mutex);
+    pthread_mutex_unlock(&cap->res_mutex);
+    if (!warm)
+        return 0;
+
+    capture_mark_gap(cap);
+
+    pthread_mutex_lock(&cap->mutex);
+    len = cap->preroll_bytes < CAPTURE_PREROLL_SIZE ? cap->preroll_bytes : CAPTURE_PREROLL_SIZE;
+    if (len > ring_buffer_count_free_bytes(&cap->ring))
+        len = ring_buffer_count_free_bytes(&cap->ring);
+    len -= len % TS_PACKET_SIZE;
+    pthread_mutex_unlock(&cap->mutex);
+
+    // the newest len bytes, oldest first, a block at a time as in
+    // capture_mark_gap()
+    chunk = capture_block_size(cap);
+    chunk -= chunk % TS_PACKET_SIZE;
+    pos = (cap->preroll_bytes - len) % CAPTURE_PREROLL_SIZE;
+    cap->preroll_bytes = 0;
+    while (len > 0)
+    {
+        n = len < chunk ? len : chunk;
+        out = ring_buffer_write_address(&cap->ring);
+        take = n < CAPTURE_PREROLL_SIZE - pos ? n : CAPTURE_PREROLL_SIZE - pos;
+        memcpy(out, cap->preroll + pos, take);
+        memcpy(out + take, cap->preroll, n - take);
+        pos = (pos + n) % CAPTURE_PREROLL_SIZE;
+
+        if (cap->tap)
+        {
+            cap->tap(cap->tap_opaque, out, n / TS_PACKET_SIZE, cap->tap_packets);
+            cap->tap_packets += n / TS_PACKET_SIZE;
+        }
+
+        pthread_mutex_lock(&cap->mutex);
+        now = capture_commit(cap, n, m2ts_now_ns());
+        if (cap->zap_ns)
+        {
+            cap->last_zap_us = (now - cap->zap_ns) / 1000;
+            cap->zap_ns = 0;
+        }
+        pthread_mutex_unlock(&cap->mutex);
+        len -= n;
+    }
+
+    pthread_mutex_lock(&cap->mutex);
+    cap->warm_zaps++;
+    pthread_mutex_unlock(&cap->mutex);
+
+    cap->last_data_ns = m2ts_now_ns();
+    return 1;
+}
+
+// tunes to what capture_retune() asked for: whatever the DVR still holds of
+// the old multiplex is dropped, and its PIDs get a discontinuity
+static void capture_switch(struct capture *cap)
+{
+    struct dvb_resource *res = &cap->res;
+    unsigned char scratch[CAPTURE_READ_SIZE];
+    void *stream_data;
+    uint64_t old_freq = res->freq;
+    int old_layer = res->layer_info;
+
+    pthread_mutex_lock(&cap->mutex);
+    cap->zap_ns = cap->retune_ns;
+    cap->zaps++;
+    pthread_mutex_unlock(&cap->mutex);
+
+    if (capture_warm_switch(cap))
+        return;
+
+    pthread_mutex_lock(&cap->mutex);
+    res->freq = cap->retune_freq;
+    res->layer_info = cap->retune_layer;
+    cap->retune_pending = 0;
+    pthread_mutex_unlock(&cap->mutex);
+
+    if (dvbres_retune(res) < 0)
+        fprintf(stderr, "\n%s\n", res->error_msg);
+
+    // the standby follows to the channel just left, for zapping back
+    if (cap->standby_open && capture_standby_tune(cap, old_freq, old_layer) < 0)
+        fprintf(stderr, "\n%s\n", cap->error_msg);
+
+    if (res->stream_count)
+    {
+        while (dvbres_stream_dequeue(res, &stream_data, NULL) > 0)
+            dvbres_stream_release(res);
+    }
+    else
+        while (read(res->dvr, scratch, sizeof(scratch)) > 0)
+            ;
+
+    capture_mark_gap(cap);
+
+    // no lock in time is handled as a lock loss by the reader
+    dvbres_wait_lock(res, CAPTURE_LOCK_TIMEOUT_MS);
+    cap->last_data_ns = m2ts_now_ns();
+}
+
+// how long the reader sleeps once the DVR is drained, 0 to wait for data
+static uint64_t capture_batch_ns(struct capture *cap)
+{
+    uint64_t ns = (uint64_t) cap->batch_us * 1000;
+    uint64_t fill_ns;
+
+    if (cap->batch_fill && cap->rate > 0)
+    {
+        fill_ns = cap->batch_fill / cap->rate;
+        if (ns == 0 || fill_ns < ns)
+            ns = fill_ns;
+    }
+    if (ns > CAPTURE_BATCH_MAX_MS * 1000000ULL)
+        ns = CAPTURE_BATCH_MAX_MS * 1000000ULL;
+    return ns;
+}
+
+// sleeps for the batching interval, woken early only by frontend events (a
+// lost lock); the DVR fills meanwhile and the next read takes it all
+static void capture_batch_sleep(struct capture *cap, uint64_t ns)
+{
+    struct dvb_resource *res = &cap->res;
+    struct pollfd fds[1];
+    struct timespec timeout;
+
+    fds[0].fd = res->frontend;
+    fds[0].events = POLLPRI;
+    timeout.tv_sec = ns / 1000000000ULL;
+    timeout.tv_nsec = ns % 1000000000ULL;
+    ppoll(fds, 1, &timeout, NULL);
+    cap->dvr_wakeups++;
+
+    if ((fds[0].revents & POLLPRI) && dvbres_lock_event(res) == 0)
+        capture_recover(cap);
+}
+
+// the DVR (or replay) reader: fills the free part of the ring in place
+static void *capture_reader_thread(void *arg)
+{
+    struct capture *cap = arg;
+    struct dvb_resource *res = &cap->res;
+    void *addr;
+    void *stream_data;
+    int bytes_read;
+    uint64_t woke_ns = 0, read_ns, now;
+    // room needed in the ring for one block from the input
+    unsigned long block_size = capture_block_size(cap);
+    uint64_t batch_ns;
+
+    // sleeps are timers: a slack of a fraction of the interval lets the
+    // kernel coalesce the wakeups of several readers
+    if (cap->source == SOURCE_TUNER && (cap->batch_us || cap->batch_fill))
+    {
+        batch_ns = (uint64_t) (cap->batch_us ? cap->batch_us : CAPTURE_BATCH_MAX_MS * 1000) * 1000;
+        prctl(PR_SET_TIMERSLACK, batch_ns / 8, 0, 0, 0);
+    }
+
+    while (cap->keep_running)
+    {
+        pthread_mutex_lock(&cap->mutex);
+        if (ring_buffer_count_free_bytes(&cap->ring) < block_size)
+        {
+            cap->ring_full++;
+            while (cap->keep_running && ring_buffer_count_free_bytes(&cap->ring) < block_size)
+                pthread_cond_wait(&cap->cond, &cap->mutex);
+        }
+        pthread_mutex_unlock(&cap->mutex);
+        if (!cap->keep_running)
+            break;
+
+        // set under the mutex by capture_retune(), which the reader does
+        // not hold here
+        if (__atomic_load_n(&cap->retune_pending, __ATOMIC_ACQUIRE))
+        {
+            capture_switch(cap);
+            woke_ns = 0;
+            continue;
+        }
+
+        // the free part of the ring belongs to this thread
+        addr = ring_buffer_write_address(&cap->ring);
+
+        if (cap->source == SOURCE_REPLAY)
+        {
+            bytes_read = m2ts_reader_read(&cap->replay, addr, CAPTURE_READ_SIZE / TS_PACKET_SIZE);
+            if (bytes_read <= 0)
+            {
+                if (bytes_read < 0)
+                    capture_set_error(cap, "Error reading replay file.");
+                capture_input_done(cap);
+                break;
+            }
+        }
+        else if (res->stream_count)
+        {
+            // mmap streaming: the only copy is from the DVR buffer to the ring
+            bytes_read = dvbres_stream_dequeue(res, &stream_data, NULL);
+            if (bytes_read > 0)
+                memcpy(addr, stream_data, bytes_read);
+            if (res->stream_index >= 0)
+                dvbres_stream_release(res);
+        }
+        else
+            bytes_read = read(res->dvr, addr, CAPTURE_DVR_READ_SIZE);
+        read_ns = m2ts_now_ns();
+        if (cap->source == SOURCE_TUNER)
+            cap->dvr_reads++;
+
+        if (cap->standby_open)
+            capture_standby_drain(cap);
+
+        if (bytes_read <= 0)
+        {
+            // frontend events tell a lost lock before the data stops
+            struct pollfd fds[3];
+            int lost = 0;
+            fds[0].fd = res->dvr;
+            fds[0].events = POLLIN;
+            fds[1].fd = res->frontend;
+            fds[1].events = POLLPRI;
+            fds[2].fd = cap->standby.dvr;
+            fds[2].events = POLLIN;
+            poll(fds, cap->standby_open ? 3 : 2, CAPTURE_POLL_MS);
+            woke_ns = m2ts_now_ns();
+            cap->dvr_wakeups++;
+
+            if ((fds[1].revents & POLLPRI) && dvbres_lock_event(res) == 0)
+                lost = 1;
+            if (woke_ns - cap->last_data_ns > CAPTURE_STARVE_MS * 1000000ULL)
+                lost = 1;
+            if (lost)
+            {
+                capture_recover(cap);
+                woke_ns = 0;
+            }
+            continue;
+        }
+        cap->last_data_ns = read_ns;
+
+        if (woke_ns)
+        {
+            histogram_record(&cap->lat_wakeup, read_ns - woke_ns);
+            woke_ns = 0;
+        }
+
+        if (cap->tap)
+        {
+            cap->tap(cap->tap_opaque, addr, bytes_read / TS_PACKET_SIZE, cap->tap_packets);
+            cap->tap_packets += bytes_read / TS_PACKET_SIZE;
+        }
+
+        pthread_mutex_lock(&cap->mutex);
+        now = capture_commit(cap, bytes_read, read_ns);
+        if (cap->zap_ns)
+        {
+            cap->last_zap_us = (now - cap->zap_ns) / 1000;
+            cap->zap_ns = 0;
+        }
+        pthread_mutex_unlock(&cap->mutex);
+        histogram_record(&cap->lat_commit, now - read_ns);
+
+        if (cap->source != SOURCE_TUNER || !(cap->batch_us || cap->batch_fill))
+            continue;
+
+        cap->rate_bytes += bytes_read;
+        if (cap->rate_start_ns == 0)
+            cap->rate_start_ns = read_ns;
+        else if (read_ns - cap->rate_start_ns >= CAPTURE_RATE_MS * 1000000ULL)
+        {
+            cap->rate = (double) cap->rate_bytes / (read_ns - cap->rate_start_ns);
+            cap->rate_start_ns = read_ns;
+            cap->rate_bytes = 0;
+        }
+
+        // a short read drained the DVR: instead of waking on its next
+        // packets, come back when a batch has built up (memory-mapped
+        // buffers are handed out full already)
+        batch_ns = capture_batch_ns(cap);
+        if (!res->stream_count && bytes_read < CAPTURE_DVR_READ_SIZE && batch_ns > 0)
+        {
+            capture_batch_sleep(cap, batch_ns);
+            woke_ns = m2ts_now_ns();
+        }
+    }
+
+    return NULL;
+}
+
+// bytes the pipe sinks, removed ones still draining included, reference
+static unsigned long capture_sinks_pending(struct capture *cap)
+{
+    unsigned long pending = 0, p;
+    int i;
+
+    pthread_mutex_lock(&cap->list_mutex);
+    for (i = 0; i < cap->sink_count; i++)
+    {
+        p = sink_pending(cap->sinks[i]);
+        if (p > pending)
+            pending = p;
+    }
+    for (i = 0; i < cap->draining_count; i++)
+    {
+        p = sink_broken(cap->draining[i]) ? 0 : sink_pending(cap->draining[i]);
+        if (p > pending)
+            pending = p;
+    }
+    pthread_mutex_unlock(&cap->list_mutex);
+
+    return pending;
+}
+
+// records how long the oldest block of a batch waited in the ring; called
+// with the ring mutex held
+static void capture_pickup(struct capture *cap, unsigned long len, uint64_t now)
+{
+    uint64_t start = cap->packets_out * TS_PACKET_SIZE;
+    struct capture_commit *commit;
+    int first = 1;
+
+    while (cap->commit_tail != cap->commit_head)
+    {
+        commit = &cap->commits[cap->commit_tail % CAPTURE_COMMITS];
+        if (commit->end > start && first)
+        {
+            histogram_record(&cap->lat_pickup, now - commit->ns);
+            first = 0;
+        }
+        if (commit->end > start + len)
+            break;
+        cap->commit_tail++;
+    }
+}
+
+static void capture_deliver(struct capture *cap, const unsigned char *data, unsigned long len, uint64_t pickup_ns)
+{
+    int count = len / TS_PACKET_SIZE;
+    int i;
+
+    pthread_mutex_lock(&cap->list_mutex);
+    if (cap->callback_count > 0)
+    {
+        for (i = 0; i < cap->callback_count; i++)
+            cap->callbacks[i].cb(cap->callbacks[i].opaque, data, count, cap->packets_out);
+        histogram_record(&cap->lat_callbacks, m2ts_now_ns() - pickup_ns);
+    }
+    for (i = 0; i < cap->sink_count; i++)
+    {
+        // a broken output would fail on every batch: tell it once
+        if (sink_write(cap->sinks[i], data, len) < 0 && cap->sinks[i]->errors == 1)
+            fprintf(stderr, "Error writing to sink: %s.\n", strerror(errno));
+        histogram_record(&cap->lat_sinks[i], m2ts_now_ns() - pickup_ns);
+    }
+    pthread_mutex_unlock(&cap->list_mutex);
+
+    cap->packets_out += count;
+}
+
+// the sink thread: hands ring data to callbacks and sinks without copying
+static void *capture_sink_thread(void *arg)
+{
+    struct capture *cap = arg;
+    // bytes already handed to the sinks but not yet released to the reader,
+    // as vmspliced pages must stay untouched until the pipe drains them
+    unsigned long held = 0;
+    unsigned long read_size;
+    unsigned char *addr;
+    uint64_t pickup_ns;
+
+    while (cap->keep_running)
+    {
+        // release everything no pipe still references
+        if (held > 0)
+        {
+            unsigned long pending = capture_sinks_pending(cap);
+            if (pending < held)
+            {
+                pthread_mutex_lock(&cap->mutex);
+                ring_buffer_read_advance(&cap->ring, held - pending);
+                pthread_cond_broadcast(&cap->cond);
+                pthread_mutex_unlock(&cap->mutex);
+                held = pending;
+            }
+        }
+
+        pthread_mutex_lock(&cap->mutex);
+        read_size = ring_buffer_count_bytes(&cap->ring) - held;
+        if (read_size > CAPTURE_MAX_BATCH)
+            read_size = CAPTURE_MAX_BATCH;
+        read_size -= read_size % TS_PACKET_SIZE;
+
+        // once the input is over, drain whatever is left in the ring
+        if (read_size < CAPTURE_MIN_BATCH && !(cap->input_done && read_size > 0))
+        {
+            if (cap->input_done)
+            {
+                cap->delivered = 1;
+                pthread_cond_broadcast(&cap->cond);
+                pthread_mutex_unlock(&cap->mutex);
+                break;
+            }
+
+            if (held > 0)
+            {
+                // the pipe readers free ring space without signalling us
+                struct timespec timeout;
+                clock_gettime(CLOCK_REALTIME, &timeout);
+                timeout.tv_nsec += 10000000;
+                if (timeout.tv_nsec >= 1000000000)
+                {
+                    timeout.tv_sec++;
+                    timeout.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&cap->cond, &cap->mutex, &timeout);
+            }
+            else if (cap->keep_running)
+                pthread_cond_wait(&cap->cond, &cap->mutex);
+            pthread_mutex_unlock(&cap->mutex);
+            continue;
+        }
+        addr = (unsigned char *) ring_buffer_read_address(&cap->ring) + held;
+        pickup_ns = m2ts_now_ns();
+        capture_pickup(cap, read_size, pickup_ns);
+        pthread_mutex_unlock(&cap->mutex);
+
+        capture_deliver(cap, addr, read_size, pickup_ns);
+        held += read_size;
+    }
+
+    return NULL;
+}
+
+int capture_start(struct capture *cap)
+{
+    if (cap->running)
+        return capture_set_error(cap, "Capture already running.");
+    if (cap->source == SOURCE_NONE)
+        return capture_set_error(cap, "No capture input open.");
+
+    if (!cap->ring_created)
+    {
+        // the reader waits for a whole block of free space
+        if ((1UL << cap->ring_order) <= capture_block_size(cap))
+            return capture_set_error(cap, "Ring too small for the input blocks.");
+        if (cap->shm_name[0])
+        {
+            if (shm_ring_publish(&cap->shm, &cap->ring, cap->shm_name, cap->ring_order,
+                                 capture_block_size(cap)) < 0)
+                return capture_set_error(cap, errno == EEXIST ? "Shared-memory ring name in use." :
+                                         "Error publishing the ring in shared memory.");
+        }
+        else
+            ring_buffer_create(&cap->ring, cap->ring_order);
+        cap->ring_created = 1;
+    }
+    else
+    {
+        __atomic_add_fetch(&cap->generation, 1, __ATOMIC_ACQ_REL);
+        if (cap->shm.header)
+            shm_ring_new_generation(&cap->shm);
+    }
+
+    if (cap->timestamps && cap->arrival.stamps == NULL &&
+        arrival_log_create(&cap->arrival, cap->ring.count_bytes) < 0)
+        return capture_set_error(cap, "Error allocating arrival timestamps.");
+
+    if (cap->numa_bind)
+    {
+        cap->numa_node = thread_policy_node(&cap->reader_policy);
+        if (cap->numa_node >= 0)
+            cap->numa_actual = ring_buffer_bind_node(&cap->ring, cap->numa_node);
+    }
+
+    cap->keep_running = 1;
+    cap->input_done = 0;
+    cap->delivered = 0;
+    cap->commit_tail = cap->commit_head;
+    cap->last_data_ns = m2ts_now_ns();
+
+    if (pthread_create(&cap->reader_id, NULL, capture_reader_thread, cap))
+        return capture_set_error(cap, "Error creating reader thread.");
+    if (pthread_create(&cap->sink_id, NULL, capture_sink_thread, cap))
+    {
+        cap->keep_running = 0;
+        pthread_join(cap->reader_id, NULL);
+        return capture_set_error(cap, "Error creating sink thread.");
+    }
+    cap->running = 1;
+
+    if (cap->reader_policy_set)
+        thread_policy_apply(cap->reader_id, &cap->reader_policy, "reader");
+    if (cap->sink_policy_set)
+        thread_policy_apply(cap->sink_id, &cap->sink_policy, "sink");
+
+    return 0;
+}
+
+void capture_report(struct capture *cap)
+{
+    if (!cap->running)
+        return;
+
+    if (cap->reader_policy_set || cap->sink_policy_set)
+    {
+        thread_policy_report(cap->reader_id, "reader");
+        thread_policy_report(cap->sink_id, "sink");
+    }
+
+    if (cap->numa_bind)
+    {
+        if (cap->numa_node < 0)
+            fprintf(stderr, "NUMA node of the reader unknown, pin it with -R ...@cpu.\n");
+        else if (cap->numa_actual < 0)
+            fprintf(stderr, "Binding ring buffer to NUMA node %d failed.\n", cap->numa_node);
+        else
+            fprintf(stderr, "Ring buffer bound to NUMA node %d (first page on node %d).\n",
+                    cap->numa_node, cap->numa_actual);
+    }
+
+    if (cap->source == SOURCE_TUNER && cap->res.stream_count)
+        fprintf(stderr, "DVR memory-mapped streaming: %d buffers of %u bytes.\n",
+                cap->res.stream_count, cap->res.stream_size);
+    if (cap->source == SOURCE_TUNER && (cap->batch_us || cap->batch_fill))
+        fprintf(stderr, "DVR read batching: %uus budget, %lu bytes fill.\n", cap->batch_us, cap->batch_fill);
+}
+
+void capture_print_latency(struct capture *cap, FILE *fp)
+{
+    char name[32];
+    int i;
+
+    fprintf(fp, "%-22s %10s %9s %9s %9s %9s %9s\n", "latency", "count", "p50", "p90", "p99", "p99.9", "max");
+    histogram_print(&cap->lat_wakeup, "poll wakeup -> read", fp);
+    histogram_print(&cap->lat_commit, "read -> ring commit", fp);
+    histogram_print(&cap->lat_pickup, "commit -> pickup", fp);
+
+    pthread_mutex_lock(&cap->list_mutex);
+    if (cap->callback_count > 0)
+        histogram_print(&cap->lat_callbacks, "pickup -> callbacks", fp);
+    for (i = 0; i < cap->sink_count; i++)
+    {
+        snprintf(name, sizeof(name), "pickup -> sink %d", i);
+        histogram_print(&cap->lat_sinks[i], name, fp);
+    }
+    pthread_mutex_unlock(&cap->list_mutex);
+}
+
+int capture_cursor_open(struct capture *cap, struct capture_cursor *cur)
+{
+    memset(cur, 0, sizeof(struct capture_cursor));
+    if (!cap->running)
+        return capture_set_error(cap, "Capture not running.");
+
+    cur->cap = cap;
+    cur->generation = __atomic_load_n(&cap->generation, __ATOMIC_ACQUIRE);
+    cur->position = __atomic_load_n(&cap->bytes_in, __ATOMIC_ACQUIRE);
+    cur->position -= cur->position % TS_PACKET_SIZE;
+    return 0;
+}
+
+long capture_cursor_peek(struct capture_cursor *cur, const unsigned char **data, unsigned long max)
+{
+    struct capture *cap = cur->cap;
+    uint32_t generation = __atomic_load_n(&cap->generation, __ATOMIC_ACQUIRE);
+    uint64_t write_position = __atomic_load_n(&cap->bytes_in, __ATOMIC_ACQUIRE);
+    unsigned long size = cap->ring.count_bytes;
+    uint64_t available;
+
+    // the reader may be filling up to a block past write_position
+    if (generation != cur->generation || cur->position > write_position ||
+        write_position + capture_block_size(cap) > cur->position + size)
+    {
+        if (generation == cur->generation)
+            cur->overruns++;
+        cur->generation = generation;
+        cur->position = write_position - write_position % TS_PACKET_SIZE;
+        return -1;
+    }
+
+    available = write_position - cur->position;
+    if (available > max)
+        available = max;
+    available -= available % TS_PACKET_SIZE;
+
+    *data = (unsigned char *) cap->ring.address + (cur->position & (size - 1));
+    return available;
+}
+
+int capture_cursor_valid(struct capture_cursor *cur)
+{
+    struct capture *cap = cur->cap;
+    uint64_t write_position = __atomic_load_n(&cap->bytes_in, __ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&cap->generation, __ATOMIC_ACQUIRE) != cur->generation)
+        return 0;
+    return write_position + capture_block_size(cap) <= cur->position + cap->ring.count_bytes;
+}
+
+void capture_cursor_advance(struct capture_cursor *cur, unsigned long len)
+{
+    cur->position += len;
+}
+
+int capture_notify_fd(struct capture *cap)
+{
+    pthread_mutex_lock(&cap->mutex);
+    if (cap->notify_fd < 0)
+        cap->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_unlock(&cap->mutex);
+
+    return cap->notify_fd;
+}
+
+void capture_notify_arm(struct capture *cap)
+{
+    __atomic_store_n(&cap->notify_armed, 1, __ATOMIC_RELEASE);
+}
+
+int capture_wait(struct capture *cap, int timeout_ms)
+{
+    struct timespec timeout;
+    int done;
+
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += timeout_ms / 1000;
+    timeout.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (timeout.tv_nsec >= 1000000000)
+    {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&cap->mutex);
+    while (cap->running && !cap->delivered)
+        if (pthread_cond_timedwait(&cap->cond, &cap->mutex, &timeout) == ETIMEDOUT)
+            break;
+    done = cap->delivered;
+    pthread_mutex_unlock(&cap->mutex);
+
+    return done;
+}
+
+void capture_stop(struct capture *cap)
+{
+    if (!cap->running)
+        return;
+
+    pthread_mutex_lock(&cap->mutex);
+    cap->keep_running = 0;
+    pthread_cond_broadcast(&cap->cond);
+    pthread_mutex_unlock(&cap->mutex);
+
+    pthread_join(cap->reader_id, NULL);
+    pthread_join(cap->sink_id, NULL);
+    cap->running = 0;
+}
+
+void capture_get_stats(struct capture *cap, struct capture_stats *stats)
+{
+    memset(stats, 0, sizeof(struct capture_stats));
+
+    pthread_mutex_lock(&cap->mutex);
+    stats->bytes_in = cap->bytes_in;
+    stats->packets_out = cap->packets_out;
+    stats->ring_full = cap->ring_full;
+    stats->standby_adapter = cap->standby_open ? cap->standby.adapter : -1;
+    stats->standby_freq = cap->standby_open ? cap->standby.freq : 0;
+    stats->standby_ready = cap->standby_open && cap->preroll_bytes > 0 && !cap->standby_flush;
+    stats->dvr_reads = cap->dvr_reads;
+    stats->dvr_wakeups = cap->dvr_wakeups;
+    stats->zaps = cap->zaps;
+    stats->warm_zaps = cap->warm_zaps;
+    stats->last_zap_us = cap->last_zap_us;
+    stats->outages = cap->outages;
+    stats->outage_ms = cap->outage_ms;
+    stats->last_outage_ms = cap->last_outage_ms;
+    if (cap->ring_created)
+    {
+        stats->ring_used = ring_buffer_count_bytes(&cap->ring);
+        stats->ring_size = cap->ring.count_bytes;
+    }
+    pthread_mutex_unlock(&cap->mutex);
+
+    // the ioctls may be slow: the reader is not held up committing, only
+    // if it swaps in the standby meanwhile
+    if (cap->source == SOURCE_TUNER)
+    {
+        pthread_mutex_lock(&cap->res_mutex);
+        stats->dvr_lost = cap->res.stream_lost;
+        stats->signal_strength = dvbres_getsignalstrength(&cap->res);
+        stats->signal_quality = dvbres_getsignalquality(&cap->res);
+        pthread_mutex_unlock(&cap->res_mutex);
+    }
+}
+
+void capture_free(struct capture *cap)
+{
+    capture_stop(cap);
+
+    if (cap->source == SOURCE_REPLAY)
+        m2ts_reader_close(&cap->replay);
+    else if (cap->source == SOURCE_TUNER)
+        dvbres_close(&cap->res);
+    if (cap->standby_open)
+        dvbres_close(&cap->standby);
+    free(cap->preroll);
+
+    if (cap->timestamps)
+        fflush(cap->m2ts.fp);
+    arrival_log_free(&cap->arrival);
+
+    if (cap->shm.header)
+        shm_ring_unpublish(&cap->shm, &cap->ring);
+    else if (cap->ring_created)
+        ring_buffer_free(&cap->ring);
+
+    if (cap->notify_fd >= 0)
+        close(cap->notify_fd);
+
+    pthread_mutex_destroy(&cap->mutex);
+    pthread_cond_destroy(&cap->cond);
+    pthread_mutex_destroy(&cap->list_mutex);
+    pthread_mutex_destroy(&cap->res_mutex);
+    free(cap);
+}
@@ -0,0 +1,248 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+// libisdbt-capture: a capture handle owns one input (a tuner or a replay
+// file), the ring buffer, the DVR reader thread and the sink thread that
+// feeds the registered callbacks and sinks.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dvb_resource.h"
+#include "sink.h"
+#include "thread_policy.h"
+
+#define CAPTURE_MAX_CALLBACKS 16
+#define CAPTURE_MAX_SINKS     16
+
+// default ring size, as a power of two
+#define CAPTURE_RING_ORDER    28
+
+// time waited for the signal lock when opening a tuner
+#define CAPTURE_LOCK_TIMEOUT_MS 2000
+
+// lock-loss recovery: the DVR is considered starved after CAPTURE_STARVE_MS
+// without data, then retunes wait for the lock from CAPTURE_RETUNE_MIN_MS,
+// doubling up to CAPTURE_RETUNE_MAX_MS
+#define CAPTURE_STARVE_MS     300
+#define CAPTURE_RETUNE_MIN_MS 200
+#define CAPTURE_RETUNE_MAX_MS 6400
+
+// newest data of the standby tuner kept for a warm zap, written to the ring
+// right after the swap (~0.7s at 18Mbit/s)
+#define CAPTURE_PREROLL_SIZE  (188 * 8192)
+
+struct capture;
+
+// called from the sink thread with count whole TS packets (188 bytes each),
+// pointing straight into the ring. first_packet is the sequence number of
+// the first packet since the capture started. The data is only valid during
+// the call.
+typedef void (*capture_packet_cb)(void *opaque, const unsigned char *packets, int count, uint64_t first_packet);
+
+// an in-process reader of the ring with its own position, which the capture
+// never waits for: a reader that falls a ring behind is lapped, as with the
+// shared-memory readers of shm_ring.h
+struct capture_cursor {
+    struct capture *cap;
+    uint64_t position; // bytes since the capture started
+    uint32_t generation;
+
+    // times the cursor was lapped
+    uint64_t overruns;
+};
+
+struct capture_stats {
+    // bytes read from the input
+    uint64_t bytes_in;
+
+    // packets delivered to callbacks and sinks
+    uint64_t packets_out;
+
+    // times the reader had to wait for ring space
+    uint64_t ring_full;
+
+    unsigned long ring_used;
+    unsigned long ring_size;
+
+    // DVR buffers dropped by the kernel (memory-mapped streaming only)
+    unsigned int dvr_lost;
+
+    // DVR reads and reader wakeups (polls and batching sleeps) so far
+    uint64_t dvr_reads;
+    uint64_t dvr_wakeups;
+
+    // tuner only, see dvbres_getsignalstrength()/dvbres_getsignalquality()
+    int signal_strength;
+    int signal_quality;
+
+    // lock losses recovered by retuning, and the time spent without data
+    unsigned int outages;
+    uint64_t outage_ms;
+    uint64_t last_outage_ms;
+
+    // warm standby tuner, -1 when there is none, and the retunes it served
+    // among all of them, with the time from the request to the first data
+    int standby_adapter;
+    uint64_t standby_freq;
+    int standby_ready;
+    unsigned int zaps, warm_zaps;
+    uint64_t last_zap_us;
+};
+
+
+// allocates a capture handle (returns NULL if out of memory)
+struct capture *capture_new(void);
+
+// last error message of the handle
+const char *capture_error(struct capture *cap);
+
+// ring size as a power of two from 17 to 34, before capture_start(), which
+// also fails if the ring is not larger than a block of the input (up to
+// 96KB for tuners)
+int capture_set_ring_order(struct capture *cap, int order);
+
+// scheduling of the reader and sink threads, and NUMA placement of the ring
+// (memory bound to the node of the reader CPUs), before capture_start()
+void capture_set_reader_policy(struct capture *cap, struct thread_policy *tp);
+void capture_set_sink_policy(struct capture *cap, struct thread_policy *tp);
+void capture_set_numa_bind(struct capture *cap, int enable);
+
+// DVR read batching: once a read finds the DVR drained, the reader sleeps
+// for budget_us (up to 50ms), or as long as the incoming byte rate takes to
+// bring fill bytes if that is shorter, instead of waking on the next
+// packets; each read then takes all the DVR holds. Cuts reads and wakeups
+// per second for up to budget_us of added latency. 0 and 0 (the default)
+// wake on any data. Before capture_start() (returns -1 on error)
+int capture_set_read_batch(struct capture *cap, unsigned int budget_us, unsigned long fill);
+
+// publishes the ring as the named shared-memory object (see shm_ring.h for
+// the reader side), before capture_start()
+int capture_publish(struct capture *cap, const char *name);
+
+// tunes adapter (-1 searches for the first ISDB-T frontend) and waits for
+// the lock (returns -1 on error)
+int capture_open_tuner(struct capture *cap, int adapter, uint64_t freq, int layer_info);
+
+// uses a 192-byte timestamped capture as input, replayed with its original
+// timing, or a plain TS file (null-stripped ones are expanded), replayed as
+// fast as it is consumed (returns -1 on error)
+int capture_open_replay(struct capture *cap, const char *file);
+
+// moves a tuner capture to another frequency and layers. While running, the
+// reader thread retunes between two reads, so callbacks and sinks stay
+// attached; the data of the old multiplex ends with discontinuity packets.
+// Returns -1 if the capture is not a tuner (or, when not running, if the
+// retune fails)
+int capture_retune(struct capture *cap, uint64_t freq, int layer_info);
+
+// opens adapter (-1: the first free ISDB-T one) as the warm standby of a
+// tuner capture: a second tuner kept locked on the channel likely to be
+// asked next, whose DVR the reader drains into a preroll. A retune to the
+// standby's channel then swaps the tuners between two reads instead of
+// waiting for a lock, and the preroll goes out first so that players find
+// a PAT and a picture at once. After any retune, the standby is left on the
+// channel just left. Returns -1 on error
+int capture_open_standby(struct capture *cap, int adapter);
+
+// points the standby at freq and layers, without waiting for the lock: it
+// serves a retune once its data flows (returns -1 on error)
+int capture_standby_tune(struct capture *cap, uint64_t freq, int layer_info);
+
+// the tuner of the capture, NULL for replays
+struct dvb_resource *capture_resource(struct capture *cap);
+
+// registers a packet batch callback, returns its id (or -1)
+int capture_add_callback(struct capture *cap, capture_packet_cb cb, void *opaque);
+int capture_remove_callback(struct capture *cap, int id);
+
+// attaches a raw TS output; pipe sinks are fed zero-copy from the ring.
+// The sink must stay valid until removed or the capture is freed.
+int capture_add_sink(struct capture *cap, struct sink *sink);
+
+// detaches a sink; a pipe sink is returned only once its reader consumed
+// the ring pages it references, or closed the pipe
+int capture_remove_sink(struct capture *cap, struct sink *sink);
+
+// sets a callback run by the reader thread on each block it reads, before
+// the block is committed to the ring: ahead of any queueing behind callbacks
+// and sinks, for detectors that must react within the read. It delays every
+// read, so it must be quick. Only before capture_start()
+int capture_set_reader_tap(struct capture *cap, capture_packet_cb cb, void *opaque);
+
+// writes the capture to fp as 192-byte packets with arrival timestamps;
+// only before capture_start()
+int capture_add_m2ts(struct capture *cap, FILE *fp);
+
+// starts the reader and sink threads (returns -1 on error)
+int capture_start(struct capture *cap);
+
+// prints the thread scheduling, ring placement and DVR mode obtained
+void capture_report(struct capture *cap);
+
+// prints percentiles of the time spent in each stage of the pipeline: DVR
+// wakeup, ring commit, handoff to the sink thread and each sink write
+void capture_print_latency(struct capture *cap, FILE *fp);
+
+// starts a cursor at the live position of a running capture (returns -1 if
+// it is not running)
+int capture_cursor_open(struct capture *cap, struct capture_cursor *cur);
+
+// points data at the bytes available at the cursor (at most max, whole
+// packets) and returns their count, 0 if there are none. Returns -1 if the
+// cursor was lapped or the capture restarted: it was then moved to the
+// live position.
+long capture_cursor_peek(struct capture_cursor *cur, const unsigned char **data, unsigned long max);
+
+// after using the bytes from capture_cursor_peek(), tells whether they were
+// intact the whole time (1) or may have been overwritten meanwhile (0)
+int capture_cursor_valid(struct capture_cursor *cur);
+
+void capture_cursor_advance(struct capture_cursor *cur, unsigned long len);
+
+// an eventfd that becomes readable on the next ring commit after
+// capture_notify_arm(), for cursor readers in a poll loop (-1 on error)
+int capture_notify_fd(struct capture *cap);
+void capture_notify_arm(struct capture *cap);
+
+// waits up to timeout_ms for the input to end (replays), returns 1 when it
+// ended and every packet was delivered, 0 on timeout
+int capture_wait(struct capture *cap, int timeout_ms);
+
+// stops the threads
+void capture_stop(struct capture *cap);
+
+void capture_get_stats(struct capture *cap, struct capture_stats *stats);
+
+// stops, closes the input and frees the handle
+void capture_free(struct capture *cap);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* _CAPTURE_H_ */
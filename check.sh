@@ -0,0 +1,133 @@
+#!/bin/sh
+# ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+# Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+#
+# This is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3, or (at your option)
+# any later version.
+#
+# This software is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this software; see the file COPYING.  If not, write to
+# the Free Software Foundation, Inc., 51 Franklin Street,
+# Boston, MA 02110-1301, USA.
+#
+
+# Runs isdbt-capture against fakedvb.so (see "make check"). Without
+# FAKEDVB_TS the fake DVR carries PID 0x100 packets numbered in their
+# payload, which tells lost or repeated data apart from lock-loss gaps.
+
+dir=$(mktemp -d /tmp/isdbt-check.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# runs isdbt-capture for $1 seconds on the fake tuner with the rest of the
+# arguments; its messages go to $dir/log
+run() {
+    secs=$1
+    shift
+    env LD_PRELOAD=./fakedvb.so FAKEDVB_LOCK_MS=100 $FAKE_ENV \
+        timeout -s INT "$secs" ./isdbt-capture -c 35 "$@" > "$dir/log" 2>&1
+}
+
+result() {
+    if [ "$2" = ok ]; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1: $2"
+        sed 's/\r/\n/g' "$dir/log" | tail -n 5
+        failed=1
+    fi
+}
+
+# checks the capture in $1: whole packets in sync and numbered packets only
+# going forward. They must be consecutive, unless $2 is "gaps" (then gap
+# markers, adaptation-only packets with discontinuity_indicator, must be
+# there too) or "forward" (numbers are skipped by null packets or losses)
+scan() {
+    size=$(wc -c < "$1")
+    if [ "$size" -eq 0 ] || [ $((size % 188)) -ne 0 ]; then
+        echo "size $size is not a whole number of packets"
+        return
+    fi
+    od -An -v -tx1 -w188 "$1" | awk -v gaps="$2" '
+        function hex(s,   i, n) {
+            n = 0
+            for (i = 1; i <= length(s); i++)
+                n = n * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+            return n
+        }
+        $1 != "47" { print "lost sync at packet " NR - 1; bad = 1; exit }
+        $2 $3 != "0100" { next }
+        int(hex($4) / 16) % 4 == 2 && $6 == "80" { markers++; next }
+        {
+            n = hex($8 $7 $6 $5)
+            if (seen && (n <= last || (gaps == "" && n != last + 1))) {
+                print "packet " last " followed by " n; bad = 1; exit
+            }
+            last = n; seen = 1
+        }
+        END {
+            if (bad) exit
+            if (!seen) print "no numbered packets"
+            else if (gaps == "gaps" && !markers) print "no gap markers"
+            else print "ok"
+        }'
+}
+
+# basic capture; the events the tune leaves queued are no lock loss
+FAKE_ENV=
+run 3 -o "$dir/basic.ts"
+if grep -q "Signal lost" "$dir/log"; then
+    result "basic capture" "lock loss reported on a steady signal"
+else
+    result "basic capture" "$(scan "$dir/basic.ts")"
+fi
+
+# the lock is lost for 400 ms every second: the capture retunes, marks
+# the gaps and goes on
+FAKE_ENV="FAKEDVB_LOSS_EVERY_MS=1000 FAKEDVB_LOSS_MS=400"
+run 4 -o "$dir/loss.ts"
+if ! grep -q "Signal back after" "$dir/log"; then
+    result "lock-loss recovery" "no recovery reported"
+else
+    result "lock-loss recovery" "$(scan "$dir/loss.ts" gaps)"
+fi
+
+# the same with batched reads: the reader sleeps in ppoll() on the
+# frontend, which the lock-loss events wake up
+run 4 -B 10 -o "$dir/batch.ts"
+if ! grep -q "Signal back after" "$dir/log"; then
+    result "lock-loss recovery with batched reads" "no recovery reported"
+else
+    result "lock-loss recovery with batched reads" "$(scan "$dir/batch.ts" gaps)"
+fi
+
+# two tuners merged, both losing packets among identical null packets: a
+# loss starting on a null must not pull in the packets around another one
+FAKE_ENV="FAKEDVB_ADAPTERS=2 FAKEDVB_NULLS=3 FAKEDVB_DROP_PPM=3000"
+run 4 -a 0 -D 1 -o "$dir/diversity.ts"
+result "diversity with null packets" "$(scan "$dir/diversity.ts" forward)"
+
+# a 64KB ring is smaller than a DVR block: refused, not a hang
+FAKE_ENV=
+run 5 -b 16 -o "$dir/small.ts"
+rc=$?
+if [ $rc -eq 124 ]; then
+    result "ring smaller than a block" "still running after 5 s"
+elif [ $rc -eq 0 ] || ! grep -q "Invalid ring size" "$dir/log"; then
+    result "ring smaller than a block" "not refused (exit $rc)"
+else
+    result "ring smaller than a block" ok
+fi
+
+# the smallest ring that holds a block captures as usual
+run 3 -b 17 -o "$dir/order17.ts"
+result "ring just larger than a block" "$(scan "$dir/order17.ts")"
+
+exit $failed
@@ -0,0 +1,995 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "dvb_devices.h"
+#include "m2ts.h"
+
+// room for the answer to a status of every capture
+#define CONTROL_REPLY_SIZE 16384
+
+#define CONTROL_MAX_ARGS 10
+
+struct control_reply {
+    char buf[CONTROL_REPLY_SIZE];
+    int len;
+};
+
+// appends to the answer, returns 0 so that commands can end with it
+static int reply(struct control_reply *r, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        r->len += n < (int) sizeof(r->buf) - r->len ? n : (int) sizeof(r->buf) - r->len - 1;
+    return 0;
+}
+
+static int control_set_error(struct control *ctl, const char *msg)
+{
+    strncpy(ctl->error_msg, msg, sizeof(ctl->error_msg));
+    ctl->error_msg[sizeof(ctl->error_msg) - 1] = 0;
+    return -1;
+}
+
+int control_open(struct control *ctl, const char *path)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    memset(ctl, 0, sizeof(struct control));
+    for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        ctl->clients[i].fd = ctl->clients[i].passed_fd = -1;
+    ctl->fd = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return control_set_error(ctl, "Control socket path too long.");
+    strcpy(ctl->path, path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    ctl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (ctl->fd < 0)
+        return control_set_error(ctl, "Error creating the control socket.");
+
+    // a socket left by a daemon that died: nobody answers on it
+    if (connect(ctl->fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+    {
+        close(ctl->fd);
+        ctl->fd = -1;
+        return control_set_error(ctl, "Control socket already in use.");
+    }
+    unlink(path);
+
+    if (bind(ctl->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(ctl->fd, 8) < 0)
+    {
+        close(ctl->fd);
+        ctl->fd = -1;
+        return control_set_error(ctl, "Error binding the control socket.");
+    }
+
+    return 0;
+}
+
+static struct control_capture *find_capture(struct control *ctl, const char *name)
+{
+    int i;
+
+    for (i = 0; i < CONTROL_MAX_CAPTURES; i++)
+        if (ctl->captures[i] && !strcmp(ctl->captures[i]->name, name))
+            return ctl->captures[i];
+    return NULL;
+}
+
+static void remove_output(struct control_capture *cc, int i)
+{
+    struct control_output *out = cc->outputs[i];
+
+    capture_remove_sink(cc->cap, &out->sink);
+    sink_close(&out->sink);
+    free(out);
+
+    memmove(&cc->outputs[i], &cc->outputs[i + 1], (cc->output_count - i - 1) * sizeof(struct control_output *));
+    cc->output_count--;
+}
+
+static void free_capture(struct control *ctl, int slot)
+{
+    struct control_capture *cc = ctl->captures[slot];
+
+    // stopping first: no output is written to while it is closed
+    capture_stop(cc->cap);
+    while (cc->output_count > 0)
+        remove_output(cc, cc->output_count - 1);
+    capture_free(cc->cap);
+    epg_free(&cc->epg);
+    ewbs_free(&cc->ewbs);
+    free(cc);
+    ctl->captures[slot] = NULL;
+}
+
+// feeds the EIT of every capture to its EPG
+static void epg_packets(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    struct control_capture *cc = opaque;
+
+    epg_feed(&cc->epg, packets, count, first_packet);
+}
+
+// tunes and starts a capture (returns NULL with the error in r)
+static struct control_capture *open_capture(struct control *ctl, struct control_reply *r, const char *name,
+                                            int adapter, uint64_t freq, int layer_info)
+{
+    struct control_capture *cc;
+    int slot;
+
+    for (slot = 0; slot < CONTROL_MAX_CAPTURES && ctl->captures[slot]; slot++)
+        ;
+    if (slot == CONTROL_MAX_CAPTURES)
+    {
+        reply(r, "ERR too many captures\n");
+        return NULL;
+    }
+
+    cc = calloc(1, sizeof(struct control_capture));
+    if (cc == NULL || (cc->cap = capture_new()) == NULL)
+    {
+        free(cc);
+        reply(r, "ERR out of memory\n");
+        return NULL;
+    }
+    snprintf(cc->name, sizeof(cc->name), "%s", name);
+    cc->adapter = adapter;
+    cc->freq = freq;
+    cc->layer_info = layer_info;
+    epg_init(&cc->epg);
+    capture_add_callback(cc->cap, epg_packets, cc);
+    ewbs_init(&cc->ewbs, cc->name, ctl->alarm_hook);
+    if (ctl->alarm_hook)
+        capture_set_reader_tap(cc->cap, ewbs_feed, &cc->ewbs);
+
+    // tuning blocks the other commands until the lock, not the streams
+    if (capture_open_tuner(cc->cap, cc->adapter, cc->freq, cc->layer_info) < 0 ||
+        capture_start(cc->cap) < 0)
+    {
+        reply(r, "ERR %s\n", capture_error(cc->cap));
+        capture_free(cc->cap);
+        epg_free(&cc->epg);
+        ewbs_free(&cc->ewbs);
+        free(cc);
+        return NULL;
+    }
+
+    cc->adapter = capture_resource(cc->cap)->adapter;
+    ctl->captures[slot] = cc;
+    fprintf(stderr, "control: %s: adapter %d, %llu Hz, layer %d.\n", cc->name, cc->adapter,
+            (unsigned long long) cc->freq, cc->layer_info);
+    return cc;
+}
+
+static int cmd_add(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    if (argc < 4)
+        return reply(r, "ERR usage: add NAME ADAPTER FREQ [LAYER]\n");
+    if (strlen(argv[1]) >= sizeof(((struct control_capture *) 0)->name))
+        return reply(r, "ERR name too long\n");
+    // the captures tuned by jobs are named after them
+    if (!strncmp(argv[1], "job-", 4))
+        return reply(r, "ERR names starting with job- are reserved\n");
+    if (find_capture(ctl, argv[1]))
+        return reply(r, "ERR %s already exists\n", argv[1]);
+
+    if (open_capture(ctl, r, argv[1], atoi(argv[2]), strtoull(argv[3], NULL, 10),
+                     argc > 4 ? atoi(argv[4]) : LAYER_FULL) == NULL)
+        return 0;
+    return reply(r, "OK\n");
+}
+
+static int cmd_remove(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    int slot;
+
+    if (argc < 2)
+        return reply(r, "ERR usage: remove NAME\n");
+
+    for (slot = 0; slot < CONTROL_MAX_CAPTURES; slot++)
+    {
+        if (ctl->captures[slot] && !strcmp(ctl->captures[slot]->name, argv[1]))
+        {
+            if (ctl->captures[slot]->job_count > 0)
+                return reply(r, "ERR %s is used by recording jobs\n", argv[1]);
+            free_capture(ctl, slot);
+            fprintf(stderr, "control: %s removed.\n", argv[1]);
+            return reply(r, "OK\n");
+        }
+    }
+    return reply(r, "ERR no capture %s\n", argv[1]);
+}
+
+static int cmd_retune(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    struct control_capture *cc;
+    uint64_t freq;
+    int layer_info;
+
+    if (argc < 3)
+        return reply(r, "ERR usage: retune NAME FREQ [LAYER]\n");
+    if ((cc = find_capture(ctl, argv[1])) == NULL)
+        return reply(r, "ERR no capture %s\n", argv[1]);
+    if (cc->job_count > 0)
+        return reply(r, "ERR %s is used by recording jobs\n", argv[1]);
+
+    freq = strtoull(argv[2], NULL, 10);
+    layer_info = argc > 3 ? atoi(argv[3]) : cc->layer_info;
+    if (capture_retune(cc->cap, freq, layer_info) < 0)
+        return reply(r, "ERR %s\n", capture_error(cc->cap));
+
+    cc->freq = freq;
+    cc->layer_info = layer_info;
+    fprintf(stderr, "control: %s: retuning to %llu Hz, layer %d.\n", cc->name,
+            (unsigned long long) freq, layer_info);
+    return reply(r, "OK\n");
+}
+
+static int cmd_standby(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    struct control_capture *cc;
+    struct capture_stats stats;
+    uint64_t freq;
+
+    if (argc < 3)
+        return reply(r, "ERR usage: standby NAME ADAPTER|- [FREQ]\n");
+    if ((cc = find_capture(ctl, argv[1])) == NULL)
+        return reply(r, "ERR no capture %s\n", argv[1]);
+
+    capture_get_stats(cc->cap, &stats);
+    if (stats.standby_adapter < 0)
+    {
+        if (!strcmp(argv[2], "-"))
+            return reply(r, "ERR %s has no standby tuner\n", argv[1]);
+        if (capture_open_standby(cc->cap, atoi(argv[2])) < 0)
+            return reply(r, "ERR %s\n", capture_error(cc->cap));
+    }
+
+    // the next channel up unless told
+    freq = argc > 3 ? strtoull(argv[3], NULL, 10) : cc->freq + CONTROL_CHANNEL_WIDTH;
+    if (capture_standby_tune(cc->cap, freq, cc->layer_info) < 0)
+        return reply(r, "ERR %s\n", capture_error(cc->cap));
+
+    fprintf(stderr, "control: %s: standby on %llu Hz.\n", cc->name, (unsigned long long) freq);
+    return reply(r, "OK\n");
+}
+
+// fifos are opened without blocking the daemon: they need a reader already
+static int open_output(const char *path)
+{
+    struct stat st;
+    int fd;
+
+    if (stat(path, &st) == 0 && S_ISFIFO(st.st_mode))
+    {
+        fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd >= 0)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        return fd;
+    }
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+static int cmd_attach(struct control *ctl, struct control_client *client, struct control_reply *r,
+                       int argc, char **argv)
+{
+    struct control_capture *cc;
+    struct control_output *out;
+    int fd;
+
+    if (argc < 3)
+        return reply(r, "ERR usage: attach NAME PATH|-\n");
+    if ((cc = find_capture(ctl, argv[1])) == NULL)
+        return reply(r, "ERR no capture %s\n", argv[1]);
+    if (cc->output_count == CAPTURE_MAX_SINKS)
+        return reply(r, "ERR too many outputs\n");
+
+    if (!strcmp(argv[2], "-"))
+    {
+        if (client->passed_fd < 0)
+            return reply(r, "ERR no descriptor passed\n");
+        fd = client->passed_fd;
+        client->passed_fd = -1;
+    }
+    else if ((fd = open_output(argv[2])) < 0)
+        return reply(r, "ERR %s: %s\n", argv[2], strerror(errno));
+
+    out = calloc(1, sizeof(struct control_output));
+    if (out == NULL)
+    {
+        close(fd);
+        return reply(r, "ERR out of memory\n");
+    }
+    if (!strcmp(argv[2], "-"))
+        snprintf(out->path, sizeof(out->path), "fd%d", fd);
+    else
+        snprintf(out->path, sizeof(out->path), "%s", argv[2]);
+    sink_open_fd(&out->sink, fd);
+    out->sink.borrowed = 0;
+
+    if (capture_add_sink(cc->cap, &out->sink) < 0)
+    {
+        sink_close(&out->sink);
+        free(out);
+        return reply(r, "ERR %s\n", capture_error(cc->cap));
+    }
+    cc->outputs[cc->output_count++] = out;
+
+    fprintf(stderr, "control: %s: output %s attached.\n", cc->name, out->path);
+    return reply(r, "OK %s\n", out->path);
+}
+
+static int cmd_detach(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    struct control_capture *cc;
+    int i;
+
+    if (argc < 3)
+        return reply(r, "ERR usage: detach NAME PATH\n");
+    if ((cc = find_capture(ctl, argv[1])) == NULL)
+        return reply(r, "ERR no capture %s\n", argv[1]);
+
+    for (i = 0; i < cc->output_count; i++)
+    {
+        if (!strcmp(cc->outputs[i]->path, argv[2]))
+        {
+            remove_output(cc, i);
+            fprintf(stderr, "control: %s: output %s detached.\n", cc->name, argv[2]);
+            return reply(r, "OK\n");
+        }
+    }
+    return reply(r, "ERR no output %s\n", argv[2]);
+}
+
+static void status_capture(struct control_capture *cc, struct control_reply *r)
+{
+    struct capture_stats stats;
+    int i;
+
+    capture_get_stats(cc->cap, &stats);
+    // a warm zap swaps the tuners
+    cc->adapter = capture_resource(cc->cap)->adapter;
+    reply(r, "%s adapter=%d freq=%llu layer=%d signal=%d quality=%d bytes=%llu packets=%llu "
+          "ring=%lu/%lu ring_full=%llu outages=%u outage_ms=%llu dvr_lost=%u outputs=%d\n",
+          cc->name, cc->adapter, (unsigned long long) cc->freq, cc->layer_info,
+          stats.signal_strength, stats.signal_quality, (unsigned long long) stats.bytes_in,
+          (unsigned long long) stats.packets_out, stats.ring_used, stats.ring_size,
+          (unsigned long long) stats.ring_full, stats.outages, (unsigned long long) stats.outage_ms,
+          stats.dvr_lost, cc->output_count);
+    if (stats.standby_adapter >= 0 || stats.zaps > 0)
+        reply(r, "%s standby adapter=%d freq=%llu ready=%d zaps=%u warm=%u last_zap_us=%llu\n",
+              cc->name, stats.standby_adapter, (unsigned long long) stats.standby_freq, stats.standby_ready,
+              stats.zaps, stats.warm_zaps, (unsigned long long) stats.last_zap_us);
+    for (i = 0; i < cc->output_count; i++)
+        reply(r, "%s output %s\n", cc->name, cc->outputs[i]->path);
+}
+
+static int cmd_status(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    struct control_capture *cc;
+    int i;
+
+    if (argc > 1)
+    {
+        if ((cc = find_capture(ctl, argv[1])) == NULL)
+            return reply(r, "ERR no capture %s\n", argv[1]);
+        status_capture(cc, r);
+    }
+    else
+    {
+        for (i = 0; i < CONTROL_MAX_CAPTURES; i++)
+            if (ctl->captures[i])
+                status_capture(ctl->captures[i], r);
+    }
+    return reply(r, "OK\n");
+}
+
+static int cmd_devices(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    struct dvbdev_adapter list[DVBDEV_MAX_ADAPTERS];
+    int i, count;
+
+    count = dvbdev_list(list, DVBDEV_MAX_ADAPTERS);
+    for (i = 0; i < count; i++)
+    {
+        if (!list[i].probed)
+            reply(r, "adapter%d inaccessible\n", list[i].adapter);
+        else
+            reply(r, "adapter%d isdbt=%d freq=%u-%u systems=0x%llx name=%s\n", list[i].adapter, list[i].isdbt,
+                  list[i].freq_min, list[i].freq_max, (unsigned long long) list[i].systems, list[i].name);
+    }
+    return reply(r, "OK\n");
+}
+
+static int cmd_epg(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    struct control_capture *cc;
+    struct epg_event *list;
+    int i, count;
+
+    if (argc < 2)
+        return reply(r, "ERR usage: epg NAME\n");
+    if ((cc = find_capture(ctl, argv[1])) == NULL)
+        return reply(r, "ERR no capture %s\n", argv[1]);
+
+    list = malloc(EPG_MAX_EVENTS * sizeof(struct epg_event));
+    if (list == NULL)
+        return reply(r, "ERR out of memory\n");
+    count = epg_list(&cc->epg, list, EPG_MAX_EVENTS);
+    for (i = 0; i < count; i++)
+        reply(r, "service=%d event=%d start=%lld duration=%d status=%d title=%s\n", list[i].service_id,
+              list[i].event_id, (long long) list[i].start, list[i].duration, list[i].running_status, list[i].title);
+    free(list);
+    return reply(r, "OK\n");
+}
+
+// the schedule of an event, from the EPG of any capture on its multiplex
+static int find_event(struct control *ctl, uint64_t freq, int service_id, int event_id, struct epg_event *event)
+{
+    int i;
+
+    for (i = 0; i < CONTROL_MAX_CAPTURES; i++)
+        if (ctl->captures[i] && ctl->captures[i]->freq == freq &&
+            epg_find(&ctl->captures[i]->epg, service_id, event_id, event) == 0 && event->start > 0)
+            return 0;
+    return -1;
+}
+
+// whether the EIT of a capture on the job's multiplex has its event on air,
+// as events may start ahead of their schedule
+static int event_on_air(struct control *ctl, struct control_job *job)
+{
+    uint64_t since;
+    int i, event_id;
+
+    for (i = 0; i < CONTROL_MAX_CAPTURES; i++)
+        if (ctl->captures[i] && ctl->captures[i]->freq == job->freq &&
+            epg_present(&ctl->captures[i]->epg, job->service_id, &event_id, &since) == 0 &&
+            event_id == job->event_id)
+            return 1;
+    return 0;
+}
+
+// records the packets of the job's window or event (capture thread)
+static void job_packets(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    struct control_job *job = opaque;
+    struct iovec iov;
+    uint64_t since;
+    int event_id, on, cut = 0, from = 0, to = count;
+    time_t now;
+
+    if (job->finished)
+        return;
+
+    if (job->event_id >= 0 && epg_present(&job->cc->epg, job->service_id, &event_id, &since) == 0)
+    {
+        // the change came within this batch: cut on its packet
+        on = event_id == job->event_id;
+        if (since > first_packet)
+            cut = since - first_packet;
+
+        // a recording started on the schedule goes on until the event
+        // came and went
+        if (on)
+            job->aired = 1;
+        else if (job->recording && !job->aired)
+            on = 1;
+    }
+    else
+    {
+        now = time(NULL);
+        on = now >= job->start && now < job->end;
+    }
+
+    if (on && !job->recording)
+    {
+        job->recording = 1;
+        from = cut;
+    }
+    else if (!on && job->recording)
+    {
+        job->finished = 1;
+        to = cut;
+    }
+    else if (!on)
+        return;
+
+    if (to > from)
+    {
+        // copied: the job sink is not a capture sink, so the writer does
+        // not hold the ring back for a pipe reader
+        iov.iov_base = (void *) (packets + from * TS_PACKET_SIZE);
+        iov.iov_len = (size_t) (to - from) * TS_PACKET_SIZE;
+        sink_writev(&job->sink, &iov, 1);
+        job->packets += to - from;
+    }
+}
+
+static void end_job(struct control *ctl, struct control_job *job)
+{
+    struct control_capture *cc = job->cc;
+    int i;
+
+    if (job->state == CONTROL_JOB_TUNED)
+    {
+        capture_remove_callback(cc->cap, job->callback);
+        sink_close(&job->sink);
+        fprintf(stderr, "control: job %s: %llu packets recorded to %s.\n", job->name,
+                (unsigned long long) job->packets, job->path);
+
+        if (--cc->job_count == 0 && cc->job_owned)
+            for (i = 0; i < CONTROL_MAX_CAPTURES; i++)
+                if (ctl->captures[i] == cc)
+                    free_capture(ctl, i);
+    }
+    job->cc = NULL;
+    job->state = CONTROL_JOB_DONE;
+}
+
+// tunes the job, or joins a capture already on its multiplex, and opens
+// its output (returns -1 on error)
+static int tune_job(struct control *ctl, struct control_job *job, time_t now)
+{
+    struct control_reply *r;
+    struct control_capture *cc = NULL;
+    char name[sizeof(job->name) + 4];
+    int i, fd;
+
+    for (i = 0; i < CONTROL_MAX_CAPTURES && cc == NULL; i++)
+        if (ctl->captures[i] && ctl->captures[i]->freq == job->freq &&
+            (job->adapter < 0 || ctl->captures[i]->adapter == job->adapter))
+            cc = ctl->captures[i];
+
+    if (cc == NULL)
+    {
+        r = malloc(sizeof(struct control_reply));
+        if (r == NULL)
+            return -1;
+        r->len = 0;
+        snprintf(name, sizeof(name), "job-%s", job->name);
+        cc = open_capture(ctl, r, name, job->adapter, job->freq, LAYER_FULL);
+        if (cc == NULL)
+            fprintf(stderr, "control: job %s: %.*s", job->name, r->len, r->buf);
+        free(r);
+        if (cc == NULL)
+            return -1;
+        cc->job_owned = 1;
+    }
+
+    if ((fd = open_output(job->path)) < 0)
+    {
+        fprintf(stderr, "control: job %s: %s: %s.\n", job->name, job->path, strerror(errno));
+        if (cc->job_owned && cc->job_count == 0)
+            for (i = 0; i < CONTROL_MAX_CAPTURES; i++)
+                if (ctl->captures[i] == cc)
+                    free_capture(ctl, i);
+        job->state = CONTROL_JOB_DONE;
+        return 0;
+    }
+    sink_open_fd(&job->sink, fd);
+    job->sink.borrowed = 0;
+
+    job->cc = cc;
+    job->recording = job->finished = 0;
+    job->callback = capture_add_callback(cc->cap, job_packets, job);
+    cc->job_count++;
+    job->state = CONTROL_JOB_TUNED;
+    fprintf(stderr, "control: job %s: on %s, %lld s before the start.\n", job->name, cc->name,
+            (long long) (job->start - now));
+    return 0;
+}
+
+// moves every job along: reschedules, pre-tuning and ends
+static void control_jobs(struct control *ctl)
+{
+    struct control_job *job;
+    struct epg_event event;
+    time_t now = time(NULL), end;
+    int i;
+
+    for (i = 0; i < CONTROL_MAX_JOBS; i++)
+    {
+        if ((job = ctl->jobs[i]) == NULL || job->state == CONTROL_JOB_DONE)
+            continue;
+
+        if (job->event_id >= 0 && !job->recording &&
+            find_event(ctl, job->freq, job->service_id, job->event_id, &event) == 0 &&
+            event.start != job->start)
+        {
+            fprintf(stderr, "control: job %s: event moved by %lld s.\n", job->name, (long long) (event.start - job->start));
+            job->start = event.start;
+            job->end = event.start + (event.duration > 0 ? event.duration : 0);
+        }
+
+        end = job->end + (job->event_id >= 0 ? CONTROL_EVENT_GRACE_S : 0);
+        if (job->state == CONTROL_JOB_WAITING)
+        {
+            if (now >= end)
+            {
+                fprintf(stderr, "control: job %s: missed.\n", job->name);
+                job->state = CONTROL_JOB_DONE;
+            }
+            else if ((now >= job->start - job->lead_s || (job->event_id >= 0 && event_on_air(ctl, job))) &&
+                     now >= job->retry_at && tune_job(ctl, job, now) < 0)
+                job->retry_at = now + 5;
+        }
+        else if (job->finished || now >= end)
+            end_job(ctl, job);
+    }
+}
+
+static int cmd_record(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    struct control_job *job;
+    struct epg_event event;
+    int slot, lead_arg;
+
+    if (argc < 7 || (!strcmp(argv[5], "event") && argc < 8))
+        return reply(r, "ERR usage: record JOB ADAPTER FREQ PATH START END [LEAD] | "
+                     "record JOB ADAPTER FREQ PATH event SERVICE EVENT [LEAD]\n");
+    // "job-" and the name must fit in the name of the capture it may tune
+    if (strlen(argv[1]) + 4 >= sizeof(((struct control_capture *) 0)->name) ||
+        strlen(argv[4]) >= sizeof(job->path))
+        return reply(r, "ERR name too long\n");
+
+    for (slot = 0; slot < CONTROL_MAX_JOBS; slot++)
+        if (ctl->jobs[slot] && ctl->jobs[slot]->state != CONTROL_JOB_DONE && !strcmp(ctl->jobs[slot]->name, argv[1]))
+            return reply(r, "ERR job %s already exists\n", argv[1]);
+
+    // done jobs stay listed until their slot is needed: a done job of the
+    // same name goes first, then the first free or done slot
+    for (slot = 0; slot < CONTROL_MAX_JOBS; slot++)
+        if (ctl->jobs[slot] && !strcmp(ctl->jobs[slot]->name, argv[1]))
+            break;
+    if (slot == CONTROL_MAX_JOBS)
+        for (slot = 0; slot < CONTROL_MAX_JOBS && ctl->jobs[slot] && ctl->jobs[slot]->state != CONTROL_JOB_DONE; slot++)
+            ;
+    if (slot == CONTROL_MAX_JOBS)
+        return reply(r, "ERR too many jobs\n");
+
+    job = calloc(1, sizeof(struct control_job));
+    if (job == NULL)
+        return reply(r, "ERR out of memory\n");
+    strcpy(job->name, argv[1]);
+    strcpy(job->path, argv[4]);
+    job->adapter = atoi(argv[2]);
+    job->freq = strtoull(argv[3], NULL, 10);
+    job->lead_s = CONTROL_LEAD_S;
+
+    if (!strcmp(argv[5], "event"))
+    {
+        job->service_id = atoi(argv[6]);
+        job->event_id = atoi(argv[7]);
+        if (find_event(ctl, job->freq, job->service_id, job->event_id, &event) < 0)
+        {
+            free(job);
+            return reply(r, "ERR event %s of service %s is not in the EPG of a capture on %s\n",
+                         argv[7], argv[6], argv[3]);
+        }
+        job->start = event.start;
+        job->end = event.start + (event.duration > 0 ? event.duration : 0);
+        lead_arg = 8;
+    }
+    else
+    {
+        job->event_id = -1;
+        job->start = strtoll(argv[5], NULL, 10);
+        job->end = strtoll(argv[6], NULL, 10);
+        lead_arg = 7;
+    }
+    if (argc > lead_arg)
+        job->lead_s = atoi(argv[lead_arg]);
+
+    free(ctl->jobs[slot]);
+    ctl->jobs[slot] = job;
+    fprintf(stderr, "control: job %s: %llu Hz to %s, from %lld to %lld.\n", job->name,
+            (unsigned long long) job->freq, job->path, (long long) job->start, (long long) job->end);
+
+    // a window already open starts right away
+    control_jobs(ctl);
+    return reply(r, "OK\n");
+}
+
+static int cmd_jobs(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    static const char *states[] = { "waiting", "tuned", "done" };
+    struct control_job *job;
+    int i;
+
+    for (i = 0; i < CONTROL_MAX_JOBS; i++)
+    {
+        if ((job = ctl->jobs[i]) == NULL)
+            continue;
+        reply(r, "%s state=%s%s freq=%llu service=%d event=%d start=%lld end=%lld lead=%d packets=%llu path=%s\n",
+              job->name, states[job->state], job->state == CONTROL_JOB_TUNED && job->recording ? ",recording" : "",
+              (unsigned long long) job->freq, job->service_id, job->event_id, (long long) job->start,
+              (long long) job->end, job->lead_s, (unsigned long long) job->packets, job->path);
+    }
+    return reply(r, "OK\n");
+}
+
+static int cmd_cancel(struct control *ctl, struct control_reply *r, int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2)
+        return reply(r, "ERR usage: cancel JOB\n");
+
+    for (i = 0; i < CONTROL_MAX_JOBS; i++)
+    {
+        if (ctl->jobs[i] && !strcmp(ctl->jobs[i]->name, argv[1]))
+        {
+            end_job(ctl, ctl->jobs[i]);
+            free(ctl->jobs[i]);
+            ctl->jobs[i] = NULL;
+            fprintf(stderr, "control: job %s cancelled.\n", argv[1]);
+            return reply(r, "OK\n");
+        }
+    }
+    return reply(r, "ERR no job %s\n", argv[1]);
+}
+
+static void control_command(struct control *ctl, struct control_client *client, char *line)
+{
+    struct control_reply *r = malloc(sizeof(struct control_reply));
+    char *argv[CONTROL_MAX_ARGS], *save;
+    int argc = 0;
+
+    if (r == NULL)
+        return;
+    r->len = 0;
+
+    for (argv[argc] = strtok_r(line, " \t\r", &save); argv[argc] && argc < CONTROL_MAX_ARGS - 1;
+         argv[argc] = strtok_r(NULL, " \t\r", &save))
+        argc++;
+
+    if (argc == 0)
+        ;
+    else if (!strcmp(argv[0], "add"))
+        cmd_add(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "remove"))
+        cmd_remove(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "retune"))
+        cmd_retune(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "standby"))
+        cmd_standby(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "attach"))
+        cmd_attach(ctl, client, r, argc, argv);
+    else if (!strcmp(argv[0], "detach"))
+        cmd_detach(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "status"))
+        cmd_status(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "devices"))
+        cmd_devices(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "epg"))
+        cmd_epg(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "record"))
+        cmd_record(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "jobs"))
+        cmd_jobs(ctl, r, argc, argv);
+    else if (!strcmp(argv[0], "cancel"))
+        cmd_cancel(ctl, r, argc, argv);
+    else
+        reply(r, "ERR unknown command %s\n", argv[0]);
+
+    // answers are small, a client that cannot take one is dropped
+    if (r->len > 0 && send(client->fd, r->buf, r->len, MSG_NOSIGNAL | MSG_DONTWAIT) != r->len)
+    {
+        close(client->fd);
+        client->fd = -1;
+    }
+    free(r);
+}
+
+static void drop_client(struct control_client *client)
+{
+    if (client->fd >= 0)
+        close(client->fd);
+    if (client->passed_fd >= 0)
+        close(client->passed_fd);
+    client->fd = -1;
+    client->passed_fd = -1;
+}
+
+// reads what the client sent, with a descriptor if one came along, and runs
+// every complete line
+static void control_read(struct control *ctl, struct control_client *client)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char *nl;
+    ssize_t n;
+
+    if (client->len == CONTROL_LINE_SIZE - 1)
+    {
+        drop_client(client);
+        return;
+    }
+
+    iov.iov_base = client->line + client->len;
+    iov.iov_len = CONTROL_LINE_SIZE - 1 - client->len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    n = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (n <= 0)
+    {
+        drop_client(client);
+        return;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            if (client->passed_fd >= 0)
+                close(client->passed_fd);
+            memcpy(&client->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    client->len += n;
+    client->line[client->len] = 0;
+    while (client->fd >= 0 && (nl = strchr(client->line, '\n')) != NULL)
+    {
+        *nl = 0;
+        control_command(ctl, client, client->line);
+        client->len -= nl + 1 - client->line;
+        memmove(client->line, nl + 1, client->len + 1);
+    }
+    if (client->fd < 0)
+        drop_client(client);
+}
+
+// detaches the outputs whose writes failed, as every later write would
+static void control_reap(struct control *ctl)
+{
+    struct control_capture *cc;
+    int i, j;
+
+    for (i = 0; i < CONTROL_MAX_CAPTURES; i++)
+    {
+        if ((cc = ctl->captures[i]) == NULL)
+            continue;
+        for (j = cc->output_count - 1; j >= 0; j--)
+        {
+            if (cc->outputs[j]->sink.errors == 0)
+                continue;
+            fprintf(stderr, "control: %s: output %s failed, detached.\n", cc->name, cc->outputs[j]->path);
+            remove_output(cc, j);
+        }
+    }
+
+    for (i = 0; i < CONTROL_MAX_JOBS; i++)
+    {
+        if (ctl->jobs[i] == NULL || ctl->jobs[i]->state != CONTROL_JOB_TUNED || ctl->jobs[i]->sink.errors == 0)
+            continue;
+        fprintf(stderr, "control: job %s: output %s failed, stopped.\n", ctl->jobs[i]->name, ctl->jobs[i]->path);
+        end_job(ctl, ctl->jobs[i]);
+    }
+}
+
+int control_poll(struct control *ctl, int timeout_ms)
+{
+    struct pollfd fds[CONTROL_MAX_CLIENTS + 1];
+    int slots[CONTROL_MAX_CLIENTS + 1];
+    int i, n = 1, fd;
+
+    fds[0].fd = ctl->fd;
+    fds[0].events = POLLIN;
+    for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    {
+        if (ctl->clients[i].fd < 0)
+            continue;
+        fds[n].fd = ctl->clients[i].fd;
+        fds[n].events = POLLIN;
+        slots[n++] = i;
+    }
+
+    if (poll(fds, n, timeout_ms) < 0 && errno != EINTR)
+        return control_set_error(ctl, "Error polling the control socket.");
+
+    for (i = 1; i < n; i++)
+        if (fds[i].revents)
+            control_read(ctl, &ctl->clients[slots[i]]);
+
+    if (fds[0].revents & POLLIN)
+    {
+        fd = accept4(ctl->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        for (i = 0; fd >= 0 && i < CONTROL_MAX_CLIENTS && ctl->clients[i].fd >= 0; i++)
+            ;
+        if (fd >= 0 && i == CONTROL_MAX_CLIENTS)
+            close(fd);
+        else if (fd >= 0)
+        {
+            ctl->clients[i].fd = fd;
+            ctl->clients[i].len = 0;
+            ctl->clients[i].passed_fd = -1;
+        }
+    }
+
+    control_reap(ctl);
+    control_jobs(ctl);
+    return 0;
+}
+
+void control_close(struct control *ctl)
+{
+    int i;
+
+    for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        drop_client(&ctl->clients[i]);
+    for (i = 0; i < CONTROL_MAX_JOBS; i++)
+        if (ctl->jobs[i])
+        {
+            end_job(ctl, ctl->jobs[i]);
+            free(ctl->jobs[i]);
+            ctl->jobs[i] = NULL;
+        }
+    for (i = 0; i < CONTROL_MAX_CAPTURES; i++)
+        if (ctl->captures[i])
+            free_capture(ctl, i);
+
+    if (ctl->fd >= 0)
+    {
+        close(ctl->fd);
+        unlink(ctl->path);
+    }
+    ctl->fd = -1;
+}
@@ -0,0 +1,173 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+// Control socket of the capture daemon: a Unix stream socket taking one
+// command per line, each answered by zero or more data lines and a final
+// "OK [...]" or "ERR message" line.
+//
+//   add NAME ADAPTER FREQ [LAYER]  tunes ADAPTER (-1: first ISDB-T one) to
+//                                  FREQ Hz and starts capture NAME
+//   remove NAME                    stops and closes a capture
+//   retune NAME FREQ [LAYER]       moves a capture, its outputs stay attached
+//   standby NAME ADAPTER|- [FREQ]  keeps ADAPTER locked on FREQ (by default
+//                                  the next channel up) for an instant
+//                                  retune of NAME to it, see
+//                                  capture_open_standby(); - re-aims it
+//   attach NAME PATH               writes the capture to a file or a fifo,
+//                                  which must already have a reader
+//   attach NAME -                  writes it to the fd passed along with the
+//                                  command (SCM_RIGHTS), answers "OK fdN"
+//   detach NAME PATH|fdN           removes an output
+//   status [NAME]                  one line per capture and per output
+//   devices                        one line per adapter, from the device
+//                                  table (see dvb_devices.h)
+//   epg NAME                       the events of the multiplex of a capture,
+//                                  from its EIT (see epg.h)
+//   record JOB ADAPTER FREQ PATH START END [LEAD]
+//                                  records FREQ to PATH from START to END
+//                                  (seconds since the epoch)
+//   record JOB ADAPTER FREQ PATH event SERVICE EVENT [LEAD]
+//                                  records an event of the EPG of a capture
+//                                  on FREQ, following its reschedules
+//   jobs                           one line per recording job
+//   cancel JOB                     stops and forgets a job
+//
+// A recording job tunes LEAD seconds (CONTROL_LEAD_S by default) before its
+// start, or uses a capture already on FREQ, so the lock and a warm ring are
+// there when the recording begins. An event is cut on the packet that
+// completed the present/following section announcing it, and ends on the
+// one announcing the next event; a time window is cut on the first batch of
+// packets past START and the last one before END.
+//
+// Everything runs from control_poll() in the caller's thread, except the
+// captures themselves: commands never interrupt the other streams. Outputs
+// whose writes fail (eg. the reader went away) are detached automatically,
+// so the process should ignore SIGPIPE.
+
+#include <stdint.h>
+
+#include "capture.h"
+#include "sink.h"
+#include "epg.h"
+#include "ewbs.h"
+
+#define CONTROL_MAX_CAPTURES 16
+#define CONTROL_MAX_CLIENTS  16
+#define CONTROL_MAX_JOBS     32
+#define CONTROL_LINE_SIZE    512
+
+#define CONTROL_LEAD_S       60
+
+// channel spacing, for the default standby channel
+#define CONTROL_CHANNEL_WIDTH 6000000
+
+// an event still on air past its scheduled end keeps being recorded, up to
+// this long, and one that never came is given up after it
+#define CONTROL_EVENT_GRACE_S 1800
+
+struct control_output {
+    char path[256];
+    struct sink sink;
+};
+
+struct control_capture {
+    char name[32];
+    int adapter;
+    uint64_t freq;
+    int layer_info;
+    struct capture *cap;
+    struct control_output *outputs[CAPTURE_MAX_SINKS];
+    int output_count;
+
+    struct epg epg;
+    struct ewbs ewbs;
+
+    // opened by a job rather than by add, and the jobs recording from it
+    int job_owned;
+    int job_count;
+};
+
+#define CONTROL_JOB_WAITING   0
+#define CONTROL_JOB_TUNED     1
+#define CONTROL_JOB_DONE      2
+
+struct control_job {
+    char name[32];
+    char path[256];
+    int adapter;
+    uint64_t freq;
+    int lead_s;
+
+    // an EPG event, or a time window with event_id -1
+    int service_id;
+    int event_id;
+    time_t start, end;
+
+    int state;
+    time_t retry_at; // tuning failed, next attempt
+    struct control_capture *cc;
+    int callback;
+    struct sink sink;
+
+    // set by the capture thread; aired once the EIT showed the event on
+    volatile int recording;
+    int aired;
+    volatile int finished;
+    uint64_t packets;
+};
+
+struct control_client {
+    int fd;
+    char line[CONTROL_LINE_SIZE];
+    int len;
+
+    // descriptor received with the last command, -1 if none
+    int passed_fd;
+};
+
+struct control {
+    int fd;
+    char path[108];
+
+    struct control_capture *captures[CONTROL_MAX_CAPTURES];
+    struct control_job *jobs[CONTROL_MAX_JOBS];
+    struct control_client clients[CONTROL_MAX_CLIENTS];
+    int client_count;
+
+    // when set, the captures opened afterwards raise EWBS alarms on it
+    struct ewbs_hook *alarm_hook;
+
+    char error_msg[256];
+};
+
+
+// creates the socket at path, replacing a stale one (returns -1 on error)
+int control_open(struct control *ctl, const char *path);
+
+// serves clients for up to timeout_ms (returns -1 on error)
+int control_poll(struct control *ctl, int timeout_ms);
+
+// stops every job and capture, disconnects the clients and removes the socket
+void control_close(struct control *ctl);
+
+#endif /* _CONTROL_H_ */
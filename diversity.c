@@ -0,0 +1,409 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "diversity.h"
+#include "m2ts.h"
+
+// packets staged before a write to the sinks
+#define DIVERSITY_OUT 256
+
+// a packet is only used as an alignment anchor if it is this far from the
+// head of its queue at most
+#define DIVERSITY_ANCHOR 64
+
+static uint32_t packet_hash(const unsigned char *p)
+{
+    uint32_t h = 2166136261u;
+    const uint32_t *w = (const uint32_t *) p;
+    int i;
+
+    // the TEI bit differs between copies of the same packet
+    h = (h ^ (w[0] & ~0x8000u)) * 16777619u;
+    for (i = 1; i < TS_PACKET_SIZE / 4; i++)
+        h = (h ^ w[i]) * 16777619u;
+    return h;
+}
+
+static int packet_pid(const unsigned char *p)
+{
+    return (p[1] & 0x1F) << 8 | p[2];
+}
+
+static unsigned char *queue_packet(struct diversity_input *in, unsigned int i)
+{
+    return in->packets + (size_t) ((in->head + i) % DIVERSITY_QUEUE) * TS_PACKET_SIZE;
+}
+
+static uint32_t queue_hash(struct diversity_input *in, unsigned int i)
+{
+    return in->hashes[(in->head + i) % DIVERSITY_QUEUE];
+}
+
+static void queue_pop(struct diversity_input *in, unsigned int n)
+{
+    in->head = (in->head + n) % DIVERSITY_QUEUE;
+    in->count -= n;
+}
+
+static int same_packet(struct diversity *d, unsigned int i, unsigned int j)
+{
+    const unsigned char *a = queue_packet(&d->in[0], i);
+    const unsigned char *b = queue_packet(&d->in[1], j);
+
+    return queue_hash(&d->in[0], i) == queue_hash(&d->in[1], j) &&
+        (a[1] & 0x7F) == (b[1] & 0x7F) && !memcmp(a + 2, b + 2, TS_PACKET_SIZE - 2);
+}
+
+// damaged as seen from the output: TEI set or out of continuity
+static int packet_bad(struct diversity *d, const unsigned char *p)
+{
+    int pid = packet_pid(p);
+
+    if (p[1] & 0x80)
+        return 1;
+    if (pid == NULL_PID || !(p[3] & 0x10) || d->cc[pid] == 0xFF)
+        return 0;
+    // a duplicate packet repeats the previous counter
+    return (p[3] & 0x0F) != d->cc[pid] && (p[3] & 0x0F) != ((d->cc[pid] - 1) & 0x0F);
+}
+
+static void diversity_write(struct diversity *d)
+{
+    struct iovec iov;
+    int i;
+
+    for (i = 0; i < d->sink_count; i++)
+    {
+        iov.iov_base = d->out;
+        iov.iov_len = (size_t) d->out_count * TS_PACKET_SIZE;
+        if (sink_writev(d->sinks[i], &iov, 1) < 0)
+            fprintf(stderr, "Error writing diversity output.\n");
+    }
+    d->out_count = 0;
+}
+
+static void emit(struct diversity *d, const unsigned char *p, uint32_t hash)
+{
+    int pid = packet_pid(p);
+
+    d->history[d->history_pos] = hash;
+    d->history_pos = (d->history_pos + 1) % DIVERSITY_QUEUE;
+    d->history_count++;
+
+    if (pid != NULL_PID && (p[3] & 0x10))
+        d->cc[pid] = (p[3] + 1) & 0x0F;
+
+    memcpy(d->out + (size_t) d->out_count * TS_PACKET_SIZE, p, TS_PACKET_SIZE);
+    d->packets_out++;
+    if (++d->out_count == DIVERSITY_OUT)
+        diversity_write(d);
+}
+
+// index of the first packet of input from that can anchor an alignment
+static int find_anchor(struct diversity_input *in)
+{
+    unsigned int i;
+    const unsigned char *p;
+
+    for (i = 0; i < in->count && i < DIVERSITY_ANCHOR; i++)
+    {
+        p = queue_packet(in, i);
+        if (packet_pid(p) != NULL_PID && !(p[1] & 0x80))
+            return i;
+    }
+    return -1;
+}
+
+// outputs the head of an input
+static void emit_head(struct diversity *d, int input)
+{
+    emit(d, queue_packet(&d->in[input], 0), queue_hash(&d->in[input], 0));
+    queue_pop(&d->in[input], 1);
+}
+
+// looks for packet i of input `from` in the first max packets of the other
+static int find_in_other(struct diversity *d, int from, unsigned int i, unsigned int max)
+{
+    struct diversity_input *other = &d->in[!from];
+    unsigned int j;
+
+    for (j = 0; j < other->count && j < max; j++)
+        if (from == 0 ? same_packet(d, i, j) : same_packet(d, j, i))
+            return j;
+    return -1;
+}
+
+// how many packets ago a packet with this hash was output, -1 if not seen
+static int find_in_history(struct diversity *d, uint32_t hash)
+{
+    unsigned int k, n = d->history_count < DIVERSITY_QUEUE ? d->history_count : DIVERSITY_QUEUE;
+
+    for (k = 0; k < n; k++)
+        if (d->history[(d->history_pos + DIVERSITY_QUEUE - 1 - k) % DIVERSITY_QUEUE] == hash)
+            return k;
+    return -1;
+}
+
+// brings both heads to the same packet; returns 0 while there is not
+// enough data to tell, going on with input 0 alone meanwhile
+static int diversity_align(struct diversity *d)
+{
+    int anchor, j;
+
+    // input 1 is ahead: its packets before the match precede input 0
+    anchor = find_anchor(&d->in[0]);
+    if (anchor >= 0 && (j = find_in_other(d, 0, anchor, DIVERSITY_QUEUE)) >= anchor)
+    {
+        queue_pop(&d->in[1], j - anchor);
+        d->aligned = 1;
+        d->resyncs++;
+        return 1;
+    }
+
+    // input 0 is ahead: what input 1 missed goes out first
+    anchor = find_anchor(&d->in[1]);
+    if (anchor >= 0 && (j = find_in_other(d, 1, anchor, DIVERSITY_QUEUE)) >= anchor)
+    {
+        while (j-- > anchor)
+            emit_head(d, 0);
+        d->aligned = 1;
+        d->resyncs++;
+        return 1;
+    }
+
+    // input 1 is behind what was output already: skip to the output
+    if (anchor >= 0 && (j = find_in_history(d, queue_hash(&d->in[1], anchor))) >= 0)
+    {
+        unsigned int skip = anchor + j + 1;
+        queue_pop(&d->in[1], skip < d->in[1].count ? skip : d->in[1].count);
+        return 0;
+    }
+
+    // searching is costly: go on for half a window before trying again
+    if (d->in[0].count >= DIVERSITY_WINDOW)
+        while (d->in[0].count > DIVERSITY_WINDOW / 2)
+            emit_head(d, 0);
+    return 0;
+}
+
+static void diversity_merge(struct diversity *d)
+{
+    const unsigned char *a, *b;
+    int from, anchor, j;
+
+    while (d->in[0].count > 0 && d->in[1].count > 0)
+    {
+        if (!d->aligned && !diversity_align(d))
+            break;
+        if (d->in[0].count == 0 || d->in[1].count == 0)
+            break;
+
+        a = queue_packet(&d->in[0], 0);
+        b = queue_packet(&d->in[1], 0);
+
+        if (same_packet(d, 0, 0))
+        {
+            emit(d, (a[1] & 0x80) ? b : a, queue_hash(&d->in[0], 0));
+            queue_pop(&d->in[0], 1);
+            queue_pop(&d->in[1], 1);
+            continue;
+        }
+
+        // same position, different content: one copy is damaged
+        if (packet_pid(a) == packet_pid(b) && (a[3] & 0x0F) == (b[3] & 0x0F))
+        {
+            if (packet_bad(d, a) && !packet_bad(d, b))
+                emit(d, b, queue_hash(&d->in[1], 0));
+            else
+                emit(d, a, queue_hash(&d->in[0], 0));
+            queue_pop(&d->in[0], 1);
+            queue_pop(&d->in[1], 1);
+            d->repaired++;
+            continue;
+        }
+
+        // one input lost packets: the other has them before this head.
+        // Null and TEI packets match unrelated ones, the first packet that
+        // could anchor an alignment is looked for instead
+        for (from = 0; from < 2; from++)
+        {
+            anchor = find_anchor(&d->in[from]);
+            if (anchor < 0)
+                continue;
+            j = find_in_other(d, from, anchor, DIVERSITY_WINDOW + anchor);
+            if (j > anchor)
+            {
+                j -= anchor;
+                while (j-- > 0)
+                {
+                    emit_head(d, !from);
+                    d->filled[!from]++;
+                }
+                break;
+            }
+        }
+        if (from < 2)
+            continue;
+
+        // not found: wait for a full window before giving up on the pair
+        if (d->in[0].count < DIVERSITY_WINDOW && d->in[1].count < DIVERSITY_WINDOW)
+            break;
+        if (packet_bad(d, a) && !packet_bad(d, b))
+            emit(d, b, queue_hash(&d->in[1], 0));
+        else
+            emit(d, a, queue_hash(&d->in[0], 0));
+        queue_pop(&d->in[0], 1);
+        queue_pop(&d->in[1], 1);
+        d->aligned = 0;
+    }
+
+    // one input stalled (or the tuner is gone): pass the other through
+    for (from = 0; from < 2; from++)
+    {
+        if (d->in[!from].count > 0 || d->in[from].count < DIVERSITY_WINDOW)
+            continue;
+        while (d->in[from].count > DIVERSITY_WINDOW / 2)
+        {
+            emit_head(d, from);
+            d->filled[from]++;
+        }
+        d->aligned = 0;
+    }
+}
+
+int diversity_init(struct diversity *d)
+{
+    int i;
+
+    memset(d, 0, sizeof(struct diversity));
+    memset(d->cc, 0xFF, sizeof(d->cc));
+
+    for (i = 0; i < 2; i++)
+    {
+        d->in[i].packets = malloc((size_t) DIVERSITY_QUEUE * TS_PACKET_SIZE);
+        d->in[i].hashes = malloc(DIVERSITY_QUEUE * sizeof(uint32_t));
+    }
+    d->out = malloc((size_t) DIVERSITY_OUT * TS_PACKET_SIZE);
+    d->history = malloc(DIVERSITY_QUEUE * sizeof(uint32_t));
+    if (!d->in[0].packets || !d->in[1].packets || !d->in[0].hashes || !d->in[1].hashes ||
+        !d->out || !d->history)
+    {
+        diversity_free(d);
+        return -1;
+    }
+
+    pthread_mutex_init(&d->mutex, NULL);
+    return 0;
+}
+
+int diversity_add_sink(struct diversity *d, struct sink *sink)
+{
+    if (d->sink_count == DIVERSITY_MAX_SINKS)
+        return -1;
+    d->sinks[d->sink_count++] = sink;
+    return 0;
+}
+
+void diversity_feed(struct diversity *d, int input, const unsigned char *packets, int count)
+{
+    struct diversity_input *in = &d->in[input];
+    unsigned int tail;
+    int i;
+
+    pthread_mutex_lock(&d->mutex);
+    for (i = 0; i < count; i++)
+    {
+        // the merge below keeps the queues short, unless the inputs are
+        // too far apart to be aligned: input 0 goes on alone then
+        if (in->count == DIVERSITY_QUEUE)
+        {
+            if (input == 0)
+                emit_head(d, 0);
+            else
+                queue_pop(in, 1);
+            d->aligned = 0;
+        }
+
+        tail = (in->head + in->count) % DIVERSITY_QUEUE;
+        memcpy(in->packets + (size_t) tail * TS_PACKET_SIZE, packets + (size_t) i * TS_PACKET_SIZE,
+               TS_PACKET_SIZE);
+        in->hashes[tail] = packet_hash(packets + (size_t) i * TS_PACKET_SIZE);
+        in->count++;
+    }
+
+    diversity_merge(d);
+    if (d->out_count > 0)
+        diversity_write(d);
+    pthread_mutex_unlock(&d->mutex);
+}
+
+void diversity_flush(struct diversity *d)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&d->mutex);
+    diversity_merge(d);
+
+    // what is left of input 0 goes out as it is
+    while (d->in[0].count > 0)
+        emit_head(d, 0);
+
+    // of input 1 (if aligned, else input 0 is enough) only what follows
+    // the last packet already output, which input 0 did not get
+    if (d->aligned)
+    {
+        for (i = d->in[1].count; i > 0; i--)
+            if (packet_pid(queue_packet(&d->in[1], i - 1)) != NULL_PID &&
+                find_in_history(d, queue_hash(&d->in[1], i - 1)) >= 0)
+                break;
+        queue_pop(&d->in[1], i);
+        while (d->in[1].count > 0)
+        {
+            emit_head(d, 1);
+            d->filled[1]++;
+        }
+    }
+    if (d->out_count > 0)
+        diversity_write(d);
+    pthread_mutex_unlock(&d->mutex);
+}
+
+void diversity_free(struct diversity *d)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        free(d->in[i].packets);
+        free(d->in[i].hashes);
+        d->in[i].packets = NULL;
+        d->in[i].hashes = NULL;
+    }
+    free(d->out);
+    free(d->history);
+    d->out = NULL;
+    d->history = NULL;
+}
@@ -0,0 +1,94 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _DIVERSITY_H_
+#define _DIVERSITY_H_
+
+// Packet-level diversity: merges the TS of two tuners receiving the same
+// channel on different antennas into one stream.
+//
+// Both inputs carry the same packets in the same order, except where one
+// of them lost packets or delivered them corrupted. The merger keeps a
+// window of packets per input, aligns the two by packet content and, for
+// each position, outputs the copy without TEI or continuity error. Packets
+// missing from one input are taken from the other; when an input stalls
+// the other is passed through alone until both can be aligned again.
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sink.h"
+
+// packets an input may get ahead before it is considered stalled; this is
+// also how far ahead a lost run is searched for. Unaligned inputs (at start
+// or after a retune) are searched over the whole queue, ~1.3s at 18Mbit/s.
+#define DIVERSITY_WINDOW 1024
+#define DIVERSITY_QUEUE  (DIVERSITY_WINDOW * 16)
+
+#define DIVERSITY_MAX_SINKS 4
+
+struct diversity_input {
+    unsigned char *packets;
+    uint32_t *hashes;
+    unsigned int head, count;
+};
+
+struct diversity {
+    pthread_mutex_t mutex;
+    struct diversity_input in[2];
+    int aligned;
+
+    // next continuity counter per PID of the output, 0xFF if unknown
+    unsigned char cc[8192];
+
+    // hashes of the last packets output, to recognize an input that is
+    // behind the output
+    uint32_t *history;
+    unsigned int history_pos;
+    uint64_t history_count;
+
+    struct sink *sinks[DIVERSITY_MAX_SINKS];
+    int sink_count;
+    unsigned char *out;
+    int out_count;
+
+    // statistics
+    uint64_t packets_out;
+    uint64_t repaired;   // positions where one copy was damaged
+    uint64_t filled[2];  // packets only input i delivered
+    uint64_t resyncs;
+};
+
+
+// returns -1 if out of memory
+int diversity_init(struct diversity *d);
+
+int diversity_add_sink(struct diversity *d, struct sink *sink);
+
+// queues count packets of input 0 or 1 and writes out what can be merged;
+// safe to call from both capture threads
+void diversity_feed(struct diversity *d, int input, const unsigned char *packets, int count);
+
+// writes out what is left (at the end of a capture)
+void diversity_flush(struct diversity *d);
+
+void diversity_free(struct diversity *d);
+
+#endif /* _DIVERSITY_H_ */
@@ -0,0 +1,701 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "dsmcc.h"
+#include "m2ts.h"
+
+#define DSMCC_TABLE_MESSAGES 0x3B // DSI and DII
+#define DSMCC_TABLE_DATA     0x3C // DDB
+
+#define DSMCC_PROTOCOL       0x11
+#define DSMCC_TYPE_DOWNLOAD  0x03
+
+#define DSMCC_DII            0x1002
+#define DSMCC_DDB            0x1003
+#define DSMCC_DSI            0x1006
+
+#define COMPRESSED_MODULE_DESCRIPTOR 0x09 // DVB, TR 101 202
+#define NAME_DESCRIPTOR              0x02 // ARIB STD-B24 data carousels
+#define COMPRESSION_TYPE_DESCRIPTOR  0xC2 // ARIB STD-B24 data carousels
+
+#define TAG_BIOP            0x49534F06
+#define TAG_OBJECT_LOCATION 0x49534F50
+
+#define DSMCC_MAX_DEPTH 16
+
+static uint32_t be16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+void dsmcc_init(struct dsmcc *ds, const char *dir)
+{
+    memset(ds, 0, sizeof(struct dsmcc));
+    snprintf(ds->dir, sizeof(ds->dir), "%s", dir);
+    memset(ds->index, -1, sizeof(ds->index));
+    psi_assembler_init(&ds->pat, PAT_PID);
+}
+
+static struct dsmcc_module *find_module(struct dsmcc_carousel *c, int id)
+{
+    int i;
+
+    for (i = 0; i < c->module_count; i++)
+        if (c->modules[i].id == id)
+            return &c->modules[i];
+    return NULL;
+}
+
+static struct dsmcc_object *find_object(struct dsmcc_carousel *c, int module_id, const unsigned char *key, int key_len)
+{
+    int i;
+
+    for (i = 0; i < c->object_count; i++)
+        if (c->objects[i].module_id == module_id && c->objects[i].key_len == key_len &&
+            !memcmp(c->objects[i].key, key, key_len))
+            return &c->objects[i];
+    return NULL;
+}
+
+static void drop_objects(struct dsmcc_carousel *c, int module_id)
+{
+    int i, kept = 0;
+
+    for (i = 0; i < c->object_count; i++)
+        if (c->objects[i].module_id != module_id)
+            c->objects[kept++] = c->objects[i];
+    c->object_count = kept;
+}
+
+static void release_module(struct dsmcc *ds, struct dsmcc_module *m)
+{
+    if (m->data)
+        ds->memory -= m->data_len;
+    free(m->data);
+    free(m->received);
+    m->data = NULL;
+    m->received = NULL;
+}
+
+// parses an IOR at d + p, up to len: the module and object key of its BIOP
+// ObjectLocation (module_id -1 when it has none); returns the position after
+// the IOR, or -1 when it does not fit
+static int64_t parse_ior(const unsigned char *d, int64_t p, int64_t len, int *module_id, unsigned char *key, int *key_len)
+{
+    int64_t end, q;
+    uint32_t profiles, tag, i, j;
+    int components, size;
+
+    *module_id = -1;
+    if (p + 4 > len)
+        return -1;
+    p += 4 + ((be32(d + p) + 3) & ~3); // type_id, aligned
+    if (p + 4 > len)
+        return -1;
+    profiles = be32(d + p);
+    p += 4;
+
+    for (i = 0; i < profiles; i++)
+    {
+        if (p + 8 > len)
+            return -1;
+        tag = be32(d + p);
+        end = p + 8 + be32(d + p + 4);
+        if (end > len)
+            return -1;
+
+        if (tag == TAG_BIOP && end - p >= 10)
+        {
+            components = d[p + 9];
+            for (q = p + 10, j = 0; j < components && q + 5 <= end; j++, q += 5 + size)
+            {
+                size = d[q + 4];
+                if (q + 5 + size > end)
+                    break;
+                // carousel_id, module_id, version, object key
+                if (be32(d + q) == TAG_OBJECT_LOCATION && size >= 9 && 9 + d[q + 13] <= size &&
+                    d[q + 13] <= DSMCC_MAX_KEY)
+                {
+                    *module_id = be16(d + q + 9);
+                    *key_len = d[q + 13];
+                    memcpy(key, d + q + 14, *key_len);
+                }
+            }
+        }
+        p = end;
+    }
+    return p;
+}
+
+// the BIOP messages of a complete object carousel module
+static void parse_objects(struct dsmcc_carousel *c, struct dsmcc_module *m)
+{
+    const unsigned char *d = m->data;
+    struct dsmcc_object *o;
+    int64_t len = m->data_len, pos, end, p, kind_len;
+    int key_len, contexts, i;
+
+    for (pos = 0; pos + 12 <= len && !memcmp(d + pos, "BIOP", 4); pos = end)
+    {
+        end = pos + 12 + be32(d + pos + 8);
+        if (end > len)
+            break;
+
+        p = pos + 12;
+        key_len = d[p];
+        p += 1 + key_len;
+        if (p + 4 > end)
+            break;
+        kind_len = be32(d + p);
+        if (p + 4 + kind_len + 2 > end)
+            break;
+        o = c->object_count < DSMCC_MAX_OBJECTS && key_len <= DSMCC_MAX_KEY && kind_len >= 3 ?
+            &c->objects[c->object_count] : NULL;
+        if (o)
+        {
+            memset(o, 0, sizeof(struct dsmcc_object));
+            o->module_id = m->id;
+            o->key_len = key_len;
+            memcpy(o->key, d + pos + 13, key_len);
+            memcpy(o->kind, d + p + 4, 3);
+        }
+        p += 4 + kind_len;
+        p += 2 + be16(d + p); // object info
+        if (p + 1 > end)
+            break;
+
+        contexts = d[p++];
+        for (i = 0; i < contexts && p + 6 <= end; i++)
+            p += 6 + be16(d + p + 4);
+        if (p + 4 > end || p + 4 + be32(d + p) > end)
+            break;
+
+        if (o)
+        {
+            o->body = p + 4;
+            o->body_len = be32(d + p);
+            c->object_count++;
+        }
+    }
+}
+
+// a binding name is a single path component
+static int safe_name(const char *name)
+{
+    return name[0] && strcmp(name, ".") && strcmp(name, "..") && !strchr(name, '/');
+}
+
+static void write_file(struct dsmcc *ds, struct dsmcc_module *m, struct dsmcc_object *o, const char *path)
+{
+    const unsigned char *body = m->data + o->body;
+    uint32_t len;
+    FILE *fp;
+
+    if (o->body_len < 4)
+        return;
+    len = be32(body);
+    if (len > o->body_len - 4)
+        len = o->body_len - 4;
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "DSM-CC: error writing %s.\n", path);
+        return;
+    }
+    fwrite(body + 4, 1, len, fp);
+    fclose(fp);
+    o->written = 1;
+    ds->files_written++;
+}
+
+// writes the files of a directory (or the service gateway) whose modules
+// are complete, and goes down into its subdirectories
+static void walk(struct dsmcc *ds, struct dsmcc_carousel *c, struct dsmcc_object *dir, const char *path, int depth)
+{
+    struct dsmcc_module *m = find_module(c, dir->module_id);
+    struct dsmcc_object *child;
+    const unsigned char *d;
+    unsigned char key[DSMCC_MAX_KEY];
+    char name[256], child_path[1024];
+    int64_t len, p;
+    int bindings, components, i, j, id_len = 0, module_id, key_len = 0;
+
+    if (m == NULL || m->data == NULL || dir->body_len < 2)
+        return;
+    d = m->data + dir->body;
+    len = dir->body_len;
+    bindings = be16(d);
+
+    for (p = 2, i = 0; i < bindings; i++)
+    {
+        name[0] = 0;
+        if (p + 1 > len)
+            return;
+        components = d[p++];
+        for (j = 0; j < components; j++)
+        {
+            if (p + 1 > len)
+                return;
+            id_len = d[p++];
+            if (p + id_len + 1 > len)
+                return;
+            // the last component names the object
+            snprintf(name, sizeof(name), "%.*s", id_len, d + p);
+            p += id_len;
+            p += 1 + d[p]; // kind
+        }
+        p++; // binding type
+        p = parse_ior(d, p, len, &module_id, key, &key_len);
+        if (p < 0 || p + 2 > len)
+            return;
+        p += 2 + be16(d + p); // object info
+
+        if (module_id < 0 || !safe_name(name))
+            continue;
+        // not there yet, a later module completes it
+        child = find_object(c, module_id, key, key_len);
+        if (child == NULL)
+            continue;
+        if (snprintf(child_path, sizeof(child_path), "%s/%s", path, name) >= sizeof(child_path))
+            continue;
+
+        if (!memcmp(child->kind, "dir", 3) && depth < DSMCC_MAX_DEPTH)
+        {
+            mkdir(child_path, 0755);
+            walk(ds, c, child, child_path, depth + 1);
+        }
+        else if (!memcmp(child->kind, "fil", 3) && !child->written)
+        {
+            m = find_module(c, module_id);
+            if (m && m->data)
+                write_file(ds, m, child, child_path);
+        }
+    }
+}
+
+static void write_tree(struct dsmcc *ds, struct dsmcc_carousel *c)
+{
+    struct dsmcc_object *root = NULL;
+    char path[512];
+    int i;
+
+    if (c->have_gateway)
+        root = find_object(c, c->gateway_module, c->gateway_key, c->gateway_key_len);
+    for (i = 0; root == NULL && i < c->object_count; i++)
+        if (!memcmp(c->objects[i].kind, "srg", 3))
+            root = &c->objects[i];
+    if (root == NULL)
+        return;
+
+    snprintf(path, sizeof(path), "%s/pid%d", ds->dir, c->pid);
+    mkdir(path, 0755);
+    walk(ds, c, root, path, 0);
+}
+
+// a data carousel module is a file of its own, and needs no keeping
+static void write_module(struct dsmcc *ds, struct dsmcc_carousel *c, struct dsmcc_module *m)
+{
+    char path[512];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/pid%d", ds->dir, c->pid);
+    mkdir(path, 0755);
+    if (m->name[0] && safe_name(m->name))
+        snprintf(path, sizeof(path), "%s/pid%d/%s", ds->dir, c->pid, m->name);
+    else
+        snprintf(path, sizeof(path), "%s/pid%d/module-%04x.bin", ds->dir, c->pid, m->id);
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "DSM-CC: error writing %s.\n", path);
+        return;
+    }
+    fwrite(m->data, 1, m->data_len, fp);
+    fclose(fp);
+    ds->files_written++;
+
+    ds->memory -= m->data_len;
+    free(m->data);
+    m->data = NULL;
+}
+
+static void module_complete(struct dsmcc *ds, struct dsmcc_carousel *c, struct dsmcc_module *m)
+{
+    unsigned char *data;
+    uLongf len;
+
+    free(m->received);
+    m->received = NULL;
+    m->complete = 1;
+
+    if (m->compressed)
+    {
+        len = m->original_size;
+        data = ds->memory + len <= DSMCC_MAX_MEMORY ? malloc(len ? len : 1) : NULL;
+        if (data == NULL || uncompress(data, &len, m->data, m->data_len) != Z_OK)
+        {
+            free(data);
+            release_module(ds, m);
+            m->dropped = 1;
+            ds->modules_dropped++;
+            return;
+        }
+        release_module(ds, m);
+        m->data = data;
+        m->data_len = len;
+        ds->memory += len;
+    }
+    ds->modules_completed++;
+
+    if (m->data_len >= 4 && !memcmp(m->data, "BIOP", 4))
+    {
+        parse_objects(c, m);
+        write_tree(ds, c);
+    }
+    else if (m->data)
+        write_module(ds, c, m);
+}
+
+// the module descriptors: the userInfo of an object carousel's
+// BIOP::ModuleInfo, or the whole moduleInfo of a data carousel
+static const unsigned char *module_descriptors(const unsigned char *info, int len, int *descriptors_len)
+{
+    int pos, taps, i;
+
+    if (len >= 13)
+    {
+        taps = info[12];
+        for (pos = 13, i = 0; i < taps && pos + 7 <= len; i++)
+            pos += 7 + info[pos + 6];
+        if (i == taps && pos < len && pos + 1 + info[pos] == len)
+        {
+            *descriptors_len = info[pos];
+            return info + pos + 1;
+        }
+    }
+    *descriptors_len = len;
+    return info;
+}
+
+static void module_info(struct dsmcc_module *m, const unsigned char *info, int info_len)
+{
+    const unsigned char *loop, *d;
+    int len;
+
+    loop = module_descriptors(info, info_len, &len);
+
+    d = psi_find_descriptor(loop, len, COMPRESSED_MODULE_DESCRIPTOR);
+    if (d == NULL)
+        d = psi_find_descriptor(loop, len, COMPRESSION_TYPE_DESCRIPTOR);
+    if (d && d[1] >= 5)
+    {
+        m->compressed = 1;
+        m->original_size = be32(d + 3);
+    }
+
+    d = psi_find_descriptor(loop, len, NAME_DESCRIPTOR);
+    if (d)
+        snprintf(m->name, sizeof(m->name), "%.*s", d[1], d + 2);
+}
+
+static void update_module(struct dsmcc *ds, struct dsmcc_carousel *c, int id, uint32_t size, int version,
+                          int block_size, const unsigned char *info, int info_len)
+{
+    struct dsmcc_module *m = find_module(c, id);
+
+    // unchanged: its blocks keep coming in, or are skipped when complete
+    if (m && m->version == version && m->size == size && m->block_size == block_size)
+        return;
+
+    if (m)
+    {
+        release_module(ds, m);
+        drop_objects(c, id);
+    }
+    else
+    {
+        if (c->module_count == DSMCC_MAX_MODULES)
+            return;
+        m = &c->modules[c->module_count++];
+    }
+
+    memset(m, 0, sizeof(struct dsmcc_module));
+    m->id = id;
+    m->version = version;
+    m->size = size;
+    m->block_size = block_size;
+    m->block_count = (size + block_size - 1) / block_size;
+    module_info(m, info, info_len);
+
+    if (m->block_count == 0)
+    {
+        m->complete = 1;
+        return;
+    }
+    m->received = calloc((m->block_count + 7) / 8, 1);
+    if (m->received == NULL)
+        m->dropped = 1;
+}
+
+// DownloadInfoIndication: the modules, their size and version
+static void dii(struct dsmcc *ds, struct dsmcc_carousel *c, const unsigned char *b, int len)
+{
+    int block_size, pos, count, i, info_len;
+
+    if (len < 20)
+        return;
+    block_size = be16(b + 4);
+    if (block_size == 0)
+        return;
+
+    pos = 18 + be16(b + 16); // compatibilityDescriptor
+    if (pos + 2 > len)
+        return;
+    count = be16(b + pos);
+    pos += 2;
+
+    for (i = 0; i < count && pos + 8 <= len; i++, pos += 8 + info_len)
+    {
+        info_len = b[pos + 7];
+        if (pos + 8 + info_len > len)
+            break;
+        update_module(ds, c, be16(b + pos), be32(b + pos + 2), b[pos + 6], block_size, b + pos + 8, info_len);
+    }
+}
+
+// DownloadDataBlock: one block of a module, in any order
+static void ddb(struct dsmcc *ds, struct dsmcc_carousel *c, const unsigned char *b, int len)
+{
+    struct dsmcc_module *m;
+    int block, size;
+
+    if (len < 6)
+        return;
+    m = find_module(c, be16(b));
+    if (m == NULL || m->version != b[2] || m->dropped)
+        return;
+    if (m->complete)
+    {
+        ds->blocks_skipped++;
+        return;
+    }
+
+    block = be16(b + 4);
+    if (block >= m->block_count || m->received[block >> 3] & 1 << (block & 7))
+        return;
+    size = block == m->block_count - 1 ? m->size - block * m->block_size : m->block_size;
+    if (len - 6 < size)
+        return;
+
+    // the module takes memory with its first block
+    if (m->data == NULL)
+    {
+        if (ds->memory + m->size > DSMCC_MAX_MEMORY || (m->data = malloc(m->size)) == NULL)
+        {
+            m->dropped = 1;
+            ds->modules_dropped++;
+            return;
+        }
+        m->data_len = m->size;
+        ds->memory += m->size;
+    }
+
+    memcpy(m->data + block * m->block_size, b + 6, size);
+    m->received[block >> 3] |= 1 << (block & 7);
+    if (++m->blocks_received == m->block_count)
+        module_complete(ds, c, m);
+}
+
+// DownloadServerInitiate: the service gateway of an object carousel
+static void dsi(struct dsmcc *ds, struct dsmcc_carousel *c, const unsigned char *b, int len)
+{
+    unsigned char key[DSMCC_MAX_KEY];
+    int pos, end, module_id, key_len;
+
+    if (len < 24)
+        return;
+    pos = 22 + be16(b + 20); // after server_id and compatibilityDescriptor
+    if (pos + 2 > len)
+        return;
+    end = pos + 2 + be16(b + pos);
+    if (end > len)
+        return;
+
+    if (parse_ior(b, pos + 2, end, &module_id, key, &key_len) < 0 || module_id < 0)
+        return;
+    if (c->have_gateway && c->gateway_module == module_id && c->gateway_key_len == key_len &&
+        !memcmp(c->gateway_key, key, key_len))
+        return;
+
+    c->have_gateway = 1;
+    c->gateway_module = module_id;
+    c->gateway_key_len = key_len;
+    memcpy(c->gateway_key, key, key_len);
+    write_tree(ds, c);
+}
+
+static void carousel_section(void *opaque, const unsigned char *s, int len)
+{
+    struct dsmcc_carousel *c = opaque;
+    const unsigned char *m = s + 8;
+    int adaptation, message_len;
+
+    if ((s[0] != DSMCC_TABLE_MESSAGES && s[0] != DSMCC_TABLE_DATA) || len < 8 + 12 + 4)
+        return;
+    if (m[0] != DSMCC_PROTOCOL || m[1] != DSMCC_TYPE_DOWNLOAD)
+        return;
+
+    adaptation = m[9];
+    message_len = be16(m + 10);
+    if (8 + 12 + message_len > len - 4 || adaptation > message_len)
+        return;
+
+    switch (be16(m + 2))
+    {
+    case DSMCC_DII:
+        dii(c->ds, c, m + 12 + adaptation, message_len - adaptation);
+        break;
+    case DSMCC_DDB:
+        ddb(c->ds, c, m + 12 + adaptation, message_len - adaptation);
+        break;
+    case DSMCC_DSI:
+        dsi(c->ds, c, m + 12 + adaptation, message_len - adaptation);
+        break;
+    }
+}
+
+static void add_carousel(struct dsmcc *ds, int pid)
+{
+    struct dsmcc_carousel *c;
+
+    if (ds->index[pid] >= 0 || ds->carousel_count == DSMCC_MAX_CAROUSELS)
+        return;
+
+    c = calloc(1, sizeof(struct dsmcc_carousel));
+    if (c == NULL)
+        return;
+    c->objects = malloc(DSMCC_MAX_OBJECTS * sizeof(struct dsmcc_object));
+    if (c->objects == NULL)
+    {
+        free(c);
+        return;
+    }
+    c->ds = ds;
+    c->pid = pid;
+    psi_assembler_init(&c->assembler, pid);
+
+    ds->index[pid] = ds->carousel_count;
+    ds->carousels[ds->carousel_count++] = c;
+}
+
+// ISO/IEC 13818-6 types A to C: multiprotocol encapsulation, U-N messages
+// and stream descriptors
+static void pmt_section(void *opaque, const unsigned char *section, int len)
+{
+    struct dsmcc *ds = opaque;
+    struct psi_pmt pmt;
+    int i;
+
+    if (psi_parse_pmt(section, len, &pmt) < 0)
+        return;
+    for (i = 0; i < pmt.stream_count; i++)
+        if (pmt.streams[i].type >= 0x0B && pmt.streams[i].type <= 0x0D)
+            add_carousel(ds, pmt.streams[i].pid);
+}
+
+static void pat_section(void *opaque, const unsigned char *section, int len)
+{
+    struct dsmcc *ds = opaque;
+    struct psi_pat pat;
+    int i, j;
+
+    if (psi_parse_pat(section, len, &pat) < 0)
+        return;
+
+    for (i = 0; i < pat.program_count; i++)
+    {
+        // program 0 points at the NIT
+        if (pat.programs[i].program_number == 0)
+            continue;
+        for (j = 0; j < ds->pmt_count && ds->pmts[j]->pid != pat.programs[i].pid; j++)
+            ;
+        if (j < ds->pmt_count || ds->pmt_count == PSI_MAX_PROGRAMS)
+            continue;
+        ds->pmts[j] = malloc(sizeof(struct psi_assembler));
+        if (ds->pmts[j] == NULL)
+            return;
+        psi_assembler_init(ds->pmts[j], pat.programs[i].pid);
+        ds->pmt_count++;
+    }
+}
+
+void dsmcc_feed(struct dsmcc *ds, const unsigned char *packets, int count)
+{
+    const unsigned char *p;
+    int i, j, pid;
+
+    for (i = 0; i < count; i++)
+    {
+        p = packets + i * TS_PACKET_SIZE;
+        pid = TS_PID(p);
+
+        if (ds->index[pid] >= 0)
+            psi_assembler_push(&ds->carousels[(int) ds->index[pid]]->assembler, p, carousel_section,
+                               ds->carousels[(int) ds->index[pid]]);
+        else if (pid == PAT_PID)
+            psi_assembler_push(&ds->pat, p, pat_section, ds);
+        else
+            for (j = 0; j < ds->pmt_count; j++)
+                if (ds->pmts[j]->pid == pid)
+                    psi_assembler_push(ds->pmts[j], p, pmt_section, ds);
+    }
+}
+
+void dsmcc_free(struct dsmcc *ds)
+{
+    int i, j;
+
+    for (i = 0; i < ds->carousel_count; i++)
+    {
+        for (j = 0; j < ds->carousels[i]->module_count; j++)
+            release_module(ds, &ds->carousels[i]->modules[j]);
+        free(ds->carousels[i]->objects);
+        free(ds->carousels[i]);
+    }
+    ds->carousel_count = 0;
+
+    for (i = 0; i < ds->pmt_count; i++)
+        free(ds->pmts[i]);
+    ds->pmt_count = 0;
+}
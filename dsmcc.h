@@ -0,0 +1,128 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _DSMCC_H_
+#define _DSMCC_H_
+
+// DSM-CC carousel extraction (Ginga applications): the DII and DDB
+// messages of the carousel PIDs of the PMTs (stream types 0x0B-0x0D) are
+// put back together into modules, block by block in any order and for all
+// modules at once. A completed module is uncompressed if needed and, for an
+// object carousel, its BIOP objects are read: every file reachable from the
+// service gateway (DSI) is written under DIR/pidN/ as soon as the
+// directories leading to it are known. Modules of a data carousel are
+// written as DIR/pidN/module-XXXX.bin.
+//
+// A new DII only resets the modules whose version changed: the blocks of
+// complete, unchanged modules are skipped, and their files not rewritten.
+// Module memory is bounded by DSMCC_MAX_MEMORY, modules past it are dropped.
+
+#include <stdint.h>
+
+#include "psi.h"
+
+#define DSMCC_MAX_CAROUSELS 8
+#define DSMCC_MAX_MODULES   256
+#define DSMCC_MAX_OBJECTS   4096
+#define DSMCC_MAX_KEY       8
+#define DSMCC_MAX_MEMORY    (64 * 1024 * 1024)
+
+struct dsmcc_module {
+    int id;
+    int version;
+    uint32_t size;
+    int block_size;
+    int block_count;
+    int blocks_received;
+    unsigned char *received; // one bit per block
+
+    // compressed_module_descriptor: zlib data of original_size bytes
+    int compressed;
+    uint32_t original_size;
+
+    // data carousels: name_descriptor of the module, if any
+    char name[64];
+
+    unsigned char *data;
+    uint32_t data_len;
+    int complete;
+    int dropped;
+};
+
+// a BIOP object of a complete module
+struct dsmcc_object {
+    int module_id;
+    unsigned char key[DSMCC_MAX_KEY];
+    int key_len;
+    char kind[4];
+    uint32_t body, body_len; // message body, in the module data
+    int written;
+};
+
+struct dsmcc;
+
+struct dsmcc_carousel {
+    struct dsmcc *ds;
+    int pid;
+    struct psi_assembler assembler;
+
+    struct dsmcc_module modules[DSMCC_MAX_MODULES];
+    int module_count;
+
+    struct dsmcc_object *objects;
+    int object_count;
+
+    // service gateway, from the DSI
+    int have_gateway;
+    int gateway_module;
+    unsigned char gateway_key[DSMCC_MAX_KEY];
+    int gateway_key_len;
+};
+
+struct dsmcc {
+    char dir[256];
+
+    struct psi_assembler pat;
+    struct psi_assembler *pmts[PSI_MAX_PROGRAMS];
+    int pmt_count;
+
+    struct dsmcc_carousel *carousels[DSMCC_MAX_CAROUSELS];
+    int carousel_count;
+    signed char index[8192]; // carousel of each PID, -1 for none
+
+    uint64_t memory;
+
+    // statistics
+    uint64_t modules_completed;
+    uint64_t modules_dropped; // over DSMCC_MAX_MEMORY, or bad compressed data
+    uint64_t blocks_skipped;  // of modules already complete
+    uint64_t files_written;
+};
+
+
+// files go under dir, which must exist
+void dsmcc_init(struct dsmcc *ds, const char *dir);
+
+// feeds count transport packets
+void dsmcc_feed(struct dsmcc *ds, const unsigned char *packets, int count);
+
+void dsmcc_free(struct dsmcc *ds);
+
+#endif /* _DSMCC_H_ */
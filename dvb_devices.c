@@ -0,0 +1,276 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include <linux/dvb/frontend.h>
+
+#include "dvb_devices.h"
+
+// receive buffer asked for the uevent socket
+#define DVBDEV_UEVENT_BUFFER (1024 * 1024)
+
+static pthread_mutex_t dvbdev_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dvbdev_adapter dvbdev_table[DVBDEV_MAX_ADAPTERS];
+static int dvbdev_count;
+static int dvbdev_valid;
+
+// kernel uevents, -2 until first used, -1 when not available
+static int dvbdev_uevent_fd = -2;
+
+int dvbdev_probe_fd(int fd, struct dvbdev_adapter *ad)
+{
+    struct dvb_frontend_info finfo;
+    struct dtv_property prop;
+    struct dtv_properties props;
+    unsigned int i;
+
+    if (ioctl(fd, FE_GET_INFO, &finfo) < 0)
+        return -1;
+
+    memcpy(ad->name, finfo.name, sizeof(ad->name) - 1);
+    ad->name[sizeof(ad->name) - 1] = 0;
+    ad->caps = finfo.caps;
+    ad->freq_min = finfo.frequency_min;
+    ad->freq_max = finfo.frequency_max;
+    ad->systems = 0;
+
+    memset(&prop, 0, sizeof(prop));
+    prop.cmd = DTV_ENUM_DELSYS;
+    props.num = 1;
+    props.props = &prop;
+    if (ioctl(fd, FE_GET_PROPERTY, &props) == 0)
+        for (i = 0; i < prop.u.buffer.len && i < sizeof(prop.u.buffer.data); i++)
+            if (prop.u.buffer.data[i] < 64)
+                ad->systems |= 1ULL << prop.u.buffer.data[i];
+
+    // drivers older than DVB v5.5 only tell the frontend type
+    if (ad->systems)
+        ad->isdbt = (ad->systems & (1ULL << SYS_ISDBT)) != 0;
+    else
+        ad->isdbt = finfo.type == FE_OFDM;
+
+    ad->probed = 1;
+    return 0;
+}
+
+// read-only and non-blocking: works while another process tunes it
+static void dvbdev_probe(struct dvbdev_adapter *ad)
+{
+    char devname[64];
+    int fd;
+
+    sprintf(devname, "/dev/dvb/adapter%d/frontend0", ad->adapter);
+    fd = open(devname, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    dvbdev_probe_fd(fd, ad);
+    close(fd);
+}
+
+static void dvbdev_add(int adapter)
+{
+    int i;
+
+    for (i = 0; i < dvbdev_count; i++)
+        if (dvbdev_table[i].adapter == adapter)
+            return;
+    if (dvbdev_count == DVBDEV_MAX_ADAPTERS)
+        return;
+
+    memset(&dvbdev_table[dvbdev_count], 0, sizeof(struct dvbdev_adapter));
+    dvbdev_table[dvbdev_count++].adapter = adapter;
+}
+
+// adds the adapters whose directory entries match format, -1 if the
+// directory cannot be read
+static int dvbdev_enumerate(const char *dir, const char *format)
+{
+    struct dirent *e;
+    DIR *d;
+    int adapter, frontend;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return -1;
+    while ((e = readdir(d)) != NULL)
+    {
+        // sysfs names are dvbN.frontendM, /dev/dvb ones adapterN
+        frontend = 0;
+        if (sscanf(e->d_name, format, &adapter, &frontend) >= 1 && frontend == 0)
+            dvbdev_add(adapter);
+    }
+    closedir(d);
+    return 0;
+}
+
+static int dvbdev_compare(const void *a, const void *b)
+{
+    return ((const struct dvbdev_adapter *) a)->adapter - ((const struct dvbdev_adapter *) b)->adapter;
+}
+
+static void dvbdev_rebuild(void)
+{
+    char devname[64];
+    int i, fd;
+
+    dvbdev_count = 0;
+    if (dvbdev_enumerate("/sys/class/dvb", "dvb%d.frontend%d") < 0 &&
+        dvbdev_enumerate("/dev/dvb", "adapter%d") < 0)
+    {
+        for (i = 0; i < DVBDEV_PROBE_ADAPTERS; i++)
+        {
+            sprintf(devname, "/dev/dvb/adapter%d/frontend0", i);
+            fd = open(devname, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd >= 0)
+                close(fd);
+            if (fd >= 0 || errno != ENOENT)
+                dvbdev_add(i);
+        }
+    }
+    qsort(dvbdev_table, dvbdev_count, sizeof(struct dvbdev_adapter), dvbdev_compare);
+
+    for (i = 0; i < dvbdev_count; i++)
+        dvbdev_probe(&dvbdev_table[i]);
+    dvbdev_valid = 1;
+}
+
+static int dvbdev_watch(void)
+{
+    struct sockaddr_nl addr;
+    int fd, size = DVBDEV_UEVENT_BUFFER;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    // uevents of every subsystem pile up between lookups: room for a burst
+    // (the forced size needs CAP_NET_ADMIN, the other is capped by rmem_max)
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // kernel events
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// drains the pending uevents, returns 1 if one was about a dvb device or
+// some may have been lost (the socket buffer overflowed: ENOBUFS)
+static int dvbdev_hotplug(void)
+{
+    char buf[8192];
+    ssize_t n;
+    int i, found = 0;
+
+    for (;;)
+    {
+        n = recv(dvbdev_uevent_fd, buf, sizeof(buf) - 1, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // the overflow is reported once, what is still queued comes next
+        if (n < 0 && errno == ENOBUFS)
+        {
+            found = 1;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            found = 1;
+        if (n <= 0)
+            break;
+
+        // "action@devpath" then NUL separated KEY=value pairs
+        buf[n] = 0;
+        for (i = 0; i < n; i += strlen(buf + i) + 1)
+            if (!strcmp(buf + i, "SUBSYSTEM=dvb"))
+                found = 1;
+    }
+    return found;
+}
+
+// brings the table up to date; called with dvbdev_mutex held
+static void dvbdev_update(void)
+{
+    int i;
+
+    if (dvbdev_uevent_fd == -2)
+        dvbdev_uevent_fd = dvbdev_watch();
+
+    if (!dvbdev_valid || dvbdev_uevent_fd < 0 || dvbdev_hotplug())
+    {
+        dvbdev_rebuild();
+        return;
+    }
+
+    // udev may not have created the device node yet when the uevent came
+    for (i = 0; i < dvbdev_count; i++)
+        if (!dvbdev_table[i].probed)
+            dvbdev_probe(&dvbdev_table[i]);
+}
+
+int dvbdev_list(struct dvbdev_adapter *list, int max)
+{
+    int n;
+
+    pthread_mutex_lock(&dvbdev_mutex);
+    dvbdev_update();
+    n = dvbdev_count < max ? dvbdev_count : max;
+    memcpy(list, dvbdev_table, n * sizeof(struct dvbdev_adapter));
+    pthread_mutex_unlock(&dvbdev_mutex);
+
+    return n;
+}
+
+int dvbdev_isdbt_adapters(int *adapters, int max)
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&dvbdev_mutex);
+    dvbdev_update();
+    for (i = 0; i < dvbdev_count && n < max; i++)
+        if (dvbdev_table[i].isdbt)
+            adapters[n++] = dvbdev_table[i].adapter;
+    pthread_mutex_unlock(&dvbdev_mutex);
+
+    return n;
+}
+
+void dvbdev_invalidate(void)
+{
+    pthread_mutex_lock(&dvbdev_mutex);
+    dvbdev_valid = 0;
+    pthread_mutex_unlock(&dvbdev_mutex);
+}
@@ -0,0 +1,65 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _DVB_DEVICES_H_
+#define _DVB_DEVICES_H_
+
+// Process-wide table of the DVB adapters and what their first frontend can
+// do. Adapters are enumerated from sysfs (/sys/class/dvb), then /dev/dvb,
+// so numbering gaps do not hide anything, and each frontend is probed
+// read-only and non-blocking: a frontend held by another process still
+// answers FE_GET_INFO and DTV_ENUM_DELSYS. The table is built on first use
+// and rebuilt when a dvb uevent (hotplug) arrives on a netlink socket, or on
+// every lookup when uevents are not available.
+
+#include <stdint.h>
+
+#define DVBDEV_MAX_ADAPTERS 64
+
+// probed when neither sysfs nor /dev/dvb can be listed
+#define DVBDEV_PROBE_ADAPTERS 16
+
+struct dvbdev_adapter {
+    int adapter;       // N of /dev/dvb/adapterN
+    int probed;        // the fields below are valid
+    char name[128];
+    uint32_t caps;     // FE_CAN_* of dvb_frontend_info
+    uint32_t freq_min, freq_max;
+    uint64_t systems;  // bit n set when delivery system n (SYS_*) is supported
+    int isdbt;
+};
+
+
+// fills ad (but the adapter number) from an open frontend (returns -1 if
+// FE_GET_INFO fails)
+int dvbdev_probe_fd(int fd, struct dvbdev_adapter *ad);
+
+// copies the table to list, ordered by adapter number, and returns the
+// number of adapters (at most max)
+int dvbdev_list(struct dvbdev_adapter *list, int max);
+
+// fills adapters with the numbers of the ISDB-T capable adapters, in order,
+// and returns how many there are (at most max)
+int dvbdev_isdbt_adapters(int *adapters, int max);
+
+// forgets the table: the next lookup enumerates again
+void dvbdev_invalidate(void);
+
+#endif /* _DVB_DEVICES_H_ */
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -34,6 +35,11 @@
 #include <linux/dvb/dmx.h>
 
 #include "dvb_resource.h"
+#include "dvb_devices.h"
+#include "m2ts.h"
+
+// frontend events read at most by dvbres_lock_event() (the kernel queues 8)
+#define DVBRES_MAX_EVENTS 32
 
 // Saves error parameters and returns -1
 int _dvbres_error(struct dvb_resource* res, char* msg, int code) 
@@ -66,174 +72,45 @@ int dvbres_init(struct dvb_resource* res)
 
 int dvbres_listdevices(struct dvb_resource* res, char* buffer, int max_length) 
 {
-	
+  struct dvbdev_adapter list[DVBDEV_MAX_ADAPTERS];
+  int count, i, pos = 0, n;
+
   memset(buffer, 0, max_length);
-  buffer[--max_length] = 0;
-  buffer[0] = 0;
-	
-  char frontname[128];
-  char adaptername[128];
-  int rc;
-  int pos = 0;
-  
-  int ifnum = 0;
-  while (pos < max_length) 
+
+  // from the device table: nothing is opened for writing, busy tuners
+  // are listed too
+  count = dvbdev_list(list, DVBDEV_MAX_ADAPTERS);
+  if (count == 0)
+      return _dvbres_error(res, "No DVB frontend found.", ENODEV);
+
+  for (i = 0; i < count; i++)
   {
-      // generate the root device name	to devprefix		
-      sprintf(adaptername, "/dev/dvb/adapter%d", ifnum);
-	    
-      // generate the next device name and open it
-      sprintf(frontname, "%s/frontend0", adaptername);
-
-      // opening device
-      int front = open(frontname, O_RDWR);
-      if (front == -1 && ifnum == 0)
-	  return _dvbres_error(res, "Error opening frontend.", errno);
-      if (front == -1 && ifnum > 0)
-	  return _dvbres_ok(res);	  
-	  
-      // reading status with the purpose of identifying DVB-S
-      struct dvb_frontend_info finfo;
-      rc = ioctl(front, FE_GET_INFO, &finfo);
-      if (rc) 
-      {
-	  close(front);
-	  return _dvbres_error(res, "Rading frontend info", errno);
-      }
-      
-      // closing device
-      rc = close(front);
-      if (rc)
-	  return _dvbres_error(res, "Closing frontend", errno);
-      
-      // replace tabs with spaces (tab is used as separator)
-      unsigned int i;
-      for (i=0; i<sizeof(finfo.name); i++)
-	  if (finfo.name[i] == '\t')
-	      finfo.name[i] = ' ';
-      
-      
-      int slen;
-      
-      // tab (if not the first device)
-      if (ifnum > 0) {
-	  if (pos >= max_length)
-	      return _dvbres_error(res, "Device enum buffer too small", -1);
-	  buffer[pos++] = '\t';
-      }
-      
-      // space check
-      slen = strlen(finfo.name);
-      if (pos + slen >= max_length)	
-	  return _dvbres_error(res, "Device enum buffer too small", -1);
-      // copy device name
-      buffer[pos++] = '0' + ifnum;
-      buffer[pos++] = ':';
-      buffer[pos++] = ' ';
-      
-      strncpy(&buffer[pos], finfo.name, max_length - pos);
-      pos += slen;
-      
-      // tab
-      if (pos >= max_length)
-	  return _dvbres_error(res, "Device enum buffer too small", -1);
-      buffer[pos++] = '\t';
-      
-      // space check
-      slen = strlen(adaptername);
-      if (pos + slen >= max_length)	
-	  return _dvbres_error(res, "Device enum buffer too small", -1);
-      // copy device name
-      strncpy(&buffer[pos], adaptername, max_length - pos);
-      pos += slen;
-      
+      // tab is used as separator
+      char *c;
+      for (c = list[i].name; *c; c++)
+	  if (*c == '\t')
+	      *c = ' ';
 
-      // next device
-      ifnum++;
+      n = snprintf(buffer + pos, max_length - pos, "%s%d: %s%s\t/dev/dvb/adapter%d", i > 0 ? "\t" : "",
+		   list[i].adapter, list[i].probed ? list[i].name : "(not accessible)",
+		   list[i].probed && !list[i].isdbt ? " (no ISDB-T)" : "", list[i].adapter);
+      if (n >= max_length - pos)
+	  return _dvbres_error(res, "Device enum buffer too small", -1);
+      pos += n;
   }
-  
-  return _dvbres_error(res, "Device enum buffer to small", -1);
-}
 
-int dvbres_open(struct dvb_resource* res, uint64_t freq, char* device, int layer_info) {
+  return _dvbres_ok(res);
+}
 
-    // return value (code) of calls
+// sets the delivery system, frequency and layers stored in res and tunes
+static int _dvbres_tune(struct dvb_resource* res) {
     int rc;
-    
-    // the index of adaper actually used	
-    int adapternum = 0;
-    
-    // temporaray field to hold the root path (/dev/dvb/adapterN)
-    char devprefix[64];
-    
-    // temporaray field to hold device names (/dev/dvb/adapterN/{something}M)
-    char devname[64];
-    
-    // information about the actual frontend	
-    struct dvb_frontend_info finfo;
-    
-    // if no device is given
-    if (device == NULL) {
-
-	// opening device
-	do {
-	    
-	    // generate the root device name	to devprefix		
-	    sprintf(devprefix, "/dev/dvb/adapter%d", adapternum);
-	    
-	    // generate the next device name and open it
-	    sprintf(devname, "%s/frontend0", devprefix);
-	    res->frontend = open(devname, O_RDWR);
-	    if (res->frontend == -1)
-		return _dvbres_error(res, "Error opening frontend device.", errno);
-	    
-	    // reading status with the purpose of identifying tuner type
-	    rc = ioctl(res->frontend, FE_GET_INFO, &finfo);
-	    if (rc) {
-		close(res->frontend);
-		return _dvbres_error(res, "Error reading frontend information.", errno);
-	    }
-	    
-	    // if not DVB-T then we skip to the next adapter
-	    if (finfo.type != 2) {
-		close(res->frontend);
-		res->frontend = 0;
-		adapternum++;
-	    }
-	} while (!res->frontend);
-	
-    } else { // if device
-	
-	// copy the device parameter to the devprefix
-	strncpy(devprefix, device, sizeof(devprefix));
-	
-	// opening device
-	sprintf(devname, "%s/frontend0", devprefix);
-	res->frontend = open(devname, O_RDWR);
-	if (!res->frontend)
-	    return _dvbres_error(res, "Error opening frontend.", errno);
-	
-	// reading status with the purpose of identifying tuner type
-	rc = ioctl(res->frontend, FE_GET_INFO, &finfo);
-	if (rc) {
-	    close(res->frontend);
-	    return _dvbres_error(res, "Reading frontend info", errno);
-	}
-	
-	// if not DVB-T then we close and return an error
-	if (finfo.type != 2) {
-	    close(res->frontend);
-			res->frontend = 0;
-			return _dvbres_error(res, "Device is not a DVB-T frontend", -1);
-	}
-	
-    } // if device
-    
-    int inversion = (finfo.caps & FE_CAN_INVERSION_AUTO) ? INVERSION_AUTO : INVERSION_OFF;
+    int inversion = res->inversion;
+    uint64_t freq = res->freq;
     int partial_reception = 0;
     int layers = 0;
     int segment_count = 0;
-    switch (layer_info) 
+    switch (res->layer_info) 
     {
     case LAYER_FULL:
 	layers = 7; // 0x1 | 0x2 | 0x4
@@ -280,10 +157,8 @@ int dvbres_open(struct dvb_resource* res, uint64_t freq, char* device, int layer
 	};
 	
 	rc = ioctl(res->frontend, FE_SET_PROPERTY, &mydtvproperties);
-	if (rc) {
-	    close(res->frontend);
+	if (rc)
 	    return _dvbres_error(res, "Setting properties", errno);
-	}
 	
     }
     else
@@ -305,11 +180,95 @@ int dvbres_open(struct dvb_resource* res, uint64_t freq, char* device, int layer
 	};
 	
 	rc = ioctl(res->frontend, FE_SET_PROPERTY, &mydtvproperties);
-	if (rc) {
-	    close(res->frontend);
+	if (rc)
 	    return _dvbres_error(res, "Setting properties", errno);
+	
+    }
+    
+    return _dvbres_ok(res);
+}
+
+int dvbres_open(struct dvb_resource* res, uint64_t freq, char* device, int layer_info) {
+
+    // return value (code) of calls
+    int rc;
+    
+    // the index of adaper actually used	
+    int adapternum = 0;
+    
+    // temporaray field to hold the root path (/dev/dvb/adapterN)
+    char devprefix[64];
+    
+    // temporaray field to hold device names (/dev/dvb/adapterN/{something}M)
+    char devname[64];
+    
+    // information about the actual frontend	
+    struct dvbdev_adapter finfo;
+    
+    // if no device is given
+    if (device == NULL) {
+	int adapters[DVBDEV_MAX_ADAPTERS];
+	int count, i, busy = 0;
+
+	count = dvbdev_isdbt_adapters(adapters, DVBDEV_MAX_ADAPTERS);
+	if (count == 0)
+	    return _dvbres_error(res, "No ISDB-T frontend found.", ENODEV);
+
+	// the first one nobody else holds: non-blocking, a busy frontend
+	// fails at once with EBUSY
+	res->frontend = -1;
+	for (i = 0; i < count && res->frontend < 0; i++) {
+	    adapternum = adapters[i];
+	    sprintf(devprefix, "/dev/dvb/adapter%d", adapternum);
+	    sprintf(devname, "%s/frontend0", devprefix);
+	    res->frontend = open(devname, O_RDWR | O_NONBLOCK);
+	    if (res->frontend < 0 && errno == EBUSY)
+		busy++;
 	}
+	if (res->frontend < 0)
+	    return _dvbres_error(res, busy == count ? "Every ISDB-T frontend is busy." : "Error opening frontend device.", errno);
+	
+    } else { // if device
+	
+	// copy the device parameter to the devprefix
+	strncpy(devprefix, device, sizeof(devprefix));
+	devprefix[sizeof(devprefix) - 1] = 0;
+	if (sscanf(devprefix, "/dev/dvb/adapter%d", &adapternum) != 1)
+	    adapternum = -1;
+	
+	// opening device
+	sprintf(devname, "%s/frontend0", devprefix);
+	res->frontend = open(devname, O_RDWR | O_NONBLOCK);
+	if (res->frontend < 0)
+	    return _dvbres_error(res, errno == EBUSY ? "Frontend busy." : "Error opening frontend.", errno);
 	
+    } // if device
+
+    // non-blocking was only for the open
+    fcntl(res->frontend, F_SETFL, fcntl(res->frontend, F_GETFL) & ~O_NONBLOCK);
+
+    // reading the delivery systems, with the purpose of identifying ISDB-T
+    rc = dvbdev_probe_fd(res->frontend, &finfo);
+    if (rc) {
+	close(res->frontend);
+	return _dvbres_error(res, "Reading frontend info", errno);
+    }
+    
+    if (!finfo.isdbt) {
+	close(res->frontend);
+	res->frontend = 0;
+	return _dvbres_error(res, "Device is not an ISDB-T frontend", -1);
+    }
+    
+    res->adapter = adapternum;
+    res->freq = freq;
+    res->layer_info = layer_info;
+    res->inversion = (finfo.caps & FE_CAN_INVERSION_AUTO) ? INVERSION_AUTO : INVERSION_OFF;
+    
+    rc = _dvbres_tune(res);
+    if (rc) {
+	close(res->frontend);
+	return -1;
     }
     
     
@@ -350,9 +309,142 @@ int dvbres_open(struct dvb_resource* res, uint64_t freq, char* device, int layer
     return _dvbres_ok(res);
 }
 
+int dvbres_stream_start(struct dvb_resource* res, int count, unsigned int size) {
+    int rc;
+    int i;
+
+    if (count > DVBRES_STREAM_MAX_BUFFERS)
+	count = DVBRES_STREAM_MAX_BUFFERS;
+
+    struct dmx_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = count;
+    req.size = size;
+
+    // ENOTTY: kernel without DVB mmap support, fall back to read()
+    rc = ioctl(res->dvr, DMX_REQBUFS, &req);
+    if (rc)
+	return _dvbres_error(res, "DVR memory-mapped streaming not supported.", errno);
+    if (req.count == 0)
+	return _dvbres_error(res, "DVR memory-mapped streaming: no buffers.", -1);
+
+    res->stream_count = req.count;
+    res->stream_size = req.size;
+    res->stream_index = -1;
+    res->stream_seq = 0;
+    res->stream_lost = 0;
+
+    for (i = 0; i < res->stream_count; i++) {
+	struct dmx_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+	buf.index = i;
+
+	rc = ioctl(res->dvr, DMX_QUERYBUF, &buf);
+	if (rc) {
+	    dvbres_stream_stop(res);
+	    return _dvbres_error(res, "Querying DVR buffer.", errno);
+	}
+
+	res->stream_addr[i] = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, res->dvr, buf.offset);
+	if (res->stream_addr[i] == MAP_FAILED) {
+	    res->stream_addr[i] = NULL;
+	    dvbres_stream_stop(res);
+	    return _dvbres_error(res, "Mapping DVR buffer.", errno);
+	}
+
+	rc = ioctl(res->dvr, DMX_QBUF, &buf);
+	if (rc) {
+	    dvbres_stream_stop(res);
+	    return _dvbres_error(res, "Queueing DVR buffer.", errno);
+	}
+    }
+
+    return _dvbres_ok(res);
+}
+
+int dvbres_stream_dequeue(struct dvb_resource* res, void** data, unsigned int* flags) {
+    int rc;
+    struct dmx_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    rc = ioctl(res->dvr, DMX_DQBUF, &buf);
+    if (rc) {
+	if (errno == EAGAIN)
+	    return _dvbres_ok_retval(res, 0);
+	return _dvbres_error(res, "Dequeueing DVR buffer.", errno);
+    }
+
+    if (buf.index >= (unsigned int) res->stream_count)
+	return _dvbres_error(res, "Dequeued invalid DVR buffer.", -1);
+
+    // count is a monotonic counter of filled buffers: a gap means loss
+    if (res->stream_seq && buf.count != res->stream_seq)
+	res->stream_lost += buf.count - res->stream_seq;
+    res->stream_seq = buf.count + 1;
+
+    res->stream_index = buf.index;
+    *data = res->stream_addr[buf.index];
+    if (flags)
+	*flags = buf.flags;
+
+    return _dvbres_ok_retval(res, buf.bytesused);
+}
+
+int dvbres_stream_release(struct dvb_resource* res) {
+    int rc;
+    struct dmx_buffer buf;
+
+    if (res->stream_index < 0)
+	return _dvbres_ok(res);
+
+    memset(&buf, 0, sizeof(buf));
+    buf.index = res->stream_index;
+    res->stream_index = -1;
+
+    rc = ioctl(res->dvr, DMX_QBUF, &buf);
+    if (rc)
+	return _dvbres_error(res, "Queueing DVR buffer.", errno);
+
+    return _dvbres_ok(res);
+}
+
+int dvbres_stream_export(struct dvb_resource* res, int index) {
+    int rc;
+    struct dmx_exportbuffer exp;
+
+    memset(&exp, 0, sizeof(exp));
+    exp.index = index;
+    exp.flags = O_CLOEXEC;
+
+    rc = ioctl(res->dvr, DMX_EXPBUF, &exp);
+    if (rc)
+	return _dvbres_error(res, "Exporting DVR buffer.", errno);
+
+    return _dvbres_ok_retval(res, exp.fd);
+}
+
+int dvbres_stream_stop(struct dvb_resource* res) {
+    int i;
+
+    for (i = 0; i < res->stream_count; i++) {
+	if (res->stream_addr[i]) {
+	    munmap(res->stream_addr[i], res->stream_size);
+	    res->stream_addr[i] = NULL;
+	}
+    }
+    res->stream_count = 0;
+    res->stream_index = -1;
+
+    // the buffers are freed by the kernel when the DVR is closed
+    return _dvbres_ok(res);
+}
+
 int dvbres_close(struct dvb_resource* res) {
     int rc;
     
+    if (res->stream_count)
+	dvbres_stream_stop(res);
+    
     struct dtv_property myproperties[] = {
 	{ .cmd = DTV_CLEAR }, /* Clear the driver before everything */ 
     };
@@ -384,6 +476,70 @@ int dvbres_close(struct dvb_resource* res) {
     return _dvbres_ok(res);
 }
 
+int dvbres_retune(struct dvb_resource* res) {
+    return _dvbres_tune(res);
+}
+
+int dvbres_wait_lock(struct dvb_resource* res, int timeout_ms) {
+    return dvbres_wait_lock_signal(res, timeout_ms, timeout_ms);
+}
+
+int dvbres_wait_lock_signal(struct dvb_resource* res, int timeout_ms, int signal_ms) {
+    struct pollfd fds[1];
+    struct dvb_frontend_event event;
+    fe_status_t status;
+    uint64_t start = m2ts_now_ns();
+    int rc, waited, left;
+    
+    // frontend events wake us up at once, and may come long before the
+    // 20 ms are up: time is taken from the clock, not counted in polls.
+    // Status is also polled, as not every driver sends them
+    for (;;) {
+	rc = ioctl(res->frontend, FE_READ_STATUS, &status);
+	if (rc)
+	    return _dvbres_error(res, "Reading status.", errno);
+	if (status & FE_HAS_LOCK)
+	    return _dvbres_ok_retval(res, 1);
+	waited = (m2ts_now_ns() - start) / 1000000;
+	left = timeout_ms - waited;
+	if (left <= 0 || (waited >= signal_ms && !(status & FE_HAS_SIGNAL)))
+	    return _dvbres_ok_retval(res, 0);
+	
+	fds[0].fd = res->frontend;
+	fds[0].events = POLLPRI;
+	rc = poll(fds, 1, left < 20 ? left : 20);
+	if (rc > 0 && (fds[0].revents & POLLPRI))
+	    ioctl(res->frontend, FE_GET_EVENT, &event);
+    }
+}
+
+int dvbres_lock_event(struct dvb_resource* res) {
+    struct pollfd fds[1];
+    struct dvb_frontend_event event;
+    fe_status_t status;
+    int rc, i;
+    
+    // a tune queues several events, oldest first (a status 0 one among
+    // them), that dvbres_wait_lock() leaves behind: all that are queued are
+    // read, and the status now decides. The fd is blocking, so the queue
+    // is polled before each read after the first
+    fds[0].fd = res->frontend;
+    fds[0].events = POLLPRI;
+    for (i = 0; i < DVBRES_MAX_EVENTS; i++) {
+	rc = ioctl(res->frontend, FE_GET_EVENT, &event);
+	// EOVERFLOW: events were lost, the queue starts over
+	if (rc && errno != EOVERFLOW)
+	    return _dvbres_error(res, "Reading frontend event.", errno);
+	if (poll(fds, 1, 0) <= 0 || !(fds[0].revents & POLLPRI))
+	    break;
+    }
+    
+    rc = ioctl(res->frontend, FE_READ_STATUS, &status);
+    if (rc)
+	return _dvbres_error(res, "Reading status.", errno);
+    return _dvbres_ok_retval(res, (status & FE_HAS_LOCK) != 0);
+}
+
 // get if signal is present
 int dvbres_signalpresent(struct dvb_resource* res) {
     int rc;
@@ -423,3 +579,61 @@ int dvbres_getsignalquality(struct dvb_resource* res) {
 	return _dvbres_error(res, "Reading signal strength.", errno);
     return snr * 100 / 65535;
 }
+
+int dvbres_getstats(struct dvb_resource* res, struct dvbres_stats* stats) {
+    int rc, i;
+    fe_status_t status;
+    
+    struct dtv_property myproperties[] = {
+	{ .cmd = DTV_STAT_SIGNAL_STRENGTH },
+	{ .cmd = DTV_STAT_CNR },
+	{ .cmd = DTV_STAT_POST_ERROR_BIT_COUNT },
+	{ .cmd = DTV_STAT_POST_TOTAL_BIT_COUNT },
+	{ .cmd = DTV_STAT_ERROR_BLOCK_COUNT },
+	{ .cmd = DTV_STAT_TOTAL_BLOCK_COUNT },
+    };
+    
+    struct dtv_properties mydtvproperties = { 
+	.num = 6, /* The number of commands in the array */ 
+	.props = myproperties /* Pointer to the array */ 
+    };
+    
+    memset(stats, 0, sizeof(struct dvbres_stats));
+    rc = ioctl(res->frontend, FE_READ_STATUS, &status);
+    if (rc)
+	return _dvbres_error(res, "Reading status.", errno);
+    stats->status = status;
+    
+    // drivers without DTV_STAT leave every len at 0
+    rc = ioctl(res->frontend, FE_GET_PROPERTY, &mydtvproperties);
+    if (rc)
+	return _dvbres_ok(res);
+    
+    if (myproperties[0].u.st.len > 0 && myproperties[0].u.st.stat[0].scale == FE_SCALE_DECIBEL) {
+	stats->strength_valid = 1;
+	stats->strength = myproperties[0].u.st.stat[0].svalue;
+    }
+    if (myproperties[1].u.st.len > 0 && myproperties[1].u.st.stat[0].scale == FE_SCALE_DECIBEL) {
+	stats->cnr_valid = 1;
+	stats->cnr = myproperties[1].u.st.stat[0].svalue;
+    }
+    
+    for (i = 0; i < DVBRES_STAT_LAYERS; i++) {
+	if (i < myproperties[2].u.st.len && i < myproperties[3].u.st.len &&
+	    myproperties[2].u.st.stat[i].scale == FE_SCALE_COUNTER &&
+	    myproperties[3].u.st.stat[i].scale == FE_SCALE_COUNTER) {
+	    stats->layers[i].bits_valid = 1;
+	    stats->layers[i].bit_errors = myproperties[2].u.st.stat[i].uvalue;
+	    stats->layers[i].bits = myproperties[3].u.st.stat[i].uvalue;
+	}
+	if (i < myproperties[4].u.st.len && i < myproperties[5].u.st.len &&
+	    myproperties[4].u.st.stat[i].scale == FE_SCALE_COUNTER &&
+	    myproperties[5].u.st.stat[i].scale == FE_SCALE_COUNTER) {
+	    stats->layers[i].blocks_valid = 1;
+	    stats->layers[i].block_errors = myproperties[4].u.st.stat[i].uvalue;
+	    stats->layers[i].blocks = myproperties[5].u.st.stat[i].uvalue;
+	}
+    }
+    
+    return _dvbres_ok(res);
+}
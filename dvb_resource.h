@@ -28,6 +28,13 @@
 #define LAYER_B    2
 #define LAYER_C    3
 
+// DTV_STAT measurements of ISDB-T: the whole signal, then layers A to C
+#define DVBRES_STAT_LAYERS 4
+
+// DVR memory-mapped streaming (DMX_REQBUFS): buffers are whole TS packets
+#define DVBRES_STREAM_MAX_BUFFERS 32
+#define DVBRES_STREAM_BUFFER_SIZE (188 * 512)
+
 
 // structure to hold the currentstate of the resource
 struct dvb_resource {
@@ -40,11 +47,49 @@ struct dvb_resource {
 
 	// DVR device fd
 	int dvr;
+
+	// N of /dev/dvb/adapterN, -1 if the device path has no number
+	int adapter;
+
+	// tuning parameters, kept for retuning
+	uint64_t freq;
+	int layer_info;
+	int inversion;
+
+	// mmap streaming state, stream_count is 0 when read() is used
+	int stream_count;
+	unsigned int stream_size;
+	void *stream_addr[DVBRES_STREAM_MAX_BUFFERS];
+	int stream_index; // buffer currently dequeued, -1 if none
+	unsigned int stream_seq; // expected count of the next buffer
+	unsigned int stream_lost; // buffers the kernel dropped so far
 	
 	char error_msg[256];
 	int error_code;
 };
 
+// frontend measurements (DTV_STAT), each valid only when the driver has it
+struct dvbres_stats {
+	int status; // FE_HAS_* bits
+
+	// in 0.001 dBm and 0.001 dB
+	int strength_valid;
+	int64_t strength;
+	int cnr_valid;
+	int64_t cnr;
+
+	// counters running since the tune, of the whole signal and of each
+	// layer (see DVBRES_STAT_LAYERS)
+	struct {
+		int bits_valid;
+		uint64_t bit_errors; // after the inner code (post-Viterbi)
+		uint64_t bits;
+		int blocks_valid;
+		uint64_t block_errors; // uncorrected packets
+		uint64_t blocks;
+	} layers[DVBRES_STAT_LAYERS];
+};
+
 
 // list available devices: in form of <name> TAB <identifier> 
 int dvbres_listdevices(struct dvb_resource* res, char* buffer, int max_length);
@@ -55,6 +100,23 @@ int dvbres_init(struct dvb_resource* res);
 // open a resource (tuning) (returns -1 on error)
 int dvbres_open(struct dvb_resource* res, uint64_t freq, char* device, int layer_info);
 
+// tunes again to the frequency and layers given to dvbres_open(), keeping
+// the demux and DVR open (returns -1 on error)
+int dvbres_retune(struct dvb_resource* res);
+
+// waits up to timeout_ms for FE_HAS_LOCK, woken by frontend events:
+// returns 1 if locked, 0 on timeout, -1 on error
+int dvbres_wait_lock(struct dvb_resource* res, int timeout_ms);
+
+// as dvbres_wait_lock(), but gives up after signal_ms already when the
+// frontend found no signal (FE_HAS_SIGNAL) by then: returns 1 if locked, 0
+// on timeout or without signal, -1 on error
+int dvbres_wait_lock_signal(struct dvb_resource* res, int timeout_ms, int signal_ms);
+
+// reads the pending frontend events (poll the frontend fd for POLLPRI
+// first): returns 1 if the frontend is locked now, 0 if not, -1 on error
+int dvbres_lock_event(struct dvb_resource* res);
+
 // get if signal is present
 int dvbres_signalpresent(struct dvb_resource* res);
 
@@ -67,6 +129,29 @@ int dvbres_getsignalstrength(struct dvb_resource* res);
 // get signal quality 0: bad, 100: good
 int dvbres_getsignalquality(struct dvb_resource* res);
 
+// reads the frontend status and its DTV_STAT measurements (returns -1 on
+// error)
+int dvbres_getstats(struct dvb_resource* res, struct dvbres_stats* stats);
+
+// switches the DVR to memory-mapped streaming with count buffers of size
+// bytes (returns -1 if the kernel or driver does not support it, in which case
+// read() on res->dvr keeps working)
+int dvbres_stream_start(struct dvb_resource* res, int count, unsigned int size);
+
+// dequeues the next filled buffer and points data at it, no copy is made.
+// Returns the number of bytes, 0 if none is ready yet (poll res->dvr) or -1
+// on error. The buffer must be given back with dvbres_stream_release().
+int dvbres_stream_dequeue(struct dvb_resource* res, void** data, unsigned int* flags);
+
+// gives the dequeued buffer back to the kernel
+int dvbres_stream_release(struct dvb_resource* res);
+
+// exports a streaming buffer as a DMABUF fd (returns -1 on error)
+int dvbres_stream_export(struct dvb_resource* res, int index);
+
+// unmaps and frees the streaming buffers
+int dvbres_stream_stop(struct dvb_resource* res);
+
 // closes the resource (returns -1 on error)
 int dvbres_close(struct dvb_resource* res);
 
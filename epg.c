@@ -0,0 +1,264 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "epg.h"
+#include "m2ts.h"
+
+#define EIT_PF_ACTUAL        0x4E
+#define EIT_SCHEDULE_FIRST   0x50
+#define EIT_SCHEDULE_LAST    0x5F
+
+#define SHORT_EVENT_DESCRIPTOR 0x4D
+
+static const int eit_pids[EPG_PIDS] = { 0x12, 0x26, 0x27 };
+
+void epg_init(struct epg *epg)
+{
+    int i;
+
+    memset(epg, 0, sizeof(struct epg));
+    pthread_mutex_init(&epg->mutex, NULL);
+    for (i = 0; i < EPG_PIDS; i++)
+        psi_assembler_init(&epg->assemblers[i], eit_pids[i]);
+}
+
+static int bcd(int b)
+{
+    return (b >> 4) * 10 + (b & 0x0F);
+}
+
+// MJD and BCD hh:mm:ss, all ones when undefined
+static time_t start_time(const unsigned char *p)
+{
+    struct tm tm;
+
+    if (p[0] == 0xFF && p[1] == 0xFF && p[2] == 0xFF)
+        return 0;
+
+    // mktime() brings the day count since the epoch back to a date
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = 70;
+    tm.tm_mday = 1 + (p[0] << 8 | p[1]) - 40587;
+    tm.tm_hour = bcd(p[2]);
+    tm.tm_min = bcd(p[3]);
+    tm.tm_sec = bcd(p[4]);
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static int duration(const unsigned char *p)
+{
+    if (p[0] == 0xFF && p[1] == 0xFF && p[2] == 0xFF)
+        return -1;
+    return bcd(p[0]) * 3600 + bcd(p[1]) * 60 + bcd(p[2]);
+}
+
+// the event name of a short_event_descriptor, with control bytes blanked
+static void event_title(const unsigned char *d, char *title)
+{
+    int len, i;
+
+    if (d[1] < 4)
+        return;
+    len = d[5];
+    if (len > d[1] - 4)
+        len = d[1] - 4;
+    if (len > EPG_TITLE_SIZE - 1)
+        len = EPG_TITLE_SIZE - 1;
+    for (i = 0; i < len; i++)
+        title[i] = d[6 + i] < 0x20 || d[6 + i] == 0x7F ? ' ' : d[6 + i];
+    title[len] = 0;
+}
+
+// the slot of an event, a new one or the one that ended first when full
+static struct epg_event *event_slot(struct epg *epg, int service_id, int event_id)
+{
+    struct epg_event *e, *oldest = NULL;
+    int i;
+
+    for (i = 0; i < epg->event_count; i++)
+    {
+        e = &epg->events[i];
+        if (e->service_id == service_id && e->event_id == event_id)
+            return e;
+        if (oldest == NULL || e->start + e->duration < oldest->start + oldest->duration)
+            oldest = e;
+    }
+
+    if (epg->event_count < EPG_MAX_EVENTS)
+        e = &epg->events[epg->event_count++];
+    else
+        e = oldest;
+    memset(e, 0, sizeof(struct epg_event));
+    e->service_id = service_id;
+    e->event_id = event_id;
+    return e;
+}
+
+static void set_present(struct epg *epg, int service_id, int event_id)
+{
+    int i;
+
+    for (i = 0; i < epg->present_count && epg->present[i].service_id != service_id; i++)
+        ;
+    if (i == epg->present_count)
+    {
+        if (epg->present_count == EPG_MAX_SERVICES)
+            return;
+        epg->present_count++;
+        epg->present[i].service_id = service_id;
+    }
+    else if (epg->present[i].event_id == event_id)
+        return;
+
+    epg->present[i].event_id = event_id;
+    epg->present[i].since_packet = epg->packet;
+}
+
+static void eit_section(void *opaque, const unsigned char *s, int len)
+{
+    struct epg *epg = opaque;
+    struct epg_event *e;
+    const unsigned char *d;
+    int table_id = s[0], service_id, section_number, pos, end, loop_len, first = 1;
+
+    if (table_id != EIT_PF_ACTUAL && (table_id < EIT_SCHEDULE_FIRST || table_id > EIT_SCHEDULE_LAST))
+        return;
+    // next tables are announced ahead of time
+    if (len < 18 || !(s[5] & 0x01))
+        return;
+
+    service_id = s[3] << 8 | s[4];
+    section_number = s[6];
+    end = len - 4;
+
+    pthread_mutex_lock(&epg->mutex);
+    epg->sections++;
+    for (pos = 14; pos + 12 <= end; pos += 12 + loop_len)
+    {
+        loop_len = (s[pos + 10] & 0x0F) << 8 | s[pos + 11];
+        if (pos + 12 + loop_len > end)
+            break;
+
+        e = event_slot(epg, service_id, s[pos] << 8 | s[pos + 1]);
+        e->start = start_time(s + pos + 2);
+        e->duration = duration(s + pos + 7);
+        e->running_status = s[pos + 10] >> 5;
+        d = psi_find_descriptor(s + pos + 12, loop_len, SHORT_EVENT_DESCRIPTOR);
+        if (d)
+            event_title(d, e->title);
+
+        // section 0 of the present/following table holds the present event
+        if (table_id == EIT_PF_ACTUAL && section_number == 0 && first)
+            set_present(epg, service_id, e->event_id);
+        first = 0;
+    }
+    if (table_id == EIT_PF_ACTUAL && section_number == 0 && first)
+        set_present(epg, service_id, -1);
+    pthread_mutex_unlock(&epg->mutex);
+}
+
+void epg_feed(struct epg *epg, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    const unsigned char *p;
+    int i, j, pid;
+
+    for (i = 0; i < count; i++)
+    {
+        p = packets + i * TS_PACKET_SIZE;
+        pid = TS_PID(p);
+        for (j = 0; j < EPG_PIDS; j++)
+        {
+            if (pid != eit_pids[j])
+                continue;
+            epg->packet = first_packet + i;
+            psi_assembler_push(&epg->assemblers[j], p, eit_section, epg);
+        }
+    }
+}
+
+int epg_find(struct epg *epg, int service_id, int event_id, struct epg_event *event)
+{
+    int i, found = -1;
+
+    pthread_mutex_lock(&epg->mutex);
+    for (i = 0; i < epg->event_count; i++)
+    {
+        if (epg->events[i].service_id == service_id && epg->events[i].event_id == event_id)
+        {
+            *event = epg->events[i];
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&epg->mutex);
+    return found;
+}
+
+int epg_present(struct epg *epg, int service_id, int *event_id, uint64_t *since_packet)
+{
+    int i, found = -1;
+
+    pthread_mutex_lock(&epg->mutex);
+    for (i = 0; i < epg->present_count; i++)
+    {
+        if (epg->present[i].service_id == service_id)
+        {
+            *event_id = epg->present[i].event_id;
+            *since_packet = epg->present[i].since_packet;
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&epg->mutex);
+    return found;
+}
+
+static int event_order(const void *a, const void *b)
+{
+    const struct epg_event *x = a, *y = b;
+
+    if (x->service_id != y->service_id)
+        return x->service_id - y->service_id;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+int epg_list(struct epg *epg, struct epg_event *list, int max)
+{
+    int count;
+
+    pthread_mutex_lock(&epg->mutex);
+    count = epg->event_count < max ? epg->event_count : max;
+    memcpy(list, epg->events, count * sizeof(struct epg_event));
+    pthread_mutex_unlock(&epg->mutex);
+
+    qsort(list, count, sizeof(struct epg_event), event_order);
+    return count;
+}
+
+void epg_free(struct epg *epg)
+{
+    pthread_mutex_destroy(&epg->mutex);
+}
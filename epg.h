@@ -0,0 +1,100 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _EPG_H_
+#define _EPG_H_
+
+// Event information of the tuned multiplex, from the EIT present/following
+// and schedule tables of the multiplex itself (table ids 0x4E and 0x50-0x5F)
+// on the EIT PIDs: 0x12, and 0x26/0x27 for the H-EIT and L-EIT of ISDB-T.
+//
+// Start times are broadcast as local time: they are converted with the
+// local time zone of the host (mktime()), which is expected to be the one
+// of the broadcaster.
+//
+// Besides the event table, the present event of each service is tracked
+// together with the number of the packet (counted from the capture start,
+// see capture_packet_cb) that completed the section announcing it, so that
+// recordings can be cut on that very packet.
+//
+// epg_feed() runs in the capture thread, the lookups from any thread.
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "psi.h"
+
+#define EPG_MAX_EVENTS   2048
+#define EPG_MAX_SERVICES 32
+#define EPG_TITLE_SIZE   96
+
+#define EPG_PIDS         3
+
+struct epg_event {
+    int service_id;
+    int event_id;
+    time_t start; // 0 when not yet decided
+    int duration; // seconds, -1 when not yet decided
+    int running_status;
+    char title[EPG_TITLE_SIZE];
+};
+
+struct epg_present {
+    int service_id;
+    int event_id; // -1 when nothing is on
+    uint64_t since_packet;
+};
+
+struct epg {
+    pthread_mutex_t mutex;
+    struct psi_assembler assemblers[EPG_PIDS];
+
+    struct epg_event events[EPG_MAX_EVENTS];
+    int event_count;
+
+    struct epg_present present[EPG_MAX_SERVICES];
+    int present_count;
+
+    // packet being fed
+    uint64_t packet;
+
+    uint64_t sections;
+};
+
+
+void epg_init(struct epg *epg);
+
+// feeds count packets, the first one being packet number first_packet
+void epg_feed(struct epg *epg, const unsigned char *packets, int count, uint64_t first_packet);
+
+// copies an event (returns -1 if it is not known)
+int epg_find(struct epg *epg, int service_id, int event_id, struct epg_event *event);
+
+// the event on air on a service, and the packet since which it is (returns
+// -1 while the service's present/following table was not seen)
+int epg_present(struct epg *epg, int service_id, int *event_id, uint64_t *since_packet);
+
+// copies up to max events ordered by service and start, returns the count
+int epg_list(struct epg *epg, struct epg_event *list, int max);
+
+void epg_free(struct epg *epg);
+
+#endif /* _EPG_H_ */
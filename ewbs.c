@@ -0,0 +1,337 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "ewbs.h"
+#include "m2ts.h"
+
+static int ewbs_hook_set_error(struct ewbs_hook *hook, const char *msg)
+{
+    strncpy(hook->error_msg, msg, sizeof(hook->error_msg));
+    hook->error_msg[sizeof(hook->error_msg) - 1] = 0;
+    return -1;
+}
+
+int ewbs_hook_add(struct ewbs_hook *hook, const char *target)
+{
+    if (!strncmp(target, "exec:", 5) && strlen(target + 5) < sizeof(hook->command))
+        strcpy(hook->command, target + 5);
+    else if (!strncmp(target, "unix:", 5) && strlen(target + 5) < sizeof(hook->socket_path))
+        strcpy(hook->socket_path, target + 5);
+    else
+        return ewbs_hook_set_error(hook, "Invalid alarm hook, expected exec:COMMAND or unix:PATH.");
+    return 0;
+}
+
+static void format_areas(const struct ewbs_alarm *a, char *buf, size_t size)
+{
+    size_t len = 0;
+    int i;
+
+    buf[0] = 0;
+    for (i = 0; i < a->area_count && len + 8 < size; i++)
+        len += snprintf(buf + len, size - len, "%s0x%03x", i ? "," : "", a->areas[i]);
+}
+
+static void run_alarm(struct ewbs_hook *hook, const struct ewbs_alarm *a)
+{
+    struct sockaddr_un addr;
+    char areas[EWBS_MAX_AREAS * 7], message[512];
+    uint64_t latency_us = (m2ts_now_ns() - a->detected_ns) / 1000;
+    pid_t pid;
+    int len;
+
+    format_areas(a, areas, sizeof(areas));
+
+    if (hook->fd >= 0)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, hook->socket_path);
+        len = snprintf(message, sizeof(message), "EWBS %s source=%s service=%d level=%d areas=%s latency_us=%llu\n",
+                       a->active ? "on" : "off", a->source, a->service_id, a->signal_level + 1, areas,
+                       (unsigned long long) latency_us);
+        if (sendto(hook->fd, message, len, MSG_DONTWAIT | MSG_NOSIGNAL, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            fprintf(stderr, "EWBS: no listener on %s.\n", hook->socket_path);
+    }
+
+    if (hook->command[0])
+    {
+        // the environment is made before forking: only exec runs in the child
+        char vars[6][64 + sizeof(areas)];
+        char **envp;
+        char *argv[] = { "sh", "-c", hook->command, NULL };
+        int count, i;
+
+        snprintf(vars[0], sizeof(vars[0]), "EWBS_STATE=%s", a->active ? "on" : "off");
+        snprintf(vars[1], sizeof(vars[1]), "EWBS_SOURCE=%s", a->source);
+        snprintf(vars[2], sizeof(vars[2]), "EWBS_SERVICE=%d", a->service_id);
+        snprintf(vars[3], sizeof(vars[3]), "EWBS_LEVEL=%d", a->signal_level + 1);
+        snprintf(vars[4], sizeof(vars[4]), "EWBS_AREAS=%s", areas);
+        snprintf(vars[5], sizeof(vars[5]), "EWBS_LATENCY_US=%llu", (unsigned long long) latency_us);
+
+        for (count = 0; environ[count]; count++)
+            ;
+        envp = malloc((count + 7) * sizeof(char *));
+        if (envp == NULL)
+            return;
+        for (i = 0; i < 6; i++)
+            envp[i] = vars[i];
+        memcpy(envp + 6, environ, (count + 1) * sizeof(char *));
+
+        pid = fork();
+        if (pid == 0)
+        {
+            execve("/bin/sh", argv, envp);
+            _exit(127);
+        }
+        free(envp);
+        if (pid > 0)
+            waitpid(pid, NULL, 0);
+    }
+}
+
+static void *hook_thread(void *arg)
+{
+    struct ewbs_hook *hook = arg;
+    struct ewbs_alarm a;
+
+    pthread_mutex_lock(&hook->mutex);
+    while (hook->keep_running || hook->head != hook->tail)
+    {
+        if (hook->head == hook->tail)
+        {
+            pthread_cond_wait(&hook->cond, &hook->mutex);
+            continue;
+        }
+        a = hook->queue[hook->tail % EWBS_QUEUE];
+        hook->tail++;
+
+        pthread_mutex_unlock(&hook->mutex);
+        run_alarm(hook, &a);
+        pthread_mutex_lock(&hook->mutex);
+    }
+    pthread_mutex_unlock(&hook->mutex);
+
+    return NULL;
+}
+
+int ewbs_hook_start(struct ewbs_hook *hook)
+{
+    hook->fd = -1;
+    if (hook->socket_path[0])
+    {
+        hook->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (hook->fd < 0)
+            return ewbs_hook_set_error(hook, "Error creating the alarm socket.");
+    }
+
+    pthread_mutex_init(&hook->mutex, NULL);
+    pthread_cond_init(&hook->cond, NULL);
+    hook->head = hook->tail = 0;
+    hook->keep_running = 1;
+    if (pthread_create(&hook->thread, NULL, hook_thread, hook) != 0)
+    {
+        if (hook->fd >= 0)
+            close(hook->fd);
+        return ewbs_hook_set_error(hook, "Error starting the alarm thread.");
+    }
+    hook->running = 1;
+    return 0;
+}
+
+// called from reader threads: never waits for the hook
+static void hook_fire(struct ewbs_hook *hook, const struct ewbs_alarm *a)
+{
+    pthread_mutex_lock(&hook->mutex);
+    if (hook->head - hook->tail < EWBS_QUEUE)
+    {
+        hook->queue[hook->head % EWBS_QUEUE] = *a;
+        hook->head++;
+        pthread_cond_signal(&hook->cond);
+    }
+    else
+        hook->dropped++;
+    pthread_mutex_unlock(&hook->mutex);
+}
+
+void ewbs_hook_stop(struct ewbs_hook *hook)
+{
+    if (!hook->running)
+        return;
+
+    // the alarms already queued still go out
+    pthread_mutex_lock(&hook->mutex);
+    hook->keep_running = 0;
+    pthread_cond_signal(&hook->cond);
+    pthread_mutex_unlock(&hook->mutex);
+    pthread_join(hook->thread, NULL);
+    hook->running = 0;
+
+    if (hook->fd >= 0)
+        close(hook->fd);
+    hook->fd = -1;
+    pthread_mutex_destroy(&hook->mutex);
+    pthread_cond_destroy(&hook->cond);
+}
+
+void ewbs_init(struct ewbs *ew, const char *source, struct ewbs_hook *hook)
+{
+    memset(ew, 0, sizeof(struct ewbs));
+    snprintf(ew->source, sizeof(ew->source), "%s", source);
+    ew->hook = hook;
+    psi_assembler_init(&ew->pat, PAT_PID);
+}
+
+static void pat_section(void *opaque, const unsigned char *section, int len)
+{
+    struct ewbs *ew = opaque;
+    struct psi_pat pat;
+    int i, pid;
+
+    if (psi_parse_pat(section, len, &pat) < 0)
+        return;
+
+    for (i = 0; i < pat.program_count; i++)
+    {
+        pid = pat.programs[i].pid;
+        if (pat.programs[i].program_number == 0 || ew->pmt_pids[pid >> 3] & 1 << (pid & 7))
+            continue;
+        if (ew->pmt_count == PSI_MAX_PROGRAMS)
+            return;
+        ew->pmts[ew->pmt_count] = malloc(sizeof(struct psi_assembler));
+        if (ew->pmts[ew->pmt_count] == NULL)
+            return;
+        psi_assembler_init(ew->pmts[ew->pmt_count++], pid);
+        ew->pmt_pids[pid >> 3] |= 1 << (pid & 7);
+    }
+}
+
+static void set_state(struct ewbs *ew, struct ewbs_alarm *a)
+{
+    int i;
+
+    for (i = 0; i < ew->active_count && ew->active[i] != a->service_id; i++)
+        ;
+    if ((i < ew->active_count) == (a->active != 0))
+        return;
+
+    if (a->active)
+    {
+        if (ew->active_count == PSI_MAX_PROGRAMS)
+            return;
+        ew->active[ew->active_count++] = a->service_id;
+    }
+    else
+        ew->active[i] = ew->active[--ew->active_count];
+
+    ew->alarms++;
+    snprintf(a->source, sizeof(a->source), "%s", ew->source);
+    a->packet = ew->packet;
+    a->detected_ns = m2ts_now_ns();
+    if (ew->hook && ew->hook->running)
+        hook_fire(ew->hook, a);
+}
+
+// the services of a PMT's emergency information descriptor
+static void pmt_section(void *opaque, const unsigned char *section, int len)
+{
+    struct ewbs *ew = opaque;
+    struct ewbs_alarm a;
+    struct psi_pmt pmt;
+    const unsigned char *d;
+    int pos, end, area_len, i, found = 0;
+
+    if (psi_parse_pmt(section, len, &pmt) < 0)
+        return;
+
+    d = psi_find_descriptor(pmt.descriptors, pmt.descriptors_len, EMERGENCY_INFORMATION_DESCRIPTOR);
+    if (d)
+    {
+        for (pos = 2, end = 2 + d[1]; pos + 4 <= end; pos += 4 + area_len)
+        {
+            area_len = d[pos + 3];
+            if (pos + 4 + area_len > end)
+                break;
+
+            memset(&a, 0, sizeof(a));
+            a.service_id = d[pos] << 8 | d[pos + 1];
+            a.active = d[pos + 2] >> 7;
+            a.signal_level = (d[pos + 2] >> 6) & 1;
+            for (i = 0; i + 2 <= area_len && a.area_count < EWBS_MAX_AREAS; i += 2)
+                a.areas[a.area_count++] = (d[pos + 4 + i] << 8 | d[pos + 5 + i]) >> 4;
+            if (a.service_id == pmt.program_number)
+                found = 1;
+            set_state(ew, &a);
+        }
+    }
+
+    // no descriptor (left) for the program: its alarm is over
+    if (!found)
+    {
+        memset(&a, 0, sizeof(a));
+        a.service_id = pmt.program_number;
+        set_state(ew, &a);
+    }
+}
+
+void ewbs_feed(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    struct ewbs *ew = opaque;
+    const unsigned char *p;
+    int i, j, pid;
+
+    for (i = 0; i < count; i++)
+    {
+        p = packets + i * TS_PACKET_SIZE;
+        pid = TS_PID(p);
+        if (pid != PAT_PID && !(ew->pmt_pids[pid >> 3] & 1 << (pid & 7)))
+            continue;
+
+        ew->packet = first_packet + i;
+        if (pid == PAT_PID)
+            psi_assembler_push(&ew->pat, p, pat_section, ew);
+        else
+            for (j = 0; j < ew->pmt_count; j++)
+                if (ew->pmts[j]->pid == pid)
+                    psi_assembler_push(ew->pmts[j], p, pmt_section, ew);
+    }
+}
+
+void ewbs_free(struct ewbs *ew)
+{
+    int i;
+
+    for (i = 0; i < ew->pmt_count; i++)
+        free(ew->pmts[i]);
+    ew->pmt_count = 0;
+}
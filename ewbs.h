@@ -0,0 +1,112 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _EWBS_H_
+#define _EWBS_H_
+
+// Emergency Warning Broadcast System (EWBS) detection: the emergency
+// information descriptor (ARIB STD-B10, tag 0xFC) in the PMTs, checked on
+// the PMT packets as they are read (see capture_set_reader_tap()), so an
+// alarm is raised on the very packet that completes the PMT announcing it.
+//
+// The TMCC emergency alarm flag is not exposed by the Linux DVB v5 API, so
+// detection relies on the PMT alone.
+//
+// Alarms go to a hook, which a thread of its own runs off the reader: a
+// datagram to a Unix socket, then a command run with the alarm in its
+// environment (EWBS_STATE on/off, EWBS_SOURCE, EWBS_SERVICE, EWBS_LEVEL,
+// EWBS_AREAS, EWBS_LATENCY_US).
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "psi.h"
+
+#define EMERGENCY_INFORMATION_DESCRIPTOR 0xFC
+
+#define EWBS_MAX_AREAS  16
+#define EWBS_QUEUE      16
+
+struct ewbs_alarm {
+    char source[32];
+    int service_id;
+    int active;       // start_end_flag
+    int signal_level; // 0: first type, 1: second type
+    int area_count;
+    int areas[EWBS_MAX_AREAS];
+    uint64_t packet;      // packet that completed the PMT
+    uint64_t detected_ns; // CLOCK_MONOTONIC, see m2ts_now_ns()
+};
+
+// runs the alarms of any number of detectors
+struct ewbs_hook {
+    char command[256];
+    char socket_path[108];
+    int fd;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    volatile int keep_running;
+
+    struct ewbs_alarm queue[EWBS_QUEUE];
+    unsigned int head, tail;
+    uint64_t dropped;
+
+    char error_msg[256];
+};
+
+struct ewbs {
+    char source[32];
+    struct ewbs_hook *hook;
+
+    struct psi_assembler pat;
+    struct psi_assembler *pmts[PSI_MAX_PROGRAMS];
+    int pmt_count;
+    unsigned char pmt_pids[8192 / 8];
+
+    // services whose alarm is on
+    int active[PSI_MAX_PROGRAMS];
+    int active_count;
+
+    uint64_t packet;
+    uint64_t alarms;
+};
+
+
+// target is "exec:COMMAND" or "unix:PATH", and can be given again to add
+// the other one (returns -1 on error)
+int ewbs_hook_add(struct ewbs_hook *hook, const char *target);
+
+// starts the hook thread (returns -1 on error)
+int ewbs_hook_start(struct ewbs_hook *hook);
+
+void ewbs_hook_stop(struct ewbs_hook *hook);
+
+// source names the channel in the alarms
+void ewbs_init(struct ewbs *ew, const char *source, struct ewbs_hook *hook);
+
+// a capture_packet_cb, for capture_set_reader_tap() with the ewbs as opaque
+void ewbs_feed(void *opaque, const unsigned char *packets, int count, uint64_t first_packet);
+
+void ewbs_free(struct ewbs *ew);
+
+#endif /* _EWBS_H_ */
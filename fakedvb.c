@@ -0,0 +1,1139 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+// fakedvb.so: a stand-in for /dev/dvb/adapterN, to run isdbt-capture (or
+// anything built on dvb_resource) without a tuner:
+//
+//   LD_PRELOAD=./fakedvb.so FAKEDVB_LOCK_MS=200 ./isdbt-capture -c 35 -o out.ts
+//
+// open(), close(), ioctl(), read(), poll(), ppoll() and mmap() are
+// intercepted for the frontend0, demux0 and dvr0 nodes of the fake adapters and passed through
+// for everything else. Configuration comes from the environment:
+//
+//   FAKEDVB_ADAPTERS   number of adapters (1)
+//   FAKEDVB_FREQS      "freq[:signal],..." in Hz that have a signal, with an
+//                      optional strength in %; all frequencies when unset
+//   FAKEDVB_LOCK_MS    time from DTV_TUNE to FE_HAS_LOCK (500)
+//   FAKEDVB_SIGNAL     signal strength in % (80)
+//   FAKEDVB_SNR        signal quality in % (70)
+//   FAKEDVB_LOSS_EVERY_MS, FAKEDVB_LOSS_MS
+//                      once locked, lose the lock for LOSS_MS at the end of
+//                      every LOSS_EVERY_MS period (0: never)
+//   FAKEDVB_TS         TS file played in a loop on the DVR; without it the
+//                      DVR carries PID 0x100 packets numbered in their payload
+//   FAKEDVB_NULLS      1 in n generated packets is a null packet, all of
+//                      them identical (0: none)
+//   FAKEDVB_ERROR_PPM, FAKEDVB_DROP_PPM
+//                      packets per million delivered with TEI set and a
+//                      garbled payload, or lost (drawn for each adapter)
+//   FAKEDVB_RATE       DVR bitrate in bit/s (18000000)
+//   FAKEDVB_BUFFER     DVR buffer in bytes; older data is dropped beyond it,
+//                      as the kernel does (188 * 10 * 1024)
+//   FAKEDVB_MMAP       1 to accept DMX_REQBUFS (memory-mapped streaming)
+//   FAKEDVB_BUSY       "n,..." adapters whose frontend another process holds:
+//                      read-write opens fail with EBUSY
+//
+// As with the kernel, a frontend has one read-write user at a time, and
+// read-only opens may only query it.
+//   FAKEDVB_VERBOSE    1 to print what the devices did at exit
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/dvb/frontend.h>
+#include <linux/dvb/dmx.h>
+
+#define FAKE_MAX_ADAPTERS 8
+#define FAKE_MAX_FDS 4096
+#define FAKE_MAX_FREQS 128
+#define FAKE_MAX_BUFFERS 32
+#define FAKE_MAX_EVENTS 8
+
+#define FAKE_PACKET 188
+
+#define FAKE_FRONTEND 1
+#define FAKE_DEMUX    2
+#define FAKE_DVR      3
+
+struct fake_frontend {
+    uint64_t freq;
+    int tuned;
+    uint64_t tune_ns;
+    unsigned int tunes;
+
+    // read-write opens, at most one
+    int writers;
+    int busy;
+
+    // as the kernel, a status 0 event on every tune, then one on each
+    // change of the status, for FE_GET_EVENT and POLLPRI; the changes are
+    // noticed whenever the frontend is polled or queried
+    fe_status_t events[FAKE_MAX_EVENTS];
+    int event_count;
+    fe_status_t last_status;
+
+    // DVR payload: every adapter receives the same "air"
+    FILE *ts;
+    uint64_t packet_no;
+    unsigned int seed;
+};
+
+struct fake_dvr {
+    int adapter;
+    int nonblock;
+
+    // bits produced by the "air" and not read yet
+    double pending_bits;
+    uint64_t last_ns;
+    int overflow;
+
+    // memory-mapped streaming
+    int memfd;
+    unsigned char *map;
+    unsigned int count, size;
+    unsigned int stride; // size rounded to pages, as mmap offsets must be
+    int queued[FAKE_MAX_BUFFERS];
+    int filled[FAKE_MAX_BUFFERS], filled_count;
+    unsigned int seq;
+};
+
+struct fake_fd {
+    int type;
+    int adapter;
+    int writable;
+    struct fake_dvr *dvr;
+};
+
+static struct {
+    int adapters;
+    uint64_t freqs[FAKE_MAX_FREQS];
+    int freq_signal[FAKE_MAX_FREQS];
+    int freq_count;
+    int lock_ms;
+    int signal, snr;
+    int loss_every_ms, loss_ms;
+    double rate;
+    unsigned long buffer;
+    int mmap;
+    int verbose;
+    int error_ppm, drop_ppm;
+    int nulls;
+    uint64_t epoch_ns;
+
+    struct fake_frontend frontends[FAKE_MAX_ADAPTERS];
+    struct fake_fd *fds[FAKE_MAX_FDS];
+
+    // statistics
+    uint64_t bytes, dropped, lost_buffers;
+    unsigned int overflows;
+} fake;
+
+static pthread_mutex_t fake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fake_once = PTHREAD_ONCE_INIT;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static int (*real_poll)(struct pollfd *, nfds_t, int);
+static int (*real_ppoll)(struct pollfd *, nfds_t, const struct timespec *, const sigset_t *);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int env_int(const char *name, int def)
+{
+    const char *value = getenv(name);
+    return value && *value ? atoi(value) : def;
+}
+
+static void fake_report(void)
+{
+    int i;
+
+    if (!fake.verbose)
+        return;
+
+    for (i = 0; i < fake.adapters; i++)
+        fprintf(stderr, "fakedvb: adapter%d tuned %u times\n", i, fake.frontends[i].tunes);
+    fprintf(stderr, "fakedvb: %llu bytes delivered, %llu dropped (%u overflows, %llu buffers lost)\n",
+            (unsigned long long) fake.bytes, (unsigned long long) fake.dropped, fake.overflows,
+            (unsigned long long) fake.lost_buffers);
+}
+
+static void fake_init(void)
+{
+    const char *freqs, *file, *busy;
+    char *end;
+    int i;
+
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    real_read = dlsym(RTLD_NEXT, "read");
+    real_poll = dlsym(RTLD_NEXT, "poll");
+    real_ppoll = dlsym(RTLD_NEXT, "ppoll");
+    real_mmap = dlsym(RTLD_NEXT, "mmap");
+
+    fake.adapters = env_int("FAKEDVB_ADAPTERS", 1);
+    if (fake.adapters > FAKE_MAX_ADAPTERS)
+        fake.adapters = FAKE_MAX_ADAPTERS;
+    fake.lock_ms = env_int("FAKEDVB_LOCK_MS", 500);
+    fake.signal = env_int("FAKEDVB_SIGNAL", 80);
+    fake.snr = env_int("FAKEDVB_SNR", 70);
+    fake.loss_every_ms = env_int("FAKEDVB_LOSS_EVERY_MS", 0);
+    fake.loss_ms = env_int("FAKEDVB_LOSS_MS", 0);
+    fake.rate = env_int("FAKEDVB_RATE", 18000000);
+    fake.buffer = env_int("FAKEDVB_BUFFER", FAKE_PACKET * 10 * 1024);
+    fake.mmap = env_int("FAKEDVB_MMAP", 0);
+    fake.verbose = env_int("FAKEDVB_VERBOSE", 0);
+    fake.error_ppm = env_int("FAKEDVB_ERROR_PPM", 0);
+    fake.drop_ppm = env_int("FAKEDVB_DROP_PPM", 0);
+    fake.nulls = env_int("FAKEDVB_NULLS", 0);
+    fake.epoch_ns = now_ns();
+
+    freqs = getenv("FAKEDVB_FREQS");
+    while (freqs && *freqs && fake.freq_count < FAKE_MAX_FREQS)
+    {
+        fake.freqs[fake.freq_count] = strtoull(freqs, &end, 10);
+        fake.freq_signal[fake.freq_count] = fake.signal;
+        if (*end == ':')
+            fake.freq_signal[fake.freq_count] = strtol(end + 1, &end, 10);
+        fake.freq_count++;
+        freqs = *end == ',' ? end + 1 : "";
+    }
+
+    busy = getenv("FAKEDVB_BUSY");
+    while (busy && *busy)
+    {
+        i = strtol(busy, &end, 10);
+        if (end == busy)
+            break;
+        if (i >= 0 && i < FAKE_MAX_ADAPTERS)
+            fake.frontends[i].busy = 1;
+        busy = *end == ',' ? end + 1 : "";
+    }
+
+    file = getenv("FAKEDVB_TS");
+    for (i = 0; i < fake.adapters; i++)
+    {
+        fake.frontends[i].seed = i + 1;
+        if (file && *file)
+        {
+            fake.frontends[i].ts = fopen(file, "r");
+            if (fake.frontends[i].ts == NULL)
+                fprintf(stderr, "fakedvb: cannot open %s, using generated packets\n", file);
+        }
+    }
+
+    atexit(fake_report);
+}
+
+// signal strength at the tuned frequency, 0 for none
+static int fake_signal(struct fake_frontend *fe)
+{
+    int i;
+
+    if (!fe->tuned)
+        return 0;
+    if (fake.freq_count == 0)
+        return fake.signal;
+
+    // anything within the 6MHz channel counts
+    for (i = 0; i < fake.freq_count; i++)
+        if (fe->freq + 3000000 > fake.freqs[i] && fe->freq < fake.freqs[i] + 3000000)
+            return fake.freq_signal[i];
+    return 0;
+}
+
+static int fake_locked(struct fake_frontend *fe, uint64_t now)
+{
+    uint64_t lock_ns = fe->tune_ns + (uint64_t) fake.lock_ms * 1000000ULL;
+
+    if (fake_signal(fe) <= 0 || now < lock_ns)
+        return 0;
+
+    if (fake.loss_every_ms > 0)
+    {
+        uint64_t t = (now - lock_ns) / 1000000ULL % fake.loss_every_ms;
+        if (t >= (uint64_t) (fake.loss_every_ms - fake.loss_ms))
+            return 0;
+    }
+
+    return 1;
+}
+
+// locked time from the lock up to t, as a function of time alone
+static uint64_t fake_locked_until(struct fake_frontend *fe, uint64_t t)
+{
+    uint64_t lock_ns = fe->tune_ns + (uint64_t) fake.lock_ms * 1000000ULL;
+    uint64_t period, up;
+
+    if (t <= lock_ns)
+        return 0;
+    if (fake.loss_every_ms <= 0)
+        return t - lock_ns;
+
+    period = (uint64_t) fake.loss_every_ms * 1000000ULL;
+    up = period - (uint64_t) fake.loss_ms * 1000000ULL;
+    return (t - lock_ns) / period * up + ((t - lock_ns) % period < up ? (t - lock_ns) % period : up);
+}
+
+// how long the frontend was locked between from and to: a reader that
+// sleeps through an outage gets no data for it
+static uint64_t fake_locked_ns(struct fake_frontend *fe, uint64_t from, uint64_t to)
+{
+    if (fake_signal(fe) <= 0 || to <= from)
+        return 0;
+    return fake_locked_until(fe, to) - fake_locked_until(fe, from);
+}
+
+// moves the payload of a frontend to what is on air when it locks, so that
+// adapters tuned to the same channel deliver the same packets at the same time
+static void fake_air_seek(struct fake_frontend *fe)
+{
+    uint64_t lock_ns = fe->tune_ns + (uint64_t) fake.lock_ms * 1000000ULL;
+    long packets;
+
+    fe->packet_no = (lock_ns - fake.epoch_ns) / 1e9 * fake.rate / (FAKE_PACKET * 8);
+    if (fe->ts && fseek(fe->ts, 0, SEEK_END) == 0 && (packets = ftell(fe->ts) / FAKE_PACKET) > 0)
+        fseek(fe->ts, (long) (fe->packet_no % packets) * FAKE_PACKET, SEEK_SET);
+}
+
+static fe_status_t fake_status(struct fake_frontend *fe, uint64_t now)
+{
+    fe_status_t status = 0;
+
+    if (fake_signal(fe) > 0)
+        status |= FE_HAS_SIGNAL | FE_HAS_CARRIER;
+    if (fake_locked(fe, now))
+        status |= FE_HAS_VITERBI | FE_HAS_SYNC | FE_HAS_LOCK;
+    return status;
+}
+
+// queues an event, the oldest going when the queue is full
+static void fake_event(struct fake_frontend *fe, fe_status_t status)
+{
+    if (fe->event_count == FAKE_MAX_EVENTS)
+    {
+        memmove(fe->events, fe->events + 1, (FAKE_MAX_EVENTS - 1) * sizeof(fe_status_t));
+        fe->event_count--;
+    }
+    fe->events[fe->event_count++] = status;
+    fe->last_status = status;
+}
+
+// queues an event if the status changed since the last one
+static void fake_events(struct fake_frontend *fe, uint64_t now)
+{
+    fe_status_t status;
+
+    if (!fe->tuned)
+        return;
+    status = fake_status(fe, now);
+    if (status == fe->last_status)
+        return;
+
+    // a lock comes through the stages demodulators report on the way
+    if ((status & FE_HAS_LOCK) && !(fe->last_status & FE_HAS_LOCK))
+    {
+        fake_event(fe, status & ~(FE_HAS_SYNC | FE_HAS_LOCK));
+        fake_event(fe, status & ~FE_HAS_LOCK);
+    }
+    fake_event(fe, status);
+}
+
+static void fake_air_packet(struct fake_frontend *fe, unsigned char *p)
+{
+    uint64_t cc;
+
+    if (fe->ts)
+    {
+        if (fread(p, 1, FAKE_PACKET, fe->ts) == FAKE_PACKET)
+            return;
+        rewind(fe->ts);
+        if (fread(p, 1, FAKE_PACKET, fe->ts) == FAKE_PACKET)
+            return;
+    }
+
+    memset(p, 0xFF, FAKE_PACKET);
+    p[0] = 0x47;
+    if (fake.nulls > 0 && fe->packet_no % fake.nulls == 0)
+    {
+        // its number is skipped by the PID 0x100 packets
+        p[1] = 0x1F;
+        p[2] = 0xFF;
+        p[3] = 0x10;
+        fe->packet_no++;
+        return;
+    }
+    p[1] = 0x01;
+    p[2] = 0x00;
+    // the counter only counts the PID 0x100 packets
+    cc = fake.nulls > 0 ? fe->packet_no - (fe->packet_no + fake.nulls - 1) / fake.nulls : fe->packet_no;
+    p[3] = 0x10 | (cc & 0x0F);
+    memcpy(p + 4, &fe->packet_no, sizeof(fe->packet_no));
+    fe->packet_no++;
+}
+
+// the next packet the DVR of adapter delivers
+static void fake_packet(int adapter, unsigned char *p)
+{
+    struct fake_frontend *fe = &fake.frontends[adapter];
+
+    do
+        fake_air_packet(fe, p);
+    while (fake.drop_ppm && rand_r(&fe->seed) % 1000000 < (unsigned int) fake.drop_ppm);
+
+    if (fake.error_ppm && rand_r(&fe->seed) % 1000000 < (unsigned int) fake.error_ppm)
+    {
+        p[1] |= 0x80;
+        p[4 + rand_r(&fe->seed) % (FAKE_PACKET - 4)] ^= 0x5A;
+    }
+}
+
+static void fake_skip(int adapter, uint64_t bytes)
+{
+    unsigned char p[FAKE_PACKET];
+
+    fake.dropped += bytes;
+    for (; bytes >= FAKE_PACKET; bytes -= FAKE_PACKET)
+        fake_packet(adapter, p);
+}
+
+// fills the filled queue of a streaming DVR, dropping what finds no buffer
+static void fake_stream_fill(struct fake_dvr *dvr)
+{
+    int i;
+
+    while (dvr->pending_bits >= dvr->size * 8.0)
+    {
+        dvr->pending_bits -= dvr->size * 8.0;
+
+        for (i = 0; i < (int) dvr->count && !dvr->queued[i]; i++)
+            ;
+        if (i == (int) dvr->count)
+        {
+            // no buffer queued: the kernel drops it, and count shows the gap
+            fake_skip(dvr->adapter, dvr->size);
+            fake.lost_buffers++;
+            dvr->seq++;
+            continue;
+        }
+
+        unsigned int k;
+        for (k = 0; k < dvr->size / FAKE_PACKET; k++)
+            fake_packet(dvr->adapter, dvr->map + (size_t) i * dvr->stride + k * FAKE_PACKET);
+        fake.bytes += k * FAKE_PACKET;
+        dvr->queued[i] = 0;
+        dvr->filled[dvr->filled_count++] = i;
+    }
+}
+
+// accounts the data the frontend delivered since the last call
+static void fake_dvr_update(struct fake_dvr *dvr)
+{
+    struct fake_frontend *fe = &fake.frontends[dvr->adapter];
+    uint64_t now = now_ns();
+
+    dvr->pending_bits += fake.rate * fake_locked_ns(fe, dvr->last_ns, now) / 1e9;
+    dvr->last_ns = now;
+
+    if (dvr->count)
+    {
+        fake_stream_fill(dvr);
+        return;
+    }
+
+    if (dvr->pending_bits > fake.buffer * 8.0)
+    {
+        // the kernel flushes the whole DVR buffer on overflow
+        uint64_t drop = (uint64_t) (dvr->pending_bits / 8);
+        drop -= drop % FAKE_PACKET;
+        fake_skip(dvr->adapter, drop);
+        dvr->pending_bits -= drop * 8.0;
+        dvr->overflow = 1;
+        fake.overflows++;
+    }
+}
+
+static int fake_dvr_ready(struct fake_dvr *dvr)
+{
+    fake_dvr_update(dvr);
+    if (dvr->count)
+        return dvr->filled_count > 0;
+    return dvr->overflow || dvr->pending_bits >= FAKE_PACKET * 8.0;
+}
+
+// how long until the DVR gets its next packet (or buffer)
+static uint64_t fake_dvr_wait_ns(struct fake_dvr *dvr)
+{
+    double want = (dvr->count ? dvr->size : FAKE_PACKET) * 8.0 - dvr->pending_bits;
+
+    if (!fake_locked(&fake.frontends[dvr->adapter], now_ns()))
+        return 10000000ULL;
+    if (want <= 0)
+        return 0;
+    return want / fake.rate * 1e9 + 1;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec t = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+    nanosleep(&t, NULL);
+}
+
+static struct fake_fd *fake_lookup(int fd)
+{
+    if (fd < 0 || fd >= FAKE_MAX_FDS)
+        return NULL;
+    return fake.fds[fd];
+}
+
+static int fake_parse_path(const char *path, int *adapter)
+{
+    char node[16];
+
+    if (sscanf(path, "/dev/dvb/adapter%d/%15s", adapter, node) != 2)
+        return 0;
+    if (*adapter < 0 || *adapter >= fake.adapters)
+        return -1;
+
+    if (!strcmp(node, "frontend0"))
+        return FAKE_FRONTEND;
+    if (!strcmp(node, "demux0"))
+        return FAKE_DEMUX;
+    if (!strcmp(node, "dvr0"))
+        return FAKE_DVR;
+    return -1;
+}
+
+static int fake_open(const char *path, int flags, mode_t mode)
+{
+    int adapter, type, fd;
+
+    pthread_once(&fake_once, fake_init);
+
+    type = fake_parse_path(path, &adapter);
+    if (type == 0)
+        return real_open(path, flags, mode);
+    if (type < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // a real descriptor keeps the number unique
+    fd = real_open("/dev/null", O_RDWR);
+    if (fd < 0)
+        return -1;
+    if (fd >= FAKE_MAX_FDS)
+    {
+        real_close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (type == FAKE_FRONTEND && (flags & O_ACCMODE) != O_RDONLY)
+    {
+        struct fake_frontend *fe = &fake.frontends[adapter];
+        int busy;
+
+        pthread_mutex_lock(&fake_mutex);
+        busy = fe->busy || fe->writers > 0;
+        if (!busy)
+            fe->writers++;
+        pthread_mutex_unlock(&fake_mutex);
+        if (busy)
+        {
+            real_close(fd);
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    struct fake_fd *f = calloc(1, sizeof(struct fake_fd));
+    f->type = type;
+    f->adapter = adapter;
+    f->writable = (flags & O_ACCMODE) != O_RDONLY;
+    if (type == FAKE_DVR)
+    {
+        f->dvr = calloc(1, sizeof(struct fake_dvr));
+        f->dvr->adapter = adapter;
+        f->dvr->nonblock = (flags & O_NONBLOCK) != 0;
+        f->dvr->memfd = -1;
+        f->dvr->last_ns = now_ns();
+    }
+
+    pthread_mutex_lock(&fake_mutex);
+    fake.fds[fd] = f;
+    pthread_mutex_unlock(&fake_mutex);
+
+    return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return fake_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return fake_open(path, flags, mode);
+}
+
+int close(int fd)
+{
+    struct fake_fd *f;
+
+    pthread_once(&fake_once, fake_init);
+
+    pthread_mutex_lock(&fake_mutex);
+    f = fake_lookup(fd);
+    if (f)
+        fake.fds[fd] = NULL;
+    if (f && f->type == FAKE_FRONTEND && f->writable)
+        fake.frontends[f->adapter].writers--;
+    pthread_mutex_unlock(&fake_mutex);
+
+    if (f)
+    {
+        if (f->dvr)
+        {
+            // the application unmaps its views, ours goes with the buffers
+            if (f->dvr->map)
+                munmap(f->dvr->map, (size_t) f->dvr->count * f->dvr->stride);
+            if (f->dvr->memfd >= 0)
+                real_close(f->dvr->memfd);
+            free(f->dvr);
+        }
+        free(f);
+    }
+
+    return real_close(fd);
+}
+
+// counters since the lock, as packets of the DVR rate with the errors of
+// FAKEDVB_ERROR_PPM: the whole signal, then layer A (one segment of 13),
+// layer B (the other 12) and an unused layer C
+static void fake_error_stats(struct fake_frontend *fe, uint64_t now, struct dtv_property *p)
+{
+    uint64_t lock_ns = fe->tune_ns + (uint64_t) fake.lock_ms * 1000000ULL;
+    uint64_t blocks = 0, errors, value;
+    int i;
+
+    if (fake_locked(fe, now))
+        blocks = (uint64_t) (fake.rate * ((now - lock_ns) / 1e9) / (FAKE_PACKET * 8));
+    errors = blocks * fake.error_ppm / 1000000;
+
+    p->u.st.len = 4;
+    for (i = 0; i < 4; i++)
+    {
+        switch (p->cmd)
+        {
+        case DTV_STAT_POST_ERROR_BIT_COUNT:
+            value = errors * 8;
+            break;
+        case DTV_STAT_POST_TOTAL_BIT_COUNT:
+            value = blocks * FAKE_PACKET * 8;
+            break;
+        case DTV_STAT_ERROR_BLOCK_COUNT:
+            value = errors;
+            break;
+        default:
+            value = blocks;
+            break;
+        }
+        if (i == 1)
+            value /= 13;
+        else if (i == 2)
+            value -= value / 13;
+        else if (i == 3)
+            value = 0;
+        p->u.st.stat[i].scale = blocks > 0 && i < 3 ? FE_SCALE_COUNTER : FE_SCALE_NOT_AVAILABLE;
+        p->u.st.stat[i].uvalue = value;
+    }
+}
+
+static int fake_frontend_ioctl(struct fake_fd *f, unsigned long request, void *arg)
+{
+    struct fake_frontend *fe = &fake.frontends[f->adapter];
+    int signal = fake_signal(fe);
+    uint64_t now = now_ns();
+    unsigned int i;
+
+    switch (request)
+    {
+    case FE_GET_INFO:
+    {
+        struct dvb_frontend_info *info = arg;
+        memset(info, 0, sizeof(struct dvb_frontend_info));
+        snprintf(info->name, sizeof(info->name), "Fake ISDB-T frontend %d", f->adapter);
+        info->type = FE_OFDM;
+        info->frequency_min = 90000000;
+        info->frequency_max = 770000000;
+        info->frequency_stepsize = 142857;
+        info->caps = FE_CAN_INVERSION_AUTO | FE_CAN_FEC_AUTO | FE_CAN_QAM_AUTO |
+            FE_CAN_TRANSMISSION_MODE_AUTO | FE_CAN_GUARD_INTERVAL_AUTO;
+        return 0;
+    }
+    case FE_SET_PROPERTY:
+    {
+        struct dtv_properties *props = arg;
+        if (!f->writable)
+        {
+            errno = EPERM;
+            return -1;
+        }
+        for (i = 0; i < props->num; i++)
+        {
+            switch (props->props[i].cmd)
+            {
+            case DTV_CLEAR:
+                fe->tuned = 0;
+                break;
+            case DTV_FREQUENCY:
+                fe->freq = props->props[i].u.data;
+                break;
+            case DTV_TUNE:
+                fe->tuned = 1;
+                fe->tune_ns = now;
+                fe->tunes++;
+                fake_air_seek(fe);
+                fake_event(fe, 0);
+                break;
+            }
+        }
+        return 0;
+    }
+    case FE_GET_PROPERTY:
+    {
+        struct dtv_properties *props = arg;
+        for (i = 0; i < props->num; i++)
+        {
+            struct dtv_property *p = &props->props[i];
+            switch (p->cmd)
+            {
+            case DTV_FREQUENCY:
+                p->u.data = fe->freq;
+                break;
+            case DTV_DELIVERY_SYSTEM:
+                p->u.data = SYS_ISDBT;
+                break;
+            case DTV_ENUM_DELSYS:
+                p->u.buffer.len = 1;
+                p->u.buffer.data[0] = SYS_ISDBT;
+                break;
+            case DTV_STAT_SIGNAL_STRENGTH:
+                // 0% is -100dBm, 100% is -20dBm, in 0.001dBm
+                p->u.st.len = 1;
+                p->u.st.stat[0].scale = signal > 0 ? FE_SCALE_DECIBEL : FE_SCALE_NOT_AVAILABLE;
+                p->u.st.stat[0].svalue = (-100000 + signal * 800);
+                break;
+            case DTV_STAT_CNR:
+                // 0% is 0dB, 100% is 30dB, in 0.001dB
+                p->u.st.len = 1;
+                p->u.st.stat[0].scale = fake_locked(fe, now) ? FE_SCALE_DECIBEL : FE_SCALE_NOT_AVAILABLE;
+                p->u.st.stat[0].svalue = fake.snr * 300;
+                break;
+            case DTV_STAT_POST_ERROR_BIT_COUNT:
+            case DTV_STAT_POST_TOTAL_BIT_COUNT:
+            case DTV_STAT_ERROR_BLOCK_COUNT:
+            case DTV_STAT_TOTAL_BLOCK_COUNT:
+                fake_error_stats(fe, now, p);
+                break;
+            default:
+                p->u.st.len = 0;
+                break;
+            }
+        }
+        return 0;
+    }
+    case FE_READ_STATUS:
+        fake_events(fe, now);
+        *(fe_status_t *) arg = fake_status(fe, now);
+        return 0;
+    case FE_GET_EVENT:
+    {
+        // an empty queue does not block here, whatever the fd mode
+        struct dvb_frontend_event *event = arg;
+        fake_events(fe, now);
+        if (fe->event_count == 0)
+        {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+        memset(event, 0, sizeof(struct dvb_frontend_event));
+        event->status = fe->events[0];
+        event->parameters.frequency = fe->freq;
+        memmove(fe->events, fe->events + 1, (fe->event_count - 1) * sizeof(fe_status_t));
+        fe->event_count--;
+        return 0;
+    }
+    case FE_READ_SIGNAL_STRENGTH:
+        *(uint16_t *) arg = signal * 65535 / 100;
+        return 0;
+    case FE_READ_SNR:
+        *(uint16_t *) arg = fake_locked(fe, now) ? fake.snr * 65535 / 100 : 0;
+        return 0;
+    case FE_READ_BER:
+    case FE_READ_UNCORRECTED_BLOCKS:
+        *(uint32_t *) arg = 0;
+        return 0;
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+static int fake_dvr_ioctl(struct fake_fd *f, unsigned long request, void *arg)
+{
+    struct fake_dvr *dvr = f->dvr;
+    unsigned int i;
+
+    switch (request)
+    {
+    case DMX_SET_BUFFER_SIZE:
+        return 0;
+    case DMX_REQBUFS:
+    {
+        struct dmx_requestbuffers *req = arg;
+        if (!fake.mmap || dvr->count)
+            break;
+        if (req->count > FAKE_MAX_BUFFERS)
+            req->count = FAKE_MAX_BUFFERS;
+        req->size -= req->size % FAKE_PACKET;
+        if (req->count == 0 || req->size == 0)
+            return 0;
+
+        long page = sysconf(_SC_PAGESIZE);
+        dvr->stride = (req->size + page - 1) / page * page;
+        dvr->memfd = memfd_create("fakedvb", MFD_CLOEXEC);
+        if (dvr->memfd < 0 || ftruncate(dvr->memfd, (off_t) req->count * dvr->stride) < 0)
+            return -1;
+        dvr->map = real_mmap(NULL, (size_t) req->count * dvr->stride, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, dvr->memfd, 0);
+        if (dvr->map == MAP_FAILED)
+        {
+            dvr->map = NULL;
+            return -1;
+        }
+        dvr->count = req->count;
+        dvr->size = req->size;
+        return 0;
+    }
+    case DMX_QUERYBUF:
+    {
+        struct dmx_buffer *buf = arg;
+        if (buf->index >= dvr->count)
+            break;
+        buf->offset = buf->index * dvr->stride;
+        buf->length = dvr->size;
+        buf->bytesused = 0;
+        return 0;
+    }
+    case DMX_QBUF:
+    {
+        struct dmx_buffer *buf = arg;
+        if (buf->index >= dvr->count)
+            break;
+        dvr->queued[buf->index] = 1;
+        return 0;
+    }
+    case DMX_DQBUF:
+    {
+        struct dmx_buffer *buf = arg;
+        if (!dvr->count)
+            break;
+        fake_dvr_update(dvr);
+        if (dvr->filled_count == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        buf->index = dvr->filled[0];
+        buf->bytesused = dvr->size;
+        buf->offset = buf->index * dvr->stride;
+        buf->length = dvr->size;
+        buf->flags = 0;
+        buf->count = dvr->seq++;
+        dvr->filled_count--;
+        for (i = 0; i < (unsigned int) dvr->filled_count; i++)
+            dvr->filled[i] = dvr->filled[i + 1];
+        return 0;
+    }
+    }
+
+    errno = request == DMX_REQBUFS ? ENOTTY : EINVAL;
+    return -1;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    struct fake_fd *f;
+    va_list ap;
+    void *arg;
+    int rc;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    pthread_once(&fake_once, fake_init);
+
+    pthread_mutex_lock(&fake_mutex);
+    f = fake_lookup(fd);
+    if (f == NULL)
+    {
+        pthread_mutex_unlock(&fake_mutex);
+        return real_ioctl(fd, request, arg);
+    }
+
+    if (f->type == FAKE_FRONTEND)
+        rc = fake_frontend_ioctl(f, request, arg);
+    else if (f->type == FAKE_DVR)
+        rc = fake_dvr_ioctl(f, request, arg);
+    else
+        rc = 0; // demux: filters always succeed
+    pthread_mutex_unlock(&fake_mutex);
+
+    return rc;
+}
+
+ssize_t read(int fd, void *buffer, size_t len)
+{
+    struct fake_fd *f;
+    struct fake_dvr *dvr;
+    size_t n;
+
+    pthread_once(&fake_once, fake_init);
+
+    pthread_mutex_lock(&fake_mutex);
+    f = fake_lookup(fd);
+    if (f == NULL || f->type != FAKE_DVR)
+    {
+        pthread_mutex_unlock(&fake_mutex);
+        if (f)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        return real_read(fd, buffer, len);
+    }
+
+    dvr = f->dvr;
+    while (!fake_dvr_ready(dvr) || dvr->count)
+    {
+        if (dvr->nonblock || dvr->count)
+        {
+            pthread_mutex_unlock(&fake_mutex);
+            errno = dvr->count ? EINVAL : EAGAIN;
+            return -1;
+        }
+        uint64_t wait = fake_dvr_wait_ns(dvr);
+        pthread_mutex_unlock(&fake_mutex);
+        sleep_ns(wait);
+        pthread_mutex_lock(&fake_mutex);
+    }
+
+    // like the kernel, report an overflow once before returning data again
+    if (dvr->overflow)
+    {
+        dvr->overflow = 0;
+        pthread_mutex_unlock(&fake_mutex);
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    n = (size_t) (dvr->pending_bits / 8) / FAKE_PACKET;
+    if (n > len / FAKE_PACKET)
+        n = len / FAKE_PACKET;
+    for (size_t k = 0; k < n; k++)
+        fake_packet(dvr->adapter, (unsigned char *) buffer + k * FAKE_PACKET);
+    dvr->pending_bits -= n * FAKE_PACKET * 8.0;
+    fake.bytes += n * FAKE_PACKET;
+    pthread_mutex_unlock(&fake_mutex);
+
+    return n * FAKE_PACKET;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct fake_fd *f;
+    uint64_t deadline = timeout >= 0 ? now_ns() + timeout * 1000000ULL : 0;
+    uint64_t wait, now;
+    nfds_t i;
+    int fakes, ready, rc;
+
+    pthread_once(&fake_once, fake_init);
+
+    for (;;)
+    {
+        fakes = 0;
+        ready = 0;
+        wait = 10000000ULL;
+
+        pthread_mutex_lock(&fake_mutex);
+        for (i = 0; i < nfds; i++)
+        {
+            f = fake_lookup(fds[i].fd);
+            if (f == NULL)
+                continue;
+            fakes++;
+            fds[i].revents = 0;
+            if (f->type == FAKE_FRONTEND && (fds[i].events & POLLPRI))
+            {
+                fake_events(&fake.frontends[f->adapter], now_ns());
+                if (fake.frontends[f->adapter].event_count > 0)
+                {
+                    fds[i].revents = POLLPRI;
+                    ready++;
+                }
+            }
+            else if (f->type == FAKE_DVR && (fds[i].events & POLLIN))
+            {
+                if (fake_dvr_ready(f->dvr))
+                {
+                    fds[i].revents = POLLIN;
+                    ready++;
+                }
+                else if (fake_dvr_wait_ns(f->dvr) < wait)
+                    wait = fake_dvr_wait_ns(f->dvr);
+            }
+        }
+        pthread_mutex_unlock(&fake_mutex);
+
+        if (fakes == 0)
+            return real_poll(fds, nfds, timeout);
+
+        // the real descriptors are polled in slices between DVR checks
+        now = now_ns();
+        if (ready || (timeout >= 0 && now >= deadline))
+            wait = 0;
+        else if (timeout >= 0 && deadline - now < wait)
+            wait = deadline - now;
+
+        if ((nfds_t) fakes == nfds)
+        {
+            if (wait == 0)
+                return ready;
+            sleep_ns(wait);
+            continue;
+        }
+
+        struct pollfd real_fds[nfds];
+        memcpy(real_fds, fds, sizeof(struct pollfd) * nfds);
+        for (i = 0; i < nfds; i++)
+            if (fake_lookup(fds[i].fd))
+                real_fds[i].fd = -1;
+
+        rc = real_poll(real_fds, nfds, (wait + 999999) / 1000000);
+        if (rc < 0)
+            return rc;
+        for (i = 0; i < nfds; i++)
+            if (real_fds[i].fd >= 0)
+                fds[i].revents = real_fds[i].revents;
+        if (rc + ready > 0 || wait == 0)
+            return rc + ready;
+    }
+}
+
+// poll() with the timeout rounded up to milliseconds; the signal mask is
+// not applied while fake descriptors are polled
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo, const sigset_t *sigmask)
+{
+    nfds_t i;
+    int fakes = 0;
+
+    pthread_once(&fake_once, fake_init);
+
+    pthread_mutex_lock(&fake_mutex);
+    for (i = 0; i < nfds; i++)
+        if (fake_lookup(fds[i].fd))
+            fakes++;
+    pthread_mutex_unlock(&fake_mutex);
+
+    if (fakes == 0)
+        return real_ppoll(fds, nfds, tmo, sigmask);
+    return poll(fds, nfds, tmo ? (int) (tmo->tv_sec * 1000 + (tmo->tv_nsec + 999999) / 1000000) : -1);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    struct fake_fd *f;
+    int memfd = -1;
+
+    pthread_once(&fake_once, fake_init);
+
+    pthread_mutex_lock(&fake_mutex);
+    f = fake_lookup(fd);
+    if (f && f->dvr)
+        memfd = f->dvr->memfd;
+    pthread_mutex_unlock(&fake_mutex);
+
+    if (f == NULL)
+        return real_mmap(addr, length, prot, flags, fd, offset);
+    if (memfd < 0)
+    {
+        errno = ENODEV;
+        return MAP_FAILED;
+    }
+    return real_mmap(addr, length, prot, flags, memfd, offset);
+}
@@ -0,0 +1,117 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+static int histogram_index(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_COUNT)
+        return value;
+
+    // the top HISTOGRAM_SUB_BITS + 1 significant bits select the bucket
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + sub;
+}
+
+// largest value falling in bucket index
+static uint64_t histogram_value(int index)
+{
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index;
+
+    int exponent = index / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_COUNT;
+    uint64_t low = (HISTOGRAM_SUB_COUNT + sub) << (exponent - HISTOGRAM_SUB_BITS);
+    return low + ((1ULL << (exponent - HISTOGRAM_SUB_BITS)) - 1);
+}
+
+void histogram_reset(struct histogram *h)
+{
+    memset(h, 0, sizeof(struct histogram));
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+    uint64_t *count = &h->counts[histogram_index(value)];
+
+    // single writer: plain increments, atomic only so readers never see a
+    // torn value
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_percentile(struct histogram *h, double percent)
+{
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    uint64_t wanted = total * percent / 100.0;
+    uint64_t seen = 0;
+    int i;
+
+    if (total == 0)
+        return 0;
+    if (wanted == 0)
+        wanted = 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= wanted)
+        {
+            uint64_t value = histogram_value(i);
+            uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            return value < max ? value : max;
+        }
+    }
+
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+static void print_ns(FILE *fp, uint64_t ns)
+{
+    if (ns < 10000)
+        fprintf(fp, " %6lluns", (unsigned long long) ns);
+    else if (ns < 10000000)
+        fprintf(fp, " %6.1fus", ns / 1e3);
+    else
+        fprintf(fp, " %6.1fms", ns / 1e6);
+}
+
+void histogram_print(struct histogram *h, const char *name, FILE *fp)
+{
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+
+    fprintf(fp, "%-22s %10llu", name, (unsigned long long) total);
+    if (total > 0)
+    {
+        print_ns(fp, histogram_percentile(h, 50.0));
+        print_ns(fp, histogram_percentile(h, 90.0));
+        print_ns(fp, histogram_percentile(h, 99.0));
+        print_ns(fp, histogram_percentile(h, 99.9));
+        print_ns(fp, __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+    }
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,54 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Log-linear latency histogram (as in HdrHistogram): every power of two is
+// split in 2^HISTOGRAM_SUB_BITS linear buckets, so any value is kept within
+// ~6% over the whole uint64_t range in a fixed 8KB. There is one writer per
+// histogram; readers may print it concurrently and see a slightly stale copy.
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+
+void histogram_reset(struct histogram *h);
+
+void histogram_record(struct histogram *h, uint64_t value);
+
+// smallest recorded value (bucket upper bound) with at least percent of the
+// samples at or below it
+uint64_t histogram_percentile(struct histogram *h, double percent);
+
+// one line with the sample count, p50/p90/p99/p99.9 and max, values in ns
+void histogram_print(struct histogram *h, const char *name, FILE *fp);
+
+#endif /* _HISTOGRAM_H_ */
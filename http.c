@@ -0,0 +1,589 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include "http.h"
+#include "m2ts.h"
+
+#define HTTP_STATE_REQUEST   0
+#define HTTP_STATE_STREAMING 1
+#define HTTP_STATE_CLOSING   2 // sends what is left of out, then closes
+
+// epoll wakes up at least this often to drop stalled clients
+#define HTTP_TICK_MS 250
+
+#define HTTP_MAX_EVENTS 32
+
+static const char http_ok[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: video/MP2T\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static int http_set_error(struct http_server *srv, const char *msg)
+{
+    strncpy(srv->error_msg, msg, sizeof(srv->error_msg));
+    srv->error_msg[sizeof(srv->error_msg) - 1] = 0;
+    return -1;
+}
+
+static void out_printf(struct http_client *c, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf((char *) c->out + c->out_len, HTTP_OUT_SIZE - c->out_len, fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        c->out_len += n < HTTP_OUT_SIZE - c->out_len ? n : HTTP_OUT_SIZE - c->out_len - 1;
+}
+
+static void drop_client(struct http_server *srv, int slot)
+{
+    struct http_client *c = srv->clients[slot];
+
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    free(c);
+    srv->clients[slot] = NULL;
+}
+
+static void accept_clients(struct http_server *srv)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    struct epoll_event ev;
+    struct http_client *c;
+    char host[48], port[8];
+    int fd, slot;
+
+    for (;;)
+    {
+        addr_len = sizeof(addr);
+        fd = accept4(srv->fd, (struct sockaddr *) &addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        for (slot = 0; slot < HTTP_MAX_CLIENTS && srv->clients[slot]; slot++)
+            ;
+        c = slot < HTTP_MAX_CLIENTS ? calloc(1, sizeof(struct http_client)) : NULL;
+        if (c)
+            c->out = malloc(HTTP_OUT_SIZE);
+        if (c == NULL || c->out == NULL)
+        {
+            if (c)
+                free(c);
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->state = HTTP_STATE_REQUEST;
+        c->progress_ns = m2ts_now_ns();
+        if (getnameinfo((struct sockaddr *) &addr, addr_len, host, sizeof(host), port, sizeof(port),
+                        NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+            snprintf(c->peer, sizeof(c->peer), "%s:%s", host, port);
+        else
+            strcpy(c->peer, "?");
+
+        // edge-triggered: the loop keeps writing until the socket is full
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            free(c->out);
+            free(c);
+            close(fd);
+            continue;
+        }
+        srv->clients[slot] = c;
+    }
+}
+
+static void status_page(struct http_server *srv, struct http_client *c)
+{
+    int i;
+
+    out_printf(c, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n");
+    out_printf(c, "clients_served %llu\nclients_dropped %llu\nskips %llu\n",
+               (unsigned long long) srv->clients_served, (unsigned long long) srv->clients_dropped,
+               (unsigned long long) srv->skips);
+
+    for (i = 0; i < HTTP_MAX_CLIENTS; i++)
+    {
+        struct http_client *o = srv->clients[i];
+        if (o == NULL || o->state != HTTP_STATE_STREAMING)
+            continue;
+        out_printf(c, "client %s program %d bytes %llu overruns %llu%s\n", o->peer, o->program,
+                   (unsigned long long) o->bytes_sent, (unsigned long long) o->cursor.overruns,
+                   o->blocked ? " blocked" : "");
+    }
+}
+
+// parses the request line once the headers are complete (returns 1 when it
+// is, 0 while more is needed)
+static int handle_request(struct http_server *srv, struct http_client *c)
+{
+    char method[8], path[256];
+    char *end;
+    long program = 0;
+
+    c->request[c->request_len] = 0;
+    if (strstr(c->request, "\r\n\r\n") == NULL && strstr(c->request, "\n\n") == NULL)
+    {
+        if (c->request_len < HTTP_REQUEST_SIZE - 1)
+            return 0;
+        out_printf(c, "HTTP/1.0 431 Request Header Fields Too Large\r\nConnection: close\r\n\r\n");
+        c->state = HTTP_STATE_CLOSING;
+        return 1;
+    }
+
+    c->state = HTTP_STATE_CLOSING;
+    if (sscanf(c->request, "%7s %255s", method, path) != 2)
+    {
+        out_printf(c, "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n");
+        return 1;
+    }
+    if (strcmp(method, "GET"))
+    {
+        out_printf(c, "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nConnection: close\r\n\r\n");
+        return 1;
+    }
+
+    if (!strcmp(path, "/status"))
+    {
+        status_page(srv, c);
+        return 1;
+    }
+
+    if (!strncmp(path, "/service/", 9))
+    {
+        program = strtol(path + 9, &end, 10);
+        if (end == path + 9 || (*end && strcmp(end, ".ts")) || program <= 0 || program > 0xFFFF)
+            program = -1;
+    }
+    else if (strcmp(path, "/") && strcmp(path, "/stream.ts"))
+        program = -1;
+
+    if (program < 0 || capture_cursor_open(srv->cap, &c->cursor) < 0)
+    {
+        out_printf(c, "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n");
+        return 1;
+    }
+
+    c->program = program;
+    c->pmt_pid = -1;
+    psi_assembler_init(&c->pat, PAT_PID);
+    memcpy(c->out + c->out_len, http_ok, sizeof(http_ok) - 1);
+    c->out_len += sizeof(http_ok) - 1;
+    c->state = HTTP_STATE_STREAMING;
+    srv->clients_served++;
+    return 1;
+}
+
+static void read_request(struct http_server *srv, struct http_client *c)
+{
+    char discard[512];
+    int n;
+
+    // past the request anything the client sends is ignored, and a client
+    // that closed its side keeps receiving until a write fails
+    if (c->state != HTTP_STATE_REQUEST)
+    {
+        while (read(c->fd, discard, sizeof(discard)) > 0)
+            ;
+        return;
+    }
+
+    while (c->state == HTTP_STATE_REQUEST)
+    {
+        n = read(c->fd, c->request + c->request_len, HTTP_REQUEST_SIZE - 1 - c->request_len);
+        if (n <= 0)
+        {
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                c->state = -1;
+            return;
+        }
+        c->request_len += n;
+        handle_request(srv, c);
+    }
+}
+
+static void pat_section(void *opaque, const unsigned char *section, int len)
+{
+    struct http_client *c = opaque;
+    struct psi_pat pat;
+    int i;
+
+    if (psi_parse_pat(section, len, &pat) < 0)
+        return;
+
+    c->transport_stream_id = pat.transport_stream_id;
+    c->pat_version = pat.version;
+    for (i = 0; i < pat.program_count; i++)
+    {
+        if (pat.programs[i].program_number != c->program)
+            continue;
+        if (pat.programs[i].pid != c->pmt_pid)
+        {
+            c->pmt_pid = pat.programs[i].pid;
+            psi_assembler_init(&c->pmt, c->pmt_pid);
+            memset(c->pids, 0, sizeof(c->pids));
+        }
+        return;
+    }
+}
+
+static void pmt_section(void *opaque, const unsigned char *section, int len)
+{
+    struct http_client *c = opaque;
+    struct psi_pmt pmt;
+    int i;
+
+    if (psi_parse_pmt(section, len, &pmt) < 0 || pmt.program_number != c->program)
+        return;
+
+    memset(c->pids, 0, sizeof(c->pids));
+    c->pids[pmt.pcr_pid >> 3] |= 1 << (pmt.pcr_pid & 7);
+    for (i = 0; i < pmt.stream_count; i++)
+        c->pids[pmt.streams[i].pid >> 3] |= 1 << (pmt.streams[i].pid & 7);
+}
+
+// copies the packets of the client's program to out: its PMT as is, its
+// streams and PCR, and a PAT listing only the program
+static void filter_packets(struct http_client *c, const unsigned char *data, long len)
+{
+    const unsigned char *p;
+    int pid;
+
+    for (p = data; p < data + len; p += TS_PACKET_SIZE)
+    {
+        pid = TS_PID(p);
+        if (pid == PAT_PID)
+        {
+            psi_assembler_push(&c->pat, p, pat_section, c);
+            if (c->pmt_pid >= 0 && p[1] & 0x40)
+            {
+                int program[1][2] = { { c->program, c->pmt_pid } };
+                psi_make_pat(c->out + c->out_len, c->transport_stream_id, c->pat_version,
+                             (const int (*)[2]) program, 1, c->pat_cc++);
+                c->out_len += TS_PACKET_SIZE;
+            }
+            continue;
+        }
+
+        if (pid == c->pmt_pid)
+            psi_assembler_push(&c->pmt, p, pmt_section, c);
+        else if (!(c->pids[pid >> 3] & 1 << (pid & 7)))
+            continue;
+
+        memcpy(c->out + c->out_len, p, TS_PACKET_SIZE);
+        c->out_len += TS_PACKET_SIZE;
+    }
+}
+
+// writes to the client until it is up to date or its socket is full
+// (returns -1 when it has to be closed)
+static int pump(struct http_server *srv, struct http_client *c)
+{
+    const unsigned char *data = NULL;
+    struct iovec iov[2];
+    struct msghdr msg;
+    long len, n;
+
+    while (!c->blocked)
+    {
+        len = 0;
+        if (c->out_sent == c->out_len)
+        {
+            c->out_len = c->out_sent = 0;
+            if (c->state == HTTP_STATE_CLOSING)
+                return -1;
+            if (c->state != HTTP_STATE_STREAMING)
+                return 0;
+
+            len = capture_cursor_peek(&c->cursor, &data, c->program ? HTTP_OUT_SIZE : HTTP_SEND_MAX);
+            if (len < 0)
+            {
+                srv->skips++;
+                continue;
+            }
+            if (len == 0)
+                return 0;
+
+            if (c->program)
+            {
+                filter_packets(c, data, len);
+                capture_cursor_advance(&c->cursor, len);
+                if (!capture_cursor_valid(&c->cursor))
+                    c->out_len = 0;
+                continue;
+            }
+        }
+
+        // the whole multiplex goes out from the ring itself, after whatever
+        // is left of out
+        iov[0].iov_base = c->out + c->out_sent;
+        iov[0].iov_len = c->out_len - c->out_sent;
+        iov[1].iov_base = (void *) data;
+        iov[1].iov_len = len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+                c->blocked = 1;
+            else if (errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        c->progress_ns = m2ts_now_ns();
+        c->bytes_sent += n;
+        if (n < (long) iov[0].iov_len)
+        {
+            c->out_sent += n;
+            continue;
+        }
+        n -= iov[0].iov_len;
+        c->out_sent = c->out_len;
+
+        // a packet cut by a short write is finished from the ring on the
+        // next call: the cursor keeps byte positions
+        capture_cursor_advance(&c->cursor, n);
+        if (n > 0 && !capture_cursor_valid(&c->cursor))
+            srv->skips++;
+    }
+    return 0;
+}
+
+static void pump_all(struct http_server *srv)
+{
+    int i;
+
+    for (i = 0; i < HTTP_MAX_CLIENTS; i++)
+        if (srv->clients[i] && srv->clients[i]->state != HTTP_STATE_REQUEST &&
+            pump(srv, srv->clients[i]) < 0)
+            drop_client(srv, i);
+}
+
+static void *http_thread(void *arg)
+{
+    struct http_server *srv = arg;
+    struct epoll_event events[HTTP_MAX_EVENTS];
+    struct http_client *c;
+    uint64_t now, count;
+    int i, j, n;
+
+    while (srv->keep_running)
+    {
+        // armed before looking at the ring, so a commit in between still
+        // wakes us up
+        capture_notify_arm(srv->cap);
+        pump_all(srv);
+
+        n = epoll_wait(srv->epoll_fd, events, HTTP_MAX_EVENTS, HTTP_TICK_MS);
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &srv->fd)
+            {
+                accept_clients(srv);
+                continue;
+            }
+            if (events[i].data.ptr == &srv->notify_fd)
+            {
+                if (read(srv->notify_fd, &count, sizeof(count)) < 0)
+                    ;
+                continue;
+            }
+
+            c = events[i].data.ptr;
+            for (j = 0; j < HTTP_MAX_CLIENTS && srv->clients[j] != c; j++)
+                ;
+            if (j == HTTP_MAX_CLIENTS)
+                continue;
+
+            if (events[i].events & EPOLLOUT)
+                c->blocked = 0;
+            if (events[i].events & EPOLLIN)
+                read_request(srv, c);
+            if (c->state < 0 || events[i].events & (EPOLLERR | EPOLLHUP))
+                drop_client(srv, j);
+        }
+
+        now = m2ts_now_ns();
+        for (i = 0; i < HTTP_MAX_CLIENTS; i++)
+        {
+            c = srv->clients[i];
+            if (c && (c->blocked || c->state == HTTP_STATE_REQUEST) &&
+                now - c->progress_ns > (uint64_t) HTTP_STALL_MS * 1000000)
+            {
+                if (c->state == HTTP_STATE_STREAMING)
+                {
+                    srv->clients_dropped++;
+                    fprintf(stderr, "HTTP client %s too slow, dropped.\n", c->peer);
+                }
+                drop_client(srv, i);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int listen_on(struct http_server *srv, const char *address)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[256];
+    const char *port, *colon;
+    int one = 1;
+
+    // "port", "host:port" or "[v6 host]:port"
+    colon = strrchr(address, ':');
+    if (colon == NULL)
+    {
+        host[0] = 0;
+        port = address;
+    }
+    else
+    {
+        const char *h = address;
+        size_t len = colon - address;
+
+        if (len >= 2 && h[0] == '[' && h[len - 1] == ']')
+        {
+            h++;
+            len -= 2;
+        }
+        if (len >= sizeof(host))
+            return http_set_error(srv, "HTTP address too long.");
+        memcpy(host, h, len);
+        host[len] = 0;
+        port = colon + 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0)
+        return http_set_error(srv, "Invalid HTTP address.");
+
+    for (ai = res; ai; ai = ai->ai_next)
+    {
+        srv->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (srv->fd < 0)
+            continue;
+        setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(srv->fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(srv->fd, 16) == 0)
+            break;
+        close(srv->fd);
+        srv->fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (srv->fd < 0)
+        return http_set_error(srv, "Error binding the HTTP socket.");
+    return 0;
+}
+
+int http_start(struct http_server *srv, struct capture *cap, const char *address)
+{
+    struct epoll_event ev;
+
+    memset(srv, 0, sizeof(struct http_server));
+    srv->cap = cap;
+    srv->fd = srv->epoll_fd = -1;
+
+    srv->notify_fd = capture_notify_fd(cap);
+    if (srv->notify_fd < 0)
+        return http_set_error(srv, "Error creating the capture notification.");
+
+    if (listen_on(srv, address) < 0)
+        return -1;
+
+    srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv->epoll_fd < 0)
+        goto fail;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &srv->fd;
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->fd, &ev) < 0)
+        goto fail;
+    ev.data.ptr = &srv->notify_fd;
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->notify_fd, &ev) < 0)
+        goto fail;
+
+    srv->keep_running = 1;
+    if (pthread_create(&srv->thread, NULL, http_thread, srv) != 0)
+        goto fail;
+    srv->running = 1;
+    return 0;
+
+fail:
+    if (srv->epoll_fd >= 0)
+        close(srv->epoll_fd);
+    close(srv->fd);
+    srv->fd = srv->epoll_fd = -1;
+    return http_set_error(srv, "Error starting the HTTP server.");
+}
+
+void http_stop(struct http_server *srv)
+{
+    int i;
+
+    if (!srv->running)
+        return;
+
+    srv->keep_running = 0;
+    pthread_join(srv->thread, NULL);
+    srv->running = 0;
+
+    for (i = 0; i < HTTP_MAX_CLIENTS; i++)
+        if (srv->clients[i])
+            drop_client(srv, i);
+
+    close(srv->epoll_fd);
+    close(srv->fd);
+    srv->fd = srv->epoll_fd = -1;
+}
@@ -0,0 +1,109 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+// HTTP streaming of a running capture to any number of clients:
+//
+//   GET /            the whole multiplex
+//   GET /service/N   program N only: its PMT, PCR and elementary streams,
+//                    with a PAT rewritten to list just that program
+//   GET /status      clients and counters, as text
+//
+// One thread runs a non-blocking epoll loop. Each client reads the capture
+// ring through its own cursor (see capture_cursor_open()), so the capture
+// never waits for a client: the whole multiplex is written straight from
+// the ring, a client that falls a ring behind skips to the live position
+// and one that takes nothing for HTTP_STALL_MS is dropped.
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "psi.h"
+
+#define HTTP_MAX_CLIENTS  64
+#define HTTP_REQUEST_SIZE 2048
+
+// bytes queued per client besides the ring: response header, status text
+// or the packets of a service
+#define HTTP_OUT_SIZE     (188 * 256)
+
+// at most this much ring data per write
+#define HTTP_SEND_MAX     (188 * 2048)
+
+#define HTTP_STALL_MS     10000
+
+struct http_client {
+    int fd;
+    int state;
+    char peer[64];
+
+    char request[HTTP_REQUEST_SIZE];
+    int request_len;
+
+    unsigned char *out;
+    int out_len, out_sent;
+
+    struct capture_cursor cursor;
+    int blocked; // the socket is full, waiting for EPOLLOUT
+    uint64_t progress_ns; // last time the client took data
+    uint64_t bytes_sent;
+
+    // service filter, program 0 for the whole multiplex
+    int program;
+    int pmt_pid;
+    int transport_stream_id;
+    int pat_version;
+    int pat_cc;
+    struct psi_assembler pat, pmt;
+    unsigned char pids[8192 / 8];
+};
+
+struct http_server {
+    struct capture *cap;
+    int fd;
+    int epoll_fd;
+    int notify_fd;
+
+    pthread_t thread;
+    volatile int keep_running;
+    int running;
+
+    struct http_client *clients[HTTP_MAX_CLIENTS];
+
+    // statistics
+    uint64_t clients_served;
+    uint64_t clients_dropped; // too slow
+    uint64_t skips;           // times a client was lapped and skipped ahead
+
+    char error_msg[256];
+};
+
+
+// listens on "[host:]port" and starts serving cap, which must be running
+// (returns -1 on error)
+int http_start(struct http_server *srv, struct capture *cap, const char *address);
+
+// disconnects every client and stops the thread
+void http_stop(struct http_server *srv);
+
+#endif /* _HTTP_H_ */
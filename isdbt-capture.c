@@ -23,19 +23,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
-#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 
-#define BUFFER_SIZE 4096
-#define MAX_RETRIES 2
+#include "capture.h"
+#include "m2ts.h"
+#include "nullstrip.h"
+#include "diversity.h"
+#include "control.h"
+#include "http.h"
+#include "pes.h"
+#include "ewbs.h"
+#include "dsmcc.h"
+#include "layersplit.h"
+#include "pidpool.h"
+#include "tscheck.h"
+#include "survey.h"
+#include "archive.h"
 
+#define BUFFER_SIZE 4096
 
-#include "dvb_resource.h"
-#include "ring_buffer.h"
 
 uint64_t *tv_channels;
 
@@ -190,18 +201,35 @@ uint64_t tv_channels_japan[] =
 };
 
 /* global variables */
-struct dvb_resource res;
+struct capture *cap = NULL;
 FILE *ts = NULL;
-FILE *player = NULL;
+struct sink ts_sink = { .fd = -1 };
+struct sink player_sink = { .fd = -1 };
+struct nullstrip strip;
+bool strip_mode = false;
+struct capture *cap2 = NULL;
+struct diversity merge;
+bool diversity_mode = false;
+struct http_server http;
+struct pes_demux es_demux;
+struct pes_files es_files;
+bool es_mode = false;
+struct ewbs_hook alarm_hook;
+struct ewbs ewbs_monitor;
+bool alarm_mode = false;
+struct dsmcc carousel;
+bool carousel_mode = false;
+struct layer_split split;
+struct sink split_sinks[LAYER_SPLIT_CLASSES] = { { .fd = -1 }, { .fd = -1 } };
+bool split_mode = false;
+struct pid_pool pool;
+struct tscheck check;
+bool pool_mode = false;
+struct archive archive;
+bool archive_mode = false;
 int adapter_no = 0;
-
-// thread and ring buffer variables...
-pthread_t output_thread_id;
-pthread_mutex_t output_mutex;
-pthread_cond_t output_cond;
-struct ring_buffer output_buffer;
-
-int keep_reading;
+volatile sig_atomic_t quit = 0;
+volatile sig_atomic_t print_latency = 0;
 
 int scan_channels(char *output_file)
 {
@@ -269,20 +297,199 @@ int scan_channels(char *output_file)
   return 0;
 }
 
-void finish(int s){
-    fprintf(stderr, "\nExiting...\n");
+// sweeps the channel table until interrupted, appending to a CSV file
+int survey_band(char *output_file, int adapter)
+{
+  struct survey sv;
+  struct survey_result result;
+  int first = tv_channels == tv_channels_japan ? 13 : 7;
+  int channel;
+
+  for (channel = first; channel <= 69 && tv_channels[channel] == 0; channel++)
+      ;
+  if (survey_open(&sv, output_file, adapter, tv_channels[channel]) < 0)
+  {
+      fprintf(stderr, "%s: %s\n", sv.error_msg, output_file);
+      return -1;
+  }
+  fprintf(stderr, "Surveying channels %d to 69 into %s, Ctrl+C to stop.\n", first, output_file);
+
+  while (!quit)
+  {
+      uint64_t start = m2ts_now_ns();
+      int locked = 0;
+
+      for (channel = first; channel <= 69 && !quit; channel++)
+      {
+          if (tv_channels[channel] == 0)
+              continue;
+          if (survey_channel(&sv, channel, tv_channels[channel], &result) < 0)
+          {
+              fprintf(stderr, "%s\n", sv.error_msg);
+              survey_close(&sv);
+              return -1;
+          }
+          if (result.state == SURVEY_LOCKED)
+              locked++;
+      }
+      fprintf(stderr, "Sweep %llu: %d channels locked, %.1fs.\n", (unsigned long long) sv.sweep,
+              locked, (m2ts_now_ns() - start) / 1e9);
+      sv.sweep++;
+  }
 
-    keep_reading = 0;
+  survey_close(&sv);
+  return 0;
+}
 
-    pthread_join(output_thread_id, NULL);
+// records the -o output with its null packet runs replaced by markers
+void strip_nulls(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    nullstrip_write(&strip, packets, count);
+}
 
-    dvbres_close(&res);
+// extracts the elementary streams of -E
+void extract_es(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    pes_demux_feed(&es_demux, packets, count);
+}
+
+// writes the one-seg and full-seg outputs of -L
+void split_layers(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    layer_split_feed(&split, packets, count);
+}
+
+// extracts the DSM-CC carousels of -C
+void extract_carousels(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    dsmcc_feed(&carousel, packets, count);
+}
+
+// feeds the packets of tuner 0 or 1 to the diversity merge
+void merge_packets(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    diversity_feed(&merge, opaque != NULL, packets, count);
+}
+
+// the analysis of -E, -L and -C runs after the per-PID checks of the -T
+// workers when there are some, in capture order, or else in the sink thread
+void add_analysis(capture_packet_cb cb)
+{
+    if (pool_mode == true)
+        pid_pool_add_ordered(&pool, cb, NULL);
+    else
+        capture_add_callback(cap, cb, NULL);
+}
+
+// raw outputs come from the capture, or from the merge of both tuners
+void add_output(struct sink *sink)
+{
+    if (diversity_mode == true)
+        diversity_add_sink(&merge, sink);
+    else
+        capture_add_sink(cap, sink);
+}
+
+void interrupt(int s){
+    quit = 1;
+}
+
+void latency(int s){
+    print_latency = 1;
+}
+
+void finish(int s){
+    fprintf(stderr, "\nExiting...\n");
+
+    // clients read the ring directly, they go first
+    if (http.running){
+        http_stop(&http);
+        fprintf(stderr, "HTTP: %llu clients served, %llu dropped as too slow, %llu skips.\n",
+                (unsigned long long) http.clients_served, (unsigned long long) http.clients_dropped,
+                (unsigned long long) http.skips);
+    }
+    if (cap){
+        capture_stop(cap);
+        capture_print_latency(cap, stderr);
+    }
+    if (cap2)
+        capture_stop(cap2);
+    if (archive_mode == true){
+        archive_stop(&archive);
+        fprintf(stderr, "Archive: %llu MB in, %llu MB written (%.1f%%), %llu frames, %llu overruns, %llu errors.\n",
+                (unsigned long long) archive.bytes_in >> 20, (unsigned long long) archive.bytes_out >> 20,
+                archive.bytes_in ? 100.0 * archive.bytes_out / archive.bytes_in : 0.0,
+                (unsigned long long) archive.index_count, (unsigned long long) archive.overruns,
+                (unsigned long long) archive.errors);
+    }
+    if (pool_mode == true){
+        int c;
+        pid_pool_stop(&pool);
+        for (c = 0; c < pool.worker_count; c++)
+            fprintf(stderr, "Worker %d: %llu packets, %llu from shards of other workers.\n", c,
+                    (unsigned long long) pool.workers[c].processed, (unsigned long long) pool.workers[c].stolen);
+        fprintf(stderr, "Worker pool: %llu batches, %llu waits for a free slot.\n",
+                (unsigned long long) pool.head, (unsigned long long) pool.waits);
+        tscheck_print(&check, stderr);
+    }
+    if (alarm_mode == true){
+        ewbs_hook_stop(&alarm_hook);
+        fprintf(stderr, "EWBS: %llu alarm changes.\n", (unsigned long long) ewbs_monitor.alarms);
+        ewbs_free(&ewbs_monitor);
+    }
+    if (diversity_mode == true){
+        diversity_flush(&merge);
+        fprintf(stderr, "Diversity: %llu packets, %llu repaired, %llu only from tuner 1, %llu only from tuner 2, %llu resyncs.\n",
+                (unsigned long long) merge.packets_out, (unsigned long long) merge.repaired,
+                (unsigned long long) merge.filled[0], (unsigned long long) merge.filled[1],
+                (unsigned long long) merge.resyncs);
+    }
+    if (es_mode == true){
+        pes_demux_flush(&es_demux);
+        pes_files_close(&es_files);
+        fprintf(stderr, "Elementary streams: %llu PES packets from %d streams, %llu lost, %llu pool blocks allocated.\n",
+                (unsigned long long) es_demux.packets, es_demux.stream_count,
+                (unsigned long long) es_demux.errors, (unsigned long long) es_demux.pool.allocated);
+        pes_demux_free(&es_demux);
+    }
+    if (split_mode == true){
+        int c;
+        fprintf(stderr, "Layer split: %llu one-seg packets, %llu full-seg packets, %d one-seg services%s, %llu write errors.\n",
+                (unsigned long long) split.out[LAYER_SPLIT_ONESEG].packets,
+                (unsigned long long) split.out[LAYER_SPLIT_FULLSEG].packets, split.oneseg_count,
+                split.nit_seen ? "" : " (no NIT)", (unsigned long long) split.errors);
+        layer_split_free(&split);
+        for (c = 0; c < LAYER_SPLIT_CLASSES; c++)
+            if (split_sinks[c].fd >= 0)
+                sink_close(&split_sinks[c]);
+    }
+    if (carousel_mode == true){
+        fprintf(stderr, "DSM-CC: %d carousels, %llu modules completed, %llu dropped, %llu blocks skipped, %llu files written.\n",
+                carousel.carousel_count, (unsigned long long) carousel.modules_completed,
+                (unsigned long long) carousel.modules_dropped, (unsigned long long) carousel.blocks_skipped,
+                (unsigned long long) carousel.files_written);
+        dsmcc_free(&carousel);
+    }
+    if (pool_mode == true)
+        pid_pool_free(&pool);
+    if (cap)
+        capture_free(cap);
+    if (cap2)
+        capture_free(cap2);
 
     if (ts)
         fclose(ts);
+    if (strip_mode == true && ts_sink.fd >= 0){
+        nullstrip_flush(&strip);
+        if (strip.packets_in > 0)
+            fprintf(stderr, "Null stripping: %llu packets in, %llu written (%.1f%%).\n",
+                    (unsigned long long) strip.packets_in, (unsigned long long) strip.packets_out,
+                    100.0 * strip.packets_out / strip.packets_in);
+    }
+    sink_close(&ts_sink);
 
-    if (player){
-        fclose(player);
+    if (player_sink.fd >= 0){
+        sink_close(&player_sink);
         char fifo_file[64];
         sprintf(fifo_file, "/tmp/out%d.ts", adapter_no);
         remove(fifo_file);
@@ -291,94 +498,96 @@ void finish(int s){
     exit(EXIT_SUCCESS); 
 }
 
-void *output_thread(void *nothing)
-{
-    void *addr;
-    int bytes_read;
-    char buffer[BUFFER_SIZE];
-    
-    while (keep_reading)
-    {
-	bytes_read = read(res.dvr, buffer, BUFFER_SIZE);
-	if (bytes_read <= 0)
-	{
-	    struct pollfd fds[1];
-	    fds[0].fd = res.dvr;
-	    fds[0].events = POLLIN;
-	    poll(fds, 1, -1);
-	    continue;
-	}
-	
-    try_again_write:
-	if (ring_buffer_count_free_bytes (&output_buffer) >= bytes_read)
-	{ 
-	    pthread_mutex_lock(&output_mutex);
-            addr = ring_buffer_write_address (&output_buffer);
-            memcpy(addr, buffer, bytes_read);
-            ring_buffer_write_advance(&output_buffer, bytes_read);
-	    pthread_cond_signal(&output_cond);
-            pthread_mutex_unlock(&output_mutex);
-	}
-        else
-        {
-	    fprintf(stderr, "Buffer full, nich gut...\n");
-	    pthread_mutex_lock(&output_mutex);
-            pthread_cond_wait(&output_cond, &output_mutex);
-            pthread_mutex_unlock(&output_mutex);
-            goto try_again_write;
-        }
-    }
-
-    return NULL;
-}
-
 int main (int argc, char *argv[])
 {
     uint64_t freq = 599142000ULL;
-    int bytes_written = BUFFER_SIZE;
     char buffer[BUFFER_SIZE];
     char output_file[512];
+    char replay_file[512];
     char scan_file[512];
+    char survey_file[512];
     int layer_info = LAYER_FULL;
-    bool scan_mode = false, info_mode = false, player_mode = false, tsoutput_mode = false;
+    int adapter = -1;
+    int diversity_adapter = -1;
+    bool scan_mode = false, survey_mode = false, info_mode = false, player_mode = false, tsoutput_mode = false;
+    bool timestamp_mode = false, replay_mode = false, daemon_mode = false, http_mode = false;
+    char control_path[108];
+    char http_address[256];
+    char archive_file[512];
+    int archive_threads = 2, archive_level = -1;
+    unsigned int batch_us = 0;
+    unsigned long batch_fill = 0;
+    char es_prefix[256];
+    int es_pids[PES_MAX_STREAMS];
+    int es_pid_count = 0;
+    char carousel_dir[256];
+    int pool_workers = 0;
+    char split_files[LAYER_SPLIT_CLASSES][512] = { "", "" };
+    struct thread_policy policy;
     char temp_file[64];
     char player_cmd[256];
+    unsigned long writeback_mb = 0;
+    int writeback_sync_s = 0;
     tv_channels = tv_channels_america;
 
     int opt;
-    void *addr;
 
-
-    pthread_mutex_init(&output_mutex, NULL); 
-    pthread_cond_init(&output_cond, NULL); 
-    ring_buffer_create(&output_buffer, 28); 
-    
-    signal (SIGINT,finish);
+    signal (SIGINT,interrupt);
+    signal (SIGUSR1,latency);
     
     fprintf(stderr, "isdbt-capture by Rafael Diniz -  rafael (AT) riseup (DOT) net\n");
     fprintf(stderr, "License: GPLv3+\n\n");
 
+    cap = capture_new();
+    if (cap == NULL)
+    {
+	fprintf(stderr, "Out of memory.\n");
+	exit(EXIT_FAILURE);
+    }
+
     if (argc < 2)
     {
     manual:
 	fprintf(stderr, "Usage modes: \n%s -c channel_number -p player -o output.ts [-l layer_info]\n", argv[0]);
 	fprintf(stderr, "%s [-s channels.txt]\n", argv[0]);
+	fprintf(stderr, "%s -u survey.csv [-a adapter]\n", argv[0]);
 	fprintf(stderr, "%s [-i]\n", argv[0]);
+	fprintf(stderr, "%s -d control.sock\n", argv[0]);
 	fprintf(stderr, "\nOptions:\n");
 	fprintf(stderr, " -c [7..69]    Channel number (7-69) (Mandatory).\n");
 	fprintf(stderr, " -a [0..N]     Adapter number (0-N) (Optional).\n");
+	fprintf(stderr, " -D [0..N]     Second adapter on another antenna, merged packet by packet with the first (-a) (Optional).\n");
 	fprintf(stderr, " -j            Use Japan channel assignments, instead of American.\n");
-	fprintf(stderr, " -o filename   Output TS filename (Optional).\n");
+	fprintf(stderr, " -o filename   Output TS filename, \"-\" for stdout (Optional).\n");
 	fprintf(stderr, " -p player     Choose a player to play the selected channel (Eg. \"mplayer -vf yadif\" or \"vlc\") (Optional).\n");
-	fprintf(stderr, " -l [0,1,2,3]  Layer information. Possible values are: 0 (All layers), 1 (Layer A), 2 (Layer B), 3 (Layer C) (Optional).\n\n");
+	fprintf(stderr, " -l [0,1,2,3]  Layer information. Possible values are: 0 (All layers), 1 (Layer A), 2 (Layer B), 3 (Layer C) (Optional).\n");
+	fprintf(stderr, " -t            Prefix each packet of the -o output with its arrival timestamp (192-byte packets) (Optional).\n");
+	fprintf(stderr, " -w MB[:s]     Write the -o file back to disk every MB megabytes, keeping it out of the page cache, and fdatasync it every s seconds (Optional).\n");
+	fprintf(stderr, " -n            Strip null packet runs from the -o output, restored bit-exact by -r (Optional).\n");
+	fprintf(stderr, " -r file       Replay a -t capture with its original timing, or a TS file at full speed, instead of tuning (Optional).\n");
+	fprintf(stderr, " -R policy     DVR reader thread scheduling, as [fifo|rr|other][:priority][@cpulist] (Eg. \"fifo:50@2\") (Optional).\n");
+	fprintf(stderr, " -W policy     Sink thread scheduling, same format as -R (Optional).\n");
+	fprintf(stderr, " -B ms[:KB]    Let the DVR fill for up to ms (at most 50), or until KB kilobytes are due, between reads (Optional).\n");
+	fprintf(stderr, " -b [17..34]   Ring buffer size as a power of two, 28 (256MB) by default (Optional).\n");
+	fprintf(stderr, " -M            Bind the ring buffer memory to the NUMA node of the -R CPUs (Optional).\n");
+	fprintf(stderr, " -S name       Publish the capture ring as shared memory /dev/shm/name for local readers (Optional).\n");
+	fprintf(stderr, " -E prefix[:pid,...]  Extract elementary streams (all of the PMTs without pids) to prefix-PID.ext, with PTS/DTS in prefix-PID.pts (Optional).\n");
+	fprintf(stderr, " -L one.ts:full.ts  Write the one-seg and the full-seg services to their own files, either may be empty (Optional).\n");
+	fprintf(stderr, " -C dir        Write the files of the DSM-CC (Ginga) carousels to dir/pidN/ (Optional).\n");
+	fprintf(stderr, " -T [1..32]    Check the continuity of every PID on worker threads, which also run -E, -L and -C (Optional).\n");
+	fprintf(stderr, " -A exec:cmd|unix:path  Run cmd or send a datagram to path on EWBS emergency alarms, may be given twice (Optional).\n");
+	fprintf(stderr, " -Z file.tsz[:threads[:level]]  Archive the capture zlib-compressed in seekable frames, see isdbt-extract (Optional).\n");
+	fprintf(stderr, " -H [addr:]port  Serve the capture over HTTP: / for the multiplex, /service/N for one program (Optional).\n\n");
 	fprintf(stderr, " -s channels.cfg   Scan for channels, store them in a file and exit.\n");
+	fprintf(stderr, " -u survey.csv     Sweep every channel over and over, appending lock time, signal and error ratios to a CSV file.\n");
+	fprintf(stderr, " -d socket         Run as a daemon managing captures through commands on a Unix socket (see control.h).\n");
         fprintf(stderr, " -i                Print ISDB-T device information and exit.\n");
         fprintf(stderr, " -h                Prints this help.\n");
-        fprintf(stderr, "\nTo quit press 'Ctrl+C'.\n");
+        fprintf(stderr, "\nTo quit press 'Ctrl+C'. Send SIGUSR1 to print the pipeline latency percentiles.\n");
 	exit(EXIT_FAILURE);
     }
 
-    while ((opt = getopt(argc, argv, "ijha:o:c:l:s:p:")) != -1) 
+    while ((opt = getopt(argc, argv, "ijhtnMa:o:c:l:s:p:r:R:W:S:w:D:d:H:E:A:C:L:T:u:Z:B:b:")) != -1) 
     {
         switch (opt)
         {
@@ -391,8 +600,12 @@ int main (int argc, char *argv[])
 	case 'j':
             tv_channels = tv_channels_japan;
 	    break;
+	case 'D':
+	    diversity_mode = true;
+	    diversity_adapter = atoi(optarg);
+	    break;
 	case 'a':
-	    adapter_no = atoi(optarg);
+	    adapter_no = adapter = atoi(optarg);
 	    fprintf(stderr, "/dev/dvb/adapter%d selected.\n", adapter_no);
 	    break;
 	case 'o':
@@ -411,10 +624,135 @@ int main (int argc, char *argv[])
 	    scan_mode = true;
 	    strcpy(scan_file, optarg);
 	    break;
+	case 'u':
+	    survey_mode = true;
+	    snprintf(survey_file, sizeof(survey_file), "%s", optarg);
+	    break;
+	case 'd':
+	    daemon_mode = true;
+	    strcpy(control_path, optarg);
+	    break;
+	case 'E':
+	{
+	    char *pids = strchr(optarg, ':'), *end;
+	    es_mode = true;
+	    if (pids)
+		*pids++ = 0;
+	    snprintf(es_prefix, sizeof(es_prefix), "%s", optarg);
+	    while (pids && *pids && es_pid_count < PES_MAX_STREAMS)
+	    {
+		es_pids[es_pid_count++] = strtol(pids, &end, 0);
+		if (end == pids || (*end && *end != ','))
+		    goto manual;
+		pids = *end ? end + 1 : end;
+	    }
+	    break;
+	}
+	case 'L':
+	{
+	    char *full = strchr(optarg, ':');
+	    if (full == NULL)
+		goto manual;
+	    *full++ = 0;
+	    split_mode = true;
+	    snprintf(split_files[LAYER_SPLIT_ONESEG], sizeof(split_files[0]), "%s", optarg);
+	    snprintf(split_files[LAYER_SPLIT_FULLSEG], sizeof(split_files[0]), "%s", full);
+	    break;
+	}
+	case 'Z':
+	{
+	    char *threads = strchr(optarg, ':');
+	    archive_mode = true;
+	    if (threads)
+	    {
+		*threads++ = 0;
+		archive_threads = atoi(threads);
+		if (strchr(threads, ':'))
+		    archive_level = atoi(strchr(threads, ':') + 1);
+	    }
+	    snprintf(archive_file, sizeof(archive_file), "%s", optarg);
+	    break;
+	}
+	case 'T':
+	    pool_mode = true;
+	    pool_workers = atoi(optarg);
+	    break;
+	case 'C':
+	    carousel_mode = true;
+	    snprintf(carousel_dir, sizeof(carousel_dir), "%s", optarg);
+	    break;
+	case 'A':
+	    alarm_mode = true;
+	    if (ewbs_hook_add(&alarm_hook, optarg) < 0)
+	    {
+		fprintf(stderr, "%s\n", alarm_hook.error_msg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'H':
+	    http_mode = true;
+	    snprintf(http_address, sizeof(http_address), "%s", optarg);
+	    break;
 	case 'p':
 	    player_mode = true;
 	    strcpy(player_cmd, optarg);
 	    break;
+	case 't':
+	    timestamp_mode = true;
+	    break;
+	case 'n':
+	    strip_mode = true;
+	    break;
+	case 'w':
+	    if (sscanf(optarg, "%lu:%d", &writeback_mb, &writeback_sync_s) < 1)
+		goto manual;
+	    break;
+	case 'r':
+	    replay_mode = true;
+	    strcpy(replay_file, optarg);
+	    break;
+	case 'R':
+	case 'W':
+	    if (thread_policy_parse(&policy, optarg) < 0)
+	    {
+		fprintf(stderr, "Invalid scheduling policy: %s.\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    if (opt == 'R')
+		capture_set_reader_policy(cap, &policy);
+	    else
+		capture_set_sink_policy(cap, &policy);
+	    break;
+	case 'M':
+	    capture_set_numa_bind(cap, 1);
+	    break;
+	case 'b':
+	    if (capture_set_ring_order(cap, atoi(optarg)) < 0)
+	    {
+		fprintf(stderr, "%s\n", capture_error(cap));
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'B':
+	{
+	    char *fill = strchr(optarg, ':');
+	    batch_us = atof(optarg) * 1000;
+	    if (fill)
+		batch_fill = strtoul(fill + 1, NULL, 10) * 1024;
+	    if (capture_set_read_batch(cap, batch_us, batch_fill) < 0)
+	    {
+		fprintf(stderr, "%s\n", capture_error(cap));
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	}
+	case 'S':
+	    if (capture_publish(cap, optarg) < 0)
+	    {
+		fprintf(stderr, "%s\n", capture_error(cap));
+		exit(EXIT_FAILURE);
+	    }
+	    break;
 	default:
 	    goto manual;
 	}
@@ -422,6 +760,8 @@ int main (int argc, char *argv[])
     
     if (info_mode == true)
     {
+	struct dvb_resource res;
+	dvbres_init(&res);
 	memset(buffer, 0, BUFFER_SIZE);
 	fprintf(stderr, "Devices information:\n");
 	if (dvbres_listdevices(&res, buffer, BUFFER_SIZE) < 0)
@@ -440,36 +780,100 @@ int main (int argc, char *argv[])
 	scan_channels(scan_file);
     }
 
-    if (info_mode == true || scan_mode == true)
+    if (survey_mode == true)
+    {
+	if (survey_band(survey_file, adapter) < 0)
+	    exit(EXIT_FAILURE);
+    }
+
+    if (info_mode == true || scan_mode == true || survey_mode == true)
     {
 	exit(EXIT_SUCCESS);
     }
 
+    if (daemon_mode == true)
+    {
+	struct control ctl;
 
-    fprintf(stderr, "Initializing DVB structures.\n");
-    dvbres_init(&res);
+	// outputs going away must not kill every other capture
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, interrupt);
 
-    fprintf(stderr, "Opening DVB devices.\n");
-    if (dvbres_open(&res, freq, NULL, layer_info) < 0)
-    {
-	fprintf(stderr, "%s\n", res.error_msg);
-	exit(EXIT_FAILURE);
+	capture_free(cap);
+	cap = NULL;
+	if (control_open(&ctl, control_path) < 0)
+	{
+	    fprintf(stderr, "%s: %s\n", ctl.error_msg, control_path);
+	    exit(EXIT_FAILURE);
+	}
+	if (alarm_mode == true)
+	{
+	    if (ewbs_hook_start(&alarm_hook) < 0)
+	    {
+		fprintf(stderr, "%s\n", alarm_hook.error_msg);
+		exit(EXIT_FAILURE);
+	    }
+	    ctl.alarm_hook = &alarm_hook;
+	}
+	fprintf(stderr, "Waiting for commands on %s.\n", control_path);
+
+	while (!quit && control_poll(&ctl, 200) == 0)
+	    ;
+
+	fprintf(stderr, "\nExiting...\n");
+	control_close(&ctl);
+	if (alarm_mode == true)
+	    ewbs_hook_stop(&alarm_hook);
+	exit(EXIT_SUCCESS);
     }
 
-    int i;
-    fprintf(stderr, "Tuning.");
-    for (i = 0; i < MAX_RETRIES && dvbres_signallocked(&res) <= 0; i++)
+
+    if (replay_mode == true)
+    {
+	if (capture_open_replay(cap, replay_file) < 0)
+	{
+	    fprintf(stderr, "%s: %s.\n", capture_error(cap), replay_file);
+	    exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "Replaying %s.\n", replay_file);
+    }
+    else
     {
-	sleep(1);
-	fprintf(stderr, ".");
+	fprintf(stderr, "Opening DVB devices and tuning...\n");
+	if (capture_open_tuner(cap, adapter, freq, layer_info) < 0)
+	{
+	    fprintf(stderr, "%s\n", capture_error(cap));
+	    capture_free(cap);
+	    return -1;
+	}
+	fprintf(stderr, "Signal locked!\n");
     }
-    if (i == MAX_RETRIES)
+
+    if (diversity_mode == true)
     {
-	fprintf(stderr, "\nSignal not locked.\n");
-	dvbres_close(&res);
-	return -1;
+	if (replay_mode == true || timestamp_mode == true || strip_mode == true || http_mode == true || es_mode == true || carousel_mode == true || split_mode == true || pool_mode == true || archive_mode == true || adapter < 0)
+	{
+	    fprintf(stderr, "Diversity (-D) needs -a and a tuner, and does not support -t, -n, -r, -E, -C, -L, -T, -Z or -H.\n");
+	    exit(EXIT_FAILURE);
+	}
+
+	cap2 = capture_new();
+	if (cap2 == NULL || diversity_init(&merge) < 0)
+	{
+	    fprintf(stderr, "Out of memory.\n");
+	    exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "Tuning the second adapter...\n");
+	if (capture_open_tuner(cap2, diversity_adapter, freq, layer_info) < 0)
+	{
+	    fprintf(stderr, "%s\n", capture_error(cap2));
+	    exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "Signal locked on /dev/dvb/adapter%d, merging both tuners.\n", diversity_adapter);
+
+	capture_add_callback(cap, merge_packets, NULL);
+	capture_add_callback(cap2, merge_packets, cap2);
     }
-    fprintf(stderr, "\nSignal locked!\n");
     
     
     if (player_mode == true)
@@ -483,8 +887,7 @@ int main (int argc, char *argv[])
 	fprintf(stderr, "Running: %s\n", cmd);
 	system(cmd);
 	
-	player = fopen(temp_file, "w");
-	if (player == NULL)
+	if (sink_open(&player_sink, temp_file) < 0)
 	{
 	    fprintf(stderr, "Error opening fifo: %s.\n", temp_file);
 	    exit(EXIT_FAILURE);
@@ -493,74 +896,200 @@ int main (int argc, char *argv[])
 	{
 	    fprintf(stderr, "Fifo %s opened.\n", temp_file);
 	}
-
+	add_output(&player_sink);
     }
 
     if (tsoutput_mode == true)
     {
-	ts = fopen(output_file, "w");
-	if (ts == NULL)
+	// pipes get the zero-copy sink, timestamped output goes through stdio
+	if (timestamp_mode == true)
+	    ts = strcmp(output_file, "-") ? fopen(output_file, "w") : stdout;
+	else if (!strcmp(output_file, "-"))
+	    sink_open_fd(&ts_sink, STDOUT_FILENO);
+	else if (sink_open(&ts_sink, output_file) < 0)
+	    ts_sink.fd = -1;
+
+	if (ts == NULL && ts_sink.fd < 0)
 	{
 	    fprintf(stderr, "Error opening file: %s.\n", output_file);
 	    exit(EXIT_FAILURE);
 	}
 	else
 	{
-	    fprintf(stderr, "File %s opened.\n", output_file);
+	    fprintf(stderr, "File %s opened%s.\n", output_file,
+		    ts_sink.type == SINK_PIPE && ts_sink.fd >= 0 && strip_mode == false && diversity_mode == false ? " (pipe, zero-copy)" : "");
+	}
+
+	if (writeback_mb > 0 && ts_sink.fd >= 0)
+	    sink_set_writeback(&ts_sink, writeback_mb * 1024 * 1024, writeback_sync_s * 1000);
+
+	if (timestamp_mode == true)
+	    capture_add_m2ts(cap, ts);
+	else if (strip_mode == true)
+	{
+	    nullstrip_init(&strip, &ts_sink);
+	    capture_add_callback(cap, strip_nulls, NULL);
 	}
+	else
+	    add_output(&ts_sink);
     }
 
+    if (alarm_mode == true)
+    {
+	char source[32];
+	if (replay_mode == true)
+	    snprintf(source, sizeof(source), "replay");
+	else
+	    snprintf(source, sizeof(source), "adapter%d", capture_resource(cap)->adapter);
+	if (ewbs_hook_start(&alarm_hook) < 0)
+	{
+	    fprintf(stderr, "%s\n", alarm_hook.error_msg);
+	    exit(EXIT_FAILURE);
+	}
+	ewbs_init(&ewbs_monitor, source, &alarm_hook);
+	capture_set_reader_tap(cap, ewbs_feed, &ewbs_monitor);
+    }
 
-    int power = dvbres_getsignalstrength(&res);
-    if (power != 0)
-	fprintf(stderr, "Signal power = %d\n", power);
+    if (pool_mode == true)
+    {
+	if (pid_pool_init(&pool, pool_workers) < 0)
+	{
+	    fprintf(stderr, "%s\n", pool.error_msg);
+	    exit(EXIT_FAILURE);
+	}
+	tscheck_init(&check);
+	pid_pool_add_analyzer(&pool, tscheck_packet, &check);
+	capture_add_callback(cap, pid_pool_feed, &pool);
+    }
 
-    int snr = dvbres_getsignalquality(&res);
-    if (snr != 0)
-	fprintf(stderr, "Signal quality = %d\n", snr);
+    if (es_mode == true)
+    {
+	pes_files_init(&es_files, es_prefix);
+	pes_demux_init(&es_demux, es_pids, es_pid_count, pes_files_cb, &es_files);
+	add_analysis(extract_es);
+    }
 
-    // starting output thread
-    keep_reading = 1;
-    pthread_create(&output_thread_id, NULL, output_thread, NULL);
+    if (split_mode == true)
+    {
+	int c;
+	if (layer_info != LAYER_FULL)
+	{
+	    fprintf(stderr, "The layer split (-L) needs all the layers (-l 0).\n");
+	    exit(EXIT_FAILURE);
+	}
+	for (c = 0; c < LAYER_SPLIT_CLASSES; c++)
+	{
+	    if (split_files[c][0] && sink_open(&split_sinks[c], split_files[c]) < 0)
+	    {
+		fprintf(stderr, "Error opening file: %s.\n", split_files[c]);
+		exit(EXIT_FAILURE);
+	    }
+	}
+	layer_split_init(&split, split_sinks[LAYER_SPLIT_ONESEG].fd >= 0 ? &split_sinks[LAYER_SPLIT_ONESEG] : NULL,
+			 split_sinks[LAYER_SPLIT_FULLSEG].fd >= 0 ? &split_sinks[LAYER_SPLIT_FULLSEG] : NULL);
+	add_analysis(split_layers);
+    }
 
-    while (1) 
+    if (carousel_mode == true)
     {
-    try_again_read:
-        if (ring_buffer_count_bytes(&output_buffer) >= BUFFER_SIZE)
-        {
-	    pthread_mutex_lock(&output_mutex);
-	    addr = ring_buffer_read_address(&output_buffer);
-	    memcpy(buffer, addr, BUFFER_SIZE);
-	    ring_buffer_read_advance(&output_buffer, BUFFER_SIZE);
-	    pthread_cond_signal(&output_cond);
-	    pthread_mutex_unlock(&output_mutex);
+	if (mkdir(carousel_dir, 0755) < 0 && errno != EEXIST)
+	{
+	    fprintf(stderr, "Error creating directory: %s.\n", carousel_dir);
+	    exit(EXIT_FAILURE);
 	}
-	else
-	{	    
-	    pthread_mutex_lock(&output_mutex);
-	    pthread_cond_wait(&output_cond, &output_mutex);
-	    pthread_mutex_unlock(&output_mutex);
-	    goto try_again_read;
+	dsmcc_init(&carousel, carousel_dir);
+	add_analysis(extract_carousels);
+    }
+
+    if (pool_mode == true && pid_pool_start(&pool) < 0)
+    {
+	fprintf(stderr, "%s\n", pool.error_msg);
+	exit(EXIT_FAILURE);
+    }
+
+    struct capture_stats stats;
+    capture_get_stats(cap, &stats);
+    if (stats.signal_strength > 0)
+	fprintf(stderr, "Signal power = %d\n", stats.signal_strength);
+    if (stats.signal_quality > 0)
+	fprintf(stderr, "Signal quality = %d\n", stats.signal_quality);
+
+    if (capture_start(cap) < 0)
+    {
+	fprintf(stderr, "%s\n", capture_error(cap));
+	exit(EXIT_FAILURE);
+    }
+    capture_report(cap);
+
+    if (http_mode == true)
+    {
+	if (http_start(&http, cap, http_address) < 0)
+	{
+	    fprintf(stderr, "%s: %s\n", http.error_msg, http_address);
+	    exit(EXIT_FAILURE);
 	}
+	fprintf(stderr, "Serving HTTP on %s.\n", http_address);
+    }
 
-	if (tsoutput_mode == true)
-	    bytes_written = fwrite(buffer, 1, BUFFER_SIZE, ts);
+    if (archive_mode == true)
+    {
+	if (archive_start(&archive, cap, archive_file, archive_threads, archive_level) < 0)
+	{
+	    fprintf(stderr, "%s: %s\n", archive.error_msg, archive_file);
+	    exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "Archiving to %s with %d compression threads.\n", archive_file, archive_threads);
+    }
 
-	if (player_mode == true)
-	    bytes_written = fwrite(buffer, 1, BUFFER_SIZE, player);
+    if (cap2 && capture_start(cap2) < 0)
+    {
+	fprintf(stderr, "%s\n", capture_error(cap2));
+	exit(EXIT_FAILURE);
+    }
 
-	if (bytes_written != BUFFER_SIZE)
-	    fprintf(stderr, "bytes_written = %d != bytes_read = %d\n", bytes_written, BUFFER_SIZE);
+    uint64_t ring_full = 0;
+    uint64_t dvr_reads = 0, dvr_wakeups = 0;
+    uint64_t last_ns = m2ts_now_ns(), now_ns, elapsed_ns;
+    int i = 0;
+    while (!quit && capture_wait(cap, 200) == 0)
+    {
+	if (print_latency)
+	{
+	    print_latency = 0;
+	    fprintf(stderr, "\n");
+	    capture_print_latency(cap, stderr);
+	}
 
 	// small trick to not call the api too much
-	if (!(i++ % 100))
+	if (++i % 5)
+	    continue;
+
+	capture_get_stats(cap, &stats);
+	if (stats.ring_full > ring_full)
 	{
-	    power = dvbres_getsignalstrength(&res);
-	    fprintf(stderr, "Signal power = %d%%\r", power);
-	    
+	    fprintf(stderr, "Buffer full, nich gut...\n");
+	    ring_full = stats.ring_full;
 	}
 
+	if (replay_mode == true)
+	    continue;
+
+	// printed about once a second: capture_wait() may return early, the
+	// rates are over the time actually elapsed
+	now_ns = m2ts_now_ns();
+	elapsed_ns = now_ns > last_ns ? now_ns - last_ns : 1;
+	fprintf(stderr, "Signal power = %d%%  reads/s = %llu  wakeups/s = %llu", stats.signal_strength,
+		(unsigned long long) ((stats.dvr_reads - dvr_reads) * 1000000000ULL / elapsed_ns),
+		(unsigned long long) ((stats.dvr_wakeups - dvr_wakeups) * 1000000000ULL / elapsed_ns));
+	last_ns = now_ns;
+	dvr_reads = stats.dvr_reads;
+	dvr_wakeups = stats.dvr_wakeups;
+	if (stats.dvr_lost)
+	    fprintf(stderr, "  DVR buffers lost = %u", stats.dvr_lost);
+	fprintf(stderr, "   \r");
     }
 
+    finish(0);
+
     return EXIT_SUCCESS;
 }
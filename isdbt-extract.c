@@ -0,0 +1,165 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American and Japanese ISDB-T.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+// isdbt-extract: lists the frames of a -Z archive, or decodes the packets of
+// a time range back to a TS file, reading only the frames of that range.
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "archive.h"
+
+// seconds since the epoch, or "+seconds" from the start of the archive
+int parse_time(const char *arg, uint64_t start_ns, uint64_t *t)
+{
+    char *end;
+    double s = strtod(arg[0] == '+' ? arg + 1 : arg, &end);
+
+    if (*end || s < 0)
+	return -1;
+    *t = (uint64_t) (s * 1e9) + (arg[0] == '+' ? start_ns : 0);
+    return 0;
+}
+
+int list_frames(FILE *fp)
+{
+    struct archive_index *index;
+    char when[64];
+    time_t t;
+    long count, i;
+
+    count = archive_read_index(fp, &index);
+    if (count < 0)
+	return -1;
+
+    printf("frame   offset         first packet  packets  compressed  start (UTC)                 seconds\n");
+    for (i = 0; i < count; i++)
+    {
+	t = index[i].start_ns / 1000000000ULL;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+	printf("%-7ld %-14llu %-13llu %-8u %-11u %s.%03llu  %.3f\n", i,
+	       (unsigned long long) index[i].offset, (unsigned long long) index[i].first_packet,
+	       index[i].packets, index[i].size, when,
+	       (unsigned long long) (index[i].start_ns / 1000000 % 1000),
+	       (index[i].end_ns - index[i].start_ns) / 1e9);
+    }
+    free(index);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct archive_index *index = NULL;
+    const char *from_arg = NULL, *to_arg = NULL, *output = "-";
+    uint64_t start_ns = 0, from_ns = 0, to_ns = UINT64_MAX;
+    int list_mode = 0;
+    char msg[256];
+    FILE *fp, *out;
+    long count;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "lhf:t:o:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'l':
+	    list_mode = 1;
+	    break;
+	case 'f':
+	    from_arg = optarg;
+	    break;
+	case 't':
+	    to_arg = optarg;
+	    break;
+	case 'o':
+	    output = optarg;
+	    break;
+	default:
+	    goto manual;
+	}
+    }
+
+    if (optind != argc - 1)
+    {
+    manual:
+	fprintf(stderr, "Usage: %s [-l] [-f from] [-t to] [-o output.ts] archive.tsz\n", argv[0]);
+	fprintf(stderr, "\nOptions:\n");
+	fprintf(stderr, " -l            List the frames of the archive and exit.\n");
+	fprintf(stderr, " -f time       Start of the range, in seconds since the epoch or \"+seconds\" from the start (Optional).\n");
+	fprintf(stderr, " -t time       End of the range, same format as -f (Optional).\n");
+	fprintf(stderr, " -o filename   Output TS filename, stdout by default (Optional).\n");
+	exit(EXIT_FAILURE);
+    }
+
+    fp = fopen(argv[optind], "rb");
+    if (fp == NULL)
+    {
+	fprintf(stderr, "Error opening file: %s.\n", argv[optind]);
+	exit(EXIT_FAILURE);
+    }
+
+    if (list_mode)
+    {
+	if (list_frames(fp) < 0)
+	{
+	    fprintf(stderr, "Not an archive: %s.\n", argv[optind]);
+	    exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+    }
+
+    // relative times count from the first frame
+    count = archive_read_index(fp, &index);
+    if (count < 0)
+    {
+	fprintf(stderr, "Not an archive: %s.\n", argv[optind]);
+	exit(EXIT_FAILURE);
+    }
+    if (count > 0)
+	start_ns = index[0].start_ns;
+    free(index);
+
+    if ((from_arg && parse_time(from_arg, start_ns, &from_ns) < 0) ||
+	(to_arg && parse_time(to_arg, start_ns, &to_ns) < 0))
+	goto manual;
+
+    out = strcmp(output, "-") ? fopen(output, "wb") : stdout;
+    if (out == NULL)
+    {
+	fprintf(stderr, "Error opening file: %s.\n", output);
+	exit(EXIT_FAILURE);
+    }
+
+    count = archive_extract(fp, from_ns, to_ns, out, msg, sizeof(msg));
+    if (count < 0)
+    {
+	fprintf(stderr, "%s\n", msg);
+	exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "%ld packets extracted.\n", count);
+
+    fclose(out);
+    fclose(fp);
+    return EXIT_SUCCESS;
+}
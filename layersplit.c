@@ -0,0 +1,296 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "layersplit.h"
+#include "m2ts.h"
+#include "nullstrip.h"
+
+#define NIT_ACTUAL 0x40
+
+#define SERVICE_LIST_DESCRIPTOR       0x41
+#define PARTIAL_RECEPTION_DESCRIPTOR  0xFB
+
+#define SERVICE_TYPE_ONESEG 0xC0
+
+// SI of the multiplex, shared by both classes
+#define SI_LAST_PID 0x2F
+
+void layer_split_init(struct layer_split *ls, struct sink *oneseg, struct sink *fullseg)
+{
+    memset(ls, 0, sizeof(struct layer_split));
+    ls->out[LAYER_SPLIT_ONESEG].sink = oneseg;
+    ls->out[LAYER_SPLIT_FULLSEG].sink = fullseg;
+    psi_assembler_init(&ls->pat, PAT_PID);
+    psi_assembler_init(&ls->nit, NIT_PID);
+}
+
+static int is_oneseg(struct layer_split *ls, int program_number)
+{
+    int i;
+
+    for (i = 0; i < ls->oneseg_count; i++)
+        if (ls->oneseg[i] == program_number)
+            return 1;
+    // service type bits of the service id, while there is no NIT
+    return !ls->nit_seen && (program_number & 0x18) == 0x18;
+}
+
+// the classes of every PID, after a change of PAT, PMT or NIT
+static void classify(struct layer_split *ls)
+{
+    struct layer_split_program *prog;
+    int i, j, bit;
+
+    memset(ls->classes, 0, sizeof(ls->classes));
+    for (i = 1; i <= SI_LAST_PID; i++)
+        ls->classes[i] = 1 << LAYER_SPLIT_ONESEG | 1 << LAYER_SPLIT_FULLSEG;
+
+    for (i = 0; i < ls->program_count; i++)
+    {
+        prog = &ls->programs[i];
+        prog->oneseg = is_oneseg(ls, prog->program_number);
+        bit = 1 << (prog->oneseg ? LAYER_SPLIT_ONESEG : LAYER_SPLIT_FULLSEG);
+        ls->classes[prog->pmt_pid] |= bit;
+        for (j = 0; j < prog->pid_count; j++)
+            ls->classes[prog->pids[j]] |= bit;
+    }
+    ls->classes[NULL_PID] = 0;
+}
+
+static void pat_section(void *opaque, const unsigned char *section, int len)
+{
+    struct layer_split *ls = opaque;
+    struct layer_split_program *prog;
+    struct psi_pat pat;
+    int i, j;
+
+    if (psi_parse_pat(section, len, &pat) < 0)
+        return;
+    ls->transport_stream_id = pat.transport_stream_id;
+    ls->pat_version = pat.version;
+
+    for (i = 0; i < pat.program_count; i++)
+    {
+        // program 0 points at the NIT
+        if (pat.programs[i].program_number == 0)
+            continue;
+        for (j = 0; j < ls->program_count && ls->programs[j].program_number != pat.programs[i].program_number; j++)
+            ;
+        prog = &ls->programs[j];
+        if (j < ls->program_count && prog->pmt_pid == pat.programs[i].pid)
+            continue;
+        if (j == ls->program_count)
+        {
+            if (ls->program_count == PSI_MAX_PROGRAMS)
+                continue;
+            prog->pmt = malloc(sizeof(struct psi_assembler));
+            if (prog->pmt == NULL)
+                continue;
+            ls->program_count++;
+        }
+
+        prog->program_number = pat.programs[i].program_number;
+        prog->pmt_pid = pat.programs[i].pid;
+        prog->pid_count = 0;
+        psi_assembler_init(prog->pmt, prog->pmt_pid);
+    }
+    classify(ls);
+}
+
+static void pmt_section(void *opaque, const unsigned char *section, int len)
+{
+    struct layer_split *ls = opaque;
+    struct layer_split_program *prog = NULL;
+    struct psi_pmt pmt;
+    int i;
+
+    if (psi_parse_pmt(section, len, &pmt) < 0)
+        return;
+    for (i = 0; i < ls->program_count && prog == NULL; i++)
+        if (ls->programs[i].program_number == pmt.program_number)
+            prog = &ls->programs[i];
+    if (prog == NULL)
+        return;
+
+    prog->pid_count = 0;
+    prog->pids[prog->pid_count++] = pmt.pcr_pid;
+    for (i = 0; i < pmt.stream_count; i++)
+        prog->pids[prog->pid_count++] = pmt.streams[i].pid;
+    classify(ls);
+}
+
+static void add_oneseg(struct layer_split *ls, int service_id)
+{
+    int i;
+
+    for (i = 0; i < ls->oneseg_count && ls->oneseg[i] != service_id; i++)
+        ;
+    if (i == ls->oneseg_count && ls->oneseg_count < PSI_MAX_PROGRAMS)
+        ls->oneseg[ls->oneseg_count++] = service_id;
+}
+
+// the one-seg services of the transport stream loop of the actual NIT
+static void nit_section(void *opaque, const unsigned char *s, int len)
+{
+    struct layer_split *ls = opaque;
+    const unsigned char *d;
+    int pos, end, loop_len, i;
+
+    if (s[0] != NIT_ACTUAL || len < 16 || !(s[5] & 0x01))
+        return;
+
+    // every section of the NIT is sent again: its first one starts over
+    if (s[6] == 0)
+        ls->oneseg_count = 0;
+
+    pos = 10 + ((s[8] & 0x0F) << 8 | s[9]); // network descriptors
+    if (pos + 2 > len - 4)
+        return;
+    end = pos + 2 + ((s[pos] & 0x0F) << 8 | s[pos + 1]);
+    if (end > len - 4)
+        return;
+
+    for (pos += 2; pos + 6 <= end; pos += 6 + loop_len)
+    {
+        loop_len = (s[pos + 4] & 0x0F) << 8 | s[pos + 5];
+        if (pos + 6 + loop_len > end)
+            break;
+
+        d = psi_find_descriptor(s + pos + 6, loop_len, PARTIAL_RECEPTION_DESCRIPTOR);
+        for (i = 0; d && i + 2 <= d[1]; i += 2)
+            add_oneseg(ls, d[2 + i] << 8 | d[3 + i]);
+
+        d = psi_find_descriptor(s + pos + 6, loop_len, SERVICE_LIST_DESCRIPTOR);
+        for (i = 0; d && i + 3 <= d[1]; i += 3)
+            if (d[4 + i] == SERVICE_TYPE_ONESEG)
+                add_oneseg(ls, d[2 + i] << 8 | d[3 + i]);
+    }
+
+    ls->nit_seen = 1;
+    classify(ls);
+}
+
+static int out_flush(struct layer_split *ls, struct layer_split_out *out)
+{
+    int rc = 0;
+
+    if (out->n > 0 && sink_writev(out->sink, out->iov, out->n) < 0)
+    {
+        ls->errors++;
+        rc = -1;
+    }
+    out->n = 0;
+    out->pat_count = 0;
+    return rc;
+}
+
+static int out_add(struct layer_split *ls, struct layer_split_out *out, const unsigned char *p)
+{
+    struct iovec *last = out->n > 0 ? &out->iov[out->n - 1] : NULL;
+
+    out->packets++;
+    // extend the previous span when contiguous
+    if (last && (const unsigned char *) last->iov_base + last->iov_len == p)
+    {
+        last->iov_len += TS_PACKET_SIZE;
+        return 0;
+    }
+    if (out->n == LAYER_SPLIT_IOV && out_flush(ls, out) < 0)
+        return -1;
+    out->iov[out->n].iov_base = (void *) p;
+    out->iov[out->n].iov_len = TS_PACKET_SIZE;
+    out->n++;
+    return 0;
+}
+
+// the PAT of a class: its programs only
+static int out_pat(struct layer_split *ls, int class)
+{
+    struct layer_split_out *out = &ls->out[class];
+    int programs[PSI_MAX_PROGRAMS][2];
+    int i, count = 0;
+
+    // flushed first, so no PAT buffer is reused while still queued
+    if ((out->pat_count == LAYER_SPLIT_PATS || out->n == LAYER_SPLIT_IOV) && out_flush(ls, out) < 0)
+        return -1;
+
+    for (i = 0; i < ls->program_count; i++)
+    {
+        if (ls->programs[i].oneseg != (class == LAYER_SPLIT_ONESEG))
+            continue;
+        programs[count][0] = ls->programs[i].program_number;
+        programs[count][1] = ls->programs[i].pmt_pid;
+        count++;
+    }
+    psi_make_pat(out->pats[out->pat_count], ls->transport_stream_id, ls->pat_version,
+                 (const int (*)[2]) programs, count, out->pat_cc++);
+    return out_add(ls, out, out->pats[out->pat_count++]);
+}
+
+int layer_split_feed(struct layer_split *ls, const unsigned char *packets, int count)
+{
+    const unsigned char *p;
+    int i, j, c, pid, rc = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        p = packets + i * TS_PACKET_SIZE;
+        pid = TS_PID(p);
+
+        if (pid == PAT_PID)
+        {
+            psi_assembler_push(&ls->pat, p, pat_section, ls);
+            // one rewritten PAT for each PAT sent
+            if (ls->program_count > 0 && p[1] & 0x40)
+                for (c = 0; c < LAYER_SPLIT_CLASSES; c++)
+                    if (ls->out[c].sink && out_pat(ls, c) < 0)
+                        rc = -1;
+            continue;
+        }
+        if (pid == NIT_PID)
+            psi_assembler_push(&ls->nit, p, nit_section, ls);
+        else if (ls->classes[pid])
+            for (j = 0; j < ls->program_count; j++)
+                if (ls->programs[j].pmt_pid == pid)
+                    psi_assembler_push(ls->programs[j].pmt, p, pmt_section, ls);
+
+        for (c = 0; c < LAYER_SPLIT_CLASSES; c++)
+            if (ls->out[c].sink && ls->classes[pid] & 1 << c && out_add(ls, &ls->out[c], p) < 0)
+                rc = -1;
+    }
+
+    for (c = 0; c < LAYER_SPLIT_CLASSES; c++)
+        if (ls->out[c].sink && out_flush(ls, &ls->out[c]) < 0)
+            rc = -1;
+    return rc;
+}
+
+void layer_split_free(struct layer_split *ls)
+{
+    int i;
+
+    for (i = 0; i < ls->program_count; i++)
+        free(ls->programs[i].pmt);
+    ls->program_count = 0;
+}
@@ -0,0 +1,105 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _LAYERSPLIT_H_
+#define _LAYERSPLIT_H_
+
+// One-seg / full-seg split of a LAYER_FULL capture, in one pass: the
+// services of the partial_reception_descriptor of the NIT (layer A, the
+// central segment) are the one-seg ones, the other services the full-seg
+// ones. Each class has its own output with the PMTs, streams and PCRs of
+// its programs, the SI of the multiplex (PIDs 0x01-0x2F: NIT, SDT, EIT,
+// TOT...) and a PAT rewritten to list its programs only.
+//
+// The DVB API hands out the enabled layers merged into one TS, without the
+// layer of each packet from the TMCC, so classes come from the NIT. Until
+// the NIT is seen, the service type bits of the service id stand in (ARIB
+// TR-B14: 0x18 set for partial reception services), as do services listed
+// with type 0xC0 in its service_list_descriptor.
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "psi.h"
+#include "sink.h"
+
+#define LAYER_SPLIT_ONESEG  0
+#define LAYER_SPLIT_FULLSEG 1
+#define LAYER_SPLIT_CLASSES 2
+
+#define LAYER_SPLIT_IOV     64
+#define LAYER_SPLIT_PATS    8
+
+#define NIT_PID 0x0010
+
+// packets of one class staged for a single writev()
+struct layer_split_out {
+    struct sink *sink;
+    struct iovec iov[LAYER_SPLIT_IOV];
+    int n;
+    unsigned char pats[LAYER_SPLIT_PATS][188];
+    int pat_count;
+    int pat_cc;
+
+    uint64_t packets;
+};
+
+struct layer_split_program {
+    int program_number;
+    int pmt_pid;
+    int oneseg;
+    struct psi_assembler *pmt;
+
+    // PCR and stream PIDs, from the PMT
+    int pids[PSI_MAX_STREAMS + 1];
+    int pid_count;
+};
+
+struct layer_split {
+    struct layer_split_out out[LAYER_SPLIT_CLASSES];
+
+    struct psi_assembler pat, nit;
+    int transport_stream_id;
+    int pat_version;
+    int nit_seen;
+
+    struct layer_split_program programs[PSI_MAX_PROGRAMS];
+    int program_count;
+
+    // one-seg services from the NIT
+    int oneseg[PSI_MAX_PROGRAMS];
+    int oneseg_count;
+
+    // bit 0: one-seg, bit 1: full-seg
+    unsigned char classes[8192];
+
+    uint64_t errors;
+};
+
+
+// either sink may be NULL
+void layer_split_init(struct layer_split *ls, struct sink *oneseg, struct sink *fullseg);
+
+// routes count packets to the outputs (returns -1 if a write failed)
+int layer_split_feed(struct layer_split *ls, const unsigned char *packets, int count);
+
+void layer_split_free(struct layer_split *ls);
+
+#endif /* _LAYERSPLIT_H_ */
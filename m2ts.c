@@ -0,0 +1,273 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#include "m2ts.h"
+
+uint64_t m2ts_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint32_t ns_to_ats(uint64_t ns)
+{
+    return (uint32_t) (ns * 27 / 1000) & M2TS_ATS_MASK;
+}
+
+int arrival_log_create(struct arrival_log *log, unsigned long ring_bytes)
+{
+    memset(log, 0, sizeof(struct arrival_log));
+
+    // one slot per packet the ring can hold, plus one for a partial packet
+    // on each side of the read cursor
+    log->count = ring_bytes / TS_PACKET_SIZE + 2;
+    log->stamps = calloc(log->count, sizeof(uint32_t));
+    if (log->stamps == NULL)
+        return -1;
+
+    return 0;
+}
+
+void arrival_log_free(struct arrival_log *log)
+{
+    free(log->stamps);
+    log->stamps = NULL;
+}
+
+void arrival_log_stamp(struct arrival_log *log, uint64_t now_ns, unsigned long bytes)
+{
+    unsigned long n = bytes / TS_PACKET_SIZE;
+    unsigned long k;
+
+    if (log->last_ns == 0 || now_ns < log->last_ns)
+        log->last_ns = now_ns;
+
+    // the block was delivered somewhere between the previous read and this
+    // one: spread its packets evenly over that interval
+    uint64_t span = now_ns - log->last_ns;
+    for (k = 1; k <= n; k++)
+    {
+        uint64_t t = log->last_ns + span * k / n;
+        log->stamps[log->packets % log->count] = ns_to_ats(t);
+        log->packets++;
+    }
+
+    log->last_ns = now_ns;
+}
+
+uint32_t arrival_log_get(struct arrival_log *log, uint64_t packet)
+{
+    return log->stamps[packet % log->count];
+}
+
+void m2ts_writer_init(struct m2ts_writer *w, FILE *fp)
+{
+    memset(w, 0, sizeof(struct m2ts_writer));
+    w->fp = fp;
+}
+
+static int m2ts_put_packet(struct m2ts_writer *w, struct arrival_log *log, const unsigned char *packet)
+{
+    uint32_t ats = arrival_log_get(log, w->packets);
+    unsigned char header[4];
+
+    header[0] = (ats >> 24) & 0x3F; // copy permission bits left at zero
+    header[1] = (ats >> 16) & 0xFF;
+    header[2] = (ats >> 8) & 0xFF;
+    header[3] = ats & 0xFF;
+
+    w->packets++;
+
+    if (fwrite(header, 1, sizeof(header), w->fp) != sizeof(header))
+        return -1;
+    if (fwrite(packet, 1, TS_PACKET_SIZE, w->fp) != TS_PACKET_SIZE)
+        return -1;
+    return 0;
+}
+
+size_t m2ts_write(struct m2ts_writer *w, struct arrival_log *log, const unsigned char *data, size_t len)
+{
+    size_t pos = 0;
+
+    // finish a packet split across two reads from the ring
+    if (w->partial_len > 0)
+    {
+        size_t missing = TS_PACKET_SIZE - w->partial_len;
+        if (missing > len)
+            missing = len;
+        memcpy(w->partial + w->partial_len, data, missing);
+        w->partial_len += missing;
+        pos += missing;
+
+        if (w->partial_len < TS_PACKET_SIZE)
+            return pos;
+
+        w->partial_len = 0;
+        if (m2ts_put_packet(w, log, w->partial) < 0)
+            return 0;
+    }
+
+    while (len - pos >= TS_PACKET_SIZE)
+    {
+        if (m2ts_put_packet(w, log, data + pos) < 0)
+            return pos;
+        pos += TS_PACKET_SIZE;
+    }
+
+    if (pos < len)
+    {
+        memcpy(w->partial, data + pos, len - pos);
+        w->partial_len = len - pos;
+        pos = len;
+    }
+
+    return pos;
+}
+
+int m2ts_reader_open(struct m2ts_reader *r, const char *file)
+{
+    memset(r, 0, sizeof(struct m2ts_reader));
+
+    r->fp = fopen(file, "r");
+    if (r->fp == NULL)
+        return -1;
+
+    // tell 192-byte records from plain TS by where the sync bytes are
+    unsigned char probe[M2TS_PACKET_SIZE + 5];
+    size_t len = fread(probe, 1, sizeof(probe), r->fp);
+    if (len >= 5 && probe[4] == TS_SYNC_BYTE && (len < sizeof(probe) || probe[M2TS_PACKET_SIZE + 4] == TS_SYNC_BYTE))
+        r->timestamped = 1;
+    else if (len == 0 || probe[0] != TS_SYNC_BYTE)
+    {
+        fclose(r->fp);
+        r->fp = NULL;
+        return -1;
+    }
+    rewind(r->fp);
+
+    nullexpand_init(&r->expand);
+    return 0;
+}
+
+// reads the next record into r->pending and computes when it is due
+static int m2ts_reader_load(struct m2ts_reader *r)
+{
+    if (!r->timestamped)
+    {
+        // plain TS is not paced: every packet is due at once
+        if (fread(r->pending + 4, 1, TS_PACKET_SIZE, r->fp) != TS_PACKET_SIZE)
+            return ferror(r->fp) ? -1 : 0;
+        if (r->pending[4] != TS_SYNC_BYTE)
+            return -1;
+        r->pending_due_ns = 0;
+        r->has_pending = 1;
+        return 1;
+    }
+
+    if (fread(r->pending, 1, M2TS_PACKET_SIZE, r->fp) != M2TS_PACKET_SIZE)
+        return ferror(r->fp) ? -1 : 0;
+
+    if (r->pending[4] != TS_SYNC_BYTE)
+        return -1;
+
+    uint32_t ats = ((uint32_t) r->pending[0] << 24 | (uint32_t) r->pending[1] << 16 |
+                    (uint32_t) r->pending[2] << 8 | r->pending[3]) & M2TS_ATS_MASK;
+
+    if (!r->started)
+    {
+        r->started = 1;
+        r->clock = 0;
+        r->start_ns = m2ts_now_ns();
+    }
+    else
+    {
+        // the 30 bit counter wraps every ~39.7s
+        r->clock += (ats - r->last_ats) & M2TS_ATS_MASK;
+    }
+    r->last_ats = ats;
+
+    r->pending_due_ns = r->start_ns + r->clock * 1000 / 27;
+    r->has_pending = 1;
+
+    return 1;
+}
+
+int m2ts_reader_read(struct m2ts_reader *r, unsigned char *buffer, int max_packets)
+{
+    int n = 0;
+    int rc;
+
+    while (n < max_packets)
+    {
+        // null packets of a stripped run come first
+        if (nullexpand_next(&r->expand, buffer + n * TS_PACKET_SIZE))
+        {
+            n++;
+            continue;
+        }
+
+        if (!r->has_pending)
+        {
+            rc = m2ts_reader_load(r);
+            if (rc < 0)
+                return -1;
+            if (rc == 0)
+                break;
+        }
+
+        uint64_t now = m2ts_now_ns();
+        if (r->pending_due_ns > now)
+        {
+            // hand over what is already due, keeping the original bursts
+            if (n > 0)
+                break;
+
+            struct timespec due;
+            due.tv_sec = r->pending_due_ns / 1000000000ULL;
+            due.tv_nsec = r->pending_due_ns % 1000000000ULL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+                ;
+        }
+
+        r->has_pending = 0;
+        if (nullexpand_feed(&r->expand, r->pending + 4))
+            continue;
+
+        memcpy(buffer + n * TS_PACKET_SIZE, r->pending + 4, TS_PACKET_SIZE);
+        n++;
+    }
+
+    return n * TS_PACKET_SIZE;
+}
+
+void m2ts_reader_close(struct m2ts_reader *r)
+{
+    if (r->fp)
+        fclose(r->fp);
+    r->fp = NULL;
+}
@@ -0,0 +1,123 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _M2TS_H_
+#define _M2TS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nullstrip.h"
+
+#define TS_PACKET_SIZE   188
+#define TS_SYNC_BYTE     0x47
+
+// 192-byte packets: 4-byte arrival timestamp followed by the TS packet
+#define M2TS_PACKET_SIZE 192
+
+// arrival timestamps count a 27MHz clock in the lower 30 bits (as in M2TS)
+#define M2TS_CLOCK_HZ    27000000ULL
+#define M2TS_ATS_MASK    0x3FFFFFFF
+
+
+// arrival time of every packet that went through the ring, indexed by
+// packet sequence number (slots are reused once the ring wraps)
+struct arrival_log {
+    uint32_t *stamps;
+    unsigned long count;
+
+    // packets stamped so far
+    uint64_t packets;
+
+    // time of the previous stamped block, in ns
+    uint64_t last_ns;
+};
+
+// writes TS data from the ring as 192-byte timestamped packets
+struct m2ts_writer {
+    FILE *fp;
+
+    // packets written so far (matches arrival_log sequence numbers)
+    uint64_t packets;
+
+    unsigned char partial[TS_PACKET_SIZE];
+    int partial_len;
+};
+
+// reads a 192-byte timestamped capture, releasing packets at their original
+// arrival times, or a plain (possibly null-stripped) TS file as fast as it
+// is consumed
+struct m2ts_reader {
+    FILE *fp;
+    int timestamped;
+
+    // restores the null packet runs of stripped recordings
+    struct nullexpand expand;
+
+    int started;
+    uint32_t last_ats;
+
+    // 27MHz ticks elapsed since the first packet
+    uint64_t clock;
+
+    // monotonic time at which the first packet was released, in ns
+    uint64_t start_ns;
+
+    // next record, read ahead but not yet due
+    unsigned char pending[M2TS_PACKET_SIZE];
+    int has_pending;
+    uint64_t pending_due_ns;
+};
+
+
+// CLOCK_MONOTONIC in ns
+uint64_t m2ts_now_ns(void);
+
+// allocates a log large enough for a ring of ring_bytes (returns -1 on error)
+int arrival_log_create(struct arrival_log *log, unsigned long ring_bytes);
+
+void arrival_log_free(struct arrival_log *log);
+
+// stamps a block of bytes (whole packets) read at now_ns; packet times are
+// interpolated between the previous block and this one
+void arrival_log_stamp(struct arrival_log *log, uint64_t now_ns, unsigned long bytes);
+
+// returns the 30 bit arrival timestamp of the given packet
+uint32_t arrival_log_get(struct arrival_log *log, uint64_t packet);
+
+
+void m2ts_writer_init(struct m2ts_writer *w, FILE *fp);
+
+// writes len bytes of TS as timestamped packets, returns the number of TS
+// bytes consumed (len on success)
+size_t m2ts_write(struct m2ts_writer *w, struct arrival_log *log, const unsigned char *data, size_t len);
+
+
+// opens a timestamped capture or a TS file for replay (returns -1 on error)
+int m2ts_reader_open(struct m2ts_reader *r, const char *file);
+
+// reads up to max_packets TS packets (188 bytes each, timestamps stripped,
+// null runs expanded), sleeping until the first of them is due. Returns the number of bytes read,
+// 0 at end of file and -1 on error.
+int m2ts_reader_read(struct m2ts_reader *r, unsigned char *buffer, int max_packets);
+
+void m2ts_reader_close(struct m2ts_reader *r);
+
+#endif /* _M2TS_H_ */
@@ -0,0 +1,287 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "nullstrip.h"
+#include "m2ts.h"
+
+#define MARKER_MAGIC     "ISDBNUL1"
+#define MARKER_MAGIC_LEN 8
+
+static int is_null(const unsigned char *p)
+{
+    return (p[1] & 0x1F) == 0x1F && p[2] == 0xFF;
+}
+
+static int is_marker(const unsigned char *p)
+{
+    return is_null(p) && !memcmp(p + 4, MARKER_MAGIC, MARKER_MAGIC_LEN);
+}
+
+// payload made of a single repeated byte (no adaptation field)
+static int is_uniform(const unsigned char *p)
+{
+    int i;
+
+    if ((p[3] & 0x30) != 0x10)
+        return 0;
+    for (i = 5; i < TS_PACKET_SIZE; i++)
+        if (p[i] != p[4])
+            return 0;
+    return 1;
+}
+
+static void make_marker(unsigned char *m, uint32_t count, unsigned char byte1, unsigned char byte3,
+                        int flags, unsigned char fill)
+{
+    memset(m, 0xFF, TS_PACKET_SIZE);
+    m[0] = TS_SYNC_BYTE;
+    m[1] = 0x1F;
+    m[2] = 0xFF;
+    m[3] = 0x10;
+    memcpy(m + 4, MARKER_MAGIC, MARKER_MAGIC_LEN);
+    m[12] = count >> 24;
+    m[13] = count >> 16;
+    m[14] = count >> 8;
+    m[15] = count;
+    m[16] = byte1;
+    m[17] = byte3;
+    m[18] = flags;
+    m[19] = fill;
+}
+
+void nullstrip_init(struct nullstrip *ns, struct sink *sink)
+{
+    memset(ns, 0, sizeof(struct nullstrip));
+    ns->sink = sink;
+    ns->cc_step = -1;
+}
+
+static int strip_out_flush(struct nullstrip *ns)
+{
+    int rc = 0;
+
+    if (ns->iov_count > 0 && sink_writev(ns->sink, ns->iov, ns->iov_count) < 0)
+        rc = -1;
+    ns->iov_count = 0;
+    ns->markers_used = 0;
+    return rc;
+}
+
+static int strip_out_add(struct nullstrip *ns, const unsigned char *data, size_t len)
+{
+    ns->packets_out += len / TS_PACKET_SIZE;
+
+    // extend the previous span when contiguous
+    if (ns->iov_count > 0 && (const unsigned char *) ns->iov[ns->iov_count - 1].iov_base + ns->iov[ns->iov_count - 1].iov_len == data)
+    {
+        ns->iov[ns->iov_count - 1].iov_len += len;
+        return 0;
+    }
+
+    if (ns->iov_count == NULLSTRIP_IOV && strip_out_flush(ns) < 0)
+        return -1;
+
+    ns->iov[ns->iov_count].iov_base = (void *) data;
+    ns->iov[ns->iov_count].iov_len = len;
+    ns->iov_count++;
+    return 0;
+}
+
+static int strip_out_marker(struct nullstrip *ns, uint32_t count, int flags)
+{
+    // the markers are staged in ns, so flush before reusing their slots
+    if ((ns->markers_used == NULLSTRIP_IOV || ns->iov_count == NULLSTRIP_IOV) && strip_out_flush(ns) < 0)
+        return -1;
+
+    unsigned char *m = ns->markers[ns->markers_used++];
+    make_marker(m, count, ns->byte1, ns->byte3, flags, ns->fill);
+    return strip_out_add(ns, m, TS_PACKET_SIZE);
+}
+
+static int strip_end_run(struct nullstrip *ns)
+{
+    int rc = 0;
+
+    if (ns->run > 0)
+        rc = strip_out_marker(ns, ns->run, ns->cc_step > 0 ? NULLSTRIP_FLAG_CC : 0);
+    ns->run = 0;
+    ns->cc_step = -1;
+    return rc;
+}
+
+int nullstrip_write(struct nullstrip *ns, const unsigned char *packets, int count)
+{
+    const unsigned char *p;
+    int i, rc = 0;
+
+    // anything left staged by a failed write refers to old packets
+    ns->iov_count = 0;
+    ns->markers_used = 0;
+
+    if (!ns->started)
+    {
+        ns->started = 1;
+        rc = strip_out_marker(ns, 0, NULLSTRIP_FLAG_HEADER);
+    }
+
+    for (i = 0; i < count && rc == 0; i++)
+    {
+        p = packets + (size_t) i * TS_PACKET_SIZE;
+        ns->packets_in++;
+
+        if (!is_null(p))
+        {
+            rc = strip_end_run(ns);
+            if (rc == 0)
+                rc = strip_out_add(ns, p, TS_PACKET_SIZE);
+            continue;
+        }
+
+        if (!is_uniform(p))
+        {
+            // kept literally, escaped if it could be taken for a marker
+            rc = strip_end_run(ns);
+            if (rc == 0 && is_marker(p))
+                rc = strip_out_marker(ns, 0, 0);
+            if (rc == 0)
+                rc = strip_out_add(ns, p, TS_PACKET_SIZE);
+            continue;
+        }
+
+        if (ns->run > 0)
+        {
+            unsigned char expected_same = ns->byte3;
+            unsigned char expected_next = (ns->byte3 & 0xF0) | ((ns->byte3 + ns->run) & 0x0F);
+
+            int fits = p[1] == ns->byte1 && p[4] == ns->fill;
+            if (fits && ns->cc_step < 0)
+            {
+                if (p[3] == expected_same)
+                    ns->cc_step = 0;
+                else if (p[3] == expected_next)
+                    ns->cc_step = 1;
+                else
+                    fits = 0;
+            }
+            else if (fits)
+                fits = p[3] == (ns->cc_step ? expected_next : expected_same);
+
+            if (fits && ns->run < 0xFFFFFFFF)
+            {
+                ns->run++;
+                continue;
+            }
+            rc = strip_end_run(ns);
+        }
+
+        ns->run = 1;
+        ns->byte1 = p[1];
+        ns->byte3 = p[3];
+        ns->fill = p[4];
+        ns->cc_step = -1;
+    }
+
+    // a run in progress stays open across batches: it refers to no data
+    if (rc == 0)
+        rc = strip_out_flush(ns);
+
+    return rc;
+}
+
+int nullstrip_flush(struct nullstrip *ns)
+{
+    unsigned char m[TS_PACKET_SIZE];
+    struct iovec iov;
+
+    if (ns->run == 0)
+        return 0;
+
+    make_marker(m, ns->run, ns->byte1, ns->byte3, ns->cc_step > 0 ? NULLSTRIP_FLAG_CC : 0, ns->fill);
+    ns->run = 0;
+    ns->cc_step = -1;
+    ns->packets_out++;
+
+    iov.iov_base = m;
+    iov.iov_len = TS_PACKET_SIZE;
+    return sink_writev(ns->sink, &iov, 1);
+}
+
+void nullexpand_init(struct nullexpand *ne)
+{
+    memset(ne, 0, sizeof(struct nullexpand));
+}
+
+int nullexpand_feed(struct nullexpand *ne, const unsigned char *p)
+{
+    if (!ne->started)
+    {
+        // only streams written by nullstrip are expanded
+        ne->started = 1;
+        ne->active = is_marker(p) && (p[18] & NULLSTRIP_FLAG_HEADER);
+        return ne->active;
+    }
+
+    if (!ne->active)
+        return 0;
+
+    if (ne->escaped)
+    {
+        ne->escaped = 0;
+        return 0;
+    }
+
+    if (!is_marker(p))
+        return 0;
+
+    uint32_t count = (uint32_t) p[12] << 24 | (uint32_t) p[13] << 16 | (uint32_t) p[14] << 8 | p[15];
+    if (count == 0)
+    {
+        ne->escaped = 1;
+        ne->left = 0;
+        return 1;
+    }
+
+    ne->left = count;
+    ne->cc_step = p[18] & NULLSTRIP_FLAG_CC;
+    memset(ne->packet, p[19], TS_PACKET_SIZE);
+    ne->packet[0] = TS_SYNC_BYTE;
+    ne->packet[1] = p[16];
+    ne->packet[2] = 0xFF;
+    ne->packet[3] = p[17];
+    return 1;
+}
+
+int nullexpand_next(struct nullexpand *ne, unsigned char *out)
+{
+    if (ne->left == 0)
+        return 0;
+
+    memcpy(out, ne->packet, TS_PACKET_SIZE);
+    ne->left--;
+    if (ne->cc_step)
+        ne->packet[3] = (ne->packet[3] & 0xF0) | ((ne->packet[3] + 1) & 0x0F);
+    return 1;
+}
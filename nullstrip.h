@@ -0,0 +1,107 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _NULLSTRIP_H_
+#define _NULLSTRIP_H_
+
+// Null packet (PID 0x1FFF) stripping for recordings.
+//
+// A run of null packets that share their header (or whose continuity
+// counter just increments) and whose payload is a single repeated byte is
+// replaced, in place, by one marker packet, itself a null packet:
+//
+//   0x47 0x1F 0xFF 0x10 "ISDBNUL1" count[4] byte1 byte3 flags fill 0xFF...
+//
+// count is the run length, byte1/byte3 the header bytes of the first null of
+// the run, flags bit 0 set when the continuity counter increments and fill
+// the payload byte. Any other null packet is kept as is; one that happens to
+// start with the marker signature is escaped by a marker with count 0.
+// Since every run stays at its position, expanding the markers gives back
+// the bit-exact, constant-bitrate stream.
+//
+// A stripped stream starts with a marker of count 0 and flags bit 1 set, so
+// unstripped recordings are never expanded by mistake.
+
+#define NULLSTRIP_FLAG_CC     0x01
+#define NULLSTRIP_FLAG_HEADER 0x02
+
+#include <stdint.h>
+
+#include "sink.h"
+
+#define NULL_PID 0x1FFF
+
+// at most this many iovecs per writev(), markers included
+#define NULLSTRIP_IOV 64
+
+struct nullstrip {
+    struct sink *sink;
+
+    // run being collected
+    uint32_t run;
+    unsigned char byte1, byte3, fill;
+    int cc_step; // -1 until the second packet of the run
+    int started;
+
+    uint64_t packets_in;
+    uint64_t packets_out;
+
+    // output staging of one nullstrip_write() call
+    struct iovec iov[NULLSTRIP_IOV];
+    int iov_count;
+    unsigned char markers[NULLSTRIP_IOV][188];
+    int markers_used;
+};
+
+// expands markers while reading a stripped stream
+struct nullexpand {
+    uint32_t left;
+    unsigned char packet[188];
+    int cc_step;
+
+    // the next packet is a literal null that looks like a marker
+    int escaped;
+
+    // the stream began with the stripped stream header
+    int started, active;
+};
+
+
+void nullstrip_init(struct nullstrip *ns, struct sink *sink);
+
+// strips count packets and writes the result to the sink (returns -1 on
+// write error). Output is copied to the sink, never spliced.
+int nullstrip_write(struct nullstrip *ns, const unsigned char *packets, int count);
+
+// writes the marker of the run in progress (at the end of a recording)
+int nullstrip_flush(struct nullstrip *ns);
+
+
+void nullexpand_init(struct nullexpand *ne);
+
+// feeds one packet of a stripped stream: returns 1 if it is a marker, which
+// now has to be drained with nullexpand_next(), 0 if it is a regular packet
+int nullexpand_feed(struct nullexpand *ne, const unsigned char *packet);
+
+// writes the next null packet of the current run to out, returns 0 when the
+// run is over
+int nullexpand_next(struct nullexpand *ne, unsigned char *out);
+
+#endif /* _NULLSTRIP_H_ */
@@ -0,0 +1,409 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pes.h"
+#include "m2ts.h"
+
+static void *pool_get(struct pes_pool *pool, int class)
+{
+    void *block = pool->free[class];
+
+    if (block)
+    {
+        pool->free[class] = *(void **) block;
+        pool->reused++;
+        return block;
+    }
+    block = malloc((size_t) 1 << (PES_POOL_MIN_SHIFT + class));
+    if (block)
+        pool->allocated++;
+    return block;
+}
+
+static void pool_put(struct pes_pool *pool, void *block, int class)
+{
+    *(void **) block = pool->free[class];
+    pool->free[class] = block;
+}
+
+static void pool_free(struct pes_pool *pool)
+{
+    void *block;
+    int i;
+
+    for (i = 0; i < PES_POOL_CLASSES; i++)
+        while ((block = pool->free[i]))
+        {
+            pool->free[i] = *(void **) block;
+            free(block);
+        }
+}
+
+static int add_stream(struct pes_demux *pd, int pid, int stream_type)
+{
+    struct pes_stream *st;
+
+    if (pd->index[pid] >= 0)
+    {
+        pd->streams[pd->index[pid]].stream_type = stream_type;
+        return 0;
+    }
+    if (pd->stream_count == PES_MAX_STREAMS)
+        return -1;
+
+    st = &pd->streams[pd->stream_count];
+    memset(st, 0, sizeof(struct pes_stream));
+    st->pid = pid;
+    st->stream_type = stream_type;
+    st->cc = -1;
+    st->buf_class = -1;
+    pd->index[pid] = pd->stream_count++;
+    return 0;
+}
+
+void pes_demux_init(struct pes_demux *pd, const int *pids, int pid_count, pes_cb cb, void *opaque)
+{
+    int i;
+
+    memset(pd, 0, sizeof(struct pes_demux));
+    memset(pd->index, -1, sizeof(pd->index));
+    pd->cb = cb;
+    pd->opaque = opaque;
+
+    for (i = 0; i < pid_count; i++)
+        add_stream(pd, pids[i] & 0x1FFF, 0);
+
+    pd->automatic = pid_count == 0;
+    psi_assembler_init(&pd->pat, PAT_PID);
+}
+
+// the stream types worth extracting: video, audio, and the private data
+// streams ARIB captions and superimposed text are carried in
+static int wanted_type(int type)
+{
+    switch (type)
+    {
+    case 0x01: case 0x02: case 0x1B: case 0x24: // MPEG-1/2, H.264, HEVC video
+    case 0x03: case 0x04: case 0x0F: case 0x11: // MPEG audio, AAC ADTS and LATM
+    case 0x06:                                  // PES private data
+        return 1;
+    }
+    return 0;
+}
+
+static void pmt_section(void *opaque, const unsigned char *section, int len)
+{
+    struct pes_demux *pd = opaque;
+    struct psi_pmt pmt;
+    int i;
+
+    if (psi_parse_pmt(section, len, &pmt) < 0)
+        return;
+    // given PIDs only learn their stream type
+    for (i = 0; i < pmt.stream_count; i++)
+        if (pd->index[pmt.streams[i].pid] >= 0 || (pd->automatic && wanted_type(pmt.streams[i].type)))
+            add_stream(pd, pmt.streams[i].pid, pmt.streams[i].type);
+}
+
+static void pat_section(void *opaque, const unsigned char *section, int len)
+{
+    struct pes_demux *pd = opaque;
+    struct psi_pat pat;
+    int i, j;
+
+    if (psi_parse_pat(section, len, &pat) < 0)
+        return;
+
+    for (i = 0; i < pat.program_count; i++)
+    {
+        // program 0 points at the NIT
+        if (pat.programs[i].program_number == 0)
+            continue;
+        for (j = 0; j < pd->pmt_count && pd->pmts[j]->pid != pat.programs[i].pid; j++)
+            ;
+        if (j < pd->pmt_count || pd->pmt_count == PSI_MAX_PROGRAMS)
+            continue;
+        pd->pmts[j] = malloc(sizeof(struct psi_assembler));
+        if (pd->pmts[j] == NULL)
+            return;
+        psi_assembler_init(pd->pmts[j], pat.programs[i].pid);
+        pd->pmt_count++;
+    }
+}
+
+static int64_t timestamp(const unsigned char *p)
+{
+    return (int64_t) (p[0] & 0x0E) << 29 | p[1] << 22 | (p[2] & 0xFE) << 14 | p[3] << 7 | p[4] >> 1;
+}
+
+static void release(struct pes_demux *pd, struct pes_stream *st)
+{
+    if (st->buf)
+        pool_put(&pd->pool, st->buf, st->buf_class);
+    st->buf = NULL;
+    st->buf_class = -1;
+    st->len = st->expected = 0;
+}
+
+// hands the PES being assembled to the callback and gives its block back
+static void deliver(struct pes_demux *pd, struct pes_stream *st)
+{
+    struct pes_packet pes;
+    const unsigned char *p = st->buf;
+    int header = 6, flags;
+
+    if (st->len < 6 || (st->expected && st->len < st->expected))
+    {
+        if (st->len > 0)
+            pd->errors++;
+        release(pd, st);
+        return;
+    }
+    if (st->expected)
+        st->len = st->expected;
+
+    pes.pid = st->pid;
+    pes.stream_type = st->stream_type;
+    pes.stream_id = p[3];
+    pes.pts = pes.dts = PES_NO_TIMESTAMP;
+
+    // these stream ids have no optional header
+    switch (pes.stream_id)
+    {
+    case 0xBC: case 0xBE: case 0xBF: case 0xF0: case 0xF1: case 0xF2: case 0xF8: case 0xFF:
+        break;
+    default:
+        if (st->len < 9 || st->len < 9 + p[8])
+        {
+            pd->errors++;
+            release(pd, st);
+            return;
+        }
+        flags = p[7] >> 6;
+        if (flags & 2 && p[8] >= 5)
+            pes.pts = timestamp(p + 9);
+        if (flags == 3 && p[8] >= 10)
+            pes.dts = timestamp(p + 14);
+        header = 9 + p[8];
+    }
+
+    pes.data = p + header;
+    pes.len = st->len - header;
+    pd->packets++;
+    pd->cb(pd->opaque, &pes);
+    release(pd, st);
+}
+
+// appends a packet's payload, moving to a larger block when needed
+static int append(struct pes_demux *pd, struct pes_stream *st, const unsigned char *p, int n)
+{
+    unsigned char *bigger;
+    int class;
+
+    if (st->buf == NULL || st->len + n > 1 << (PES_POOL_MIN_SHIFT + st->buf_class))
+    {
+        if (st->len + n > PES_MAX_SIZE)
+            return -1;
+        for (class = st->buf_class + 1; st->len + n > 1 << (PES_POOL_MIN_SHIFT + class); class++)
+            ;
+        bigger = pool_get(&pd->pool, class);
+        if (bigger == NULL)
+            return -1;
+        if (st->buf)
+        {
+            memcpy(bigger, st->buf, st->len);
+            pool_put(&pd->pool, st->buf, st->buf_class);
+        }
+        st->buf = bigger;
+        st->buf_class = class;
+    }
+
+    memcpy(st->buf + st->len, p, n);
+    st->len += n;
+    return 0;
+}
+
+static void feed_stream(struct pes_demux *pd, struct pes_stream *st, const unsigned char *packet)
+{
+    const unsigned char *p = packet + 4;
+    int cc = packet[3] & 0x0F;
+    int pusi = packet[1] & 0x40;
+    int n;
+
+    if (packet[3] & 0x20)
+        p += 1 + p[0];
+    n = packet + TS_PACKET_SIZE - p;
+    if (n <= 0)
+        return;
+
+    // a lost packet spoils the PES in progress
+    if (st->cc >= 0 && cc != ((st->cc + 1) & 0x0F))
+    {
+        if (st->buf)
+            pd->errors++;
+        release(pd, st);
+    }
+    st->cc = cc;
+
+    if (pusi)
+    {
+        // an unbounded PES ends where the next one starts
+        if (st->buf)
+            deliver(pd, st);
+        if (n < 6 || p[0] != 0 || p[1] != 0 || p[2] != 1)
+        {
+            pd->errors++;
+            return;
+        }
+        st->expected = (p[4] << 8 | p[5]) ? (p[4] << 8 | p[5]) + 6 : 0;
+    }
+    else if (st->buf == NULL)
+        return;
+
+    if (append(pd, st, p, n) < 0)
+    {
+        pd->errors++;
+        release(pd, st);
+        return;
+    }
+    if (st->expected && st->len >= st->expected)
+        deliver(pd, st);
+}
+
+void pes_demux_feed(struct pes_demux *pd, const unsigned char *packets, int count)
+{
+    const unsigned char *p;
+    int i, j, pid;
+
+    for (i = 0; i < count; i++)
+    {
+        p = packets + i * TS_PACKET_SIZE;
+        if (p[1] & 0x80 || !(p[3] & 0x10))
+            continue;
+        pid = TS_PID(p);
+
+        if (pd->index[pid] >= 0)
+        {
+            feed_stream(pd, &pd->streams[pd->index[pid]], p);
+            continue;
+        }
+
+        if (pid == PAT_PID)
+            psi_assembler_push(&pd->pat, p, pat_section, pd);
+        else
+            for (j = 0; j < pd->pmt_count; j++)
+                if (pd->pmts[j]->pid == pid)
+                    psi_assembler_push(pd->pmts[j], p, pmt_section, pd);
+    }
+}
+
+void pes_demux_flush(struct pes_demux *pd)
+{
+    int i;
+
+    for (i = 0; i < pd->stream_count; i++)
+        if (pd->streams[i].buf)
+            deliver(pd, &pd->streams[i]);
+}
+
+void pes_demux_free(struct pes_demux *pd)
+{
+    int i;
+
+    for (i = 0; i < pd->stream_count; i++)
+        release(pd, &pd->streams[i]);
+    pool_free(&pd->pool);
+
+    for (i = 0; i < pd->pmt_count; i++)
+        free(pd->pmts[i]);
+    pd->pmt_count = 0;
+}
+
+void pes_files_init(struct pes_files *pf, const char *prefix)
+{
+    memset(pf, 0, sizeof(struct pes_files));
+    snprintf(pf->prefix, sizeof(pf->prefix), "%s", prefix);
+}
+
+static const char *extension(const struct pes_packet *pes)
+{
+    switch (pes->stream_type)
+    {
+    case 0x01: return "m1v";
+    case 0x02: return "m2v";
+    case 0x1B: return "h264";
+    case 0x24: return "hevc";
+    case 0x03: case 0x04: return "mpa";
+    case 0x0F: return "aac";
+    case 0x11: return "latm";
+    case 0x06: return pes->stream_id == 0xBD ? "arib" : "es";
+    }
+    return "es";
+}
+
+void pes_files_cb(void *opaque, const struct pes_packet *pes)
+{
+    struct pes_files *pf = opaque;
+    char path[300];
+    int i;
+
+    for (i = 0; i < pf->count && pf->pids[i] != pes->pid; i++)
+        ;
+    if (i == pf->count)
+    {
+        if (pf->count == PES_MAX_STREAMS)
+            return;
+        snprintf(path, sizeof(path), "%s-%d.%s", pf->prefix, pes->pid, extension(pes));
+        pf->es[i] = fopen(path, "w");
+        snprintf(path, sizeof(path), "%s-%d.pts", pf->prefix, pes->pid);
+        pf->pts[i] = fopen(path, "w");
+        if (pf->es[i] == NULL || pf->pts[i] == NULL)
+            fprintf(stderr, "Error opening file: %s.\n", path);
+        pf->pids[i] = pes->pid;
+        pf->count++;
+    }
+
+    if (pf->es[i] == NULL || pf->pts[i] == NULL)
+        return;
+    if (pes->pts != PES_NO_TIMESTAMP)
+        fprintf(pf->pts[i], "%llu %lld %lld\n", (unsigned long long) pf->offsets[i],
+                (long long) pes->pts, (long long) pes->dts);
+    fwrite(pes->data, 1, pes->len, pf->es[i]);
+    pf->offsets[i] += pes->len;
+}
+
+void pes_files_close(struct pes_files *pf)
+{
+    int i;
+
+    for (i = 0; i < pf->count; i++)
+    {
+        if (pf->es[i])
+            fclose(pf->es[i]);
+        if (pf->pts[i])
+            fclose(pf->pts[i]);
+    }
+    pf->count = 0;
+}
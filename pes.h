@@ -0,0 +1,134 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _PES_H_
+#define _PES_H_
+
+// PES reassembly: the packets of selected PIDs are put back together into
+// PES packets, handed to a callback as elementary stream data with their
+// PTS/DTS. The PIDs are given explicitly or, with none given, taken from the
+// PMTs of the multiplex (video, audio and ARIB caption/superimpose streams).
+//
+// PES buffers come from a pool of power-of-two blocks shared by the
+// streams: a stream holds one block while it assembles a PES and hands it
+// back once the callback returned, so a running demux does not allocate.
+//
+// pes_files_open() is a ready-made callback writing each stream to
+// PREFIX-PID.EXT, with a PREFIX-PID.pts sidecar of "offset pts dts" lines
+// (byte offset of each PES payload in the ES file, -1 for a missing stamp).
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "psi.h"
+
+#define PES_MAX_STREAMS    32
+
+// pool block sizes: 4 KiB << 0 .. 4 KiB << (PES_POOL_CLASSES - 1)
+#define PES_POOL_MIN_SHIFT 12
+#define PES_POOL_CLASSES   9
+
+// larger PES packets are dropped (counted in errors)
+#define PES_MAX_SIZE       (1 << (PES_POOL_MIN_SHIFT + PES_POOL_CLASSES - 1))
+
+#define PES_NO_TIMESTAMP   -1
+
+// a complete PES, valid during the callback
+struct pes_packet {
+    int pid;
+    int stream_type; // from the PMT, 0 if unknown
+    int stream_id;
+    int64_t pts, dts; // 90 kHz, PES_NO_TIMESTAMP when absent
+    const unsigned char *data; // elementary stream bytes
+    int len;
+};
+
+typedef void (*pes_cb)(void *opaque, const struct pes_packet *pes);
+
+struct pes_pool {
+    void *free[PES_POOL_CLASSES]; // linked through their first word
+
+    // blocks taken from malloc, and handed out again from the pool
+    uint64_t allocated;
+    uint64_t reused;
+};
+
+struct pes_stream {
+    int pid;
+    int stream_type;
+    int cc;
+
+    unsigned char *buf;
+    int buf_class;
+    int len;
+    int expected; // whole PES size, 0 while unknown or unbounded
+};
+
+struct pes_demux {
+    struct pes_stream streams[PES_MAX_STREAMS];
+    int stream_count;
+    signed char index[8192]; // stream of each PID, -1 for none
+
+    // streams found in the PMTs, when no PID was given
+    int automatic;
+    struct psi_assembler pat;
+    struct psi_assembler *pmts[PSI_MAX_PROGRAMS];
+    int pmt_count;
+
+    struct pes_pool pool;
+    pes_cb cb;
+    void *opaque;
+
+    // statistics
+    uint64_t packets;
+    uint64_t errors; // PES lost to a continuity error, a bad start or size
+};
+
+// elementary stream files written by pes_files_cb()
+struct pes_files {
+    char prefix[256];
+    FILE *es[PES_MAX_STREAMS];
+    FILE *pts[PES_MAX_STREAMS];
+    int pids[PES_MAX_STREAMS];
+    uint64_t offsets[PES_MAX_STREAMS];
+    int count;
+};
+
+
+// with pid_count 0 the streams are taken from the PMTs
+void pes_demux_init(struct pes_demux *pd, const int *pids, int pid_count, pes_cb cb, void *opaque);
+
+// feeds count transport packets
+void pes_demux_feed(struct pes_demux *pd, const unsigned char *packets, int count);
+
+// delivers the PES packets still being assembled (of unbounded length)
+void pes_demux_flush(struct pes_demux *pd);
+
+// frees the pool and the PSI state
+void pes_demux_free(struct pes_demux *pd);
+
+void pes_files_init(struct pes_files *pf, const char *prefix);
+
+// a pes_cb, with a struct pes_files as opaque
+void pes_files_cb(void *opaque, const struct pes_packet *pes);
+
+void pes_files_close(struct pes_files *pf);
+
+#endif /* _PES_H_ */
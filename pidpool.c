@@ -0,0 +1,305 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "pidpool.h"
+#include "m2ts.h"
+#include "psi.h"
+
+static int pid_pool_set_error(struct pid_pool *pool, const char *msg)
+{
+    strncpy(pool->error_msg, msg, sizeof(pool->error_msg));
+    pool->error_msg[sizeof(pool->error_msg) - 1] = 0;
+    return -1;
+}
+
+// multiplicative hash: PIDs of the same program, often consecutive or a
+// power of two apart, land on different shards
+static int shard_of(int pid)
+{
+    return (uint32_t) (pid * 2654435761u) >> 26;
+}
+
+int pid_pool_init(struct pid_pool *pool, int workers)
+{
+    memset(pool, 0, sizeof(struct pid_pool));
+    if (workers < 1 || workers > PID_POOL_MAX_WORKERS)
+        return pid_pool_set_error(pool, "Invalid number of workers.");
+
+    pool->batches = malloc(PID_POOL_BATCHES * sizeof(struct pid_pool_batch));
+    if (pool->batches == NULL)
+        return pid_pool_set_error(pool, "Out of memory.");
+
+    pool->worker_count = workers;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_mutex_init(&pool->retire_mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->slot_cond, NULL);
+    return 0;
+}
+
+int pid_pool_add_analyzer(struct pid_pool *pool, pid_pool_cb cb, void *opaque)
+{
+    char msg[96];
+
+    if (pool->running || pool->analyzer_count == PID_POOL_MAX_CALLBACKS)
+    {
+        snprintf(msg, sizeof(msg), "Analyzers must be added before starting, up to %d.", PID_POOL_MAX_CALLBACKS);
+        return pid_pool_set_error(pool, msg);
+    }
+    pool->analyzers[pool->analyzer_count].cb = cb;
+    pool->analyzers[pool->analyzer_count].opaque = opaque;
+    pool->analyzer_count++;
+    return 0;
+}
+
+int pid_pool_add_ordered(struct pid_pool *pool, capture_packet_cb cb, void *opaque)
+{
+    char msg[96];
+
+    if (pool->running || pool->ordered_count == PID_POOL_MAX_CALLBACKS)
+    {
+        snprintf(msg, sizeof(msg), "Callbacks must be added before starting, up to %d.", PID_POOL_MAX_CALLBACKS);
+        return pid_pool_set_error(pool, msg);
+    }
+    pool->ordered[pool->ordered_count].cb = cb;
+    pool->ordered[pool->ordered_count].opaque = opaque;
+    pool->ordered_count++;
+    return 0;
+}
+
+// hands the batches every shard is done with to the ordered callbacks, in
+// order, and frees their slots
+static void retire(struct pid_pool *pool)
+{
+    struct pid_pool_batch *b;
+    int i;
+
+    pthread_mutex_lock(&pool->retire_mutex);
+    while (pool->retired < __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE))
+    {
+        b = &pool->batches[pool->retired % PID_POOL_BATCHES];
+        if (__atomic_load_n(&b->pending, __ATOMIC_ACQUIRE) > 0)
+            break;
+
+        for (i = 0; i < pool->ordered_count; i++)
+            pool->ordered[i].cb(pool->ordered[i].opaque, b->data, b->count, b->first_packet);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->retired++;
+        pthread_cond_broadcast(&pool->slot_cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->retire_mutex);
+}
+
+// takes a shard with batches pending, if no other worker has it, and runs
+// the analyzers on its packets up to the last batch published (returns 0
+// if there was nothing to take)
+static int run_shard(struct pid_pool_worker *w, int s)
+{
+    struct pid_pool *pool = w->pool;
+    struct pid_pool_shard *shard = &pool->shards[s];
+    struct pid_pool_batch *b;
+    const unsigned char *p;
+    uint64_t next, head;
+    int i, j, ran = 0;
+
+    while (__atomic_load_n(&shard->next, __ATOMIC_RELAXED) < __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_exchange_n(&shard->claimed, 1, __ATOMIC_ACQUIRE))
+            return ran;
+
+        head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+        for (next = shard->next; next < head; next++)
+        {
+            b = &pool->batches[next % PID_POOL_BATCHES];
+            for (i = b->start[s]; i < b->start[s + 1]; i++)
+            {
+                p = b->data + b->index[i] * TS_PACKET_SIZE;
+                for (j = 0; j < pool->analyzer_count; j++)
+                    pool->analyzers[j].cb(pool->analyzers[j].opaque, p, b->first_packet + b->index[i]);
+            }
+
+            w->processed += b->start[s + 1] - b->start[s];
+            if (s % pool->worker_count != w->id)
+                w->stolen += b->start[s + 1] - b->start[s];
+            __atomic_store_n(&shard->next, next + 1, __ATOMIC_RELAXED);
+            if (__atomic_sub_fetch(&b->pending, 1, __ATOMIC_ACQ_REL) == 0)
+                retire(pool);
+        }
+
+        // batches published meanwhile are seen by the loop condition: no
+        // one else could take the shard while it was claimed
+        __atomic_store_n(&shard->claimed, 0, __ATOMIC_RELEASE);
+        ran = 1;
+    }
+    return ran;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct pid_pool_worker *w = arg;
+    struct pid_pool *pool = w->pool;
+    uint64_t seen;
+    int k, s, found;
+
+    while (1)
+    {
+        seen = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+        found = 0;
+
+        // its own shards first, then whole shards of the others
+        for (s = w->id; s < PID_POOL_SHARDS; s += pool->worker_count)
+            found |= run_shard(w, s);
+        for (k = 0; k < PID_POOL_SHARDS; k++)
+        {
+            s = (w->id * PID_POOL_SHARDS / pool->worker_count + k) % PID_POOL_SHARDS;
+            if (s % pool->worker_count != w->id)
+                found |= run_shard(w, s);
+        }
+        if (found)
+            continue;
+
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->keep_running && pool->head == seen)
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        if (!pool->keep_running && pool->head == seen)
+        {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
+
+int pid_pool_start(struct pid_pool *pool)
+{
+    int i;
+
+    pool->keep_running = 1;
+    for (i = 0; i < pool->worker_count; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_thread, &pool->workers[i]) != 0)
+        {
+            pool->worker_count = i;
+            pid_pool_stop(pool);
+            return pid_pool_set_error(pool, "Error starting the worker threads.");
+        }
+    }
+    pool->running = 1;
+    return 0;
+}
+
+// groups the packet indexes of a batch by shard (a counting sort)
+static void sort_batch(struct pid_pool_batch *b)
+{
+    unsigned char shards[PID_POOL_BATCH_PACKETS];
+    int fill[PID_POOL_SHARDS];
+    int i, s;
+
+    memset(b->start, 0, sizeof(b->start));
+    for (i = 0; i < b->count; i++)
+    {
+        shards[i] = shard_of(TS_PID(b->data + i * TS_PACKET_SIZE));
+        b->start[shards[i] + 1]++;
+    }
+    for (s = 0; s < PID_POOL_SHARDS; s++)
+    {
+        b->start[s + 1] += b->start[s];
+        fill[s] = b->start[s];
+    }
+    for (i = 0; i < b->count; i++)
+        b->index[fill[shards[i]]++] = i;
+}
+
+void pid_pool_feed(void *opaque, const unsigned char *packets, int count, uint64_t first_packet)
+{
+    struct pid_pool *pool = opaque;
+    struct pid_pool_batch *b;
+    int n;
+
+    while (count > 0)
+    {
+        n = count < PID_POOL_BATCH_PACKETS ? count : PID_POOL_BATCH_PACKETS;
+
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->head - pool->retired == PID_POOL_BATCHES)
+        {
+            pool->waits++;
+            while (pool->head - pool->retired == PID_POOL_BATCHES)
+                pthread_cond_wait(&pool->slot_cond, &pool->mutex);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        // the slot is free: no worker looks at it until it is published
+        b = &pool->batches[pool->head % PID_POOL_BATCHES];
+        memcpy(b->data, packets, (size_t) n * TS_PACKET_SIZE);
+        b->count = n;
+        b->first_packet = first_packet;
+        sort_batch(b);
+        b->pending = PID_POOL_SHARDS;
+
+        pthread_mutex_lock(&pool->mutex);
+        __atomic_store_n(&pool->head, pool->head + 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&pool->work_cond);
+        pthread_mutex_unlock(&pool->mutex);
+
+        packets += (size_t) n * TS_PACKET_SIZE;
+        count -= n;
+        first_packet += n;
+    }
+}
+
+void pid_pool_stop(struct pid_pool *pool)
+{
+    int i;
+
+    // what was fed is still analyzed and handed out
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->worker_count > 0 && pool->retired < pool->head)
+        pthread_cond_wait(&pool->slot_cond, &pool->mutex);
+    pool->keep_running = 0;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->worker_count; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    pool->running = 0;
+}
+
+void pid_pool_free(struct pid_pool *pool)
+{
+    if (pool->running)
+        pid_pool_stop(pool);
+    free(pool->batches);
+    pool->batches = NULL;
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_mutex_destroy(&pool->retire_mutex);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->slot_cond);
+}
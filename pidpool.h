@@ -0,0 +1,137 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _PIDPOOL_H_
+#define _PIDPOOL_H_
+
+// A pool of worker threads running per-PID analyzers on the packets of a
+// capture, sharded by PID: every packet of a PID goes to the same shard, and
+// a shard is worked on by one thread at a time, in packet order, so the
+// state an analyzer keeps for a PID has a single writer and needs no lock.
+//
+// pid_pool_feed() (a capture_packet_cb) copies each batch into a slot of
+// the pool and sorts its packets by shard; the workers then take whole
+// shards, their own first (shard % workers) and any other one with work
+// pending when idle. Nothing is locked per packet: a shard is claimed with
+// an atomic exchange, and locks are only taken per batch.
+//
+// Once every shard is done with a batch, the ordered callbacks get it, in
+// batch order: outputs fed after the analysis keep the capture's order.
+// When all the slots are in use, pid_pool_feed() waits for one.
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "capture.h"
+
+#define PID_POOL_MAX_WORKERS   32
+#define PID_POOL_SHARDS        64
+#define PID_POOL_BATCHES       32
+#define PID_POOL_BATCH_PACKETS 1024
+#define PID_POOL_MAX_CALLBACKS 8
+
+// called by a worker for each packet of the PIDs of a shard, in order
+typedef void (*pid_pool_cb)(void *opaque, const unsigned char *packet, uint64_t number);
+
+struct pid_pool_batch {
+    unsigned char data[PID_POOL_BATCH_PACKETS * 188];
+    int count;
+    uint64_t first_packet;
+
+    // packet indexes grouped by shard: those of shard s are
+    // index[start[s]] to index[start[s + 1] - 1]
+    uint16_t index[PID_POOL_BATCH_PACKETS];
+    int start[PID_POOL_SHARDS + 1];
+
+    // shards still to go through it
+    int pending;
+};
+
+struct pid_pool_shard {
+    int claimed;
+    uint64_t next; // sequence number of the next batch to go through
+};
+
+struct pid_pool_worker {
+    struct pid_pool *pool;
+    int id;
+    pthread_t thread;
+
+    // packets of shards taken from another worker, and in all
+    uint64_t stolen;
+    uint64_t processed;
+};
+
+struct pid_pool {
+    int worker_count;
+    struct pid_pool_worker workers[PID_POOL_MAX_WORKERS];
+
+    struct {
+        pid_pool_cb cb;
+        void *opaque;
+    } analyzers[PID_POOL_MAX_CALLBACKS];
+    int analyzer_count;
+    struct {
+        capture_packet_cb cb;
+        void *opaque;
+    } ordered[PID_POOL_MAX_CALLBACKS];
+    int ordered_count;
+
+    struct pid_pool_batch *batches;
+    struct pid_pool_shard shards[PID_POOL_SHARDS];
+
+    // published batches, and those handed to the ordered callbacks
+    uint64_t head;
+    uint64_t retired;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;  // a batch was published
+    pthread_cond_t slot_cond;  // a batch was retired
+    pthread_mutex_t retire_mutex;
+    int running;
+    volatile int keep_running;
+
+    // times pid_pool_feed() had to wait for a slot
+    uint64_t waits;
+
+    char error_msg[256];
+};
+
+
+// workers threads, 1 to PID_POOL_MAX_WORKERS (returns -1 on error)
+int pid_pool_init(struct pid_pool *pool, int workers);
+
+// adds a per-PID analyzer, or a callback getting every batch once it was
+// analyzed, before pid_pool_start() (returns -1 when there are too many)
+int pid_pool_add_analyzer(struct pid_pool *pool, pid_pool_cb cb, void *opaque);
+int pid_pool_add_ordered(struct pid_pool *pool, capture_packet_cb cb, void *opaque);
+
+// starts the workers (returns -1 on error)
+int pid_pool_start(struct pid_pool *pool);
+
+// a capture_packet_cb, with the pool as opaque
+void pid_pool_feed(void *opaque, const unsigned char *packets, int count, uint64_t first_packet);
+
+// waits for the batches fed so far to be done, and stops the workers
+void pid_pool_stop(struct pid_pool *pool);
+
+void pid_pool_free(struct pid_pool *pool);
+
+#endif /* _PIDPOOL_H_ */
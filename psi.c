@@ -0,0 +1,255 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "psi.h"
+#include "m2ts.h"
+
+static uint32_t crc_table[256];
+static int crc_ready;
+
+static void crc_init(void)
+{
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+        c = (uint32_t) i << 24;
+        for (j = 0; j < 8; j++)
+            c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : c << 1;
+        crc_table[i] = c;
+    }
+    crc_ready = 1;
+}
+
+uint32_t psi_crc32(const unsigned char *data, int len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    int i;
+
+    // the table comes out the same from any thread
+    if (!crc_ready)
+        crc_init();
+
+    for (i = 0; i < len; i++)
+        crc = (crc << 8) ^ crc_table[((crc >> 24) ^ data[i]) & 0xFF];
+    return crc;
+}
+
+void psi_assembler_init(struct psi_assembler *a, int pid)
+{
+    memset(a, 0, sizeof(struct psi_assembler));
+    a->pid = pid;
+    a->cc = -1;
+}
+
+// section_length plus the 3 header bytes, or 0 until known
+static int section_size(const unsigned char *s, int len)
+{
+    if (len < 3)
+        return 0;
+    return (((s[1] & 0x0F) << 8) | s[2]) + 3;
+}
+
+// appends payload bytes and hands out the sections they complete
+static void assembler_append(struct psi_assembler *a, const unsigned char *p, int n, psi_section_cb cb, void *opaque)
+{
+    int size, take;
+
+    while (n > 0 && a->len >= 0)
+    {
+        // stuffing: no section starts with 0xFF
+        if (a->len == 0 && p[0] == 0xFF)
+            return;
+
+        size = section_size(a->data, a->len);
+        take = size ? size - a->len : 3 - a->len;
+        if (take > n)
+            take = n;
+        if (a->len + take > PSI_MAX_SECTION)
+        {
+            a->len = -1;
+            return;
+        }
+        memcpy(a->data + a->len, p, take);
+        a->len += take;
+        p += take;
+        n -= take;
+
+        size = section_size(a->data, a->len);
+        if (size && a->len == size)
+        {
+            // long sections end in a CRC, the whole section then checks to 0
+            if (!(a->data[1] & 0x80) || psi_crc32(a->data, size) == 0)
+                cb(opaque, a->data, size);
+            else
+                a->errors++;
+            a->len = 0;
+        }
+    }
+}
+
+void psi_assembler_push(struct psi_assembler *a, const unsigned char *packet, psi_section_cb cb, void *opaque)
+{
+    const unsigned char *p = packet + 4;
+    const unsigned char *end = packet + TS_PACKET_SIZE;
+    int cc = packet[3] & 0x0F;
+    int pusi = packet[1] & 0x40;
+
+    if (packet[1] & 0x80 || !(packet[3] & 0x10))
+        return;
+    if (packet[3] & 0x20)
+        p += 1 + p[0];
+    if (p >= end)
+        return;
+
+    // a lost packet spoils the section in progress
+    if (a->cc >= 0 && cc != ((a->cc + 1) & 0x0F))
+    {
+        if (a->len > 0)
+            a->errors++;
+        a->len = pusi ? 0 : -1;
+    }
+    a->cc = cc;
+
+    if (pusi)
+    {
+        int pointer = *p++;
+        if (p + pointer > end)
+            return;
+
+        // the tail of the previous section comes before the pointer
+        if (a->len > 0)
+            assembler_append(a, p, pointer, cb, opaque);
+        a->len = 0;
+        p += pointer;
+    }
+    else if (a->len <= 0)
+        return;
+
+    assembler_append(a, p, end - p, cb, opaque);
+}
+
+int psi_parse_pat(const unsigned char *s, int len, struct psi_pat *pat)
+{
+    int pos;
+
+    if (len < 12 || s[0] != PSI_TABLE_PAT || section_size(s, len) != len)
+        return -1;
+
+    memset(pat, 0, sizeof(struct psi_pat));
+    pat->transport_stream_id = s[3] << 8 | s[4];
+    pat->version = (s[5] >> 1) & 0x1F;
+
+    for (pos = 8; pos + 4 <= len - 4 && pat->program_count < PSI_MAX_PROGRAMS; pos += 4)
+    {
+        pat->programs[pat->program_count].program_number = s[pos] << 8 | s[pos + 1];
+        pat->programs[pat->program_count].pid = (s[pos + 2] & 0x1F) << 8 | s[pos + 3];
+        pat->program_count++;
+    }
+    return 0;
+}
+
+int psi_parse_pmt(const unsigned char *s, int len, struct psi_pmt *pmt)
+{
+    int pos, es_len;
+
+    if (len < 16 || s[0] != PSI_TABLE_PMT || section_size(s, len) != len)
+        return -1;
+
+    memset(pmt, 0, sizeof(struct psi_pmt));
+    pmt->program_number = s[3] << 8 | s[4];
+    pmt->version = (s[5] >> 1) & 0x1F;
+    pmt->pcr_pid = (s[8] & 0x1F) << 8 | s[9];
+    pmt->descriptors_len = (s[10] & 0x0F) << 8 | s[11];
+    pmt->descriptors = s + 12;
+
+    pos = 12 + pmt->descriptors_len;
+    if (pos > len - 4)
+        return -1;
+
+    while (pos + 5 <= len - 4 && pmt->stream_count < PSI_MAX_STREAMS)
+    {
+        es_len = (s[pos + 3] & 0x0F) << 8 | s[pos + 4];
+        if (pos + 5 + es_len > len - 4)
+            return -1;
+        pmt->streams[pmt->stream_count].type = s[pos];
+        pmt->streams[pmt->stream_count].pid = (s[pos + 1] & 0x1F) << 8 | s[pos + 2];
+        pmt->streams[pmt->stream_count].descriptors = s + pos + 5;
+        pmt->streams[pmt->stream_count].descriptors_len = es_len;
+        pmt->stream_count++;
+        pos += 5 + es_len;
+    }
+    return 0;
+}
+
+const unsigned char *psi_find_descriptor(const unsigned char *loop, int len, int tag)
+{
+    int pos = 0;
+
+    while (pos + 2 <= len && pos + 2 + loop[pos + 1] <= len)
+    {
+        if (loop[pos] == tag)
+            return loop + pos;
+        pos += 2 + loop[pos + 1];
+    }
+    return NULL;
+}
+
+void psi_make_pat(unsigned char *packet, int transport_stream_id, int version,
+                  const int (*programs)[2], int count, int cc)
+{
+    unsigned char *s = packet + 5;
+    int section_length = 5 + 4 * count + 4;
+    int i, pos = 8;
+    uint32_t crc;
+
+    memset(packet, 0xFF, TS_PACKET_SIZE);
+    packet[0] = TS_SYNC_BYTE;
+    packet[1] = 0x40; // payload_unit_start_indicator, PID 0
+    packet[2] = 0x00;
+    packet[3] = 0x10 | (cc & 0x0F);
+    packet[4] = 0; // pointer_field
+
+    s[0] = PSI_TABLE_PAT;
+    s[1] = 0xB0 | (section_length >> 8);
+    s[2] = section_length & 0xFF;
+    s[3] = transport_stream_id >> 8;
+    s[4] = transport_stream_id & 0xFF;
+    s[5] = 0xC1 | (version & 0x1F) << 1; // current_next_indicator set
+    s[6] = 0;
+    s[7] = 0;
+    for (i = 0; i < count; i++, pos += 4)
+    {
+        s[pos] = programs[i][0] >> 8;
+        s[pos + 1] = programs[i][0] & 0xFF;
+        s[pos + 2] = 0xE0 | programs[i][1] >> 8;
+        s[pos + 3] = programs[i][1] & 0xFF;
+    }
+
+    crc = psi_crc32(s, pos);
+    s[pos] = crc >> 24;
+    s[pos + 1] = crc >> 16;
+    s[pos + 2] = crc >> 8;
+    s[pos + 3] = crc;
+}
@@ -0,0 +1,106 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _PSI_H_
+#define _PSI_H_
+
+// MPEG-2 PSI: reassembly of the sections carried on a PID, and the PAT and
+// PMT of the multiplex.
+
+#include <stdint.h>
+
+#define PSI_MAX_SECTION  4096
+#define PSI_MAX_PROGRAMS 64
+#define PSI_MAX_STREAMS  32
+
+#define PAT_PID 0x0000
+
+#define PSI_TABLE_PAT 0x00
+#define PSI_TABLE_PMT 0x02
+
+#define TS_PID(p) (((p)[1] & 0x1F) << 8 | (p)[2])
+
+// called with each complete section whose CRC (when it has one) is good
+typedef void (*psi_section_cb)(void *opaque, const unsigned char *section, int len);
+
+// collects the sections of one PID
+struct psi_assembler {
+    int pid;
+    unsigned char data[PSI_MAX_SECTION];
+    int len;
+    int cc;
+
+    // sections dropped for a bad CRC or a continuity error
+    unsigned long errors;
+};
+
+struct psi_pat {
+    int transport_stream_id;
+    int version;
+    int program_count;
+    struct {
+        int program_number;
+        int pid; // PMT PID, or NIT PID for program 0
+    } programs[PSI_MAX_PROGRAMS];
+};
+
+struct psi_pmt {
+    int program_number;
+    int version;
+    int pcr_pid;
+
+    // program_info descriptors, pointing into the parsed section
+    const unsigned char *descriptors;
+    int descriptors_len;
+
+    int stream_count;
+    struct {
+        int type;
+        int pid;
+        const unsigned char *descriptors;
+        int descriptors_len;
+    } streams[PSI_MAX_STREAMS];
+};
+
+
+// CRC32 of MPEG-2 sections (polynomial 0x04C11DB7, no reflection); a section
+// with its CRC appended checks to 0
+uint32_t psi_crc32(const unsigned char *data, int len);
+
+void psi_assembler_init(struct psi_assembler *a, int pid);
+
+// feeds a packet of the assembler's PID, calling cb for each section it
+// completes
+void psi_assembler_push(struct psi_assembler *a, const unsigned char *packet, psi_section_cb cb, void *opaque);
+
+// parse a complete section (returns -1 if it is not a valid PAT/PMT)
+int psi_parse_pat(const unsigned char *section, int len, struct psi_pat *pat);
+int psi_parse_pmt(const unsigned char *section, int len, struct psi_pmt *pmt);
+
+// finds a descriptor by tag in a descriptor loop, returns it (tag byte
+// first) or NULL
+const unsigned char *psi_find_descriptor(const unsigned char *loop, int len, int tag);
+
+// writes a single-packet PAT listing count programs, with continuity
+// counter cc (programs holds program_number, pid pairs)
+void psi_make_pat(unsigned char *packet, int transport_stream_id, int version,
+                  const int (*programs)[2], int count, int cc);
+
+#endif /* _PSI_H_ */
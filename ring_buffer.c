@@ -20,12 +20,27 @@
 
 #include "ring_buffer.h"
 
+#include <sys/syscall.h>
+
+// mbind(2) constants, so that libnuma is not needed
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE (1 << 0)
+#endif
+#ifndef MPOL_F_ADDR
+#define MPOL_F_ADDR (1 << 1)
+#endif
+
 void
 ring_buffer_create (struct ring_buffer *buffer, unsigned long order)
 {
     char path[] = "/dev/shm/ring-buffer-XXXXXX";
     int file_descriptor;
-    void *address;
     int status;
     
     
@@ -37,38 +52,56 @@ ring_buffer_create (struct ring_buffer *buffer, unsigned long order)
     if (status)
 	report_exceptional_condition ();
  
-    buffer->count_bytes = 1UL << order;
-    buffer->write_offset_bytes = 0;
-    buffer->read_offset_bytes = 0;
+    status = ftruncate (file_descriptor, 1UL << order);
+    if (status)
+	report_exceptional_condition ();
+ 
+    status = ring_buffer_attach (buffer, file_descriptor, 0, 1UL << order,
+				 PROT_READ | PROT_WRITE);
+    if (status)
+	report_exceptional_condition ();
  
-    status = ftruncate (file_descriptor, buffer->count_bytes);
+    status = close (file_descriptor);
     if (status)
 	report_exceptional_condition ();
+
+}
+
+int
+ring_buffer_attach (struct ring_buffer *buffer, int file_descriptor,
+		    off_t offset, unsigned long count_bytes, int prot)
+{
+    void *address;
+ 
+    buffer->count_bytes = count_bytes;
+    buffer->write_offset_bytes = 0;
+    buffer->read_offset_bytes = 0;
  
     buffer->address = mmap (NULL, buffer->count_bytes << 1, PROT_NONE,
 			    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
  
     if (buffer->address == MAP_FAILED)
-	report_exceptional_condition ();
+	return -1;
  
     address =
-	mmap (buffer->address, buffer->count_bytes, PROT_READ | PROT_WRITE,
-	      MAP_FIXED | MAP_SHARED, file_descriptor, 0);
+	mmap (buffer->address, buffer->count_bytes, prot,
+	      MAP_FIXED | MAP_SHARED, file_descriptor, offset);
  
     if (address != buffer->address)
-	report_exceptional_condition ();
+	goto fail;
  
     address = mmap (buffer->address + buffer->count_bytes,
-		    buffer->count_bytes, PROT_READ | PROT_WRITE,
-		    MAP_FIXED | MAP_SHARED, file_descriptor, 0);
+		    buffer->count_bytes, prot,
+		    MAP_FIXED | MAP_SHARED, file_descriptor, offset);
  
     if (address != buffer->address + buffer->count_bytes)
-	report_exceptional_condition ();
- 
-    status = close (file_descriptor);
-    if (status)
-	report_exceptional_condition ();
+	goto fail;
+
+    return 0;
 
+ fail:
+    munmap (buffer->address, buffer->count_bytes << 1);
+    return -1;
 }
  
 void
@@ -133,3 +166,29 @@ ring_buffer_clear (struct ring_buffer *buffer)
   buffer->read_offset_bytes = 0;
 }
 
+
+int
+ring_buffer_bind_node (struct ring_buffer *buffer, int node)
+{
+  unsigned long nodemask[16];
+  int actual = -1;
+
+  if (node < 0 || node >= (int) (sizeof (nodemask) * 8))
+    return -1;
+
+  memset (nodemask, 0, sizeof (nodemask));
+  nodemask[node / (8 * sizeof (unsigned long))] |= 1UL << (node % (8 * sizeof (unsigned long)));
+
+  // both views map the same shm pages, whose policy is kept per file offset
+  if (syscall (SYS_mbind, buffer->address, buffer->count_bytes, MPOL_BIND,
+	       nodemask, sizeof (nodemask) * 8, MPOL_MF_MOVE))
+    return -1;
+
+  // fault the first page in and ask where it went
+  *(volatile char *) buffer->address = *(volatile char *) buffer->address;
+  if (syscall (SYS_get_mempolicy, &actual, NULL, 0, buffer->address,
+	       MPOL_F_NODE | MPOL_F_ADDR))
+    return -1;
+
+  return actual;
+}
@@ -48,6 +48,11 @@ struct ring_buffer
  
 void ring_buffer_create (struct ring_buffer *buffer, unsigned long order);
 
+// maps count_bytes of fd at offset twice in a row (the mirrored view used by
+// the ring), returns -1 on error
+int ring_buffer_attach (struct ring_buffer *buffer, int file_descriptor,
+			off_t offset, unsigned long count_bytes, int prot);
+
 void ring_buffer_free (struct ring_buffer *buffer);
  
 void *ring_buffer_write_address (struct ring_buffer *buffer);
@@ -64,6 +69,10 @@ unsigned long ring_buffer_count_free_bytes (struct ring_buffer *buffer);
  
 void ring_buffer_clear (struct ring_buffer *buffer);
 
+// binds the ring memory to a NUMA node, returns the node the first page
+// actually landed on (or -1 on error)
+int ring_buffer_bind_node (struct ring_buffer *buffer, int node);
+
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,326 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_ring.h"
+#include "m2ts.h"
+
+static unsigned long header_size(void)
+{
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    return (sizeof(struct shm_ring_header) + page - 1) / page * page;
+}
+
+// shm_open() wants a name with a leading slash
+static void shm_name(char *out, size_t len, const char *name)
+{
+    snprintf(out, len, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+// removes the object name if its publisher is gone (returns 0), leaves it
+// alone otherwise (-1)
+static int shm_ring_remove_stale(const char *name)
+{
+    struct shm_ring_header *header;
+    struct stat st;
+    int fd, pid = 0, stale = 0;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) == 0 && (unsigned long) st.st_size >= header_size())
+    {
+        header = mmap(NULL, header_size(), PROT_READ, MAP_SHARED, fd, 0);
+        if (header != MAP_FAILED)
+        {
+            if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == SHM_RING_MAGIC)
+                pid = __atomic_load_n(&header->writer_pid, __ATOMIC_ACQUIRE);
+            munmap(header, header_size());
+        }
+    }
+    close(fd);
+
+    // a ring whose publisher no longer exists
+    if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH)
+        stale = 1;
+    if (!stale)
+        return -1;
+    return shm_unlink(name) < 0 && errno != ENOENT ? -1 : 0;
+}
+
+int shm_ring_publish(struct shm_ring *pub, struct ring_buffer *ring, const char *name,
+                     unsigned long order, unsigned long margin)
+{
+    unsigned long size = 1UL << order;
+    unsigned long offset = header_size();
+
+    memset(pub, 0, sizeof(struct shm_ring));
+    shm_name(pub->name, sizeof(pub->name), name);
+
+    pub->fd = shm_open(pub->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (pub->fd < 0 && errno == EEXIST)
+    {
+        if (shm_ring_remove_stale(pub->name) < 0)
+        {
+            errno = EEXIST;
+            return -1;
+        }
+        // another publisher may have been quicker: EEXIST again
+        pub->fd = shm_open(pub->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (pub->fd < 0)
+        return -1;
+
+    if (ftruncate(pub->fd, offset + size) < 0)
+        goto fail;
+
+    pub->header = mmap(NULL, offset, PROT_READ | PROT_WRITE, MAP_SHARED, pub->fd, 0);
+    if (pub->header == MAP_FAILED)
+        goto fail;
+
+    if (ring_buffer_attach(ring, pub->fd, offset, size, PROT_READ | PROT_WRITE) < 0)
+    {
+        munmap(pub->header, offset);
+        goto fail;
+    }
+
+    pub->header->version = SHM_RING_VERSION;
+    pub->header->size = size;
+    pub->header->data_offset = offset;
+    pub->header->margin = margin;
+    pub->header->generation = 1;
+    pub->header->writer_pid = getpid();
+
+    // readers check the magic last
+    __atomic_store_n(&pub->header->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+
+ fail:
+    close(pub->fd);
+    shm_unlink(pub->name);
+    pub->fd = -1;
+    pub->header = NULL;
+    return -1;
+}
+
+static void shm_ring_wake(struct shm_ring_header *header)
+{
+    __atomic_add_fetch(&header->notify, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_ACQUIRE))
+        syscall(SYS_futex, &header->notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void shm_ring_commit(struct shm_ring *pub, unsigned long bytes)
+{
+    // single writer: a plain add published with release semantics
+    uint64_t position = pub->header->write_position + bytes;
+    __atomic_store_n(&pub->header->write_position, position, __ATOMIC_RELEASE);
+    shm_ring_wake(pub->header);
+}
+
+void shm_ring_new_generation(struct shm_ring *pub)
+{
+    __atomic_add_fetch(&pub->header->generation, 1, __ATOMIC_RELEASE);
+    shm_ring_wake(pub->header);
+}
+
+void shm_ring_unpublish(struct shm_ring *pub, struct ring_buffer *ring)
+{
+    if (pub->header == NULL)
+        return;
+
+    ring_buffer_free(ring);
+    munmap(pub->header, header_size());
+    close(pub->fd);
+    shm_unlink(pub->name);
+    pub->header = NULL;
+    pub->fd = -1;
+}
+
+int ring_reader_open(struct ring_reader *r, const char *name)
+{
+    char path[64];
+    struct stat st;
+    int i;
+
+    memset(r, 0, sizeof(struct ring_reader));
+    r->slot = -1;
+    shm_name(path, sizeof(path), name);
+
+    // without write access the reader gets no slot and polls instead of
+    // being woken up
+    r->fd = shm_open(path, O_RDWR, 0);
+    if (r->fd < 0)
+    {
+        r->fd = shm_open(path, O_RDONLY, 0);
+        if (r->fd < 0)
+            return -1;
+        r->readonly = 1;
+    }
+
+    if (fstat(r->fd, &st) < 0 || (unsigned long) st.st_size < header_size())
+        goto fail;
+
+    // the slots and waiters are written by the readers
+    r->header = mmap(NULL, header_size(), r->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                     MAP_SHARED, r->fd, 0);
+    if (r->header == MAP_FAILED)
+        goto fail;
+
+    if (__atomic_load_n(&r->header->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+        r->header->version != SHM_RING_VERSION ||
+        r->header->data_offset + r->header->size > (uint64_t) st.st_size)
+        goto fail_header;
+
+    if (ring_buffer_attach(&r->ring, r->fd, r->header->data_offset, r->header->size, PROT_READ) < 0)
+        goto fail_header;
+
+    r->generation = __atomic_load_n(&r->header->generation, __ATOMIC_ACQUIRE);
+    r->cursor = __atomic_load_n(&r->header->write_position, __ATOMIC_ACQUIRE);
+
+    // claim a free slot, or one left behind by a dead reader
+    for (i = 0; i < SHM_RING_MAX_READERS && r->slot < 0 && !r->readonly; i++)
+    {
+        struct shm_ring_slot *slot = &r->header->readers[i];
+        int32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+
+        if (pid != 0 && !(kill(pid, 0) < 0 && errno == ESRCH))
+            continue;
+        if (__atomic_compare_exchange_n(&slot->pid, &pid, getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&slot->cursor, r->cursor, __ATOMIC_RELEASE);
+            r->slot = i;
+        }
+    }
+
+    // readers beyond the slot table still work, they are just not listed
+    return 0;
+
+ fail_header:
+    munmap(r->header, header_size());
+ fail:
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+}
+
+long ring_reader_peek(struct ring_reader *r, const unsigned char **data, unsigned long max)
+{
+    struct shm_ring_header *header = r->header;
+    uint32_t generation = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+    uint64_t write_position = __atomic_load_n(&header->write_position, __ATOMIC_ACQUIRE);
+    uint64_t oldest = 0;
+
+    if (generation != r->generation || r->cursor > write_position)
+    {
+        r->generation = generation;
+        r->cursor = write_position;
+        return -1;
+    }
+
+    if (write_position + header->margin > header->size)
+        oldest = write_position + header->margin - header->size;
+    if (r->cursor < oldest)
+    {
+        // commits are whole packets, so packet starts are multiples of 188
+        r->cursor = (oldest + TS_PACKET_SIZE - 1) / TS_PACKET_SIZE * TS_PACKET_SIZE;
+        r->overruns++;
+        return -1;
+    }
+
+    uint64_t available = write_position - r->cursor;
+    if (available > max)
+        available = max;
+    available -= available % TS_PACKET_SIZE;
+
+    *data = (unsigned char *) r->ring.address + (r->cursor & (header->size - 1));
+    return available;
+}
+
+int ring_reader_valid(struct ring_reader *r)
+{
+    struct shm_ring_header *header = r->header;
+    uint64_t write_position = __atomic_load_n(&header->write_position, __ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&header->generation, __ATOMIC_ACQUIRE) != r->generation)
+        return 0;
+
+    // the writer may be filling up to margin bytes past write_position
+    return write_position + header->margin <= r->cursor + header->size;
+}
+
+void ring_reader_advance(struct ring_reader *r, unsigned long len)
+{
+    r->cursor += len;
+    if (r->slot >= 0)
+        __atomic_store_n(&r->header->readers[r->slot].cursor, r->cursor, __ATOMIC_RELEASE);
+}
+
+void ring_reader_wait(struct ring_reader *r, int timeout_ms)
+{
+    struct shm_ring_header *header = r->header;
+    struct timespec timeout;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long) (timeout_ms % 1000) * 1000000;
+
+    if (r->readonly)
+    {
+        if (__atomic_load_n(&header->write_position, __ATOMIC_ACQUIRE) == r->cursor)
+            nanosleep(&timeout, NULL);
+        return;
+    }
+
+    __atomic_add_fetch(&header->waiters, 1, __ATOMIC_ACQ_REL);
+    uint32_t notify = __atomic_load_n(&header->notify, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&header->write_position, __ATOMIC_ACQUIRE) == r->cursor &&
+        __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE) == r->generation)
+        syscall(SYS_futex, &header->notify, FUTEX_WAIT, notify, &timeout, NULL, 0);
+    __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_ACQ_REL);
+}
+
+void ring_reader_close(struct ring_reader *r)
+{
+    if (r->fd < 0)
+        return;
+
+    if (r->slot >= 0)
+        __atomic_store_n(&r->header->readers[r->slot].pid, 0, __ATOMIC_RELEASE);
+
+    ring_buffer_free(&r->ring);
+    munmap(r->header, header_size());
+    close(r->fd);
+    r->fd = -1;
+}
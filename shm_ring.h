@@ -0,0 +1,151 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+// Publication of a capture ring as a named POSIX shared-memory object, so
+// that local processes can map the multiplex without a copy.
+//
+// Object layout: one header page, then the ring data (mapped mirrored, like
+// ring_buffer). The writer never waits for the readers: each reader keeps
+// its own cursor and detects when the writer lapped it.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "ring_buffer.h"
+
+#define SHM_RING_MAGIC       0x49534254 // "ISBT"
+#define SHM_RING_VERSION     1
+#define SHM_RING_MAX_READERS 16
+
+struct shm_ring_slot {
+    // pid of the reader holding the slot, 0 if free
+    int32_t pid;
+    uint32_t reserved;
+
+    // stream position the reader has consumed up to
+    uint64_t cursor;
+};
+
+// all positions count bytes since the stream started; fields are accessed
+// with __atomic builtins
+struct shm_ring_header {
+    uint32_t magic;
+    uint32_t version;
+
+    // ring data size (a power of two) and its offset in the object
+    uint64_t size;
+    uint64_t data_offset;
+
+    // bytes the writer may be filling ahead of write_position: data older
+    // than write_position + margin - size may already be overwritten
+    uint64_t margin;
+
+    // total bytes committed
+    uint64_t write_position;
+
+    // bumped whenever the capture restarts; a retune keeps the stream,
+    // the gap is marked with discontinuity packets instead
+    uint32_t generation;
+
+    // futex word bumped on every commit, readers sleeping on it are counted
+    // in waiters
+    uint32_t notify;
+    uint32_t waiters;
+
+    // pid of the publishing process, to tell a stale object from one in use
+    int32_t writer_pid;
+
+    struct shm_ring_slot readers[SHM_RING_MAX_READERS];
+};
+
+// writer side
+struct shm_ring {
+    int fd;
+    char name[64];
+    struct shm_ring_header *header;
+};
+
+// reader side
+struct ring_reader {
+    int fd;
+    struct shm_ring_header *header;
+    struct ring_buffer ring;
+
+    int readonly;
+    int slot;
+    uint32_t generation;
+    uint64_t cursor;
+
+    // times the writer lapped this reader
+    uint64_t overruns;
+};
+
+
+// creates the shared object name (eg. "/isdbt-0") with a ring of 2^order
+// bytes and attaches ring to it, replacing ring_buffer_create(). An object
+// left by a publisher that died is replaced; if the name is held by a live
+// publisher, or by an object that is not a ring, it fails with errno set
+// to EEXIST (returns -1 on error)
+int shm_ring_publish(struct shm_ring *pub, struct ring_buffer *ring, const char *name,
+                     unsigned long order, unsigned long margin);
+
+// publishes bytes just committed to the ring
+void shm_ring_commit(struct shm_ring *pub, unsigned long bytes);
+
+// starts a new stream generation (readers jump to the live position)
+void shm_ring_new_generation(struct shm_ring *pub);
+
+// unmaps and removes the object (attached readers keep their mapping)
+void shm_ring_unpublish(struct shm_ring *pub, struct ring_buffer *ring);
+
+
+// maps a published ring and claims a reader slot; reading starts at the
+// live position (returns -1 on error)
+int ring_reader_open(struct ring_reader *r, const char *name);
+
+// points data at the bytes available at the cursor (at most max, whole
+// packets) and returns their count, 0 if there are none. Returns -1 if the
+// writer lapped the reader or restarted the stream: the cursor was then moved
+// to the oldest data still intact.
+long ring_reader_peek(struct ring_reader *r, const unsigned char **data, unsigned long max);
+
+// after using the bytes returned by ring_reader_peek(), tells whether they
+// were still intact the whole time (1) or overwritten meanwhile (0)
+int ring_reader_valid(struct ring_reader *r);
+
+// consumes len bytes
+void ring_reader_advance(struct ring_reader *r, unsigned long len);
+
+// sleeps until new data is committed or timeout_ms elapses
+void ring_reader_wait(struct ring_reader *r, int timeout_ms);
+
+void ring_reader_close(struct ring_reader *r);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* _SHM_RING_H_ */
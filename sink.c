@@ -0,0 +1,246 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "sink.h"
+
+// pipe size requested for pipe sinks, bigger pipes mean fewer wakeups
+#define SINK_PIPE_SIZE (1024 * 1024)
+
+int sink_open(struct sink *sink, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    sink_open_fd(sink, fd);
+    sink->borrowed = 0;
+    return 0;
+}
+
+int sink_open_fd(struct sink *sink, int fd)
+{
+    struct stat st;
+
+    memset(sink, 0, sizeof(struct sink));
+    sink->fd = fd;
+    sink->type = SINK_FILE;
+    sink->borrowed = 1;
+
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+    {
+        sink->type = SINK_PIPE;
+        fcntl(fd, F_SETPIPE_SZ, SINK_PIPE_SIZE);
+    }
+
+    return 0;
+}
+
+void sink_set_writeback(struct sink *sink, unsigned long chunk, int sync_ms)
+{
+    struct stat st;
+    off_t offset;
+
+    sink->wb_chunk = 0;
+    if (chunk == 0 || fstat(sink->fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+
+    offset = lseek(sink->fd, 0, SEEK_CUR);
+    if (offset < 0)
+        return;
+
+    sink->wb_chunk = chunk;
+    sink->wb_sync_ms = sync_ms;
+    sink->wb_offset = sink->wb_started = sink->wb_done = offset;
+    sink->wb_sync_ns = 0;
+}
+
+static uint64_t sink_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// paces the write-back of a file sink after len more bytes were written
+static void sink_writeback(struct sink *sink, size_t len)
+{
+    sink->wb_offset += len;
+
+    if (sink->wb_offset - sink->wb_started >= sink->wb_chunk)
+    {
+        // start writing the new chunk out, without waiting
+        sync_file_range(sink->fd, sink->wb_started, sink->wb_offset - sink->wb_started,
+                        SYNC_FILE_RANGE_WRITE);
+
+        // the previous chunk had a whole chunk of time to get to disk: wait
+        // for whatever is left of it, then it can leave the page cache
+        if (sink->wb_started > sink->wb_done)
+        {
+            sync_file_range(sink->fd, sink->wb_done, sink->wb_started - sink->wb_done,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(sink->fd, sink->wb_done, sink->wb_started - sink->wb_done,
+                          POSIX_FADV_DONTNEED);
+            sink->wb_done = sink->wb_started;
+        }
+        sink->wb_started = sink->wb_offset;
+    }
+
+    // sync_file_range() does not write metadata, this makes the data
+    // recoverable after a crash
+    if (sink->wb_sync_ms > 0)
+    {
+        uint64_t now = sink_now_ns();
+        if (sink->wb_sync_ns == 0)
+            sink->wb_sync_ns = now;
+        else if (now - sink->wb_sync_ns >= (uint64_t) sink->wb_sync_ms * 1000000ULL)
+        {
+            fdatasync(sink->fd);
+            sink->wb_sync_ns = now;
+        }
+    }
+}
+
+int sink_write(struct sink *sink, const void *data, size_t len)
+{
+    const char *p = data;
+    size_t left = len;
+    ssize_t rc;
+
+    while (left > 0)
+    {
+        if (sink->type == SINK_PIPE)
+        {
+            // no SPLICE_F_GIFT: the pages stay part of the ring, the caller
+            // holds them back from the writer until the pipe drains
+            struct iovec iov = { .iov_base = (void *) p, .iov_len = left };
+            rc = vmsplice(sink->fd, &iov, 1, 0);
+            if (rc < 0 && errno == EINVAL)
+            {
+                // not spliceable after all, fall back to copying
+                sink->type = SINK_FILE;
+                continue;
+            }
+        }
+        else
+            rc = write(sink->fd, p, left);
+
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            sink->errors++;
+            return -1;
+        }
+        p += rc;
+        left -= rc;
+    }
+
+    if (sink->wb_chunk)
+        sink_writeback(sink, len);
+
+    return len;
+}
+
+int sink_writev(struct sink *sink, struct iovec *iov, int count)
+{
+    ssize_t rc;
+
+    while (count > 0)
+    {
+        rc = writev(sink->fd, iov, count);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            sink->errors++;
+            return -1;
+        }
+
+        if (sink->wb_chunk)
+            sink_writeback(sink, rc);
+
+        // skip what was written, then resume inside a partial iovec
+        while (count > 0 && (size_t) rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+unsigned long sink_pending(struct sink *sink)
+{
+    int pending = 0;
+
+    if (sink->type != SINK_PIPE)
+        return 0;
+
+    // a pipe page is released once the reader consumed it, so what is still
+    // queued is exactly what is still referenced
+    if (ioctl(sink->fd, FIONREAD, &pending) < 0)
+        return 0;
+
+    return pending;
+}
+
+int sink_broken(struct sink *sink)
+{
+    struct pollfd pfd = { .fd = sink->fd, .events = 0 };
+
+    if (sink->type != SINK_PIPE)
+        return 0;
+
+    // the write end of a pipe reports POLLERR once every reader is gone
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLERR | POLLNVAL)) != 0;
+}
+
+void sink_close(struct sink *sink)
+{
+    if (!sink->borrowed && sink->fd >= 0)
+        close(sink->fd);
+    sink->fd = -1;
+}
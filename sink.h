@@ -0,0 +1,82 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define SINK_FILE 0
+#define SINK_PIPE 1
+
+// an output fed straight from ring memory
+struct sink {
+    int fd;
+    int type;
+
+    // fd belongs to someone else (eg. stdout), do not close it
+    int borrowed;
+
+    // failed writes so far
+    unsigned long errors;
+
+    // write-back control of regular files, off while wb_chunk is 0
+    unsigned long wb_chunk;
+    int wb_sync_ms;
+    uint64_t wb_offset;  // file offset written up to
+    uint64_t wb_started; // write-back started up to here
+    uint64_t wb_done;    // on disk and dropped from the page cache up to here
+    uint64_t wb_sync_ns; // last fdatasync()
+};
+
+
+// opens (creates/truncates) a file or an existing fifo for writing
+// (returns -1 on error)
+int sink_open(struct sink *sink, const char *path);
+
+// wraps an already open fd; pipes are detected automatically
+int sink_open_fd(struct sink *sink, int fd);
+
+// writes all of data, returns len or -1 on error. Pipe sinks hand the pages
+// to the kernel with vmsplice(), so data must stay untouched until
+// sink_pending() says the reader has consumed it.
+int sink_write(struct sink *sink, const void *data, size_t len);
+
+// writes a gather list with writev(); the data is always copied, even into
+// pipes, so it may come from short-lived buffers (returns -1 on error)
+int sink_writev(struct sink *sink, struct iovec *iov, int count);
+
+// makes a file sink push its data to disk every chunk bytes instead of
+// letting dirty pages pile up: write-back of each chunk is started with
+// sync_file_range(), the previous chunk is waited for and dropped from the
+// page cache. sync_ms > 0 adds an fdatasync() that often. No-op for pipes.
+void sink_set_writeback(struct sink *sink, unsigned long chunk, int sync_ms);
+
+// bytes written that the kernel may still be referencing (pipe sinks)
+unsigned long sink_pending(struct sink *sink);
+
+// 1 if a pipe sink has lost its reader, so nothing pending will be read
+int sink_broken(struct sink *sink);
+
+void sink_close(struct sink *sink);
+
+#endif /* _SINK_H_ */
@@ -0,0 +1,181 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "survey.h"
+#include "m2ts.h"
+
+static const char *layer_names[DVBRES_STAT_LAYERS] = { "all", "a", "b", "c" };
+
+static int survey_set_error(struct survey *sv, const char *msg)
+{
+    strncpy(sv->error_msg, msg, sizeof(sv->error_msg));
+    sv->error_msg[sizeof(sv->error_msg) - 1] = 0;
+    return -1;
+}
+
+int survey_open(struct survey *sv, const char *path, int adapter, uint64_t freq)
+{
+    char device[64];
+    int i;
+
+    memset(sv, 0, sizeof(struct survey));
+    sv->signal_ms = SURVEY_SIGNAL_MS;
+    sv->lock_ms = SURVEY_LOCK_MS;
+    sv->dwell_ms = SURVEY_DWELL_MS;
+    sv->sweep = 1;
+
+    sv->fp = fopen(path, "a");
+    if (sv->fp == NULL)
+        return survey_set_error(sv, "Error opening the survey file.");
+
+    // append-only: the header goes in once
+    if (ftell(sv->fp) == 0)
+    {
+        fprintf(sv->fp, "time,sweep,channel,frequency,state,lock_ms,strength,quality,strength_dbm,cnr_db");
+        for (i = 0; i < DVBRES_STAT_LAYERS; i++)
+            fprintf(sv->fp, ",ber_%s,per_%s", layer_names[i], layer_names[i]);
+        fprintf(sv->fp, "\n");
+        fflush(sv->fp);
+    }
+
+    dvbres_init(&sv->res);
+    snprintf(device, sizeof(device), "/dev/dvb/adapter%d", adapter);
+    if (dvbres_open(&sv->res, freq, adapter < 0 ? NULL : device, LAYER_FULL) < 0)
+    {
+        survey_set_error(sv, sv->res.error_msg);
+        fclose(sv->fp);
+        sv->fp = NULL;
+        return -1;
+    }
+    sv->open = 1;
+    return 0;
+}
+
+static double ratio(uint64_t errors, uint64_t total)
+{
+    return total > 0 ? (double) errors / total : -1;
+}
+
+static void write_result(struct survey *sv, struct survey_result *r)
+{
+    static const char *states[] = { "nosignal", "nolock", "locked" };
+    struct timespec now;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(sv->fp, "%lld.%03ld,%llu,%d,%llu,%s,", (long long) now.tv_sec, now.tv_nsec / 1000000,
+            (unsigned long long) sv->sweep, r->channel, (unsigned long long) r->freq, states[r->state]);
+
+    // fields not measured are left empty
+    if (r->state == SURVEY_LOCKED)
+        fprintf(sv->fp, "%d", r->lock_ms);
+    fprintf(sv->fp, ",%d,%d,", r->strength, r->quality);
+    if (r->stats.strength_valid)
+        fprintf(sv->fp, "%.1f", r->stats.strength / 1000.0);
+    fprintf(sv->fp, ",");
+    if (r->stats.cnr_valid)
+        fprintf(sv->fp, "%.1f", r->stats.cnr / 1000.0);
+    for (i = 0; i < DVBRES_STAT_LAYERS; i++)
+    {
+        fprintf(sv->fp, ",");
+        if (r->ber[i] >= 0)
+            fprintf(sv->fp, "%.3e", r->ber[i]);
+        fprintf(sv->fp, ",");
+        if (r->per[i] >= 0)
+            fprintf(sv->fp, "%.3e", r->per[i]);
+    }
+    fprintf(sv->fp, "\n");
+
+    // a line at a time, so the series survives a kill and can be followed
+    fflush(sv->fp);
+}
+
+int survey_channel(struct survey *sv, int channel, uint64_t freq, struct survey_result *r)
+{
+    struct dvbres_stats before;
+    uint64_t start;
+    int i, rc;
+
+    memset(r, 0, sizeof(struct survey_result));
+    r->channel = channel;
+    r->freq = freq;
+    for (i = 0; i < DVBRES_STAT_LAYERS; i++)
+        r->ber[i] = r->per[i] = -1;
+
+    start = m2ts_now_ns();
+    sv->res.freq = freq;
+    if (dvbres_retune(&sv->res) < 0)
+        return survey_set_error(sv, sv->res.error_msg);
+
+    rc = dvbres_wait_lock_signal(&sv->res, sv->lock_ms, sv->signal_ms);
+    if (rc < 0)
+        return survey_set_error(sv, sv->res.error_msg);
+
+    if (rc == 1)
+    {
+        r->state = SURVEY_LOCKED;
+        r->lock_ms = (m2ts_now_ns() - start) / 1000000;
+
+        // the error counters run from the tune: the dwell gets their difference
+        dvbres_getstats(&sv->res, &before);
+        usleep(sv->dwell_ms * 1000);
+    }
+    else
+        r->state = dvbres_signalpresent(&sv->res) > 0 ? SURVEY_NO_LOCK : SURVEY_NO_SIGNAL;
+
+    if (dvbres_getstats(&sv->res, &r->stats) < 0)
+        return survey_set_error(sv, sv->res.error_msg);
+    r->strength = dvbres_getsignalstrength(&sv->res);
+    if (r->state == SURVEY_LOCKED)
+    {
+        r->quality = dvbres_getsignalquality(&sv->res);
+        for (i = 0; i < DVBRES_STAT_LAYERS; i++)
+        {
+            if (r->stats.layers[i].bits_valid && before.layers[i].bits_valid)
+                r->ber[i] = ratio(r->stats.layers[i].bit_errors - before.layers[i].bit_errors,
+                                  r->stats.layers[i].bits - before.layers[i].bits);
+            if (r->stats.layers[i].blocks_valid && before.layers[i].blocks_valid)
+                r->per[i] = ratio(r->stats.layers[i].block_errors - before.layers[i].block_errors,
+                                  r->stats.layers[i].blocks - before.layers[i].blocks);
+        }
+    }
+
+    sv->channels++;
+    if (r->state == SURVEY_LOCKED)
+        sv->locked++;
+    write_result(sv, r);
+    return 0;
+}
+
+void survey_close(struct survey *sv)
+{
+    if (sv->open)
+        dvbres_close(&sv->res);
+    sv->open = 0;
+    if (sv->fp)
+        fclose(sv->fp);
+    sv->fp = NULL;
+}
@@ -0,0 +1,89 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _SURVEY_H_
+#define _SURVEY_H_
+
+// Band occupancy survey: one tuner sweeps a channel table over and over,
+// appending a line per channel to a CSV time series (see survey_channel()):
+// whether it locked and how fast, signal strength, CNR and the bit and
+// packet error ratios of the whole signal and of each layer.
+//
+// The tuner is opened once and retuned for each channel. A channel without
+// signal is given up as soon as the frontend reports no FE_HAS_SIGNAL after
+// signal_ms, and the lock is waited for on frontend events, so a sweep of
+// the band takes seconds. Error ratios are measured over dwell_ms after the
+// lock, from the difference of the DTV_STAT counters.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dvb_resource.h"
+
+#define SURVEY_SIGNAL_MS 100
+#define SURVEY_LOCK_MS   2000
+#define SURVEY_DWELL_MS  250
+
+#define SURVEY_NO_SIGNAL 0
+#define SURVEY_NO_LOCK   1
+#define SURVEY_LOCKED    2
+
+struct survey_result {
+    int channel;
+    uint64_t freq;
+    int state;        // SURVEY_*
+    int lock_ms;      // from the tune, when locked
+    int strength;     // 0 to 100, FE_READ_SIGNAL_STRENGTH
+    int quality;      // 0 to 100, FE_READ_SNR
+    struct dvbres_stats stats; // at the end of the dwell
+
+    // over the dwell, -1 if not measured: the whole signal, then layers A
+    // to C (see DVBRES_STAT_LAYERS)
+    double ber[DVBRES_STAT_LAYERS];
+    double per[DVBRES_STAT_LAYERS];
+};
+
+struct survey {
+    struct dvb_resource res;
+    int open;
+    FILE *fp;
+
+    int signal_ms;
+    int lock_ms;
+    int dwell_ms;
+
+    uint64_t sweep;       // number of the sweep going on, from 1
+    uint64_t channels;    // surveyed so far, and those locked
+    uint64_t locked;
+
+    char error_msg[256];
+};
+
+
+// appends to path, writing the CSV header when the file is new, and opens
+// the tuner of adapter (-1 for any free one) on freq (returns -1 on error)
+int survey_open(struct survey *sv, const char *path, int adapter, uint64_t freq);
+
+// tunes to a channel, measures it and appends its line (returns -1 on error)
+int survey_channel(struct survey *sv, int channel, uint64_t freq, struct survey_result *result);
+
+void survey_close(struct survey *sv);
+
+#endif /* _SURVEY_H_ */
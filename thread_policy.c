@@ -0,0 +1,215 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include "thread_policy.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+
+// parses a cpu list like "0-3,8"
+static int parse_cpus(cpu_set_t *set, const char *list)
+{
+    char *end;
+
+    CPU_ZERO(set);
+    while (*list)
+    {
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0)
+            return -1;
+        list = end;
+
+        if (*list == '-')
+        {
+            list++;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+            list = end;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+
+        if (*list == ',')
+            list++;
+        else if (*list)
+            return -1;
+    }
+
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int thread_policy_parse(struct thread_policy *tp, const char *spec)
+{
+    char name[16];
+    const char *at = strchr(spec, '@');
+    size_t len = at ? (size_t) (at - spec) : strlen(spec);
+
+    memset(tp, 0, sizeof(struct thread_policy));
+
+    if (at)
+    {
+        if (parse_cpus(&tp->cpus, at + 1) < 0)
+            return -1;
+        tp->set_cpus = 1;
+    }
+
+    if (len == 0)
+        return 0;
+    if (len >= sizeof(name))
+        return -1;
+    memcpy(name, spec, len);
+    name[len] = 0;
+
+    char *colon = strchr(name, ':');
+    if (colon)
+    {
+        *colon = 0;
+        tp->priority = atoi(colon + 1);
+    }
+
+    if (!strcmp(name, "fifo"))
+        tp->policy = SCHED_FIFO;
+    else if (!strcmp(name, "rr"))
+        tp->policy = SCHED_RR;
+    else if (!strcmp(name, "other"))
+        tp->policy = SCHED_OTHER;
+    else
+        return -1;
+
+    if (tp->policy != SCHED_OTHER &&
+        (tp->priority < sched_get_priority_min(tp->policy) ||
+         tp->priority > sched_get_priority_max(tp->policy)))
+        return -1;
+    if (tp->policy == SCHED_OTHER)
+        tp->priority = 0;
+
+    tp->set_sched = 1;
+    return 0;
+}
+
+int thread_policy_apply(pthread_t thread, struct thread_policy *tp, const char *name)
+{
+    int rc, ret = 0;
+
+    if (tp->set_cpus)
+    {
+        rc = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &tp->cpus);
+        if (rc)
+        {
+            fprintf(stderr, "%s: setting CPU affinity failed: %s.\n", name, strerror(rc));
+            ret = -1;
+        }
+    }
+
+    if (tp->set_sched)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = tp->priority;
+
+        rc = pthread_setschedparam(thread, tp->policy, &param);
+        if (rc)
+        {
+            fprintf(stderr, "%s: setting scheduling policy failed: %s.\n", name, strerror(rc));
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+void thread_policy_report(pthread_t thread, const char *name)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int policy;
+    char list[256];
+    int pos = 0;
+    int cpu, first = -1;
+
+    if (pthread_getschedparam(thread, &policy, &param))
+        return;
+
+    list[0] = 0;
+    if (pthread_getaffinity_np(thread, sizeof(cpu_set_t), &cpus) == 0)
+    {
+        // print the affinity mask as ranges
+        for (cpu = 0; cpu <= CPU_SETSIZE && pos < (int) sizeof(list) - 16; cpu++)
+        {
+            int in = cpu < CPU_SETSIZE && CPU_ISSET(cpu, &cpus);
+            if (in && first < 0)
+                first = cpu;
+            if (!in && first >= 0)
+            {
+                if (first == cpu - 1)
+                    pos += sprintf(list + pos, "%s%d", pos ? "," : "", first);
+                else
+                    pos += sprintf(list + pos, "%s%d-%d", pos ? "," : "", first, cpu - 1);
+                first = -1;
+            }
+        }
+    }
+
+    fprintf(stderr, "%s thread: %s priority %d, CPUs %s\n", name,
+            policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER",
+            param.sched_priority, list[0] ? list : "?");
+}
+
+int thread_policy_node(struct thread_policy *tp)
+{
+    char path[128];
+    int cpu;
+
+    if (!tp->set_cpus)
+        return -1;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &tp->cpus))
+            break;
+
+    // the cpu directory holds a "nodeN" link to its NUMA node
+    sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
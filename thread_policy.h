@@ -0,0 +1,55 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _THREAD_POLICY_H_
+#define _THREAD_POLICY_H_
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+
+// scheduling class, priority and CPU affinity requested for a thread
+struct thread_policy {
+    int set_sched;
+    int policy;
+    int priority;
+
+    int set_cpus;
+    cpu_set_t cpus;
+};
+
+
+// parses "fifo:50", "rr:10@2", "other@0-3,8" or "@4" (returns -1 on error)
+int thread_policy_parse(struct thread_policy *tp, const char *spec);
+
+// applies the policy to a running thread; failures (usually EPERM for the
+// real-time classes) are reported on stderr and -1 is returned
+int thread_policy_apply(pthread_t thread, struct thread_policy *tp, const char *name);
+
+// prints the scheduling class, priority and affinity the thread really has
+void thread_policy_report(pthread_t thread, const char *name);
+
+// NUMA node of the first CPU of the policy, -1 if not pinned or unknown
+int thread_policy_node(struct thread_policy *tp);
+
+#endif /* _THREAD_POLICY_H_ */
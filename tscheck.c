@@ -0,0 +1,124 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "tscheck.h"
+#include "psi.h"
+#include "nullstrip.h"
+
+void tscheck_init(struct tscheck *tc)
+{
+    int pid;
+
+    memset(tc, 0, sizeof(struct tscheck));
+    for (pid = 0; pid < 8192; pid++)
+        tc->pids[pid].last_cc = -1;
+}
+
+static void error_at(struct tscheck_pid *s, uint64_t number)
+{
+    if (s->cc_errors + s->transport_errors == 1)
+        s->first_error = number;
+}
+
+void tscheck_packet(void *opaque, const unsigned char *p, uint64_t number)
+{
+    struct tscheck *tc = opaque;
+    struct tscheck_pid *s = &tc->pids[TS_PID(p)];
+    int cc = p[3] & 0x0F;
+    int has_payload = p[3] & 0x10;
+
+    s->packets++;
+    if (p[1] & 0x80)
+    {
+        s->transport_errors++;
+        error_at(s, number);
+        return;
+    }
+    if (p[3] & 0xC0)
+        s->scrambled++;
+
+    // null packets carry no meaningful counter
+    if (TS_PID(p) == NULL_PID)
+        return;
+
+    // a discontinuity_indicator restarts the count
+    if (s->last_cc >= 0 && !(p[3] & 0x20 && p[4] > 0 && p[5] & 0x80))
+    {
+        if (!has_payload)
+        {
+            if (cc != s->last_cc)
+            {
+                s->cc_errors++;
+                error_at(s, number);
+            }
+        }
+        else if (cc == s->last_cc)
+        {
+            // one duplicate packet is allowed
+            if (s->duplicate)
+            {
+                s->cc_errors++;
+                error_at(s, number);
+            }
+            s->duplicate = 1;
+            return;
+        }
+        else if (cc != ((s->last_cc + 1) & 0x0F))
+        {
+            s->cc_errors++;
+            error_at(s, number);
+        }
+    }
+    s->last_cc = cc;
+    s->duplicate = 0;
+}
+
+void tscheck_print(struct tscheck *tc, FILE *fp)
+{
+    struct tscheck_pid *s;
+    uint64_t packets = 0, cc_errors = 0, transport_errors = 0;
+    int pid, count = 0;
+
+    for (pid = 0; pid < 8192; pid++)
+    {
+        s = &tc->pids[pid];
+        if (s->packets == 0)
+            continue;
+        count++;
+        packets += s->packets;
+        cc_errors += s->cc_errors;
+        transport_errors += s->transport_errors;
+        if (s->cc_errors + s->transport_errors + s->scrambled == 0)
+            continue;
+        fprintf(fp, "  PID 0x%04x: %llu packets, %llu continuity errors, %llu transport errors, %llu scrambled",
+                pid, (unsigned long long) s->packets, (unsigned long long) s->cc_errors,
+                (unsigned long long) s->transport_errors, (unsigned long long) s->scrambled);
+        if (s->cc_errors + s->transport_errors > 0)
+            fprintf(fp, ", first at packet %llu", (unsigned long long) s->first_error);
+        fprintf(fp, ".\n");
+    }
+    fprintf(fp, "TS check: %d PIDs, %llu packets, %llu continuity errors, %llu transport errors.\n",
+            count, (unsigned long long) packets, (unsigned long long) cc_errors,
+            (unsigned long long) transport_errors);
+}
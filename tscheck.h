@@ -0,0 +1,54 @@
+/* ISDB-T Capture. A DVB v5 API TS capture for Linux, for ISDB-TB 6MHz Latin American ISDB-T International.
+ * Copyright (C) 2014 Rafael Diniz <rafael@riseup.net>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _TSCHECK_H_
+#define _TSCHECK_H_
+
+// Per-PID transport stream checks (ETSI TR 101 290 first priority
+// continuity errors, transport errors and scrambled packets), kept per PID
+// so that a pid_pool can run them with one writer per PID.
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct tscheck_pid {
+    uint64_t packets;
+    uint64_t cc_errors;
+    uint64_t transport_errors;
+    uint64_t scrambled;
+    uint64_t first_error; // packet number of the first error, if any
+    int last_cc;          // -1 before the first packet
+    int duplicate;        // the last packet repeated the one before
+};
+
+struct tscheck {
+    struct tscheck_pid pids[8192];
+};
+
+
+void tscheck_init(struct tscheck *tc);
+
+// a pid_pool_cb, with the tscheck as opaque
+void tscheck_packet(void *opaque, const unsigned char *packet, uint64_t number);
+
+// one line per PID seen with its counters, then the totals
+void tscheck_print(struct tscheck *tc, FILE *fp);
+
+#endif /* _TSCHECK_H_ */